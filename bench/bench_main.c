@@ -0,0 +1,281 @@
+// Synthetic 8080 programs timed on each execution core.
+//
+// usage: run_bench [--reps n] [output file]
+//
+// Every program runs to HLT from a fresh copy of memory once per
+// repetition and core. The instruction count comes from an untimed
+// cpu_step run first, the cores must agree with it on the final cycle
+// count. The lanes core runs CPU_LANES copies of the program at once, its
+// time per instruction is over the instructions of all copies. Results go
+// to stdout as a table and to the output file (bench_output.txt by
+// default) one line per program and core:
+//   program core instructions cycles reps ns_per_instr stddev_pct mhz best_ns_per_instr
+
+#include "../src/cpu.h"
+#include "../src/block_cache.h"
+#include "../src/cpu_lanes.h"
+#include "../src/console.h"
+#include <math.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_ORIGIN 0x0000
+#define BENCH_SLICE 2000000
+#define BENCH_MAX_REPS 64
+
+typedef struct {
+    const char *name;
+    const uint8_t *code;
+    size_t len;
+} Program;
+
+// LXI SP 0xF000 ; LXI H 0x1000
+// outer: MVI C 0
+// loop: MOV A,B ; ADD C ; XRA C ; RAL ; CMA ; ADC D ; MOV B,A ; DCR C ; JNZ loop
+// DCX H ; MOV A,H ; ORA L ; JNZ outer ; HLT
+static const uint8_t alu[] = {
+    0x31, 0x00, 0xF0, 0x21, 0x00, 0x10, 0x0E, 0x00,
+    0x78, 0x81, 0xA9, 0x17, 0x2F, 0x8A, 0x47, 0x0D, 0xC2, 0x08, 0x00,
+    0x2B, 0x7C, 0xB5, 0xC2, 0x06, 0x00, 0x76,
+};
+
+// LXI SP 0xF000 ; MVI A 0 ; STA 0x0100
+// rep: LXI H 0x2000 ; LXI D 0x3000 ; LXI B 0x1000
+// copy: MOV A,M ; STAX D ; INX H ; INX D ; DCX B ; MOV A,B ; ORA C ; JNZ copy
+// LDA 0x0100 ; DCR A ; STA 0x0100 ; JNZ rep ; HLT
+static const uint8_t memcopy[] = {
+    0x31, 0x00, 0xF0, 0x3E, 0x00, 0x32, 0x00, 0x01,
+    0x21, 0x00, 0x20, 0x11, 0x00, 0x30, 0x01, 0x00, 0x10,
+    0x7E, 0x12, 0x23, 0x13, 0x0B, 0x78, 0xB1, 0xC2, 0x11, 0x00,
+    0x3A, 0x00, 0x01, 0x3D, 0x32, 0x00, 0x01, 0xC2, 0x08, 0x00, 0x76,
+};
+
+// LXI SP 0xF000 ; LXI H 0 ; MVI A 18 ; CALL rec ; HLT
+// rec: ORA A ; RZ ; DCR A ; PUSH PSW ; CALL rec ; POP PSW ; PUSH PSW ;
+//      CALL rec ; POP PSW ; INX H ; INR A ; RET
+static const uint8_t calls[] = {
+    0x31, 0x00, 0xF0, 0x21, 0x00, 0x00, 0x3E, 0x12, 0xCD, 0x0C, 0x00, 0x76,
+    0xB7, 0xC8, 0x3D, 0xF5, 0xCD, 0x0C, 0x00, 0xF1, 0xF5, 0xCD, 0x0C, 0x00,
+    0xF1, 0x23, 0x3C, 0xC9,
+};
+
+// LXI SP 0xF000 ; LXI H 0x0800
+// outer: MVI C 0
+// loop: MOV A,B ; RLC ; RLC ; XRA B ; INR A ; MOV B,A ; ANI 1 ; JZ even ;
+//       INR D ; JMP next
+// even: INR E
+// next: MOV A,B ; ANI 6 ; JPO skip ; INR D ; INR E
+// skip: DCR C ; JNZ loop
+// DCX H ; MOV A,H ; ORA L ; JNZ outer ; HLT
+static const uint8_t branches[] = {
+    0x31, 0x00, 0xF0, 0x21, 0x00, 0x08, 0x0E, 0x00,
+    0x78, 0x07, 0x07, 0xA8, 0x3C, 0x47, 0xE6, 0x01, 0xCA, 0x17, 0x00,
+    0x14, 0xC3, 0x18, 0x00,
+    0x1C,
+    0x78, 0xE6, 0x06, 0xE2, 0x20, 0x00, 0x14, 0x1C,
+    0x0D, 0xC2, 0x08, 0x00,
+    0x2B, 0x7C, 0xB5, 0xC2, 0x06, 0x00, 0x76,
+};
+
+// LXI SP 0xF000 ; LXI H 0x1000
+// outer: MVI C 0
+// loop: MOV A,C ; OUT 1 ; DCR C ; JNZ loop
+// DCX H ; MOV A,H ; ORA L ; JNZ outer ; HLT
+static const uint8_t output[] = {
+    0x31, 0x00, 0xF0, 0x21, 0x00, 0x10, 0x0E, 0x00,
+    0x79, 0xD3, 0x01, 0x0D, 0xC2, 0x08, 0x00,
+    0x2B, 0x7C, 0xB5, 0xC2, 0x06, 0x00, 0x76,
+};
+
+static const Program programs[] = {
+    {"alu", alu, sizeof(alu)},
+    {"memcopy", memcopy, sizeof(memcopy)},
+    {"calls", calls, sizeof(calls)},
+    {"branches", branches, sizeof(branches)},
+    {"output", output, sizeof(output)},
+};
+
+typedef enum {
+    CORE_INTERPRETER,
+    CORE_BLOCK_CACHE,
+    CORE_JIT,
+    CORE_LAZY_FLAGS,
+    CORE_LANES,
+    CORE_COUNT
+} Core;
+
+static const char *const core_names[CORE_COUNT] = {"interpreter", "block-cache", "jit", "lazy-flags", "lanes"};
+
+// one copy of the program per lane, the other cores run copy 0
+typedef struct {
+    uint8_t *mem[CPU_LANES];
+    Bus bus[CPU_LANES];
+    CpuState cpu[CPU_LANES];
+    Console console[CPU_LANES];
+    int copies;
+    BlockCache *block_cache;
+    CpuLanes lanes;
+} Machine;
+
+static bool machine_init(Machine *m, const Program *program, Core core, FILE *sink) {
+    m->copies = core == CORE_LANES ? CPU_LANES : 1;
+    for (int i = 0; i < m->copies; i++) {
+        memset(m->mem[i], 0, MEM_SIZE);
+        memcpy(m->mem[i] + BENCH_ORIGIN, program->code, program->len);
+
+        m->bus[i] = (Bus){0};
+        bus_map_ram(&m->bus[i], 0, MEM_SIZE, m->mem[i]);
+        m->cpu[i] = (CpuState){.bus = &m->bus[i], .pc = BENCH_ORIGIN};
+        console_attach(&m->console[i], &m->bus[i], 1, sink);
+        if (core == CORE_LANES) cpu_lanes_set(&m->lanes, i, &m->cpu[i]);
+    }
+
+    m->block_cache = NULL;
+    if (core == CORE_BLOCK_CACHE || core == CORE_JIT) {
+        m->block_cache = block_cache_create(&m->bus[0]);
+        if (!m->block_cache) return false;
+        if (core == CORE_JIT && !block_cache_enable_jit(m->block_cache)) {
+            block_cache_destroy(m->block_cache);
+            return false;
+        }
+    }
+    return true;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t count_instructions(Machine *m, uint64_t *cycles) {
+    uint64_t count = 0;
+    *cycles = 0;
+    while (!m->cpu[0].halted) {
+        *cycles += cpu_step(&m->cpu[0]);
+        count++;
+    }
+    return count;
+}
+
+int main(int argc, char *argv[]) {
+    const char *path = "bench_output.txt";
+    int reps = 5;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--reps") == 0 && i + 1 < argc) {
+            reps = atoi(argv[++i]);
+        } else {
+            path = argv[i];
+        }
+    }
+    if (reps < 1 || reps > BENCH_MAX_REPS) {
+        fprintf(stderr, "ERROR: --reps must be between 1 and %d\n", BENCH_MAX_REPS);
+        return 1;
+    }
+
+    FILE *results = fopen(path, "w");
+    FILE *sink = fopen("/dev/null", "w");
+    static Machine m;
+    bool allocated = true;
+    for (int i = 0; i < CPU_LANES; i++) {
+        m.mem[i] = malloc(MEM_SIZE);
+        allocated = allocated && m.mem[i];
+    }
+    if (!results || !sink || !allocated) {
+        fprintf(stderr, "ERROR: could not open %s\n", path);
+        return 1;
+    }
+
+    fprintf(results, "# program core instructions cycles reps ns_per_instr stddev_pct mhz best_ns_per_instr\n");
+    printf("%-10s %-12s %12s %10s %8s %10s %10s\n",
+           "program", "core", "instructions", "ns/instr", "stddev", "MHz", "best");
+
+    int failed = 0;
+    for (size_t p = 0; p < sizeof(programs) / sizeof(programs[0]); p++) {
+        const Program *program = &programs[p];
+
+        uint64_t expected_cycles;
+        machine_init(&m, program, CORE_INTERPRETER, sink);
+        uint64_t instructions = count_instructions(&m, &expected_cycles);
+
+        for (Core core = 0; core < CORE_COUNT; core++) {
+            double ns[BENCH_MAX_REPS];
+            const char *problem = NULL;
+
+            for (int r = 0; r < reps && !problem; r++) {
+                if (!machine_init(&m, program, core, sink)) {
+                    problem = "unavailable";
+                    break;
+                }
+
+                double start = now();
+                if (core == CORE_LANES) {
+                    bool running = true;
+                    while (running) {
+                        running = cpu_lanes_run(&m.lanes, BENCH_SLICE) > 0;
+                        for (int i = 0; i < m.copies; i++) {
+                            console_flush(&m.console[i]);
+                        }
+                    }
+                    for (int i = 0; i < m.copies; i++) {
+                        cpu_lanes_get(&m.lanes, i, &m.cpu[i]);
+                    }
+                }
+                while (!m.cpu[0].halted) {
+                    if (core == CORE_LAZY_FLAGS) {
+                        cpu_run_lazy(&m.cpu[0], BENCH_SLICE);
+                    } else {
+                        cpu_run(&m.cpu[0], BENCH_SLICE);
+                    }
+                    console_flush(&m.console[0]);
+                }
+                double seconds = now() - start;
+
+                block_cache_destroy(m.block_cache);
+                ns[r] = seconds * 1e9 / (instructions * m.copies);
+                for (int i = 0; i < m.copies && !problem; i++) {
+                    if (m.cpu[i].cycle != expected_cycles) {
+                        fprintf(stderr, "ERROR: %s on %s ran %llu cycles, expected %llu\n",
+                                program->name, core_names[core],
+                                (unsigned long long)m.cpu[i].cycle, (unsigned long long)expected_cycles);
+                        problem = "wrong result";
+                        failed++;
+                    }
+                }
+            }
+            if (problem) {
+                printf("%-10s %-12s %12s\n", program->name, core_names[core], problem);
+                continue;
+            }
+
+            double mean = 0, best = ns[0], var = 0;
+            for (int r = 0; r < reps; r++) {
+                mean += ns[r];
+                if (ns[r] < best) best = ns[r];
+            }
+            mean /= reps;
+            for (int r = 0; r < reps; r++) {
+                var += (ns[r] - mean) * (ns[r] - mean);
+            }
+            double stddev_pct = reps > 1 ? 100.0 * sqrt(var / (reps - 1)) / mean : 0.0;
+            double mhz = expected_cycles / (mean * instructions / 1e9) / 1e6;
+
+            printf("%-10s %-12s %12llu %10.3f %7.2f%% %10.1f %10.3f\n", program->name, core_names[core],
+                   (unsigned long long)instructions, mean, stddev_pct, mhz, best);
+            fprintf(results, "%s %s %llu %llu %d %.4f %.3f %.2f %.4f\n", program->name, core_names[core],
+                    (unsigned long long)instructions, (unsigned long long)expected_cycles,
+                    reps, mean, stddev_pct, mhz, best);
+        }
+    }
+
+    fclose(sink);
+    for (int i = 0; i < CPU_LANES; i++) {
+        free(m.mem[i]);
+    }
+    if (fclose(results) != 0) {
+        fprintf(stderr, "ERROR: could not write %s\n", path);
+        return 1;
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,84 @@
+#include "audio.h"
+#include <string.h>
+
+void audio_init(Audio *audio, uint32_t clock, uint32_t rate, uint64_t latency) {
+    memset(audio, 0, sizeof(*audio));
+    audio->clock = clock;
+    audio->rate = rate;
+    audio->latency = latency;
+}
+
+void audio_set_sample(Audio *audio, uint8_t n, const int16_t *pcm, size_t len, bool loop) {
+    if (n >= AUDIO_MAX_SAMPLES) return;
+    audio->samples[n] = (AudioSample){.pcm = pcm, .len = pcm ? len : 0, .loop = loop};
+}
+
+bool audio_push(Audio *audio, AudioEvent event) {
+    size_t tail = atomic_load_explicit(&audio->tail, memory_order_relaxed);
+    if (tail - atomic_load_explicit(&audio->head, memory_order_acquire) == AUDIO_RING_SIZE) {
+        atomic_fetch_add_explicit(&audio->dropped, 1, memory_order_relaxed);
+        return false;
+    }
+    audio->events[tail & (AUDIO_RING_SIZE - 1)] = event;
+    atomic_store_explicit(&audio->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+static uint64_t playhead(const Audio *audio) {
+    return audio->base + audio->frames * audio->clock / audio->rate;
+}
+
+static void resync(Audio *audio, uint64_t cycle) {
+    audio->base = cycle > audio->latency ? cycle - audio->latency : 0;
+    audio->frames = 0;
+    audio->synced = true;
+}
+
+// starts and stops every sample whose event is due
+static void apply_due(Audio *audio) {
+    size_t head = atomic_load_explicit(&audio->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&audio->tail, memory_order_acquire);
+
+    while (head != tail) {
+        const AudioEvent *event = &audio->events[head & (AUDIO_RING_SIZE - 1)];
+        uint64_t now = playhead(audio);
+        uint64_t drift = AUDIO_RESYNC * audio->latency;
+
+        if (!audio->synced || event->cycle > now + drift || event->cycle + drift < now) {
+            resync(audio, event->cycle);
+            now = playhead(audio);
+        }
+        if (event->cycle > now) break;
+
+        if (event->sample < AUDIO_MAX_SAMPLES) {
+            audio->playing[event->sample] = event->start;
+            audio->position[event->sample] = 0;
+        }
+        head++;
+    }
+    atomic_store_explicit(&audio->head, head, memory_order_release);
+}
+
+void audio_mix(Audio *audio, int16_t *out, size_t frames) {
+    for (size_t i = 0; i < frames; i++) {
+        apply_due(audio);
+
+        int32_t mixed = 0;
+        for (int n = 0; n < AUDIO_MAX_SAMPLES; n++) {
+            if (!audio->playing[n]) continue;
+
+            const AudioSample *sample = &audio->samples[n];
+            if (audio->position[n] >= sample->len) {
+                if (!sample->loop || !sample->len) {
+                    audio->playing[n] = false;
+                    continue;
+                }
+                audio->position[n] = 0;
+            }
+            mixed += sample->pcm[audio->position[n]++];
+        }
+
+        out[i] = mixed > INT16_MAX ? INT16_MAX : mixed < INT16_MIN ? INT16_MIN : mixed;
+        if (audio->synced) audio->frames++;
+    }
+}
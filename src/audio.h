@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+// Sample playback for sound boards that trigger prerecorded effects. The
+// emulation thread turns writes to its sound latches into AudioEvents
+// stamped with the cpu cycle and pushes them into a wait-free single
+// producer / single consumer ring. The audio thread pops them in
+// audio_mix and starts or stops preloaded PCM samples once its playhead
+// reaches their cycle. Neither side ever waits on the other: a full ring
+// drops the event, an empty one keeps playing what already runs.
+//
+// The playhead trails the newest events by latency cycles, which absorbs
+// the emulation running in bursts of a frame. It is put back on the
+// events when the two drift apart by more than AUDIO_RESYNC latencies,
+// after a pause or when the audio device started late.
+
+// events, a power of two
+#define AUDIO_RING_SIZE 256
+#define AUDIO_MAX_SAMPLES 16
+#define AUDIO_RESYNC 4
+
+typedef struct {
+    uint64_t cycle;
+    uint8_t sample;
+    bool start;             // false stops a looping sample
+} AudioEvent;
+
+typedef struct {
+    const int16_t *pcm;     // mono at the output rate, NULL plays nothing
+    size_t len;
+    bool loop;
+} AudioSample;
+
+typedef struct {
+    // head is only written by the audio thread, tail only by the
+    // emulation thread
+    _Alignas(64) atomic_size_t head;
+    _Alignas(64) atomic_size_t tail;
+    atomic_size_t dropped;
+    AudioEvent events[AUDIO_RING_SIZE];
+
+    // audio thread only from here on
+    _Alignas(64) AudioSample samples[AUDIO_MAX_SAMPLES];
+    size_t position[AUDIO_MAX_SAMPLES];
+    bool playing[AUDIO_MAX_SAMPLES];
+
+    uint32_t clock, rate;
+    uint64_t latency;
+
+    // the playhead is base + frames * clock / rate, exact over any run
+    bool synced;
+    uint64_t base;
+    uint64_t frames;
+} Audio;
+
+// clock is the cpu clock in Hz, rate the output sample rate
+void audio_init(Audio *audio, uint32_t clock, uint32_t rate, uint64_t latency);
+
+// before the audio thread starts, the pcm has to outlive the Audio
+void audio_set_sample(Audio *audio, uint8_t n, const int16_t *pcm, size_t len, bool loop);
+
+// emulation thread, false when the ring was full and the event dropped
+bool audio_push(Audio *audio, AudioEvent event);
+
+// audio thread, fills frames mono samples
+void audio_mix(Audio *audio, int16_t *out, size_t frames);
@@ -0,0 +1,357 @@
+#define _GNU_SOURCE
+#include "batch.h"
+#include "block_cache.h"
+#include "console.h"
+#include "loader.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// cycles per cpu_run call, same slice main.c uses
+#define BATCH_SLICE 33333
+
+// Per worker deque of job indices. The owner takes jobs from the tail,
+// idle workers steal from the head. Jobs are whole program runs, so a
+// mutex per deque costs nothing next to them.
+typedef struct {
+    pthread_mutex_t lock;
+    size_t *jobs;
+    size_t head, tail;
+} WorkQueue;
+
+typedef struct {
+    BatchJob *jobs;
+    WorkQueue *queues;
+    int queue_count;
+    const BatchOptions *options;
+} BatchPool;
+
+typedef struct {
+    BatchPool *pool;
+    int index;
+} Worker;
+
+static bool queue_pop(WorkQueue *queue, size_t *job) {
+    pthread_mutex_lock(&queue->lock);
+    bool found = queue->head < queue->tail;
+    if (found) {
+        *job = queue->jobs[--queue->tail];
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return found;
+}
+
+static bool queue_steal(WorkQueue *queue, size_t *job) {
+    pthread_mutex_lock(&queue->lock);
+    bool found = queue->head < queue->tail;
+    if (found) {
+        *job = queue->jobs[queue->head++];
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return found;
+}
+
+static void run_job(BatchJob *job, const BatchOptions *options) {
+    Image image;
+    if (!image_load(job->path, IMAGE_AUTO, job->origin, &image)) {
+        job->status = JOB_LOAD_ERROR;
+        return;
+    }
+
+    Bus bus = {0};
+    uint8_t *mem = calloc(MEM_SIZE, 1);
+    FILE *output = open_memstream(&job->output, &job->output_len);
+    if (!mem || !output) {
+        if (output) fclose(output);
+        free(mem);
+        image_free(&image);
+        job->status = JOB_LOAD_ERROR;
+        return;
+    }
+    bus_map_ram(&bus, 0, MEM_SIZE, mem);
+    image_map(&image, &bus, mem);
+
+    Console console;
+    console_attach(&console, &bus, 1, output);
+
+    BlockCache *block_cache = NULL;
+    if (options->block_cache || options->jit) {
+        block_cache = block_cache_create(&bus);
+        if (block_cache && options->jit) {
+            block_cache_enable_jit(block_cache);
+        }
+    }
+
+    CpuState cpu = job->initial;
+    cpu.bus = &bus;
+    cpu.cycle = 0;
+    if (!job->pc_given) {
+        cpu.pc = image.entry;
+    }
+
+    while (!cpu.halted && cpu.cycle < job->cycle_limit) {
+        uint64_t left = job->cycle_limit - cpu.cycle;
+        cpu_run(&cpu, left < BATCH_SLICE ? left : BATCH_SLICE);
+    }
+
+    block_cache_destroy(block_cache);
+    console_flush(&console);
+    fclose(output);
+    free(mem);
+    image_free(&image);
+
+    job->status = cpu.halted ? JOB_HALTED : JOB_CYCLE_LIMIT;
+    job->final = cpu;
+    job->final.bus = NULL;
+}
+
+static void *worker_main(void *arg) {
+    Worker *worker = arg;
+    BatchPool *pool = worker->pool;
+    size_t job;
+
+    for (;;) {
+        bool found = queue_pop(&pool->queues[worker->index], &job);
+
+        // nothing new gets queued, so a round over every queue coming up
+        // empty means all jobs are taken
+        for (int i = 1; !found && i < pool->queue_count; i++) {
+            found = queue_steal(&pool->queues[(worker->index + i) % pool->queue_count], &job);
+        }
+        if (!found) break;
+
+        run_job(&pool->jobs[job], pool->options);
+    }
+    return NULL;
+}
+
+bool batch_run(BatchJob *jobs, size_t count, const BatchOptions *options, double *seconds) {
+    int threads = options->threads;
+    if (threads <= 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = online > 0 ? (int)online : 1;
+    }
+    if ((size_t)threads > count) {
+        threads = count ? (int)count : 1;
+    }
+
+    BatchPool pool = {
+        .jobs = jobs,
+        .queues = calloc(threads, sizeof(WorkQueue)),
+        .queue_count = threads,
+        .options = options,
+    };
+    Worker *workers = calloc(threads, sizeof(Worker));
+    pthread_t *thread_ids = calloc(threads, sizeof(pthread_t));
+
+    // deal the jobs out round robin, stealing evens out the rest
+    size_t per_queue = (count + threads - 1) / threads;
+    size_t *slots = calloc(per_queue * threads + 1, sizeof(size_t));
+    if (!pool.queues || !workers || !thread_ids || !slots) {
+        fprintf(stderr, "ERROR: out of memory starting %d batch threads\n", threads);
+        free(slots);
+        free(thread_ids);
+        free(workers);
+        free(pool.queues);
+        return false;
+    }
+    for (int q = 0; q < threads; q++) {
+        WorkQueue *queue = &pool.queues[q];
+        pthread_mutex_init(&queue->lock, NULL);
+        queue->jobs = slots + q * per_queue;
+    }
+    for (size_t i = 0; i < count; i++) {
+        WorkQueue *queue = &pool.queues[i % threads];
+        queue->jobs[queue->tail++] = count - 1 - i;
+        jobs[count - 1 - i].status = JOB_PENDING;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    int started = 0;
+    for (int t = 0; t < threads; t++) {
+        workers[t] = (Worker){.pool = &pool, .index = t};
+        if (pthread_create(&thread_ids[t], NULL, worker_main, &workers[t]) != 0) break;
+        started++;
+    }
+    if (started == 0) {
+        // no threads available, run everything here
+        worker_main(&workers[0]);
+    }
+    for (int t = 0; t < started; t++) {
+        pthread_join(thread_ids[t], NULL);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    for (int q = 0; q < threads; q++) {
+        pthread_mutex_destroy(&pool.queues[q].lock);
+    }
+    free(slots);
+    free(thread_ids);
+    free(workers);
+    free(pool.queues);
+
+    *seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    return true;
+}
+
+static bool parse_number(const char *text, uint64_t *out) {
+    char *end;
+    *out = strtoull(text, &end, 0);
+    return end != text && *end == '\0';
+}
+
+static bool parse_setting(BatchJob *job, const char *setting) {
+    const char *eq = strchr(setting, '=');
+    uint64_t val;
+    if (!eq || !parse_number(eq + 1, &val)) return false;
+
+    size_t len = eq - setting;
+    CpuState *cpu = &job->initial;
+
+    if (len == 6 && strncmp(setting, "cycles", len) == 0) {
+        job->cycle_limit = val;
+        return true;
+    }
+    if (len == 2 && strncmp(setting, "sp", len) == 0) {
+        cpu->sp = val;
+        return val <= 0xFFFF;
+    }
+    if (len == 6 && strncmp(setting, "origin", len) == 0) {
+        job->origin = val;
+        return val <= 0xFFFF;
+    }
+    if (len == 2 && strncmp(setting, "pc", len) == 0) {
+        cpu->pc = val;
+        job->pc_given = true;
+        return val <= 0xFFFF;
+    }
+    if (len == 5 && strncmp(setting, "flags", len) == 0) {
+        cpu->flags = val & FLAG_MASK;
+        return val <= 0xFF;
+    }
+    if (len != 1 || val > 0xFF) return false;
+
+    switch (setting[0]) {
+        case 'a': cpu->a = val; return true;
+        case 'b': cpu->b = val; return true;
+        case 'c': cpu->c = val; return true;
+        case 'd': cpu->d = val; return true;
+        case 'e': cpu->e = val; return true;
+        case 'h': cpu->h = val; return true;
+        case 'l': cpu->l = val; return true;
+    }
+    return false;
+}
+
+BatchJob *batch_load_manifest(const char *path, size_t *count) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "ERROR: could not open manifest %s\n", path);
+        return NULL;
+    }
+
+    BatchJob *jobs = NULL;
+    size_t capacity = 0;
+    size_t n = 0;
+    char line[4096];
+    int line_number = 0;
+
+    while (fgets(line, sizeof(line), f)) {
+        line_number++;
+        char *comment = strchr(line, '#');
+        if (comment) *comment = '\0';
+
+        char *save;
+        char *token = strtok_r(line, " \t\r\n", &save);
+        if (!token) continue;
+
+        if (n == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            BatchJob *grown = realloc(jobs, capacity * sizeof(BatchJob));
+            if (!grown) goto out_of_memory;
+            jobs = grown;
+        }
+
+        BatchJob *job = &jobs[n++];
+        memset(job, 0, sizeof(*job));
+        job->path = strdup(token);
+        job->cycle_limit = BATCH_DEFAULT_CYCLE_LIMIT;
+        if (!job->path) goto out_of_memory;
+
+        while ((token = strtok_r(NULL, " \t\r\n", &save))) {
+            if (!parse_setting(job, token)) {
+                fprintf(stderr, "ERROR: %s:%d: invalid setting %s\n", path, line_number, token);
+                fclose(f);
+                batch_free(jobs, n);
+                return NULL;
+            }
+        }
+    }
+
+    fclose(f);
+    if (n == 0) {
+        fprintf(stderr, "ERROR: no jobs in manifest %s\n", path);
+        free(jobs);
+        return NULL;
+    }
+    *count = n;
+    return jobs;
+
+out_of_memory:
+    // the partial list is no use, jobs past the failure would be missing
+    fprintf(stderr, "ERROR: out of memory reading manifest %s\n", path);
+    fclose(f);
+    batch_free(jobs, n);
+    return NULL;
+}
+
+void batch_free(BatchJob *jobs, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        free(jobs[i].path);
+        free(jobs[i].output);
+    }
+    free(jobs);
+}
+
+void batch_report(FILE *f, const BatchJob *jobs, size_t count, double seconds) {
+    static const char *const status_names[] = {
+        [JOB_PENDING] = "pending",
+        [JOB_HALTED] = "halted",
+        [JOB_CYCLE_LIMIT] = "cycle-limit",
+        [JOB_LOAD_ERROR] = "load-error",
+    };
+    uint64_t total_cycles = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        const BatchJob *job = &jobs[i];
+        const CpuState *cpu = &job->final;
+
+        fprintf(f, "job %zu %s: %s", i, job->path, status_names[job->status]);
+        if (job->status == JOB_HALTED || job->status == JOB_CYCLE_LIMIT) {
+            fprintf(f, " cycles=%llu a=%02X b=%02X c=%02X d=%02X e=%02X h=%02X l=%02X sp=%04X pc=%04X flags=%02X",
+                (unsigned long long)cpu->cycle, cpu->a, cpu->b, cpu->c, cpu->d, cpu->e, cpu->h, cpu->l,
+                cpu->sp, cpu->pc, cpu->flags);
+            total_cycles += cpu->cycle;
+        }
+        fprintf(f, "\n");
+
+        // program output indented below its job
+        const char *out = job->output;
+        const char *end = out + job->output_len;
+        while (out && out < end) {
+            const char *nl = memchr(out, '\n', end - out);
+            size_t len = nl ? (size_t)(nl - out) : (size_t)(end - out);
+            fprintf(f, "    %.*s\n", (int)len, out);
+            out += len + 1;
+        }
+    }
+
+    fprintf(f, "%zu jobs in %.3f s, %.1f instances/s, %.1f MHz emulated\n",
+        count, seconds, seconds > 0 ? count / seconds : 0.0,
+        seconds > 0 ? total_cycles / seconds / 1e6 : 0.0);
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include "cpu.h"
+
+// Batch mode: runs many independent programs on a work stealing thread
+// pool, each job with its own bus, memory and output.
+//
+// Manifest format, one job per line, # starts a comment:
+//   <program file> [cycles=N] [origin=N] [a=N] [b=N] ... [l=N] [sp=N] [pc=N] [flags=N]
+// Numbers are decimal or 0x prefixed hex. cycles caps the job, it stops
+// at the first instruction boundary past it if it did not halt before.
+// origin is where raw binaries load, pc defaults to the image entry.
+
+#define BATCH_DEFAULT_CYCLE_LIMIT 100000000
+
+typedef enum {
+    JOB_PENDING,
+    JOB_HALTED,
+    JOB_CYCLE_LIMIT,
+    JOB_LOAD_ERROR
+} JobStatus;
+
+typedef struct {
+    char *path;
+    CpuState initial;       // registers to start from, bus unused
+    bool pc_given;          // initial.pc set by the manifest
+    uint16_t origin;
+    uint64_t cycle_limit;
+
+    // results
+    JobStatus status;
+    CpuState final;
+    char *output;           // everything the program printed
+    size_t output_len;
+} BatchJob;
+
+typedef struct {
+    int threads;            // 0 uses every online cpu
+    bool block_cache;
+    bool jit;
+} BatchOptions;
+
+// returns NULL and prints the offending line when the manifest is invalid
+BatchJob *batch_load_manifest(const char *path, size_t *count);
+
+void batch_free(BatchJob *jobs, size_t count);
+
+// runs every job and stores the wall clock seconds it took in seconds.
+// Returns false and prints why when the pool could not be set up, no job
+// ran then.
+bool batch_run(BatchJob *jobs, size_t count, const BatchOptions *options, double *seconds);
+
+// per job status, registers and output in manifest order, then the
+// throughput summary
+void batch_report(FILE *f, const BatchJob *jobs, size_t count, double seconds);
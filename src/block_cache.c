@@ -0,0 +1,564 @@
+#include "cpu_ops.h"
+#include "block_cache.h"
+#include "jit.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define BLOCK_MAX_OPS 32
+
+// executions before a block gets compiled to native code
+#define JIT_THRESHOLD 16
+#define JIT_CODE_SIZE (16 << 20)
+
+// opcode value of the sentinel op closing every block
+#define BLOCK_END 0x100
+
+// Superinstructions, runs of instructions the profiler's pair report
+// finds back to back in hot loops, executed as one op. The fused op keeps
+// the immediate and next_pc of the last instruction and the summed cycles.
+enum {
+    FUSED_DCR_JNZ_B = BLOCK_END + 1,    // DCR r ; JNZ
+    FUSED_DCR_JNZ_C,
+    FUSED_DCR_JNZ_D,
+    FUSED_DCR_JNZ_E,
+    FUSED_DCR_JNZ_H,
+    FUSED_DCR_JNZ_L,
+    FUSED_DCR_JNZ_A,
+    FUSED_DCX_JNZ_BC,                   // DCX rp ; MOV A,hi ; ORA lo ; JNZ, either half first
+    FUSED_DCX_JNZ_DE,
+    FUSED_DCX_JNZ_HL,
+    FUSED_MOV_A_M_INX_H,                // MOV A,M ; INX H
+    FUSED_CPI_JNZ,                      // CPI arg ; Jccc, conditions in opcode order
+    FUSED_CPI_JZ,
+    FUSED_CPI_JNC,
+    FUSED_CPI_JC,
+    BLOCK_OPCODES
+};
+
+static const uint16_t fused_dcr_jnz[8] = {
+    FUSED_DCR_JNZ_B, FUSED_DCR_JNZ_C, FUSED_DCR_JNZ_D, FUSED_DCR_JNZ_E,
+    FUSED_DCR_JNZ_H, FUSED_DCR_JNZ_L, 0, FUSED_DCR_JNZ_A,
+};
+
+typedef struct {
+    uint16_t opcode;
+    uint16_t imm;       // immediate operand, 8 bit ones in the low byte
+    uint16_t next_pc;   // address of the following instruction
+    uint8_t cycles;     // not taken cycles for conditional instructions
+    uint8_t arg;        // fused ops: immediate of the first instruction
+} MicroOp;
+
+typedef struct Block {
+    uint16_t start;
+    uint16_t size;          // bytes of 8080 code covered
+    uint32_t cycles;        // sum over all ops
+    uint32_t lead_cycles;   // sum over all ops but the last one
+    bool valid;
+    bool falls_through;     // cut at BLOCK_MAX_OPS instead of a block ender
+
+    // exit_pc[0] is the fall through address, exit_pc[1] the static
+    // branch target if there is one, link caches the blocks found there
+    uint16_t exit_pc[2];
+    struct Block *link[2];
+
+    // per page block lists, [0] for the page of start, [1] for the next
+    // page when the block crosses into it
+    struct Block *page_next[2];
+
+    // native code, compiled once exec_count reaches JIT_THRESHOLD
+    JitBlockFn native;
+    uint32_t exec_count;
+
+    uint8_t op_count;
+    MicroOp ops[BLOCK_MAX_OPS + 1];
+} Block;
+
+struct BlockCache {
+    Bus *bus;
+    Block *map[0x10000];
+    Block *page_blocks[256];
+    Block *pool;
+    size_t pool_used;
+    uint32_t flushes;       // blocks from before a flush get reused
+    Jit *jit;
+};
+
+// instructions that may write over code of the block running them, block
+// enders are left out since the block is done after them anyway
+static inline bool opcode_writes_memory(uint16_t opcode) {
+    switch (opcode) {
+        case 0x70: case 0x71: case 0x72: case 0x73:     // MOV M,r
+        case 0x74: case 0x75: case 0x77:
+        case 0x34: case 0x35: case 0x36:                // INR M DCR M MVI M
+        case 0x02: case 0x12: case 0x22: case 0x32:     // STAX SHLD STA
+        case 0xC5: case 0xD5: case 0xE5: case 0xF5:     // PUSH
+        case 0xE3:                                      // XTHL
+            return true;
+    }
+    return false;
+}
+
+static inline Block *page_list_next(Block *block, uint8_t page) {
+    return (uint8_t)(block->start >> 8) == page ? block->page_next[0] : block->page_next[1];
+}
+
+BlockCache *block_cache_create(Bus *bus) {
+    BlockCache *cache = calloc(1, sizeof(BlockCache));
+    if (!cache) return NULL;
+
+    cache->pool = malloc(BLOCK_POOL_SIZE * sizeof(Block));
+    if (!cache->pool) {
+        free(cache);
+        return NULL;
+    }
+
+    cache->bus = bus;
+    bus->block_cache = cache;
+    for (int page = 0; page < BUS_PAGES; page++) {
+        bus_set_code_page(bus, page, false);
+    }
+    return cache;
+}
+
+void block_cache_destroy(BlockCache *cache) {
+    if (!cache) return;
+    block_cache_flush(cache);
+    cache->bus->block_cache = NULL;
+    jit_destroy(cache->jit);
+    free(cache->pool);
+    free(cache);
+}
+
+void block_cache_flush(BlockCache *cache) {
+    for (size_t i = 0; i < cache->pool_used; i++) {
+        cache->pool[i].valid = false;
+    }
+    cache->pool_used = 0;
+    cache->flushes++;
+    memset(cache->map, 0, sizeof(cache->map));
+    memset(cache->page_blocks, 0, sizeof(cache->page_blocks));
+    for (int page = 0; page < BUS_PAGES; page++) {
+        bus_set_code_page(cache->bus, page, false);
+    }
+    if (cache->jit) {
+        jit_reset(cache->jit);
+    }
+}
+
+bool block_cache_enable_jit(BlockCache *cache) {
+    if (!cache->jit) {
+        // the jit compiles one instruction per op, blocks translated so
+        // far may hold fused ones
+        block_cache_flush(cache);
+        cache->jit = jit_create(JIT_CODE_SIZE);
+    }
+    return cache->jit != NULL;
+}
+
+void block_cache_invalidate(BlockCache *cache, uint16_t addr) {
+    uint8_t page = addr >> 8;
+    bool page_has_code = false;
+
+    for (Block *block = cache->page_blocks[page]; block; block = page_list_next(block, page)) {
+        if (!block->valid) continue;
+
+        if ((uint16_t)(addr - block->start) < block->size) {
+            block->valid = false;
+            cache->map[block->start] = NULL;
+        } else {
+            page_has_code = true;
+        }
+    }
+
+    if (!page_has_code) {
+        cache->page_blocks[page] = NULL;
+        bus_set_code_page(cache->bus, page, false);
+    }
+}
+
+void block_cache_invalidate_page(BlockCache *cache, uint8_t page) {
+    for (Block *block = cache->page_blocks[page]; block; block = page_list_next(block, page)) {
+        if (block->valid) {
+            block->valid = false;
+            cache->map[block->start] = NULL;
+        }
+    }
+    cache->page_blocks[page] = NULL;
+    bus_set_code_page(cache->bus, page, false);
+}
+
+static void add_to_page(BlockCache *cache, Block *block, uint8_t page, int slot) {
+    block->page_next[slot] = cache->page_blocks[page];
+    cache->page_blocks[page] = block;
+    bus_set_code_page(cache->bus, page, true);
+}
+
+// number of ops starting at ops that make up a superinstruction, which
+// goes to fused, 1 when they do not
+static int fuse(const MicroOp *ops, int left, MicroOp *fused) {
+    uint16_t first = ops[0].opcode;
+    uint16_t second = left > 1 ? ops[1].opcode : BLOCK_END;
+    uint16_t code = 0;
+    int count = 2;
+
+    if ((first & 0xC7) == 0x05 && first != 0x35 && second == 0xC2) {
+        code = fused_dcr_jnz[first >> 3 & 7];
+    } else if (first == 0x7E && second == 0x23) {
+        code = FUSED_MOV_A_M_INX_H;
+    } else if (first == 0xFE && (second & 0xE7) == 0xC2) {
+        code = FUSED_CPI_JNZ + (second >> 3 & 3);
+    } else if ((first == 0x0B || first == 0x1B || first == 0x2B) && left >= 4 && ops[3].opcode == 0xC2) {
+        // register numbers of the high and the low half
+        uint16_t hi = (first >> 4) * 2, lo = hi + 1;
+        if ((ops[1].opcode == (0x78 | hi) && ops[2].opcode == (0xB0 | lo))
+                || (ops[1].opcode == (0x78 | lo) && ops[2].opcode == (0xB0 | hi))) {
+            code = FUSED_DCX_JNZ_BC + (first >> 4);
+            count = 4;
+        }
+    }
+    if (!code) return 1;
+
+    *fused = (MicroOp){
+        .opcode = code, .imm = ops[count - 1].imm, .next_pc = ops[count - 1].next_pc, .arg = ops[0].imm
+    };
+    for (int i = 0; i < count; i++) {
+        fused->cycles += ops[i].cycles;
+    }
+    return count;
+}
+
+// fuses the ops of a block in place, returns how many are left
+static uint8_t fuse_block(MicroOp *ops, uint8_t n) {
+    uint8_t out = 0;
+    for (uint8_t i = 0; i < n; ) {
+        MicroOp fused;
+        int count = fuse(ops + i, n - i, &fused);
+        ops[out++] = count > 1 ? fused : ops[i];
+        i += count;
+    }
+    return out;
+}
+
+// Decoding ahead of execution has to see the bytes cpu_step would fetch,
+// which only holds for host memory. Code on devices is left to cpu_step.
+static bool decodable(Bus *bus, uint16_t addr) {
+    return bus_in_host_memory(bus, addr, 1)
+        && bus_in_host_memory(bus, addr, opcode_length(bus_peek(bus, addr)));
+}
+
+// NULL when pc is not decodable
+static Block *translate(BlockCache *cache, uint16_t pc) {
+    Bus *bus = cache->bus;
+    if (!decodable(bus, pc)) return NULL;
+
+    if (cache->pool_used == BLOCK_POOL_SIZE) {
+        block_cache_flush(cache);
+    }
+
+    Block *block = &cache->pool[cache->pool_used++];
+    uint16_t addr = pc;
+    uint32_t cycles = 0;
+    uint32_t lead_cycles = 0;
+    uint8_t n = 0;
+
+    block->exit_pc[1] = 0;
+    block->falls_through = true;
+    bool has_target = false;
+
+    while (n < BLOCK_MAX_OPS && (n == 0 || decodable(bus, addr))) {
+        uint8_t opcode = bus_peek(bus, addr);
+        uint8_t length = opcode_length(opcode);
+        MicroOp *op = &block->ops[n++];
+
+        op->opcode = opcode;
+        if (length == 3) {
+            op->imm = lb_hb_to_uint16(bus_peek(bus, addr + 1), bus_peek(bus, addr + 2));
+        } else if (length == 2) {
+            op->imm = bus_peek(bus, addr + 1);
+        } else {
+            op->imm = 0;
+        }
+        addr += length;
+        op->next_pc = addr;
+        op->cycles = op_cycles[opcode];
+
+        lead_cycles = cycles;
+        cycles += op->cycles;
+
+        if (opcode_ends_block(opcode)) {
+            block->falls_through = false;
+            if (length == 3) {
+                block->exit_pc[1] = op->imm;
+                has_target = true;
+            } else if ((opcode & 0xC7) == 0xC7) {
+                block->exit_pc[1] = opcode & 0x38;
+                has_target = true;
+            }
+            break;
+        }
+    }
+
+    // native code is compiled from the 8080 code, one instruction per op
+    if (!cache->jit) {
+        n = fuse_block(block->ops, n);
+    }
+
+    block->ops[n].opcode = BLOCK_END;
+    block->op_count = n;
+    block->start = pc;
+    block->size = (uint16_t)(addr - pc);
+    block->cycles = cycles;
+    block->lead_cycles = lead_cycles;
+    block->valid = true;
+    block->exit_pc[0] = addr;
+    if (!has_target) {
+        block->exit_pc[1] = addr;
+    }
+    block->link[0] = NULL;
+    block->link[1] = NULL;
+    block->page_next[0] = NULL;
+    block->page_next[1] = NULL;
+    block->native = NULL;
+    block->exec_count = 0;
+
+    uint8_t first_page = pc >> 8;
+    uint8_t last_page = (uint16_t)(addr - 1) >> 8;
+    add_to_page(cache, block, first_page, 0);
+    if (last_page != first_page) {
+        add_to_page(cache, block, last_page, 1);
+    }
+
+    cache->map[pc] = block;
+    return block;
+}
+
+static inline Block *block_lookup(BlockCache *cache, uint16_t pc) {
+    Block *block = cache->map[pc];
+    if (block) return block;
+    return translate(cache, pc);
+}
+
+static inline Block *block_successor(BlockCache *cache, Block *block, uint16_t pc) {
+    int slot = pc == block->exit_pc[1] ? 1 : (pc == block->exit_pc[0] ? 0 : -1);
+    if (slot < 0) {
+        return block_lookup(cache, pc);
+    }
+
+    Block *next = block->link[slot];
+    if (next && next->valid) return next;
+
+    // a full pool gets flushed in block_lookup, block may be running
+    // from a slot the new block took over by now
+    uint32_t flushes = cache->flushes;
+    next = block_lookup(cache, pc);
+    if (block->valid && cache->flushes == flushes) {
+        block->link[slot] = next;
+    }
+    return next;
+}
+
+// cycles of the ops in front of op, blocks only count theirs at the end
+static inline uint64_t cycles_before(const Block *block, const MicroOp *op) {
+    uint64_t cycles = 0;
+    for (const MicroOp *before = block->ops; before < op; before++) {
+        cycles += before->cycles;
+    }
+    return cycles;
+}
+
+#define IMM8  ((uint8_t)op->imm)
+#define IMM16 (op->imm)
+#define NOW   (cpu->cycle + cycles + cycles_before(block, op))
+
+#define FUSED_JCCC(cc) cpu->pc = op->next_pc; cpu_jccc(cpu, cc, IMM16)
+#define FUSED_DCX_JNZ(rp, hi, lo) cpu_dcx(cpu, rp); cpu->a = cpu->hi; cpu_ora(cpu, cpu->lo); FUSED_JCCC(CC_NZ)
+
+#define FUSED_OPCODE_TABLE(FUSE) \
+    FUSE(FUSED_DCR_JNZ_B,     { cpu_dcr(cpu, REG_B); FUSED_JCCC(CC_NZ); })     \
+    FUSE(FUSED_DCR_JNZ_C,     { cpu_dcr(cpu, REG_C); FUSED_JCCC(CC_NZ); })     \
+    FUSE(FUSED_DCR_JNZ_D,     { cpu_dcr(cpu, REG_D); FUSED_JCCC(CC_NZ); })     \
+    FUSE(FUSED_DCR_JNZ_E,     { cpu_dcr(cpu, REG_E); FUSED_JCCC(CC_NZ); })     \
+    FUSE(FUSED_DCR_JNZ_H,     { cpu_dcr(cpu, REG_H); FUSED_JCCC(CC_NZ); })     \
+    FUSE(FUSED_DCR_JNZ_L,     { cpu_dcr(cpu, REG_L); FUSED_JCCC(CC_NZ); })     \
+    FUSE(FUSED_DCR_JNZ_A,     { cpu_dcr(cpu, REG_A); FUSED_JCCC(CC_NZ); })     \
+    FUSE(FUSED_DCX_JNZ_BC,    { FUSED_DCX_JNZ(RP_BC, b, c); })                 \
+    FUSE(FUSED_DCX_JNZ_DE,    { FUSED_DCX_JNZ(RP_DE, d, e); })                 \
+    FUSE(FUSED_DCX_JNZ_HL,    { FUSED_DCX_JNZ(RP_HL, h, l); })                 \
+    FUSE(FUSED_MOV_A_M_INX_H, { cpu_mov(cpu, REG_A, REG_M); cpu_inx(cpu, RP_HL); }) \
+    FUSE(FUSED_CPI_JNZ,       { cpu_cmp(cpu, op->arg); FUSED_JCCC(CC_NZ); })   \
+    FUSE(FUSED_CPI_JZ,        { cpu_cmp(cpu, op->arg); FUSED_JCCC(CC_Z); })    \
+    FUSE(FUSED_CPI_JNC,       { cpu_cmp(cpu, op->arg); FUSED_JCCC(CC_NC); })   \
+    FUSE(FUSED_CPI_JC,        { cpu_cmp(cpu, op->arg); FUSED_JCCC(CC_C); })
+
+#if defined(__GNUC__) && !defined(CPU_SWITCH_DISPATCH)
+
+#define BLOCK_LABEL(code, op_cycles, handler) \
+    op_##code: if (opcode_ends_block(code)) cpu->pc = op->next_pc; handler; \
+    if (opcode_writes_memory(code) && !block->valid) goto aborted; \
+    op++; goto *dispatch[op->opcode];
+#define BLOCK_LABEL_C(code, op_cycles, taken_cycles, handler) \
+    op_##code: cpu->pc = op->next_pc; \
+    if (handler) extra_cycles = taken_cycles - op_cycles; \
+    op++; goto *dispatch[op->opcode];
+#define BLOCK_ADDR(code, op_cycles, handler) [code] = &&op_##code,
+#define BLOCK_ADDR_C(code, op_cycles, taken_cycles, handler) [code] = &&op_##code,
+#define FUSED_LABEL(code, handler) \
+    op_##code: handler \
+    op++; goto *dispatch[op->opcode];
+#define FUSED_ADDR(code, handler) [code] = &&op_##code,
+
+#else
+
+#define BLOCK_CASE(code, op_cycles, handler) \
+    case code: if (opcode_ends_block(code)) cpu->pc = op->next_pc; handler; \
+    if (opcode_writes_memory(code) && !block->valid) goto aborted; \
+    break;
+#define BLOCK_CASE_C(code, op_cycles, taken_cycles, handler) \
+    case code: cpu->pc = op->next_pc; \
+    if (handler) extra_cycles = taken_cycles - op_cycles; \
+    break;
+#define FUSED_CASE(code, handler) \
+    case code: handler break;
+
+#endif
+
+// cpu_step with cpu->cycle brought up to where the run got, the run loops
+// add their cycles only when they return
+static inline int step_at(CpuState *cpu, uint64_t cycle) {
+    cpu->cycle = cycle;
+    return cpu_step(cpu);
+}
+
+// Runs hot blocks as native code. Cold blocks, blocks starting with an
+// instruction the jit leaves alone and the instructions native code bails
+// on go through cpu_step. Native code loads and stores the registers
+// itself, so this works on cpu directly rather than on a local copy.
+static uint64_t run_native(BlockCache *cache, CpuState *cpu, uint64_t cycle_budget) {
+    uint64_t start = cpu->cycle;
+    uint64_t cycles = 0;
+
+    while (cycles < cycle_budget && !cpu->halted) {
+        Block *block = block_lookup(cache, cpu->pc);
+        uint64_t cycles_left = cycle_budget - cycles;
+
+        if (!block || block->lead_cycles >= cycles_left || !jit_supports(block->ops[0].opcode)) {
+            cycles += step_at(cpu, start + cycles);
+            continue;
+        }
+
+        if (!block->native && ++block->exec_count >= JIT_THRESHOLD) {
+            block->native = jit_compile(cache->jit, cache->bus, block->start, block->op_count);
+            if (!block->native) {
+                // code buffer full, start over
+                block_cache_flush(cache);
+                continue;
+            }
+        }
+
+        if (block->native) {
+            uint64_t limit = cycles_left - block->lead_cycles;
+            uint32_t result = block->native(cpu, limit < JIT_MAX_CYCLE_LIMIT ? limit : JIT_MAX_CYCLE_LIMIT);
+            cycles += result & ~JIT_BAIL;
+            if (result & JIT_BAIL) {
+                cycles += step_at(cpu, start + cycles);
+            }
+            continue;
+        }
+
+        for (int i = 0; i < block->op_count && block->valid && !cpu->halted; i++) {
+            cycles += step_at(cpu, start + cycles);
+        }
+    }
+
+    cpu->cycle = start + cycles;
+    return cycles;
+}
+
+uint64_t block_cache_run(BlockCache *cache, CpuState *cpu_state, uint64_t cycle_budget) {
+    if (cache->jit) {
+        return run_native(cache, cpu_state, cycle_budget);
+    }
+
+#if defined(__GNUC__) && !defined(CPU_SWITCH_DISPATCH)
+    static const void *const dispatch[BLOCK_OPCODES] = {
+        CPU_OPCODE_TABLE(BLOCK_ADDR, BLOCK_ADDR_C)
+        [BLOCK_END] = &&block_end,
+        FUSED_OPCODE_TABLE(FUSED_ADDR)
+    };
+#endif
+
+    CpuState local = *cpu_state;
+    CpuState *cpu = &local;
+    uint64_t cycles = 0;
+    Block *block = NULL;
+
+    while (cycles < cycle_budget && !cpu->halted) {
+        if (!block || !block->valid) {
+            block = block_lookup(cache, cpu->pc);
+        }
+
+        // the last instruction has to start within the budget, otherwise
+        // step through the remaining ones on the interpreter, like code
+        // that could not be translated
+        if (!block || cycles + block->lead_cycles >= cycle_budget) {
+            *cpu_state = local;
+            cycles += step_at(cpu_state, local.cycle + cycles);
+            cpu_state->cycle = local.cycle;
+            local = *cpu_state;
+            block = NULL;
+            continue;
+        }
+
+        MicroOp *op;
+        uint32_t extra_cycles;
+
+    enter_block:
+        op = block->ops;
+        extra_cycles = 0;
+
+#if defined(__GNUC__) && !defined(CPU_SWITCH_DISPATCH)
+        goto *dispatch[op->opcode];
+
+        CPU_OPCODE_TABLE(BLOCK_LABEL, BLOCK_LABEL_C)
+        FUSED_OPCODE_TABLE(FUSED_LABEL)
+#else
+        for (;; op++) {
+            switch (op->opcode) {
+                CPU_OPCODE_TABLE(BLOCK_CASE, BLOCK_CASE_C)
+                FUSED_OPCODE_TABLE(FUSED_CASE)
+                case BLOCK_END: goto block_end;
+            }
+        }
+#endif
+
+    aborted:
+        // the block wrote over its own code, count what ran and retranslate
+        cpu->pc = op->next_pc;
+        for (MicroOp *done = block->ops; done <= op; done++) {
+            cycles += done->cycles;
+        }
+        block = NULL;
+        continue;
+
+    block_end:
+        // only block enders keep pc up to date while running
+        if (block->falls_through) {
+            cpu->pc = block->exit_pc[0];
+        }
+        cycles += block->cycles + extra_cycles;
+        if (cycles >= cycle_budget || cpu->halted) {
+            break;
+        }
+
+        // chained successors that fit the budget run without another trip
+        // through the loop
+        block = block_successor(cache, block, cpu->pc);
+        if (block && cycles + block->lead_cycles < cycle_budget) {
+            goto enter_block;
+        }
+    }
+
+    local.cycle += cycles;
+    *cpu_state = local;
+    return cycles;
+}
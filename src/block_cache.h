@@ -0,0 +1,38 @@
+#pragma once
+
+#include "cpu.h"
+
+// Predecoded basic block cache. A block runs from its entry pc up to the
+// next JMP/Jccc, CALL/Cccc, RET/Rccc, RST, PCHL or HLT and is kept as an
+// array of micro ops with operands already read and cycle totals summed.
+// Blocks are cached per entry address and linked to their successors.
+
+// blocks translated before the cache flushes and starts over
+#define BLOCK_POOL_SIZE 4096
+
+// creates a cache and attaches it to the bus, cpu_run then executes
+// through it, returns NULL when out of memory
+BlockCache *block_cache_create(Bus *bus);
+
+// detaches the cache from its bus and frees it
+void block_cache_destroy(BlockCache *cache);
+
+// compiles hot blocks to native code from now on, returns false when
+// there is no native backend for this platform. Off unless asked for:
+// code that calls, returns or does I/O every few instructions runs
+// slower than on the interpreter, only tight loops gain.
+bool block_cache_enable_jit(BlockCache *cache);
+
+// drops every translated block
+void block_cache_flush(BlockCache *cache);
+
+// same contract as cpu_run
+uint64_t block_cache_run(BlockCache *cache, CpuState *cpu, uint64_t cycle_budget);
+
+// called by bus_write_slow for writes into a page holding translated code,
+// invalidates the blocks covering addr
+void block_cache_invalidate(BlockCache *cache, uint16_t addr);
+
+// invalidates every block with code on the page, for memory changed
+// behind the bus's back
+void block_cache_invalidate_page(BlockCache *cache, uint8_t page);
@@ -0,0 +1,184 @@
+#include "bus.h"
+#include "block_cache.h"
+#include <string.h>
+
+// a page and its mirrors are written through the fast path only while
+// none of them holds code or waits for its first write after a snapshot
+// or bus_watch_clean
+static void update_write_trap(Bus *bus, uint8_t page) {
+    bool trap = false;
+    uint8_t p = page;
+    do {
+        trap |= bus->code_page[p] || (bus->dirty_generation && !bus->dirty[p])
+            || (bus->watched[p] && !bus->watch_dirty[p]);
+        p += bus->mirror_step[p];
+    } while (p != page);
+
+    do {
+        bus->write_page[p] = trap ? NULL : bus->page[p].ram;
+        p += bus->mirror_step[p];
+    } while (p != page);
+}
+
+static void map_pages(Bus *bus, uint16_t addr, size_t size, const uint8_t *read, uint8_t *ram, BusPage device) {
+    size_t first = addr / BUS_PAGE_SIZE;
+    size_t count = size / BUS_PAGE_SIZE;
+
+    for (size_t i = 0; i < count && first + i < BUS_PAGES; i++) {
+        size_t offset = i * BUS_PAGE_SIZE;
+        BusPage *page = &bus->page[first + i];
+
+        *page = device;
+        page->ram = ram ? ram + offset : NULL;
+        bus->read_page[first + i] = read ? read + offset : NULL;
+        bus->write_page[first + i] = page->ram;
+    }
+
+    // which pages are RAM changed under the snapshot and the watches
+    bus->dirty_generation = 0;
+    memset(bus->watched, 0, sizeof(bus->watched));
+
+    for (int p = 0; p < BUS_PAGES; p++) {
+        bus->mirror_step[p] = 0;
+        for (int n = 1; n < BUS_PAGES && bus->read_page[p]; n++) {
+            if (bus->read_page[(p + n) % BUS_PAGES] == bus->read_page[p]) {
+                bus->mirror_step[p] = n;
+                break;
+            }
+        }
+    }
+
+    // pages left trapped by a watch or the snapshot open again
+    for (int p = 0; p < BUS_PAGES; p++) {
+        update_write_trap(bus, p);
+    }
+
+    // translated code may come from the old mapping, flushing also puts
+    // back the write traps cleared above
+    if (bus->block_cache) {
+        block_cache_flush(bus->block_cache);
+    }
+}
+
+void bus_map_ram(Bus *bus, uint16_t addr, size_t size, uint8_t *host) {
+    map_pages(bus, addr, size, host, host, (BusPage){0});
+}
+
+void bus_map_rom(Bus *bus, uint16_t addr, size_t size, const uint8_t *host) {
+    map_pages(bus, addr, size, host, NULL, (BusPage){0});
+}
+
+void bus_map_device(Bus *bus, uint16_t addr, size_t size, BusReadFn read, BusWriteFn write, void *ctx) {
+    map_pages(bus, addr, size, NULL, NULL, (BusPage){.read = read, .write = write, .ctx = ctx});
+}
+
+void bus_unmap(Bus *bus, uint16_t addr, size_t size) {
+    map_pages(bus, addr, size, NULL, NULL, (BusPage){0});
+}
+
+void bus_map_in(Bus *bus, uint8_t port, BusInFn in, void *ctx) {
+    bus->in_port[port] = (BusInPort){.in = in, .ctx = ctx};
+}
+
+void bus_map_out(Bus *bus, uint8_t port, BusOutFn out, void *ctx) {
+    bus->out_port[port] = (BusOutPort){.out = out, .ctx = ctx};
+}
+
+void bus_set_code_page(Bus *bus, uint8_t page, bool code) {
+    bus->code_page[page] = code;
+    update_write_trap(bus, page);
+}
+
+void bus_track_dirty(Bus *bus, uint64_t generation) {
+    // clean pages of the same snapshot are still trapped, only the written
+    // ones need it again
+    bool rearm = generation && generation == bus->dirty_generation;
+    bus->dirty_generation = generation;
+
+    for (int page = 0; page < BUS_PAGES; page++) {
+        if (rearm && !bus->dirty[page]) continue;
+        bus->dirty[page] = false;
+        update_write_trap(bus, page);
+    }
+}
+
+void bus_watch(Bus *bus, uint16_t addr, size_t size, bool watch) {
+    size_t first = addr / BUS_PAGE_SIZE;
+    for (size_t page = first; page < first + size / BUS_PAGE_SIZE && page < BUS_PAGES; page++) {
+        // mirrors too, a write through any of them has to be seen
+        uint8_t p = page;
+        do {
+            bus->watched[p] = watch;
+            bus->watch_dirty[p] = false;
+            p += bus->mirror_step[p];
+        } while (p != page);
+        update_write_trap(bus, page);
+    }
+}
+
+void bus_watch_clean(Bus *bus, uint8_t page) {
+    uint8_t p = page;
+    do {
+        bus->watch_dirty[p] = false;
+        p += bus->mirror_step[p];
+    } while (p != page);
+    update_write_trap(bus, page);
+}
+
+static inline bool page_unmapped(Bus *bus, uint8_t page) {
+    const BusPage *p = &bus->page[page];
+    return !bus->read_page[page] && !p->read && !p->write;
+}
+
+uint8_t *bus_page_ram(Bus *bus, uint8_t page) {
+    if (bus->page[page].ram) return bus->page[page].ram;
+    if (bus->mem && page_unmapped(bus, page)) return bus->mem + page * BUS_PAGE_SIZE;
+    return NULL;
+}
+
+uint8_t bus_read_slow(Bus *bus, uint16_t addr) {
+    const BusPage *page = &bus->page[addr >> 8];
+    if (page->read) return page->read(page->ctx, addr);
+    if (bus->mem && page_unmapped(bus, addr >> 8)) return bus->mem[addr];
+    return 0xFF;
+}
+
+void bus_write_slow(Bus *bus, uint16_t addr, uint8_t val) {
+    const BusPage *page = &bus->page[addr >> 8];
+
+    if (page->write) {
+        page->write(page->ctx, addr, val);
+    } else if (page->ram) {
+        page->ram[addr & 0xFF] = val;
+    } else if (bus->mem && page_unmapped(bus, addr >> 8)) {
+        bus->mem[addr] = val;
+    } else {
+        return;     // ROM
+    }
+
+    uint8_t p = addr >> 8;
+    if (bus->dirty_generation && !bus->dirty[p]) {
+        do {
+            bus->dirty[p] = true;
+            p += bus->mirror_step[p];
+        } while (p != addr >> 8);
+        update_write_trap(bus, p);
+    }
+    if (bus->watched[p] && !bus->watch_dirty[p]) {
+        do {
+            bus->watch_dirty[p] = true;
+            p += bus->mirror_step[p];
+        } while (p != addr >> 8);
+        update_write_trap(bus, p);
+    }
+
+    if (!bus->block_cache) return;
+
+    do {
+        uint16_t mirrored = (p << 8) | (addr & 0xFF);
+        if (bus->code_page[p]) {
+            block_cache_invalidate(bus->block_cache, mirrored);
+        }
+        p += bus->mirror_step[p];
+    } while (p != addr >> 8);
+}
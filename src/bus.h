@@ -0,0 +1,157 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// size of the 8080 address space
+#define MEM_SIZE 0x10000
+
+// the address space is mapped in 256 pages of 256 bytes
+#define BUS_PAGE_SIZE 0x100
+#define BUS_PAGES (MEM_SIZE / BUS_PAGE_SIZE)
+
+typedef struct BlockCache BlockCache;
+typedef struct Snapshot Snapshot;
+
+// memory mapped device handlers, addr is the full 16 bit address
+typedef uint8_t (*BusReadFn)(void *ctx, uint16_t addr);
+typedef void (*BusWriteFn)(void *ctx, uint16_t addr, uint8_t val);
+
+// IN / OUT port handlers
+typedef uint8_t (*BusInFn)(void *ctx, uint8_t port);
+typedef void (*BusOutFn)(void *ctx, uint8_t port, uint8_t val);
+
+typedef struct {
+    BusInFn in;             // IN leaves A alone when NULL
+    void *ctx;
+} BusInPort;
+
+typedef struct {
+    BusOutFn out;           // OUT does nothing when NULL
+    void *ctx;
+} BusOutPort;
+
+// what a page is mapped to
+typedef struct {
+    uint8_t *ram;           // writable host memory, NULL for ROM and devices
+    BusReadFn read;         // device, reads 0xFF when NULL
+    BusWriteFn write;       // device, writes are dropped when NULL
+    void *ctx;
+} BusPage;
+
+typedef struct {
+    // Fast path, host memory of every page. NULL sends the access to the
+    // slow path: devices, unmapped pages, writes to ROM and writes into
+    // pages holding translated code.
+    const uint8_t *read_page[BUS_PAGES];
+    uint8_t *write_page[BUS_PAGES];
+    BusPage page[BUS_PAGES];
+
+    // pages to the next page mapped to the same host memory, wrapping
+    // around, 0 when not mirrored. Lets stores reach code seen through a
+    // mirror, a ROM view of RAM included.
+    uint8_t mirror_step[BUS_PAGES];
+
+    // flat memory behind pages nobody mapped, so a bus that only sets mem
+    // works as 64K of RAM, only through the slow path
+    uint8_t *mem;
+
+    // IN and OUT handlers, indexed by port
+    BusInPort in_port[256];
+    BusOutPort out_port[256];
+
+    // cpu cycle the IN or OUT a port handler runs for started at, the cpu
+    // itself may be a copy that only gets its cycle count on return
+    uint64_t port_cycle;
+
+    // set while a block cache is attached, code_page marks the pages it
+    // translated code from. Their write_page and the one of every mirror
+    // stay NULL, so stores there reach block_cache_invalidate.
+    BlockCache *block_cache;
+    uint8_t code_page[BUS_PAGES];
+
+    // generation of the snapshot written pages are tracked against, 0
+    // while none is. Clean pages keep write_page NULL as well, the first
+    // store marks the page and its mirrors dirty and opens the fast path
+    // again.
+    uint64_t dirty_generation;
+    uint8_t dirty[BUS_PAGES];
+
+    // pages watched with bus_watch, watch_dirty is set by the first write
+    // since bus_watch_clean. Clean watched pages keep write_page NULL the
+    // same way, so a page costs one trap per clean / dirty round.
+    uint8_t watched[BUS_PAGES];
+    uint8_t watch_dirty[BUS_PAGES];
+} Bus;
+
+// Map size bytes from addr on, both multiples of BUS_PAGE_SIZE. Mapping
+// the same host memory at several addresses mirrors it. Any mapping
+// change drops the code an attached block cache translated.
+
+// host memory read and written directly
+void bus_map_ram(Bus *bus, uint16_t addr, size_t size, uint8_t *host);
+
+// host memory read directly, writes are dropped
+void bus_map_rom(Bus *bus, uint16_t addr, size_t size, const uint8_t *host);
+
+// every access goes through the handlers, either may be NULL
+void bus_map_device(Bus *bus, uint16_t addr, size_t size, BusReadFn read, BusWriteFn write, void *ctx);
+
+// back to the flat mem fallback
+void bus_unmap(Bus *bus, uint16_t addr, size_t size);
+
+// handler for IN / OUT on one port, NULL removes it. IN and OUT of the
+// same port are separate, they often belong to different devices.
+void bus_map_in(Bus *bus, uint8_t port, BusInFn in, void *ctx);
+void bus_map_out(Bus *bus, uint8_t port, BusOutFn out, void *ctx);
+
+// writable host memory behind a page, the mem fallback included, NULL for
+// ROM, devices and unmapped pages without mem
+uint8_t *bus_page_ram(Bus *bus, uint8_t page);
+
+// starts tracking written pages against the snapshot of generation with
+// every page clean, 0 stops tracking. Any mapping change stops it too.
+void bus_track_dirty(Bus *bus, uint64_t generation);
+
+// Starts or stops watching the pages of size bytes from addr, both
+// multiples of BUS_PAGE_SIZE, for writes. Watched pages start clean. For
+// video RAM: convert what watch_dirty says changed, then clean it. Any
+// mapping change stops every watch.
+void bus_watch(Bus *bus, uint16_t addr, size_t size, bool watch);
+
+// clears watch_dirty of a page and its mirrors, the next write marks it
+void bus_watch_clean(Bus *bus, uint8_t page);
+
+// marks the page as holding translated code, writes to it and its
+// mirrors then take the slow path
+void bus_set_code_page(Bus *bus, uint8_t page, bool code);
+
+#if defined(__GNUC__)
+#define BUS_COLD __attribute__((cold))
+#else
+#define BUS_COLD
+#endif
+
+// accesses that missed read_page / write_page
+BUS_COLD uint8_t bus_read_slow(Bus *bus, uint16_t addr);
+BUS_COLD void bus_write_slow(Bus *bus, uint16_t addr, uint8_t val);
+
+// RAM or ROM behind addr without touching devices, which read as 0xFF.
+// For tools looking at code and operands outside of execution.
+static inline uint8_t bus_peek(Bus *bus, uint16_t addr) {
+    const uint8_t *page = bus->read_page[addr >> 8];
+    if (page) return page[addr & 0xFF];
+    const uint8_t *ram = bus_page_ram(bus, addr >> 8);
+    return ram ? ram[addr & 0xFF] : 0xFF;
+}
+
+// true when the len bytes from addr are host memory, so bus_peek sees
+// what the cpu would read there. Devices and unmapped pages are not.
+static inline bool bus_in_host_memory(Bus *bus, uint16_t addr, int len) {
+    uint8_t first = addr >> 8;
+    uint8_t last = (uint16_t)(addr + len - 1) >> 8;
+    return (bus->read_page[first] || bus_page_ram(bus, first))
+        && (bus->read_page[last] || bus_page_ram(bus, last));
+}
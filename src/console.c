@@ -0,0 +1,33 @@
+#include "console.h"
+
+// longest line, "255\n"
+#define CONSOLE_LINE_MAX 4
+
+static void console_out(void *ctx, uint8_t port, uint8_t val) {
+    (void)port;
+    Console *console = ctx;
+
+    if (console->len > CONSOLE_BUFFER_SIZE - CONSOLE_LINE_MAX) {
+        console_flush(console);
+    }
+
+    char *p = console->buffer + console->len;
+    if (val >= 100) *p++ = '0' + val / 100;
+    if (val >= 10) *p++ = '0' + val / 10 % 10;
+    *p++ = '0' + val % 10;
+    *p++ = '\n';
+    console->len = p - console->buffer;
+}
+
+void console_attach(Console *console, Bus *bus, uint8_t port, FILE *out) {
+    console->out = out;
+    console->len = 0;
+    bus_map_out(bus, port, console_out, console);
+}
+
+void console_flush(Console *console) {
+    if (console->len) {
+        fwrite(console->buffer, 1, console->len, console->out);
+        console->len = 0;
+    }
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include "bus.h"
+
+// Console on an OUT port: every byte written to it is printed as a decimal
+// number on its own line. Output collects in a buffer and reaches the
+// FILE in batches, so print heavy programs are not held up by stdio.
+
+#define CONSOLE_BUFFER_SIZE 4096
+
+typedef struct {
+    FILE *out;
+    size_t len;
+    char buffer[CONSOLE_BUFFER_SIZE];
+} Console;
+
+// registers the console as the OUT handler of port on bus
+void console_attach(Console *console, Bus *bus, uint8_t port, FILE *out);
+
+// writes everything buffered so far to the FILE
+void console_flush(Console *console);
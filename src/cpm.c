@@ -0,0 +1,80 @@
+#include "cpm.h"
+#include "cpu_ops.h"
+
+// cycles of the RET the trap stands in for
+#define CPM_RET_CYCLES 10
+
+void cpm_install(Cpm *cpm, CpuState *cpu, uint8_t *ram, FILE *out) {
+    *cpm = (Cpm){.out = out};
+
+    // JMP CPM_BOOT ; JMP CPM_BDOS
+    ram[0x0000] = 0xC3;
+    ram[0x0001] = CPM_BOOT & 0xFF;
+    ram[0x0002] = CPM_BOOT >> 8;
+    ram[0x0005] = 0xC3;
+    ram[0x0006] = CPM_BDOS & 0xFF;
+    ram[0x0007] = CPM_BDOS >> 8;
+    ram[CPM_BOOT] = 0x76;
+    ram[CPM_BDOS] = 0x76;
+
+    cpu->pc = CPM_TPA;
+    cpu->sp = CPM_BDOS - 2;
+    ram[cpu->sp] = 0x00;
+    ram[cpu->sp + 1] = 0x00;
+    cpu->halted = false;
+}
+
+static void bdos(Cpm *cpm, CpuState *cpu) {
+    switch (cpu->c) {
+        case 0:
+            cpm->exited = true;
+            return;
+        case 2:
+            fputc(cpu->e, cpm->out);
+            break;
+        case 9: {
+            // at most the whole address space, a missing '$' must not hang
+            uint16_t addr = lb_hb_to_uint16(cpu->e, cpu->d);
+            for (uint32_t i = 0; i < MEM_SIZE; i++) {
+                uint8_t ch = bus_read(cpu->bus, addr + i);
+                if (ch == '$') break;
+                fputc(ch, cpm->out);
+            }
+            break;
+        }
+        default:
+            fprintf(stderr, "WARNING: unsupported BDOS function %d\n", cpu->c);
+    }
+
+    // results come back in A and L, B and H, none of these has one
+    cpu->a = cpu->l = 0;
+    cpu->b = cpu->h = 0;
+}
+
+bool cpm_trap(Cpm *cpm, CpuState *cpu) {
+    if (!cpu->halted || cpm->exited) return false;
+
+    if (cpu->pc == (uint16_t)(CPM_BOOT + 1)) {
+        cpm->exited = true;
+        return false;
+    }
+    if (cpu->pc != (uint16_t)(CPM_BDOS + 1)) return false;
+
+    cpm->bdos_calls++;
+    bdos(cpm, cpu);
+    if (cpm->exited) return false;
+
+    cpu->halted = false;
+    cpu_ret(cpu);
+    cpu->cycle += CPM_RET_CYCLES;
+    return true;
+}
+
+uint64_t cpm_run(Cpm *cpm, CpuState *cpu, uint64_t cycle_budget) {
+    uint64_t start = cpu->cycle;
+    while (cpu->cycle - start < cycle_budget) {
+        cpu_run(cpu, cycle_budget - (cpu->cycle - start));
+        if (cpu->halted && !cpm_trap(cpm, cpu)) break;
+    }
+    return cpu->cycle - start;
+}
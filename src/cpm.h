@@ -0,0 +1,38 @@
+#pragma once
+
+#include "cpu.h"
+
+// CP/M machine profile for .COM programs. Instead of a BDOS and BIOS the
+// page zero vectors jump to HLT instructions at the top of memory:
+// 0x0000 (warm boot) goes to CPM_BOOT, 0x0005 (BDOS) to CPM_BDOS. When
+// the cpu halts on one of them cpm_trap services the call in C and
+// returns to the program, so every core runs at full speed and none of
+// them knows about CP/M.
+//
+// BDOS functions 0 (system reset), 2 (console output) and 9 (print
+// string up to '$') are supported, others print a warning and return 0.
+// The word at 0x0006 holds CPM_BDOS, programs that put their stack
+// below the BDOS find it there.
+
+#define CPM_TPA  0x0100
+#define CPM_BDOS 0xFE00
+#define CPM_BOOT 0xFF00
+
+typedef struct {
+    FILE *out;
+    bool exited;            // the program jumped to 0 or called function 0
+    uint64_t bdos_calls;
+} Cpm;
+
+// Writes the vectors and trap HLTs into ram, starts the cpu at CPM_TPA
+// with a return address of 0 on the stack like the CCP leaves it.
+void cpm_install(Cpm *cpm, CpuState *cpu, uint8_t *ram, FILE *out);
+
+// Called with a halted cpu. Services a BDOS call and returns true with
+// the cpu running again after the CALL 5. Returns false when the halt
+// was a real HLT or the program exited, the cpu stays halted.
+bool cpm_trap(Cpm *cpm, CpuState *cpu);
+
+// same contract as cpu_run, with BDOS calls serviced on the way. Returns
+// early once the program halted or exited.
+uint64_t cpm_run(Cpm *cpm, CpuState *cpu, uint64_t cycle_budget);
@@ -4,6 +4,9 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include "bus.h"
+
+typedef struct Profiler Profiler;
 
 typedef enum {
     REG_B,
@@ -34,33 +37,53 @@ typedef enum {
     CC_M
 } ConditionCode;
 
-typedef struct {
-    size_t rom_size;
-    uint8_t *mem;
-} Bus;
+// PSW bits: S Z 0 AC 0 P 1 CY
+#define FLAG_CY 0x01
+#define FLAG_ALWAYS_ONE 0x02
+#define FLAG_P  0x04
+#define FLAG_AC 0x10
+#define FLAG_Z  0x40
+#define FLAG_S  0x80
+#define FLAG_MASK (FLAG_S | FLAG_Z | FLAG_AC | FLAG_P | FLAG_CY)
 
 typedef struct {
     uint8_t a, b, c, d, e, h, l;
 
     uint16_t sp, pc;
 
-    bool carry_flag;
-    bool parity_flag;
-    bool auxilary_flag;
-    bool zero_flag;
-    bool sign_flag;
+    // packed PSW, same layout as the byte PUSH PSW stores
+    uint8_t flags;
 
     bool halted;
     bool interruptible;
 
-    uint8_t port0;
-    uint8_t port1;
-    uint8_t port2;
-    uint8_t port3;
-
     uint64_t cycle;
 
     Bus *bus;
 } CpuState;
 
 int cpu_step(CpuState *cpu);
+
+// cpu_step on a switch dispatch in every build, kept simple on purpose
+// as the reference for differential testing of the faster cores
+int cpu_step_reference(CpuState *cpu);
+
+// executes instructions until at least cycle_budget cycles were consumed
+// or the cpu halts, adds them to cpu->cycle and returns them. Runs on the
+// block cache when one is attached to the bus.
+uint64_t cpu_run(CpuState *cpu, uint64_t cycle_budget);
+
+// cpu_run on the interpreter with every instruction accounted in
+// profiler, see profiler.h. Ignores an attached block cache.
+uint64_t cpu_run_profiled(CpuState *cpu, Profiler *profiler, uint64_t cycle_budget);
+
+// cpu_run on an interpreter that computes flags only when something reads
+// them, see cpu_lazy.c. cpu->flags is up to date again when it returns.
+// Ignores an attached block cache.
+uint64_t cpu_run_lazy(CpuState *cpu, uint64_t cycle_budget);
+
+// Raises interrupt RST rst. Accepted only while interrupts are enabled,
+// then wakes the cpu from HLT, disables interrupts and calls rst * 8 like
+// the RST instruction, 11 cycles added to cpu->cycle. Returns whether it
+// was accepted; a device holding its line keeps raising it.
+bool cpu_interrupt(CpuState *cpu, uint8_t rst);
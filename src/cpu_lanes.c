@@ -0,0 +1,536 @@
+#include "cpu_lanes.h"
+#include "cpu_ops.h"
+#include <string.h>
+
+// Lanes execute together when they sit at the same pc and see the same
+// instruction bytes there. Each round picks the lowest pc among the running
+// lanes: lanes that took a branch backwards run ahead until they come out
+// of the loop, lanes that jumped forward wait, so structured code gets
+// back into lockstep at the join point.
+
+typedef int16_t SignedLanes __attribute__((vector_size(CPU_LANES * 2)));
+
+// everything taking or returning vectors is inlined into cpu_lanes_run,
+// they never get passed by value across a real call
+#define LANE_INLINE static inline __attribute__((always_inline))
+
+// longest stretch run with 16 bit cycle counters
+#define LANE_MAX_SLICE 0x4000
+
+LANE_INLINE Lanes lane_select(Lanes mask, Lanes val, Lanes old) {
+    return (val & mask) | (old & ~mask);
+}
+
+LANE_INLINE Lanes lane_broadcast(uint16_t val) {
+    return (Lanes){0} + val;
+}
+
+// Masks come from arithmetic rather than vector compares: compares on
+// vectors wider than the target's registers get expanded lane by lane,
+// shifts and adds get split in halves.
+
+// all ones in the lanes where x is not zero
+LANE_INLINE Lanes lane_nonzero(Lanes x) {
+    return -((x | -x) >> 15);
+}
+
+LANE_INLINE Lanes lane_equal(Lanes a, Lanes b) {
+    return ~lane_nonzero(a ^ b);
+}
+
+// all ones in the lanes where x is above zero, x never is -0x8000
+LANE_INLINE Lanes lane_positive(SignedLanes x) {
+    return (Lanes)(-x >> 15);
+}
+
+LANE_INLINE bool lane_any(Lanes mask) {
+    uint64_t words[sizeof(Lanes) / 8];
+    uint64_t any = 0;
+    memcpy(words, &mask, sizeof(mask));
+    for (size_t i = 0; i < sizeof(Lanes) / 8; i++) {
+        any |= words[i];
+    }
+    return any != 0;
+}
+
+// index of the first lane in a non empty mask
+LANE_INLINE int lane_first(Lanes mask) {
+    uint64_t words[sizeof(Lanes) / 8];
+    memcpy(words, &mask, sizeof(mask));
+    int i = 0;
+    while (!words[i]) i++;
+    return i * 4 + __builtin_ctzll(words[i]) / 16;
+}
+
+// same bits as zsp_table, parity folded down instead of looked up
+LANE_INLINE Lanes lane_zsp(Lanes r) {
+    Lanes p = r ^ (r >> 4);
+    p ^= p >> 2;
+    p ^= p >> 1;
+    return (r & FLAG_S) | (~lane_nonzero(r) & FLAG_Z) | ((~p & 1) << 2);
+}
+
+// carry / borrow into bit 4, matches aux_carry_add and aux_carry_sub
+LANE_INLINE Lanes lane_aux_carry(Lanes a, Lanes b, Lanes r) {
+    return (a ^ b ^ r) & FLAG_AC;
+}
+
+LANE_INLINE Lanes lane_pair(const CpuLanes *l, Register hi, Register lo) {
+    return (l->reg[hi] << 8) | l->reg[lo];
+}
+
+LANE_INLINE Lanes lane_get_rp(const CpuLanes *l, RegisterPair rp) {
+    if (rp == RP_SP) return l->sp;
+    return lane_pair(l, rp * 2, rp * 2 + 1);
+}
+
+LANE_INLINE void lane_set_rp(CpuLanes *l, Lanes mask, RegisterPair rp, Lanes val) {
+    if (rp == RP_SP) {
+        l->sp = lane_select(mask, val, l->sp);
+        return;
+    }
+    l->reg[rp * 2] = lane_select(mask, val >> 8, l->reg[rp * 2]);
+    l->reg[rp * 2 + 1] = lane_select(mask, val & 0xFF, l->reg[rp * 2 + 1]);
+}
+
+// drops the verified instructions a store to addr could be part of, at
+// every address mirroring it
+LANE_INLINE void lane_forget(CpuLanes *l, Bus *bus, uint16_t addr) {
+    uint8_t page = addr >> 8;
+    do {
+        uint16_t mirrored = (page << 8) | (addr & 0xFF);
+        for (int i = 0; i < 3; i++) {
+            l->verified[(uint16_t)(mirrored - i) % LANE_VERIFIED_SLOTS] = 0;
+        }
+        page += bus->mirror_step[page];
+    } while (page != addr >> 8);
+}
+
+// memory differs between lanes, so loads and stores go lane by lane
+LANE_INLINE Lanes lane_read(CpuLanes *l, Lanes mask, Lanes addr) {
+    Lanes val = {0};
+    for (int i = 0; i < CPU_LANES; i++) {
+        if (mask[i]) val[i] = bus_read(l->bus[i], addr[i]);
+    }
+    return val;
+}
+
+LANE_INLINE void lane_write(CpuLanes *l, Lanes mask, Lanes addr, Lanes val) {
+    for (int i = 0; i < CPU_LANES; i++) {
+        if (mask[i]) {
+            bus_write(l->bus[i], addr[i], val[i]);
+            lane_forget(l, l->bus[i], addr[i]);
+        }
+    }
+}
+
+LANE_INLINE Lanes lane_read_reg(CpuLanes *l, Lanes mask, Register r) {
+    if (r == REG_M) return lane_read(l, mask, lane_pair(l, REG_H, REG_L));
+    return l->reg[r];
+}
+
+LANE_INLINE void lane_write_reg(CpuLanes *l, Lanes mask, Register r, Lanes val) {
+    if (r == REG_M) {
+        lane_write(l, mask, lane_pair(l, REG_H, REG_L), val);
+        return;
+    }
+    l->reg[r] = lane_select(mask, val, l->reg[r]);
+}
+
+LANE_INLINE void lane_alu(CpuLanes *l, Lanes mask, int op, Lanes b) {
+    Lanes a = l->reg[REG_A];
+    Lanes carry = l->flags & FLAG_CY;
+    Lanes r, flags;
+
+    switch (op) {
+        case 0: case 1: case 2: case 3: case 7: {
+            // ADD ADC SUB SBB CMP, bit 8 of the 16 bit result is the carry
+            Lanes in = op == 1 || op == 3 ? carry : lane_broadcast(0);
+            Lanes wide = op < 2 ? a + b + in : a - b - in;
+            r = wide & 0xFF;
+            flags = lane_zsp(r) | lane_aux_carry(a, b, r) | ((wide >> 8) & FLAG_CY);
+            break;
+        }
+        case 4:     // ANA
+            r = a & b;
+            flags = lane_zsp(r) | (((a | b) & 0x08) << 1);
+            break;
+        case 5:     // XRA
+            r = a ^ b;
+            flags = lane_zsp(r);
+            break;
+        default:    // ORA
+            r = a | b;
+            flags = lane_zsp(r);
+            break;
+    }
+
+    l->flags = lane_select(mask, flags, l->flags);
+    if (op != 7) {
+        l->reg[REG_A] = lane_select(mask, r, a);
+    }
+}
+
+// every store an instruction can make, for dropping verified entries
+// around what cpu_step is about to write
+static void lane_forget_stores(CpuLanes *l, CpuState *cpu, uint8_t opcode) {
+    uint16_t addr;
+    int count = cpu_store_span(cpu, opcode, &addr);
+    for (int i = 0; i < count; i++) {
+        lane_forget(l, cpu->bus, addr + i);
+    }
+}
+
+// runs one instruction of one lane through the scalar core, used is what
+// the lane ran so far in this slice and not in l->cycle yet
+static int lane_step_scalar(CpuLanes *l, int lane, int used) {
+    CpuState cpu;
+    cpu_lanes_get(l, lane, &cpu);
+    lane_forget_stores(l, &cpu, bus_peek(cpu.bus, cpu.pc));
+    cpu.cycle += used;
+    int cycles = cpu_step(&cpu);
+    cpu.cycle = l->cycle[lane];
+    cpu_lanes_set(l, lane, &cpu);
+    return cycles;
+}
+
+typedef enum {
+    LANE_TOGETHER,      // every lane in the mask continues at next_pc
+    LANE_SPLIT,         // a conditional jump went both ways, l->pc is set
+    LANE_SCALAR         // no vector version, nothing was executed
+} LaneResult;
+
+// runs one instruction on every lane in mask, all of them sit at pc with
+// the same instruction bytes there. Leaves l->pc and the cycle counters
+// alone unless the lanes split, the caller keeps track of them while the
+// lanes stay together.
+LANE_INLINE LaneResult lane_execute(CpuLanes *l, Lanes mask, uint16_t pc, const uint8_t *code, uint16_t *next_pc) {
+    uint8_t opcode = code[0];
+    uint16_t next = pc + 1;
+    Lanes addr = lane_broadcast(lb_hb_to_uint16(code[1], code[2]));
+    Register dst = (opcode >> 3) & 7;
+    Register src = opcode & 7;
+    RegisterPair rp = (opcode >> 4) & 3;
+
+    switch (opcode) {
+        // NOP
+        case 0x00: case 0x08: case 0x10: case 0x18:
+        case 0x20: case 0x28: case 0x30: case 0x38:
+            break;
+
+        // MOV  01DDDSSS
+        case 0x40 ... 0x75: case 0x77 ... 0x7F:
+            lane_write_reg(l, mask, dst, lane_read_reg(l, mask, src));
+            break;
+
+        // MVI  00DDD110
+        case 0x06: case 0x0E: case 0x16: case 0x1E:
+        case 0x26: case 0x2E: case 0x36: case 0x3E:
+            lane_write_reg(l, mask, dst, lane_broadcast(code[1]));
+            next = pc + 2;
+            break;
+
+        // LXI  00RP0001
+        case 0x01: case 0x11: case 0x21: case 0x31:
+            lane_set_rp(l, mask, rp, addr);
+            next = pc + 3;
+            break;
+
+        case 0x3A:  // LDA
+            l->reg[REG_A] = lane_select(mask, lane_read(l, mask, addr), l->reg[REG_A]);
+            next = pc + 3;
+            break;
+        case 0x32:  // STA
+            lane_write(l, mask, addr, l->reg[REG_A]);
+            next = pc + 3;
+            break;
+        case 0x2A:  // LHLD
+            l->reg[REG_L] = lane_select(mask, lane_read(l, mask, addr), l->reg[REG_L]);
+            l->reg[REG_H] = lane_select(mask, lane_read(l, mask, addr + 1), l->reg[REG_H]);
+            next = pc + 3;
+            break;
+        case 0x22:  // SHLD
+            lane_write(l, mask, addr, l->reg[REG_L]);
+            lane_write(l, mask, addr + 1, l->reg[REG_H]);
+            next = pc + 3;
+            break;
+
+        // LDAX 000R1010 / STAX 000R0010
+        case 0x0A: case 0x1A:
+            l->reg[REG_A] = lane_select(mask, lane_read(l, mask, lane_get_rp(l, rp)), l->reg[REG_A]);
+            break;
+        case 0x02: case 0x12:
+            lane_write(l, mask, lane_get_rp(l, rp), l->reg[REG_A]);
+            break;
+
+        case 0xEB: {    // XCHG
+            Lanes d = l->reg[REG_D], e = l->reg[REG_E];
+            l->reg[REG_D] = lane_select(mask, l->reg[REG_H], d);
+            l->reg[REG_E] = lane_select(mask, l->reg[REG_L], e);
+            l->reg[REG_H] = lane_select(mask, d, l->reg[REG_H]);
+            l->reg[REG_L] = lane_select(mask, e, l->reg[REG_L]);
+            break;
+        }
+
+        // ALU  10OOOSSS / 11OOO110 db
+        case 0x80 ... 0xBF:
+            lane_alu(l, mask, dst, lane_read_reg(l, mask, src));
+            break;
+        case 0xC6: case 0xCE: case 0xD6: case 0xDE:
+        case 0xE6: case 0xEE: case 0xF6: case 0xFE:
+            lane_alu(l, mask, dst, lane_broadcast(code[1]));
+            next = pc + 2;
+            break;
+
+        // INR 00DDD100 / DCR 00DDD101
+        case 0x04: case 0x0C: case 0x14: case 0x1C: case 0x24: case 0x2C: case 0x34: case 0x3C:
+        case 0x05: case 0x0D: case 0x15: case 0x1D: case 0x25: case 0x2D: case 0x35: case 0x3D: {
+            Lanes val = lane_read_reg(l, mask, dst);
+            Lanes r = (opcode & 1 ? val - 1 : val + 1) & 0xFF;
+            Lanes flags = (l->flags & FLAG_CY) | lane_zsp(r) | lane_aux_carry(val, lane_broadcast(1), r);
+            l->flags = lane_select(mask, flags, l->flags);
+            lane_write_reg(l, mask, dst, r);
+            break;
+        }
+
+        // INX 00RP0011 / DCX 00RP1011
+        case 0x03: case 0x13: case 0x23: case 0x33:
+            lane_set_rp(l, mask, rp, lane_get_rp(l, rp) + 1);
+            break;
+        case 0x0B: case 0x1B: case 0x2B: case 0x3B:
+            lane_set_rp(l, mask, rp, lane_get_rp(l, rp) - 1);
+            break;
+
+        // DAD  00RP1001
+        case 0x09: case 0x19: case 0x29: case 0x39: {
+            Lanes hl = lane_pair(l, REG_H, REG_L);
+            Lanes rp_val = lane_get_rp(l, rp);
+            Lanes sum = hl + rp_val;
+            Lanes carry = ((hl & rp_val) | ((hl | rp_val) & ~sum)) >> 15;
+            l->flags = lane_select(mask, (l->flags & ~FLAG_CY) | carry, l->flags);
+            lane_set_rp(l, mask, RP_HL, sum);
+            break;
+        }
+
+        // RLC RRC RAL RAR
+        case 0x07: case 0x0F: case 0x17: case 0x1F: {
+            Lanes a = l->reg[REG_A];
+            Lanes carry = l->flags & FLAG_CY;
+            Lanes r, out;
+            switch (opcode) {
+                case 0x07: out = a >> 7; r = (a << 1) | out; break;
+                case 0x0F: out = a & 1; r = (a >> 1) | (out << 7); break;
+                case 0x17: out = a >> 7; r = (a << 1) | carry; break;
+                default:   out = a & 1; r = (a >> 1) | (carry << 7); break;
+            }
+            l->flags = lane_select(mask, (l->flags & ~FLAG_CY) | out, l->flags);
+            l->reg[REG_A] = lane_select(mask, r & 0xFF, a);
+            break;
+        }
+
+        case 0x2F:  // CMA
+            l->reg[REG_A] = lane_select(mask, ~l->reg[REG_A] & 0xFF, l->reg[REG_A]);
+            break;
+        case 0x37:  // STC
+            l->flags |= mask & FLAG_CY;
+            break;
+        case 0x3F:  // CMC
+            l->flags ^= mask & FLAG_CY;
+            break;
+
+        case 0xC3: case 0xCB:   // JMP
+            next = addr[0];
+            break;
+
+        // Jccc 11CCC010
+        case 0xC2: case 0xCA: case 0xD2: case 0xDA:
+        case 0xE2: case 0xEA: case 0xF2: case 0xFA: {
+            static const uint8_t cc_flag[4] = {FLAG_Z, FLAG_CY, FLAG_P, FLAG_S};
+            Lanes set = lane_nonzero(l->flags & cc_flag[dst >> 1]);
+            Lanes taken = mask & (dst & 1 ? set : ~set);
+            next = pc + 3;
+            if (!lane_any(taken ^ mask)) {
+                next = addr[0];
+            } else if (lane_any(taken)) {
+                Lanes fall_through = lane_select(mask, lane_broadcast(next), l->pc);
+                l->pc = lane_select(taken, addr, fall_through);
+                return LANE_SPLIT;
+            }
+            break;
+        }
+
+        default:
+            return LANE_SCALAR;
+    }
+
+    *next_pc = next;
+    return LANE_TOGETHER;
+}
+
+void cpu_lanes_set(CpuLanes *l, int lane, const CpuState *cpu) {
+    l->reg[REG_B][lane] = cpu->b;
+    l->reg[REG_C][lane] = cpu->c;
+    l->reg[REG_D][lane] = cpu->d;
+    l->reg[REG_E][lane] = cpu->e;
+    l->reg[REG_H][lane] = cpu->h;
+    l->reg[REG_L][lane] = cpu->l;
+    l->reg[REG_A][lane] = cpu->a;
+    l->flags[lane] = cpu->flags;
+    l->halted[lane] = cpu->halted ? 0xFFFF : 0;
+    l->interruptible[lane] = cpu->interruptible;
+    l->sp[lane] = cpu->sp;
+    l->pc[lane] = cpu->pc;
+    l->cycle[lane] = cpu->cycle;
+    l->bus[lane] = cpu->bus;
+}
+
+void cpu_lanes_get(const CpuLanes *l, int lane, CpuState *cpu) {
+    *cpu = (CpuState){
+        .a = l->reg[REG_A][lane],
+        .b = l->reg[REG_B][lane],
+        .c = l->reg[REG_C][lane],
+        .d = l->reg[REG_D][lane],
+        .e = l->reg[REG_E][lane],
+        .h = l->reg[REG_H][lane],
+        .l = l->reg[REG_L][lane],
+        .sp = l->sp[lane],
+        .pc = l->pc[lane],
+        .flags = l->flags[lane],
+        .halted = l->halted[lane] != 0,
+        .interruptible = l->interruptible[lane],
+        .cycle = l->cycle[lane],
+        .bus = l->bus[lane],
+    };
+}
+
+LANE_INLINE void lane_fetch(Bus *bus, uint16_t pc, uint8_t *code) {
+    code[0] = bus_peek(bus, pc);
+    code[1] = bus_peek(bus, pc + 1);
+    code[2] = bus_peek(bus, pc + 2);
+}
+
+// lanes whose memory holds another instruction than code at pc, or whose
+// code sits on a device and only cpu_step may fetch it
+LANE_INLINE Lanes lane_code_differs(CpuLanes *l, uint16_t pc, const uint8_t *code) {
+    uint8_t length = opcode_length(code[0]);
+    Lanes differs = {0};
+    for (int i = 0; i < CPU_LANES; i++) {
+        if (!bus_in_host_memory(l->bus[i], pc, length)) differs[i] = 0xFFFF;
+        for (int b = 0; b < length; b++) {
+            if (bus_peek(l->bus[i], pc + b) != code[b]) differs[i] = 0xFFFF;
+        }
+    }
+    return differs;
+}
+
+// true when every lane holds code at pc, remembered until a store hits it
+LANE_INLINE bool lane_code_verified(CpuLanes *l, uint16_t pc, const uint8_t *code) {
+    uint32_t *slot = &l->verified[pc % LANE_VERIFIED_SLOTS];
+    if (*slot == pc + 1u) return true;
+    if (lane_any(lane_code_differs(l, pc, code))) return false;
+    *slot = pc + 1u;
+    return true;
+}
+
+// runs lanes while their left counter is positive, instructions are
+// charged against it
+static void lane_run_slice(CpuLanes *l, const SignedLanes *start, SignedLanes *left) {
+    for (;;) {
+        Lanes active = ~l->halted & lane_positive(*left);
+        if (!lane_any(active)) break;
+
+        // usually every running lane sits at the same pc, otherwise the
+        // lowest one goes first. The group keeps going on its own as long
+        // as it stays below the next waiting lane.
+        uint16_t pc = l->pc[lane_first(active)];
+        uint32_t wait_pc = 0x10000;
+        Lanes mask = active & lane_equal(l->pc, lane_broadcast(pc));
+        if (lane_any(mask ^ active)) {
+            for (int i = 0; i < CPU_LANES; i++) {
+                if (active[i] && l->pc[i] < pc) pc = l->pc[i];
+            }
+            mask = active & lane_equal(l->pc, lane_broadcast(pc));
+            for (int i = 0; i < CPU_LANES; i++) {
+                if (active[i] && !mask[i] && l->pc[i] < wait_pc) wait_pc = l->pc[i];
+            }
+        }
+
+        Bus *bus = l->bus[lane_first(mask)];
+        uint8_t code[3];
+        lane_fetch(bus, pc, code);
+
+        // lanes whose memory holds something else at pc go on their own
+        if (!lane_code_verified(l, pc, code)) {
+            Lanes differs = mask & lane_code_differs(l, pc, code);
+            for (int i = 0; i < CPU_LANES; i++) {
+                if (differs[i]) (*left)[i] -= lane_step_scalar(l, i, (*start)[i] - (*left)[i]);
+            }
+            mask &= ~differs;
+            wait_pc = 0;
+            if (!lane_any(mask)) continue;
+        }
+
+        // while the group stays together its pc and cycles are plain
+        // integers, the vectors catch up when it breaks up. It stops at the
+        // latest when its lane with the fewest cycles left runs out.
+        int budget = LANE_MAX_SLICE;
+        for (int i = 0; i < CPU_LANES; i++) {
+            if (mask[i] && (*left)[i] < budget) budget = (*left)[i];
+        }
+
+        int used = 0;
+        LaneResult result;
+        for (;;) {
+            uint16_t next_pc;
+            result = lane_execute(l, mask, pc, code, &next_pc);
+            if (result == LANE_SCALAR) break;
+            used += op_cycles[code[0]];
+            if (result == LANE_SPLIT) break;
+
+            pc = next_pc;
+            if (used >= budget || pc >= wait_pc) break;
+            lane_fetch(bus, pc, code);
+            if (!lane_code_verified(l, pc, code)) break;
+        }
+
+        if (result != LANE_SPLIT) {
+            l->pc = lane_select(mask, lane_broadcast(pc), l->pc);
+        }
+        *left -= (SignedLanes)mask & (int16_t)used;
+
+        if (result == LANE_SCALAR) {
+            for (int i = 0; i < CPU_LANES; i++) {
+                if (mask[i]) (*left)[i] -= lane_step_scalar(l, i, (*start)[i] - (*left)[i]);
+            }
+        }
+    }
+}
+
+int cpu_lanes_run(CpuLanes *l, uint64_t cycle_budget) {
+    memset(l->verified, 0, sizeof(l->verified));
+
+    // the budget runs in slices that fit the 16 bit counters, each lane
+    // starts the next slice with whatever is left of its budget
+    uint64_t used[CPU_LANES] = {0};
+    for (;;) {
+        SignedLanes start;
+        for (int i = 0; i < CPU_LANES; i++) {
+            uint64_t rest = used[i] < cycle_budget ? cycle_budget - used[i] : 0;
+            start[i] = rest < LANE_MAX_SLICE ? rest : LANE_MAX_SLICE;
+        }
+        if (!lane_any(~l->halted & lane_positive(start))) break;
+
+        SignedLanes left = start;
+        lane_run_slice(l, &start, &left);
+        for (int i = 0; i < CPU_LANES; i++) {
+            used[i] += start[i] - left[i];
+            l->cycle[i] += start[i] - left[i];
+        }
+    }
+
+    int running = 0;
+    for (int i = 0; i < CPU_LANES; i++) {
+        running += !l->halted[i];
+    }
+    return running;
+}
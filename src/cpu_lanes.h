@@ -0,0 +1,46 @@
+#pragma once
+
+#include "cpu.h"
+
+// Lockstep interpreter for CPU_LANES instances of the same program, each
+// with its own bus and memory. Registers are kept as one vector per
+// register across all lanes, so every lane sitting at the same pc runs the
+// instruction in one go. Lanes that branched elsewhere wait until the
+// others catch up, instructions without a vector version run through
+// cpu_step one lane at a time. Needs the GCC / Clang vector extensions.
+
+#ifndef CPU_LANES
+#define CPU_LANES 16
+#endif
+
+// every lane is 16 bits wide, 8 bit registers included: one width for
+// everything keeps the compiler from converting between vector sizes,
+// which it does element by element without AVX2
+typedef uint16_t Lanes __attribute__((vector_size(CPU_LANES * 2)));
+
+// instructions found to be the same in every lane's memory, direct mapped
+// by pc so most steps skip comparing the code of every lane
+#define LANE_VERIFIED_SLOTS 1024
+
+typedef struct {
+    Lanes reg[8];           // indexed by Register, reg[REG_M] is unused
+    Lanes flags;
+    Lanes halted;           // 0xFFFF once the lane halted
+    Lanes interruptible;
+    Lanes sp, pc;
+
+    uint64_t cycle[CPU_LANES];
+    Bus *bus[CPU_LANES];
+
+    // pc + 1 of the verified instruction, 0 when the slot is empty.
+    // Cleared at the start of every run, memory may change in between.
+    uint32_t verified[LANE_VERIFIED_SLOTS];
+} CpuLanes;
+
+// copies a scalar cpu into / out of a lane
+void cpu_lanes_set(CpuLanes *lanes, int lane, const CpuState *cpu);
+void cpu_lanes_get(const CpuLanes *lanes, int lane, CpuState *cpu);
+
+// runs every lane until it consumed at least cycle_budget more cycles or
+// halted, returns the number of lanes that did not halt
+int cpu_lanes_run(CpuLanes *lanes, uint64_t cycle_budget);
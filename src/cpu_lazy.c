@@ -0,0 +1,283 @@
+#include "cpu_ops.h"
+
+// cpu_run with lazily evaluated flags. Most ALU results have their flags
+// overwritten by the next ALU instruction before anything looks at them,
+// so this core keeps only the last result, a byte the aux carry can be
+// told from and the carry, which is cheap enough to keep up to date.
+// Conditional jumps, calls and returns test those directly, ADC/SBB and
+// the rotates use the carry as it is. PUSH PSW and the end of the run
+// build the flags byte, bit for bit what the eager handlers in cpu_ops.h
+// compute: the aux carry tables there are bit 4 of a ^ b ^ result.
+//
+// The Z, S and P bits follow from the result byte, which holds for any
+// flags an ALU instruction leaves. A POP PSW, or the flags the run starts
+// with, can hold combinations no result has: Z with S, Z without P,
+// bits outside FLAG_MASK. Until the next ALU instruction those run on
+// cpu_step.
+
+typedef struct {
+    uint8_t result;
+    uint8_t aux;        // AC is bit 4 of aux ^ result
+    uint8_t carry;      // FLAG_CY or 0
+} LazyFlags;
+
+CPU_INLINE uint8_t lazy_flags(const LazyFlags *lazy) {
+    return zsp_table[lazy->result] | ((lazy->aux ^ lazy->result) & FLAG_AC) | lazy->carry;
+}
+
+// a result byte with the S, Z and P of the flags, indexed by them as
+// S Z P, 0xFF where no byte has them
+static const uint8_t zsp_result[8] = {0x01, 0x03, 0xFF, 0x00, 0x80, 0x81, 0xFF, 0xFF};
+
+// takes over cpu->flags, false when no result byte gives them
+CPU_INLINE bool lazy_load(LazyFlags *lazy, const CpuState *cpu) {
+    uint8_t flags = cpu->flags;
+    uint8_t result = zsp_result[(flags & (FLAG_S | FLAG_Z)) >> 5 | (flags & FLAG_P) >> 2];
+    if (result == 0xFF || (flags & ~FLAG_MASK)) return false;
+
+    lazy->result = result;
+    lazy->aux = result ^ (flags & FLAG_AC);
+    lazy->carry = flags & FLAG_CY;
+    return true;
+}
+
+CPU_INLINE bool lazy_condition(const LazyFlags *lazy, ConditionCode cc) {
+    switch (cc) {
+        case CC_NZ: return lazy->result != 0;
+        case CC_Z:  return lazy->result == 0;
+        case CC_NC: return !lazy->carry;
+        case CC_C:  return lazy->carry;
+        case CC_PO: return !(zsp_table[lazy->result] & FLAG_P);
+        case CC_PE: return zsp_table[lazy->result] & FLAG_P;
+        case CC_P:  return !(lazy->result & 0x80);
+        case CC_M:  return lazy->result & 0x80;
+    }
+    return 0;
+}
+
+CPU_INLINE void lazy_add(LazyFlags *lazy, CpuState *cpu, uint8_t b, uint8_t carry) {
+    uint16_t result = cpu->a + b + carry;
+    lazy->aux = cpu->a ^ b;
+    lazy->result = result;
+    lazy->carry = result >> 8;
+    cpu->a = result;
+}
+
+CPU_INLINE void lazy_sub(LazyFlags *lazy, CpuState *cpu, uint8_t b, uint8_t borrow, bool store) {
+    uint16_t result = cpu->a - b - borrow;
+    lazy->aux = cpu->a ^ b;
+    lazy->result = result;
+    lazy->carry = (result >> 8) & FLAG_CY;
+    if (store) cpu->a = result;
+}
+
+CPU_INLINE void lazy_ana(LazyFlags *lazy, CpuState *cpu, uint8_t b) {
+    uint8_t result = cpu->a & b;
+    lazy->aux = result ^ (((cpu->a | b) & 0x08) << 1);
+    lazy->result = result;
+    lazy->carry = 0;
+    cpu->a = result;
+}
+
+CPU_INLINE void lazy_logic(LazyFlags *lazy, CpuState *cpu, uint8_t result) {
+    lazy->aux = result;
+    lazy->result = result;
+    lazy->carry = 0;
+    cpu->a = result;
+}
+
+CPU_INLINE void lazy_inr(LazyFlags *lazy, CpuState *cpu, Register dst_reg) {
+    uint8_t reg_val = cpu_read_reg(cpu, dst_reg);
+    uint8_t result = reg_val + 1;
+    lazy->aux = reg_val ^ 1;
+    lazy->result = result;
+    cpu_set_reg(cpu, dst_reg, result);
+}
+
+CPU_INLINE void lazy_dcr(LazyFlags *lazy, CpuState *cpu, Register dst_reg) {
+    uint8_t reg_val = cpu_read_reg(cpu, dst_reg);
+    uint8_t result = reg_val - 1;
+    lazy->aux = reg_val ^ 1;
+    lazy->result = result;
+    cpu_set_reg(cpu, dst_reg, result);
+}
+
+CPU_INLINE void lazy_dad(LazyFlags *lazy, CpuState *cpu, RegisterPair rp) {
+    uint32_t result = (uint32_t)cpu_get_reg_pair(cpu, RP_HL) + cpu_get_reg_pair(cpu, rp);
+    lazy->carry = result >> 16;
+    cpu_set_reg_pair(cpu, RP_HL, (uint8_t)result, (uint8_t)(result >> 8));
+}
+
+CPU_INLINE void lazy_daa(LazyFlags *lazy, CpuState *cpu) {
+    uint8_t correction = 0;
+    uint8_t lsb = cpu->a & 0x0F;
+    uint8_t msb = cpu->a >> 4;
+
+    if (lsb > 9 || ((lazy->aux ^ lazy->result) & FLAG_AC)) {
+        correction += 0x06;
+    }
+    if (msb > 9 || lazy->carry || (msb >= 9 && lsb > 9)) {
+        correction += 0x60;
+        lazy->carry = FLAG_CY;
+    }
+
+    lazy->aux = cpu->a ^ correction;
+    cpu->a += correction;
+    lazy->result = cpu->a;
+}
+
+CPU_INLINE void lazy_rotate(LazyFlags *lazy, CpuState *cpu, bool left, bool through_carry) {
+    uint8_t val = cpu->a;
+    uint8_t out = left ? val >> 7 : val & 0x01;
+    uint8_t in = through_carry ? lazy->carry : out;
+    cpu->a = left ? (val << 1) | in : (val >> 1) | (in << 7);
+    lazy->carry = out;
+}
+
+CPU_INLINE void lazy_jccc(LazyFlags *lazy, CpuState *cpu, ConditionCode cc, uint16_t addr) {
+    if (lazy_condition(lazy, cc)) {
+        cpu->pc = addr;
+    }
+}
+
+CPU_INLINE bool lazy_Cccc(LazyFlags *lazy, CpuState *cpu, ConditionCode cc, uint16_t addr) {
+    if (lazy_condition(lazy, cc)) {
+        cpu_call(cpu, addr);
+        return 1;
+    }
+    return 0;
+}
+
+CPU_INLINE bool lazy_Rccc(LazyFlags *lazy, CpuState *cpu, ConditionCode cc) {
+    if (lazy_condition(lazy, cc)) {
+        cpu_ret(cpu);
+        return 1;
+    }
+    return 0;
+}
+
+// The opcode table names the eager handlers, these macros swap in the
+// lazy ones for the cores below, which keep their state in `lazy` and
+// whether it holds the flags in `exact`. A macro naming itself calls the
+// eager function.
+#define cpu_add(cpu, b)         lazy_add(&lazy, cpu, b, 0)
+#define cpu_adc(cpu, b)         lazy_add(&lazy, cpu, b, lazy.carry)
+#define cpu_sub(cpu, b)         lazy_sub(&lazy, cpu, b, 0, true)
+#define cpu_sbb(cpu, b)         lazy_sub(&lazy, cpu, b, lazy.carry, true)
+#define cpu_cmp(cpu, b)         lazy_sub(&lazy, cpu, b, 0, false)
+#define cpu_ana(cpu, b)         lazy_ana(&lazy, cpu, b)
+#define cpu_ora(cpu, b)         lazy_logic(&lazy, cpu, cpu->a | (b))
+#define cpu_xra(cpu, b)         lazy_logic(&lazy, cpu, cpu->a ^ (b))
+#define cpu_inr(cpu, r)         lazy_inr(&lazy, cpu, r)
+#define cpu_dcr(cpu, r)         lazy_dcr(&lazy, cpu, r)
+#define cpu_dad(cpu, rp)        lazy_dad(&lazy, cpu, rp)
+#define cpu_daa(cpu)            lazy_daa(&lazy, cpu)
+#define cpu_rlc(cpu)            lazy_rotate(&lazy, cpu, true, false)
+#define cpu_rrc(cpu)            lazy_rotate(&lazy, cpu, false, false)
+#define cpu_ral(cpu)            lazy_rotate(&lazy, cpu, true, true)
+#define cpu_rar(cpu)            lazy_rotate(&lazy, cpu, false, true)
+#define cpu_stc(cpu)            (lazy.carry = FLAG_CY)
+#define cpu_cmc(cpu)            (lazy.carry ^= FLAG_CY)
+#define cpu_jccc(cpu, cc, addr) lazy_jccc(&lazy, cpu, cc, addr)
+#define cpu_Cccc(cpu, cc, addr) lazy_Cccc(&lazy, cpu, cc, addr)
+#define cpu_Rccc(cpu, cc)       lazy_Rccc(&lazy, cpu, cc)
+#define cpu_push_psw(cpu)       (cpu->flags = lazy_flags(&lazy), cpu_push_psw(cpu))
+#define cpu_pop_psw(cpu)        (cpu_pop_psw(cpu), exact = lazy_load(&lazy, cpu))
+
+// cpu_step on a copy, the cores' local state never has its address taken
+// by a call and stays in host registers
+#define LAZY_STEP_EAGER() { \
+    CpuState step = local; \
+    step.cycle += cycles; \
+    cycles += cpu_step(&step); \
+    step.cycle = local.cycle; \
+    local = step; \
+    exact = lazy_load(&lazy, cpu); \
+}
+
+#define IMM8  cpu_fetch(cpu)
+#define IMM16 cpu_fetch_word(cpu)
+#define NOW   (cpu->cycle + cycles)
+
+#if defined(__GNUC__) && !defined(CPU_SWITCH_DISPATCH)
+
+#define LAZY_ADDR(opcode, cycles, handler) [opcode] = &&op_##opcode,
+#define LAZY_ADDR_C(opcode, cycles, taken_cycles, handler) [opcode] = &&op_##opcode,
+#define LAZY_NEXT() \
+    if (cycles >= cycle_budget) goto done; \
+    goto *dispatch[cpu_fetch(cpu)];
+#define LAZY_LABEL(opcode, op_cycles, handler) \
+    op_##opcode: handler; cycles += op_cycles; \
+    if (opcode == 0x76) goto done; \
+    if (opcode == 0xF1 && !exact) goto eager; \
+    LAZY_NEXT()
+#define LAZY_LABEL_C(opcode, op_cycles, taken_cycles, handler) \
+    op_##opcode: cycles += (handler) ? taken_cycles : op_cycles; \
+    LAZY_NEXT()
+
+uint64_t cpu_run_lazy(CpuState *cpu_state, uint64_t cycle_budget) {
+    static const void *const dispatch[256] = {
+        CPU_OPCODE_TABLE(LAZY_ADDR, LAZY_ADDR_C)
+    };
+
+    CpuState local = *cpu_state;
+    CpuState *cpu = &local;
+    LazyFlags lazy = {0};
+    bool exact = lazy_load(&lazy, cpu);
+    uint64_t cycles = 0;
+
+    if (cpu->halted) {
+        return 0;
+    }
+
+eager:
+    while (!exact) {
+        if (cycles >= cycle_budget || cpu->halted) goto done;
+        LAZY_STEP_EAGER()
+    }
+    LAZY_NEXT()
+
+    CPU_OPCODE_TABLE(LAZY_LABEL, LAZY_LABEL_C)
+
+done:
+    if (exact) {
+        cpu->flags = lazy_flags(&lazy);
+    }
+    local.cycle += cycles;
+    *cpu_state = local;
+    return cycles;
+}
+
+#else
+
+#define LAZY_CASE(opcode, op_cycles, handler) \
+    case opcode: handler; cycles += op_cycles; break;
+#define LAZY_CASE_C(opcode, op_cycles, taken_cycles, handler) \
+    case opcode: cycles += (handler) ? taken_cycles : op_cycles; break;
+
+uint64_t cpu_run_lazy(CpuState *cpu_state, uint64_t cycle_budget) {
+    CpuState local = *cpu_state;
+    CpuState *cpu = &local;
+    LazyFlags lazy = {0};
+    bool exact = lazy_load(&lazy, cpu);
+    uint64_t cycles = 0;
+
+    while (cycles < cycle_budget && !cpu->halted) {
+        if (!exact) {
+            LAZY_STEP_EAGER()
+            continue;
+        }
+        switch (cpu_fetch(cpu)) {
+            CPU_OPCODE_TABLE(LAZY_CASE, LAZY_CASE_C)
+        }
+    }
+
+    if (exact) {
+        cpu->flags = lazy_flags(&lazy);
+    }
+    local.cycle += cycles;
+    *cpu_state = local;
+    return cycles;
+}
+
+#endif
@@ -0,0 +1,922 @@
+#pragma once
+
+// Instruction semantics shared by the execution cores: bus access, register
+// helpers, flag tables, one inline handler per instruction and the opcode
+// table tying opcodes to handlers and cycle counts. Only include from the
+// core implementations.
+
+#include "cpu.h"
+#include "block_cache.h"
+#include <stdint.h>
+#include <stdio.h>
+
+// The bus fast paths have to inline into every handler. With the slow
+// path calls in them GCC would rather call them, taking pc and the
+// registers out of host registers.
+#if defined(__GNUC__)
+#define CPU_INLINE static inline __attribute__((always_inline))
+#else
+#define CPU_INLINE static inline
+#endif
+
+// plain RAM and ROM take one table lookup, everything else goes through
+// the slow path in bus.c
+CPU_INLINE uint8_t bus_read(Bus *bus, uint16_t addr) {
+    const uint8_t *page = bus->read_page[addr >> 8];
+    if (page) return page[addr & 0xFF];
+    return bus_read_slow(bus, addr);
+}
+
+CPU_INLINE void bus_write(Bus* bus, uint16_t addr, uint8_t val) {
+    uint8_t *page = bus->write_page[addr >> 8];
+    if (page) {
+        page[addr & 0xFF] = val;
+    } else {
+        bus_write_slow(bus, addr, val);
+    }
+}
+
+static inline uint16_t cpu_get_hl(CpuState *cpu) {
+    return (((uint16_t)cpu->h << 8) | cpu->l);
+}
+
+static inline uint16_t lb_hb_to_uint16(uint8_t low_byte, uint8_t high_byte) {
+    return ((uint16_t)high_byte << 8) | low_byte;
+}
+
+static inline void cpu_set_reg_pair(CpuState *cpu, RegisterPair rp, uint8_t low_byte, uint8_t high_byte) {
+    switch(rp) {
+        case RP_BC: cpu->b = high_byte; cpu->c = low_byte; break;
+        case RP_DE: cpu->d = high_byte; cpu->e = low_byte; break;
+        case RP_HL: cpu->h = high_byte; cpu->l = low_byte; break;
+        case RP_SP: cpu->sp = lb_hb_to_uint16(low_byte, high_byte); break;
+    }
+}
+
+static inline uint16_t cpu_get_reg_pair(CpuState *cpu, RegisterPair rp) {
+    switch(rp) {
+        case RP_BC: return lb_hb_to_uint16(cpu->c, cpu->b);
+        case RP_DE: return lb_hb_to_uint16(cpu->e, cpu->d);
+        case RP_HL: return lb_hb_to_uint16(cpu->l, cpu->h);
+        case RP_SP: return cpu->sp;
+    }
+    return -1;
+}
+
+static inline uint8_t cpu_read_reg(CpuState *cpu, Register r) {
+    switch(r) {
+        case REG_M: return bus_read(cpu->bus, cpu_get_hl(cpu));
+        case REG_B: return cpu->b;
+        case REG_C: return cpu->c;
+        case REG_D: return cpu->d;
+        case REG_E: return cpu->e;
+        case REG_H: return cpu->h;
+        case REG_L: return cpu->l;
+        case REG_A: return cpu->a;
+    }
+    return -1;
+}
+
+static inline void cpu_set_reg(CpuState *cpu, Register r, uint8_t val) {
+    switch(r) {
+        case REG_M: bus_write(cpu->bus, cpu_get_hl(cpu), val); break;
+        case REG_B: cpu->b = val; break;
+        case REG_C: cpu->c = val; break;
+        case REG_D: cpu->d = val; break;
+        case REG_E: cpu->e = val; break;
+        case REG_H: cpu->h = val; break;
+        case REG_L: cpu->l = val; break;
+        case REG_A: cpu->a = val; break;
+    }
+}
+
+static inline bool check_condition(CpuState *cpu, ConditionCode condition_code) {
+    switch(condition_code) {
+        case CC_NZ: return !(cpu->flags & FLAG_Z);
+        case CC_Z:  return cpu->flags & FLAG_Z;
+        case CC_NC: return !(cpu->flags & FLAG_CY);
+        case CC_C:  return cpu->flags & FLAG_CY;
+        case CC_PO: return !(cpu->flags & FLAG_P);
+        case CC_PE: return cpu->flags & FLAG_P;
+        case CC_P:  return !(cpu->flags & FLAG_S);
+        case CC_M:  return cpu->flags & FLAG_S;
+    }
+    return 0;
+}
+
+CPU_INLINE void cpu_stack_push(CpuState *cpu, uint16_t val) {
+    bus_write(cpu->bus, cpu->sp-1, (uint8_t)(val >> 8));
+    bus_write(cpu->bus, cpu->sp-2, (uint8_t)(val));
+    cpu->sp -= 2;
+}
+
+// sign, zero and parity flags of every 8 bit result
+static const uint8_t zsp_table[256] = {
+    0x44, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00, 0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04,
+    0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04, 0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00,
+    0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04, 0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00,
+    0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00, 0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04,
+    0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04, 0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00,
+    0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00, 0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04,
+    0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00, 0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04,
+    0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04, 0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00,
+    0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84, 0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80,
+    0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80, 0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84,
+    0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80, 0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84,
+    0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84, 0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80,
+    0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80, 0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84,
+    0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84, 0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80,
+    0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84, 0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80,
+    0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80, 0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84,
+};
+
+// aux carry lookups indexed by bit 3 of both operands and of the result,
+// (a3 << 2) | (b3 << 1) | r3, which tells if bit 3 carried (or borrowed)
+static const uint8_t half_carry_table[8] = {
+    0, 0, FLAG_AC, 0, FLAG_AC, 0, FLAG_AC, FLAG_AC
+};
+
+static const uint8_t sub_half_carry_table[8] = {
+    0, FLAG_AC, FLAG_AC, FLAG_AC, 0, 0, 0, FLAG_AC
+};
+
+static inline uint8_t half_carry_index(uint8_t a, uint8_t b, uint8_t result) {
+    return ((a & 0x08) >> 1) | ((b & 0x08) >> 2) | ((result & 0x08) >> 3);
+}
+
+static inline uint8_t aux_carry_add(uint8_t a, uint8_t b, uint8_t result) {
+    return half_carry_table[half_carry_index(a, b, result)];
+}
+
+static inline uint8_t aux_carry_sub(uint8_t a, uint8_t b, uint8_t result) {
+    return sub_half_carry_table[half_carry_index(a, b, result)];
+}
+
+CPU_INLINE uint8_t cpu_fetch(CpuState *cpu) {
+    return bus_read(cpu->bus, cpu->pc++);
+}
+
+CPU_INLINE uint16_t cpu_fetch_word(CpuState *cpu) {
+    uint8_t low_byte = cpu_fetch(cpu);
+    uint8_t high_byte = cpu_fetch(cpu);
+    return lb_hb_to_uint16(low_byte, high_byte);
+}
+
+// Handlers below get their operands from the opcode table at the bottom of
+// this file, so register and condition arguments are compile time constants
+// and the switches in cpu_read_reg/cpu_set_reg/check_condition fold away.
+// Immediate operands are fetched by the dispatcher (IMM8/IMM16) before the
+// handler runs, pc already points past the whole instruction.
+
+// MOV  01DDDSSS         (moves SSS reg to DDD reg)
+static inline void cpu_mov(CpuState *cpu, Register dst, Register src) {
+    cpu_set_reg(cpu, dst, cpu_read_reg(cpu, src));
+}
+
+// MVI  00DDD110 db      (moves immediate to DDD reg)
+static inline void cpu_mvi(CpuState *cpu, Register dst, uint8_t immediate) {
+    cpu_set_reg(cpu, dst, immediate);
+}
+
+// LXI  00RP0001 lb hb   (loads 16 bit immediate to register pair)
+static inline void cpu_lxi(CpuState *cpu, RegisterPair dst, uint16_t immediate) {
+    cpu_set_reg_pair(cpu, dst, (uint8_t)immediate, (uint8_t)(immediate >> 8));
+}
+
+// LDA  00111010 lb hb   (loads data from address to reg A)
+static inline void cpu_lda(CpuState *cpu, uint16_t addr) {
+    cpu->a = bus_read(cpu->bus, addr);
+}
+
+// STA  00110010 lb hb   (stores reg A to address)
+static inline void cpu_sta(CpuState *cpu, uint16_t addr) {
+    bus_write(cpu->bus, addr, cpu->a);
+}
+
+// LHLD 00101010 lb hb   (load hl pair from mem)
+static inline void cpu_lhld(CpuState *cpu, uint16_t addr) {
+    cpu->l = bus_read(cpu->bus, addr);
+    cpu->h = bus_read(cpu->bus, addr + 1);
+}
+
+// SHLD 00100010 lb hb   (stores hl to mem)
+static inline void cpu_shld(CpuState *cpu, uint16_t addr) {
+    bus_write(cpu->bus, addr, cpu->l);
+    bus_write(cpu->bus, addr + 1, cpu->h);
+}
+
+// LDAX 00RP1010         (loads value from address from RP to A reg only BC or DE)
+static inline void cpu_ldax(CpuState *cpu, RegisterPair rp) {
+    cpu->a = bus_read(cpu->bus, cpu_get_reg_pair(cpu, rp));
+}
+
+// STAX 00RP0010         (stores value from A reg to adress from RP)
+static inline void cpu_stax(CpuState *cpu, RegisterPair rp) {
+    bus_write(cpu->bus, cpu_get_reg_pair(cpu, rp), cpu->a);
+}
+
+// XCHG 11101011         (exchanges hl with de)
+static inline void cpu_xchg(CpuState *cpu) {
+    uint8_t temp_l = cpu->l;
+    uint8_t temp_h = cpu->h;
+    cpu->l = cpu->e;
+    cpu->h = cpu->d;
+    cpu->e = temp_l;
+    cpu->d = temp_h;
+}
+
+// ADD 10000SSS / ADI 11000110 db     (add register or immediate to A)
+static inline void cpu_add(CpuState *cpu, uint8_t b) {
+    uint8_t a = cpu->a;
+    uint16_t result = a + b;
+
+    cpu->flags = zsp_table[(uint8_t)result] | aux_carry_add(a, b, result) | (result >> 8);
+    cpu->a = (uint8_t)result;
+}
+
+// ADC 10001SSS / ACI 11001110 db     (add register or immediate to A with carry)
+static inline void cpu_adc(CpuState *cpu, uint8_t b) {
+    uint8_t a = cpu->a;
+    uint16_t result = a + b + (cpu->flags & FLAG_CY);
+
+    cpu->flags = zsp_table[(uint8_t)result] | aux_carry_add(a, b, result) | (result >> 8);
+    cpu->a = (uint8_t)result;
+}
+
+// SUB 10010SSS / SUI 11010110 db     (subtract register or immediate from A)
+static inline void cpu_sub(CpuState *cpu, uint8_t b) {
+    uint8_t a = cpu->a;
+    uint16_t result = a - b;
+
+    cpu->flags = zsp_table[(uint8_t)result] | aux_carry_sub(a, b, result) | ((result >> 8) & FLAG_CY);
+    cpu->a = (uint8_t)result;
+}
+
+// SBB 10011SSS / SBI 11011110 db     (subtract register or immediate from A with borrow)
+static inline void cpu_sbb(CpuState *cpu, uint8_t b) {
+    uint8_t a = cpu->a;
+    uint16_t result = a - b - (cpu->flags & FLAG_CY);
+
+    cpu->flags = zsp_table[(uint8_t)result] | aux_carry_sub(a, b, result) | ((result >> 8) & FLAG_CY);
+    cpu->a = (uint8_t)result;
+}
+
+// INR 00DDD100             (increment register)
+static inline void cpu_inr(CpuState *cpu, Register dst_reg) {
+    uint8_t reg_val = cpu_read_reg(cpu, dst_reg);
+    uint8_t result = reg_val + 1;
+
+    cpu->flags = (cpu->flags & FLAG_CY) | zsp_table[result] | aux_carry_add(reg_val, 1, result);
+
+    cpu_set_reg(cpu, dst_reg, result);
+}
+
+// DCR 00DDD101             (decrement register)
+static inline void cpu_dcr(CpuState *cpu, Register dst_reg) {
+    uint8_t reg_val = cpu_read_reg(cpu, dst_reg);
+    uint8_t result = reg_val - 1;
+
+    cpu->flags = (cpu->flags & FLAG_CY) | zsp_table[result] | aux_carry_sub(reg_val, 1, result);
+
+    cpu_set_reg(cpu, dst_reg, result);
+}
+
+// INX 00RP0011             (increment register pair)
+static inline void cpu_inx(CpuState *cpu, RegisterPair rp) {
+    uint16_t result = cpu_get_reg_pair(cpu, rp) + 1;
+    cpu_set_reg_pair(cpu, rp, (uint8_t)(result & 0xFF), (uint8_t)(result >> 8));
+}
+
+// DCX 00RP1011             (decrement register pair)
+static inline void cpu_dcx(CpuState *cpu, RegisterPair rp) {
+    uint16_t result = cpu_get_reg_pair(cpu, rp) - 1;
+    cpu_set_reg_pair(cpu, rp, (uint8_t)(result & 0xFF), (uint8_t)(result >> 8));
+}
+
+// DAD 00RP1001             (Add register pair to HL (16 bit add))
+static inline void cpu_dad(CpuState *cpu, RegisterPair rp) {
+    uint16_t val_to_add = cpu_get_reg_pair(cpu, rp);
+    uint16_t hl_val = cpu_get_reg_pair(cpu, RP_HL);
+
+    uint32_t result = (uint32_t)hl_val + (uint32_t)val_to_add;
+
+    cpu->flags = (cpu->flags & ~FLAG_CY) | (result >> 16);
+
+    cpu_set_reg_pair(cpu, RP_HL, (result & 0xFF), (result >> 8) & 0xFF);
+}
+
+// DAA 00100111             (Decimal Adjust Accumulator)
+static inline void cpu_daa(CpuState *cpu) {
+    bool cy = cpu->flags & FLAG_CY;
+    uint8_t correction = 0;
+    uint8_t lsb = cpu->a & 0x0F;
+    uint8_t msb = cpu->a >> 4;
+
+    if (lsb > 9 || (cpu->flags & FLAG_AC)) {
+        correction += 0x06;
+    }
+
+    if (msb > 9 || cy || (msb >= 9 && lsb > 9)) {
+        correction += 0x60;
+        cy = true;
+    }
+
+    uint8_t result = cpu->a + correction;
+
+    cpu->flags = zsp_table[result] | aux_carry_add(cpu->a, correction, result) | cy;
+    cpu->a = result;
+}
+
+// ANA 10100SSS / ANI 11100110 db     (and register or immediate with A)
+static inline void cpu_ana(CpuState *cpu, uint8_t b) {
+    uint8_t a = cpu->a;
+    uint8_t result = a & b;
+
+    cpu->flags = zsp_table[result] | (((a | b) & 0x08) << 1);
+    cpu->a = result;
+}
+
+// ORA 10110SSS / ORI 11110110 db     (or register or immediate with A)
+static inline void cpu_ora(CpuState *cpu, uint8_t b) {
+    uint8_t result = cpu->a | b;
+
+    cpu->flags = zsp_table[result];
+    cpu->a = result;
+}
+
+// XRA 10101SSS / XRI 11101110 db     (xor register or immediate with A)
+static inline void cpu_xra(CpuState *cpu, uint8_t b) {
+    uint8_t result = cpu->a ^ b;
+
+    cpu->flags = zsp_table[result];
+    cpu->a = result;
+}
+
+// CMP 10111SSS / CPI 11111110 db     (compare register or immediate with A)
+static inline void cpu_cmp(CpuState *cpu, uint8_t b) {
+    uint8_t a = cpu->a;
+    uint16_t result = a - b;
+
+    cpu->flags = zsp_table[(uint8_t)result] | aux_carry_sub(a, b, result) | ((result >> 8) & FLAG_CY);
+}
+
+// RLC 00000111             (rotate A left)
+static inline void cpu_rlc(CpuState *cpu) {
+    uint8_t val = cpu->a;
+    uint8_t msb = val >> 7;
+    cpu->flags = (cpu->flags & ~FLAG_CY) | msb;
+    cpu->a = (val << 1) | msb;
+}
+
+// RRC 00001111             (rotate A right)
+static inline void cpu_rrc(CpuState *cpu) {
+    uint8_t val = cpu->a;
+    uint8_t lsb = val & 0x01;
+    cpu->flags = (cpu->flags & ~FLAG_CY) | lsb;
+    cpu->a = (val >> 1) | (lsb << 7);
+}
+
+// RAL 000010111            (rotate A left through carry)
+static inline void cpu_ral(CpuState *cpu) {
+    uint8_t val = cpu->a;
+    uint8_t current_carry = cpu->flags & FLAG_CY;
+    cpu->flags = (cpu->flags & ~FLAG_CY) | (val >> 7);
+    cpu->a = (val << 1) | current_carry;
+}
+
+// RAR 000011111             (rotate A right through carry)
+static inline void cpu_rar(CpuState *cpu) {
+    uint8_t val = cpu->a;
+    uint8_t current_carry = cpu->flags & FLAG_CY;
+    cpu->flags = (cpu->flags & ~FLAG_CY) | (val & 0x01);
+    cpu->a = (val >> 1) | (current_carry << 7);
+}
+
+// CMA 00101111              (compliment A)
+static inline void cpu_cma(CpuState *cpu) {
+    cpu->a = ~cpu->a;
+}
+
+// CMC 00111111              (compliment carry flag)
+static inline void cpu_cmc(CpuState *cpu) {
+    cpu->flags ^= FLAG_CY;
+}
+
+// STC 00110111              (set carry flag)
+static inline void cpu_stc(CpuState *cpu) {
+    cpu->flags |= FLAG_CY;
+}
+
+// JMP 11000011 lb hb        (unconditional jump)
+static inline void cpu_jmp(CpuState *cpu, uint16_t addr) {
+    cpu->pc = addr;
+}
+
+// Jccc 11CCC010 lb hb       (conditional jump)
+static inline void cpu_jccc(CpuState *cpu, ConditionCode cc, uint16_t addr) {
+    if (check_condition(cpu, cc)) {
+        cpu->pc = addr;
+    }
+}
+
+// CALL 11001101 lb hb       (unconditional subrutine call)
+CPU_INLINE void cpu_call(CpuState *cpu, uint16_t addr) {
+    cpu_stack_push(cpu, cpu->pc);
+    cpu->pc = addr;
+}
+
+// Cccc 11CCC100 lb hb       (conditional subrutine call) returns 1 if call happened and 0 otherwise
+static inline bool cpu_Cccc(CpuState *cpu, ConditionCode cc, uint16_t addr) {
+    if (check_condition(cpu, cc)) {
+        cpu_call(cpu, addr);
+        return 1;
+    }
+    return 0;
+}
+
+// RET 11001001              (unconditional return from subrutine)
+static inline void cpu_ret(CpuState *cpu) {
+    uint8_t lo = bus_read(cpu->bus, cpu->sp);
+    uint8_t hi = bus_read(cpu->bus, cpu->sp + 1);
+    cpu->pc = lb_hb_to_uint16(lo, hi);
+    cpu->sp += 2;
+}
+
+// Rccc 11CCC000             (Conditional return from subrutine) returns 1 if return happened and 0 otherwise
+static inline bool cpu_Rccc(CpuState *cpu, ConditionCode cc) {
+    if (check_condition(cpu, cc)) {
+        cpu_ret(cpu);
+        return 1;
+    }
+    return 0;
+}
+
+// RST 11NNN111              (Restart / Call to address N * 8)
+CPU_INLINE void cpu_rst(CpuState *cpu, uint8_t n) {
+    cpu_stack_push(cpu, cpu->pc);
+    cpu->pc = (uint16_t)n << 3;
+}
+
+// PCHL 11101001             (Jump to address in HL)
+static inline void cpu_pchl(CpuState *cpu) {
+    cpu->pc = cpu_get_reg_pair(cpu, RP_HL);
+}
+
+// PUSH 11RP0101             (push register pair on the stack)
+static inline void cpu_push(CpuState *cpu, RegisterPair rp) {
+    cpu_stack_push(cpu, cpu_get_reg_pair(cpu, rp));
+}
+
+// PUSH PSW 11110101         (push A and flags on the stack)
+static inline void cpu_push_psw(CpuState *cpu) {
+    cpu_stack_push(cpu, ((uint16_t)cpu->a << 8) | cpu->flags | FLAG_ALWAYS_ONE);
+}
+
+// POP 11RP0001              (Pop register pair from stack)
+static inline void cpu_pop(CpuState *cpu, RegisterPair rp) {
+    uint8_t low_byte = bus_read(cpu->bus, cpu->sp);
+    uint8_t high_byte = bus_read(cpu->bus, cpu->sp + 1);
+    cpu->sp += 2;
+    cpu_set_reg_pair(cpu, rp, low_byte, high_byte);
+}
+
+// POP PSW 11110001          (Pop A and flags from stack)
+static inline void cpu_pop_psw(CpuState *cpu) {
+    cpu->flags = bus_read(cpu->bus, cpu->sp) & FLAG_MASK;
+    cpu->a = bus_read(cpu->bus, cpu->sp + 1);
+    cpu->sp += 2;
+}
+
+// XTHL 11100011             (Exchange top of stack with HL)
+static inline void cpu_xthl(CpuState *cpu) {
+    uint8_t stack_lo = bus_read(cpu->bus, cpu->sp);
+    uint8_t stack_hi = bus_read(cpu->bus, cpu->sp + 1);
+
+    bus_write(cpu->bus, cpu->sp, cpu->l);
+    bus_write(cpu->bus, cpu->sp + 1, cpu->h);
+
+    cpu->l = stack_lo;
+    cpu->h = stack_hi;
+}
+
+// SPHL 11111001             (Set SP to content of HL)
+static inline void cpu_sphl(CpuState *cpu) {
+    cpu->sp = cpu_get_reg_pair(cpu, RP_HL);
+}
+
+// IN 11011011 pa            (read input port into A)
+static inline void cpu_in(CpuState *cpu, uint8_t port, uint64_t cycle) {
+    const BusInPort *io = &cpu->bus->in_port[port];
+    if (io->in) {
+        cpu->bus->port_cycle = cycle;
+        cpu->a = io->in(io->ctx, port);
+    }
+}
+
+// OUT 11010011 pa           (Write A to output port)
+static inline void cpu_out(CpuState *cpu, uint8_t port, uint64_t cycle) {
+    const BusOutPort *io = &cpu->bus->out_port[port];
+    if (io->out) {
+        cpu->bus->port_cycle = cycle;
+        io->out(io->ctx, port, cpu->a);
+    }
+}
+
+// EI 11111011               (Enable interrupts)
+static inline void cpu_ei(CpuState *cpu) {
+    cpu->interruptible = true;
+}
+
+// DI 11110011               (Disable interrupts)
+static inline void cpu_di(CpuState *cpu) {
+    cpu->interruptible = false;
+}
+
+// HLT 01110110              (Halt processor)
+static inline void cpu_hlt(CpuState *cpu) {
+    cpu->halted = true;
+}
+
+// NOP 00000000              (No operation)
+static inline void cpu_nop(CpuState *cpu) {
+    (void)cpu;
+}
+
+// Opcode table, one entry per opcode with its operands spelled out:
+//   OP (opcode, cycles, handler)
+//   OPC(opcode, cycles, cycles_if_taken, handler returning whether it was taken)
+// Each execution core expands it with its own OP/OPC, IMM8/IMM16 and NOW,
+// the cycle count the instruction started at.
+#define CPU_OPCODE_TABLE(OP, OPC) \
+    OP (0x00,  4,     cpu_nop(cpu))                            \
+    OP (0x01, 10,     cpu_lxi(cpu, RP_BC, IMM16))              \
+    OP (0x02,  7,     cpu_stax(cpu, RP_BC))                    \
+    OP (0x03,  5,     cpu_inx(cpu, RP_BC))                     \
+    OP (0x04,  5,     cpu_inr(cpu, REG_B))                     \
+    OP (0x05,  5,     cpu_dcr(cpu, REG_B))                     \
+    OP (0x06,  7,     cpu_mvi(cpu, REG_B, IMM8))               \
+    OP (0x07,  4,     cpu_rlc(cpu))                            \
+    OP (0x08,  4,     cpu_nop(cpu))                            \
+    OP (0x09, 10,     cpu_dad(cpu, RP_BC))                     \
+    OP (0x0A,  7,     cpu_ldax(cpu, RP_BC))                    \
+    OP (0x0B,  5,     cpu_dcx(cpu, RP_BC))                     \
+    OP (0x0C,  5,     cpu_inr(cpu, REG_C))                     \
+    OP (0x0D,  5,     cpu_dcr(cpu, REG_C))                     \
+    OP (0x0E,  7,     cpu_mvi(cpu, REG_C, IMM8))               \
+    OP (0x0F,  4,     cpu_rrc(cpu))                            \
+    OP (0x10,  4,     cpu_nop(cpu))                            \
+    OP (0x11, 10,     cpu_lxi(cpu, RP_DE, IMM16))              \
+    OP (0x12,  7,     cpu_stax(cpu, RP_DE))                    \
+    OP (0x13,  5,     cpu_inx(cpu, RP_DE))                     \
+    OP (0x14,  5,     cpu_inr(cpu, REG_D))                     \
+    OP (0x15,  5,     cpu_dcr(cpu, REG_D))                     \
+    OP (0x16,  7,     cpu_mvi(cpu, REG_D, IMM8))               \
+    OP (0x17,  4,     cpu_ral(cpu))                            \
+    OP (0x18,  4,     cpu_nop(cpu))                            \
+    OP (0x19, 10,     cpu_dad(cpu, RP_DE))                     \
+    OP (0x1A,  7,     cpu_ldax(cpu, RP_DE))                    \
+    OP (0x1B,  5,     cpu_dcx(cpu, RP_DE))                     \
+    OP (0x1C,  5,     cpu_inr(cpu, REG_E))                     \
+    OP (0x1D,  5,     cpu_dcr(cpu, REG_E))                     \
+    OP (0x1E,  7,     cpu_mvi(cpu, REG_E, IMM8))               \
+    OP (0x1F,  4,     cpu_rar(cpu))                            \
+    OP (0x20,  4,     cpu_nop(cpu))                            \
+    OP (0x21, 10,     cpu_lxi(cpu, RP_HL, IMM16))              \
+    OP (0x22, 16,     cpu_shld(cpu, IMM16))                    \
+    OP (0x23,  5,     cpu_inx(cpu, RP_HL))                     \
+    OP (0x24,  5,     cpu_inr(cpu, REG_H))                     \
+    OP (0x25,  5,     cpu_dcr(cpu, REG_H))                     \
+    OP (0x26,  7,     cpu_mvi(cpu, REG_H, IMM8))               \
+    OP (0x27,  4,     cpu_daa(cpu))                            \
+    OP (0x28,  4,     cpu_nop(cpu))                            \
+    OP (0x29, 10,     cpu_dad(cpu, RP_HL))                     \
+    OP (0x2A, 16,     cpu_lhld(cpu, IMM16))                    \
+    OP (0x2B,  5,     cpu_dcx(cpu, RP_HL))                     \
+    OP (0x2C,  5,     cpu_inr(cpu, REG_L))                     \
+    OP (0x2D,  5,     cpu_dcr(cpu, REG_L))                     \
+    OP (0x2E,  7,     cpu_mvi(cpu, REG_L, IMM8))               \
+    OP (0x2F,  4,     cpu_cma(cpu))                            \
+    OP (0x30,  4,     cpu_nop(cpu))                            \
+    OP (0x31, 10,     cpu_lxi(cpu, RP_SP, IMM16))              \
+    OP (0x32, 13,     cpu_sta(cpu, IMM16))                     \
+    OP (0x33,  5,     cpu_inx(cpu, RP_SP))                     \
+    OP (0x34, 10,     cpu_inr(cpu, REG_M))                     \
+    OP (0x35, 10,     cpu_dcr(cpu, REG_M))                     \
+    OP (0x36, 10,     cpu_mvi(cpu, REG_M, IMM8))               \
+    OP (0x37,  4,     cpu_stc(cpu))                            \
+    OP (0x38,  4,     cpu_nop(cpu))                            \
+    OP (0x39, 10,     cpu_dad(cpu, RP_SP))                     \
+    OP (0x3A, 13,     cpu_lda(cpu, IMM16))                     \
+    OP (0x3B,  5,     cpu_dcx(cpu, RP_SP))                     \
+    OP (0x3C,  5,     cpu_inr(cpu, REG_A))                     \
+    OP (0x3D,  5,     cpu_dcr(cpu, REG_A))                     \
+    OP (0x3E,  7,     cpu_mvi(cpu, REG_A, IMM8))               \
+    OP (0x3F,  4,     cpu_cmc(cpu))                            \
+    OP (0x40,  5,     cpu_mov(cpu, REG_B, REG_B))              \
+    OP (0x41,  5,     cpu_mov(cpu, REG_B, REG_C))              \
+    OP (0x42,  5,     cpu_mov(cpu, REG_B, REG_D))              \
+    OP (0x43,  5,     cpu_mov(cpu, REG_B, REG_E))              \
+    OP (0x44,  5,     cpu_mov(cpu, REG_B, REG_H))              \
+    OP (0x45,  5,     cpu_mov(cpu, REG_B, REG_L))              \
+    OP (0x46,  7,     cpu_mov(cpu, REG_B, REG_M))              \
+    OP (0x47,  5,     cpu_mov(cpu, REG_B, REG_A))              \
+    OP (0x48,  5,     cpu_mov(cpu, REG_C, REG_B))              \
+    OP (0x49,  5,     cpu_mov(cpu, REG_C, REG_C))              \
+    OP (0x4A,  5,     cpu_mov(cpu, REG_C, REG_D))              \
+    OP (0x4B,  5,     cpu_mov(cpu, REG_C, REG_E))              \
+    OP (0x4C,  5,     cpu_mov(cpu, REG_C, REG_H))              \
+    OP (0x4D,  5,     cpu_mov(cpu, REG_C, REG_L))              \
+    OP (0x4E,  7,     cpu_mov(cpu, REG_C, REG_M))              \
+    OP (0x4F,  5,     cpu_mov(cpu, REG_C, REG_A))              \
+    OP (0x50,  5,     cpu_mov(cpu, REG_D, REG_B))              \
+    OP (0x51,  5,     cpu_mov(cpu, REG_D, REG_C))              \
+    OP (0x52,  5,     cpu_mov(cpu, REG_D, REG_D))              \
+    OP (0x53,  5,     cpu_mov(cpu, REG_D, REG_E))              \
+    OP (0x54,  5,     cpu_mov(cpu, REG_D, REG_H))              \
+    OP (0x55,  5,     cpu_mov(cpu, REG_D, REG_L))              \
+    OP (0x56,  7,     cpu_mov(cpu, REG_D, REG_M))              \
+    OP (0x57,  5,     cpu_mov(cpu, REG_D, REG_A))              \
+    OP (0x58,  5,     cpu_mov(cpu, REG_E, REG_B))              \
+    OP (0x59,  5,     cpu_mov(cpu, REG_E, REG_C))              \
+    OP (0x5A,  5,     cpu_mov(cpu, REG_E, REG_D))              \
+    OP (0x5B,  5,     cpu_mov(cpu, REG_E, REG_E))              \
+    OP (0x5C,  5,     cpu_mov(cpu, REG_E, REG_H))              \
+    OP (0x5D,  5,     cpu_mov(cpu, REG_E, REG_L))              \
+    OP (0x5E,  7,     cpu_mov(cpu, REG_E, REG_M))              \
+    OP (0x5F,  5,     cpu_mov(cpu, REG_E, REG_A))              \
+    OP (0x60,  5,     cpu_mov(cpu, REG_H, REG_B))              \
+    OP (0x61,  5,     cpu_mov(cpu, REG_H, REG_C))              \
+    OP (0x62,  5,     cpu_mov(cpu, REG_H, REG_D))              \
+    OP (0x63,  5,     cpu_mov(cpu, REG_H, REG_E))              \
+    OP (0x64,  5,     cpu_mov(cpu, REG_H, REG_H))              \
+    OP (0x65,  5,     cpu_mov(cpu, REG_H, REG_L))              \
+    OP (0x66,  7,     cpu_mov(cpu, REG_H, REG_M))              \
+    OP (0x67,  5,     cpu_mov(cpu, REG_H, REG_A))              \
+    OP (0x68,  5,     cpu_mov(cpu, REG_L, REG_B))              \
+    OP (0x69,  5,     cpu_mov(cpu, REG_L, REG_C))              \
+    OP (0x6A,  5,     cpu_mov(cpu, REG_L, REG_D))              \
+    OP (0x6B,  5,     cpu_mov(cpu, REG_L, REG_E))              \
+    OP (0x6C,  5,     cpu_mov(cpu, REG_L, REG_H))              \
+    OP (0x6D,  5,     cpu_mov(cpu, REG_L, REG_L))              \
+    OP (0x6E,  7,     cpu_mov(cpu, REG_L, REG_M))              \
+    OP (0x6F,  5,     cpu_mov(cpu, REG_L, REG_A))              \
+    OP (0x70,  7,     cpu_mov(cpu, REG_M, REG_B))              \
+    OP (0x71,  7,     cpu_mov(cpu, REG_M, REG_C))              \
+    OP (0x72,  7,     cpu_mov(cpu, REG_M, REG_D))              \
+    OP (0x73,  7,     cpu_mov(cpu, REG_M, REG_E))              \
+    OP (0x74,  7,     cpu_mov(cpu, REG_M, REG_H))              \
+    OP (0x75,  7,     cpu_mov(cpu, REG_M, REG_L))              \
+    OP (0x76,  7,     cpu_hlt(cpu))                            \
+    OP (0x77,  7,     cpu_mov(cpu, REG_M, REG_A))              \
+    OP (0x78,  5,     cpu_mov(cpu, REG_A, REG_B))              \
+    OP (0x79,  5,     cpu_mov(cpu, REG_A, REG_C))              \
+    OP (0x7A,  5,     cpu_mov(cpu, REG_A, REG_D))              \
+    OP (0x7B,  5,     cpu_mov(cpu, REG_A, REG_E))              \
+    OP (0x7C,  5,     cpu_mov(cpu, REG_A, REG_H))              \
+    OP (0x7D,  5,     cpu_mov(cpu, REG_A, REG_L))              \
+    OP (0x7E,  7,     cpu_mov(cpu, REG_A, REG_M))              \
+    OP (0x7F,  5,     cpu_mov(cpu, REG_A, REG_A))              \
+    OP (0x80,  4,     cpu_add(cpu, cpu_read_reg(cpu, REG_B)))  \
+    OP (0x81,  4,     cpu_add(cpu, cpu_read_reg(cpu, REG_C)))  \
+    OP (0x82,  4,     cpu_add(cpu, cpu_read_reg(cpu, REG_D)))  \
+    OP (0x83,  4,     cpu_add(cpu, cpu_read_reg(cpu, REG_E)))  \
+    OP (0x84,  4,     cpu_add(cpu, cpu_read_reg(cpu, REG_H)))  \
+    OP (0x85,  4,     cpu_add(cpu, cpu_read_reg(cpu, REG_L)))  \
+    OP (0x86,  7,     cpu_add(cpu, cpu_read_reg(cpu, REG_M)))  \
+    OP (0x87,  4,     cpu_add(cpu, cpu_read_reg(cpu, REG_A)))  \
+    OP (0x88,  4,     cpu_adc(cpu, cpu_read_reg(cpu, REG_B)))  \
+    OP (0x89,  4,     cpu_adc(cpu, cpu_read_reg(cpu, REG_C)))  \
+    OP (0x8A,  4,     cpu_adc(cpu, cpu_read_reg(cpu, REG_D)))  \
+    OP (0x8B,  4,     cpu_adc(cpu, cpu_read_reg(cpu, REG_E)))  \
+    OP (0x8C,  4,     cpu_adc(cpu, cpu_read_reg(cpu, REG_H)))  \
+    OP (0x8D,  4,     cpu_adc(cpu, cpu_read_reg(cpu, REG_L)))  \
+    OP (0x8E,  7,     cpu_adc(cpu, cpu_read_reg(cpu, REG_M)))  \
+    OP (0x8F,  4,     cpu_adc(cpu, cpu_read_reg(cpu, REG_A)))  \
+    OP (0x90,  4,     cpu_sub(cpu, cpu_read_reg(cpu, REG_B)))  \
+    OP (0x91,  4,     cpu_sub(cpu, cpu_read_reg(cpu, REG_C)))  \
+    OP (0x92,  4,     cpu_sub(cpu, cpu_read_reg(cpu, REG_D)))  \
+    OP (0x93,  4,     cpu_sub(cpu, cpu_read_reg(cpu, REG_E)))  \
+    OP (0x94,  4,     cpu_sub(cpu, cpu_read_reg(cpu, REG_H)))  \
+    OP (0x95,  4,     cpu_sub(cpu, cpu_read_reg(cpu, REG_L)))  \
+    OP (0x96,  7,     cpu_sub(cpu, cpu_read_reg(cpu, REG_M)))  \
+    OP (0x97,  4,     cpu_sub(cpu, cpu_read_reg(cpu, REG_A)))  \
+    OP (0x98,  4,     cpu_sbb(cpu, cpu_read_reg(cpu, REG_B)))  \
+    OP (0x99,  4,     cpu_sbb(cpu, cpu_read_reg(cpu, REG_C)))  \
+    OP (0x9A,  4,     cpu_sbb(cpu, cpu_read_reg(cpu, REG_D)))  \
+    OP (0x9B,  4,     cpu_sbb(cpu, cpu_read_reg(cpu, REG_E)))  \
+    OP (0x9C,  4,     cpu_sbb(cpu, cpu_read_reg(cpu, REG_H)))  \
+    OP (0x9D,  4,     cpu_sbb(cpu, cpu_read_reg(cpu, REG_L)))  \
+    OP (0x9E,  7,     cpu_sbb(cpu, cpu_read_reg(cpu, REG_M)))  \
+    OP (0x9F,  4,     cpu_sbb(cpu, cpu_read_reg(cpu, REG_A)))  \
+    OP (0xA0,  4,     cpu_ana(cpu, cpu_read_reg(cpu, REG_B)))  \
+    OP (0xA1,  4,     cpu_ana(cpu, cpu_read_reg(cpu, REG_C)))  \
+    OP (0xA2,  4,     cpu_ana(cpu, cpu_read_reg(cpu, REG_D)))  \
+    OP (0xA3,  4,     cpu_ana(cpu, cpu_read_reg(cpu, REG_E)))  \
+    OP (0xA4,  4,     cpu_ana(cpu, cpu_read_reg(cpu, REG_H)))  \
+    OP (0xA5,  4,     cpu_ana(cpu, cpu_read_reg(cpu, REG_L)))  \
+    OP (0xA6,  7,     cpu_ana(cpu, cpu_read_reg(cpu, REG_M)))  \
+    OP (0xA7,  4,     cpu_ana(cpu, cpu_read_reg(cpu, REG_A)))  \
+    OP (0xA8,  4,     cpu_xra(cpu, cpu_read_reg(cpu, REG_B)))  \
+    OP (0xA9,  4,     cpu_xra(cpu, cpu_read_reg(cpu, REG_C)))  \
+    OP (0xAA,  4,     cpu_xra(cpu, cpu_read_reg(cpu, REG_D)))  \
+    OP (0xAB,  4,     cpu_xra(cpu, cpu_read_reg(cpu, REG_E)))  \
+    OP (0xAC,  4,     cpu_xra(cpu, cpu_read_reg(cpu, REG_H)))  \
+    OP (0xAD,  4,     cpu_xra(cpu, cpu_read_reg(cpu, REG_L)))  \
+    OP (0xAE,  7,     cpu_xra(cpu, cpu_read_reg(cpu, REG_M)))  \
+    OP (0xAF,  4,     cpu_xra(cpu, cpu_read_reg(cpu, REG_A)))  \
+    OP (0xB0,  4,     cpu_ora(cpu, cpu_read_reg(cpu, REG_B)))  \
+    OP (0xB1,  4,     cpu_ora(cpu, cpu_read_reg(cpu, REG_C)))  \
+    OP (0xB2,  4,     cpu_ora(cpu, cpu_read_reg(cpu, REG_D)))  \
+    OP (0xB3,  4,     cpu_ora(cpu, cpu_read_reg(cpu, REG_E)))  \
+    OP (0xB4,  4,     cpu_ora(cpu, cpu_read_reg(cpu, REG_H)))  \
+    OP (0xB5,  4,     cpu_ora(cpu, cpu_read_reg(cpu, REG_L)))  \
+    OP (0xB6,  7,     cpu_ora(cpu, cpu_read_reg(cpu, REG_M)))  \
+    OP (0xB7,  4,     cpu_ora(cpu, cpu_read_reg(cpu, REG_A)))  \
+    OP (0xB8,  4,     cpu_cmp(cpu, cpu_read_reg(cpu, REG_B)))  \
+    OP (0xB9,  4,     cpu_cmp(cpu, cpu_read_reg(cpu, REG_C)))  \
+    OP (0xBA,  4,     cpu_cmp(cpu, cpu_read_reg(cpu, REG_D)))  \
+    OP (0xBB,  4,     cpu_cmp(cpu, cpu_read_reg(cpu, REG_E)))  \
+    OP (0xBC,  4,     cpu_cmp(cpu, cpu_read_reg(cpu, REG_H)))  \
+    OP (0xBD,  4,     cpu_cmp(cpu, cpu_read_reg(cpu, REG_L)))  \
+    OP (0xBE,  7,     cpu_cmp(cpu, cpu_read_reg(cpu, REG_M)))  \
+    OP (0xBF,  4,     cpu_cmp(cpu, cpu_read_reg(cpu, REG_A)))  \
+    OPC(0xC0,  5, 11, cpu_Rccc(cpu, CC_NZ))                    \
+    OP (0xC1, 10,     cpu_pop(cpu, RP_BC))                     \
+    OP (0xC2, 10,     cpu_jccc(cpu, CC_NZ, IMM16))             \
+    OP (0xC3, 10,     cpu_jmp(cpu, IMM16))                     \
+    OPC(0xC4, 11, 17, cpu_Cccc(cpu, CC_NZ, IMM16))             \
+    OP (0xC5, 11,     cpu_push(cpu, RP_BC))                    \
+    OP (0xC6,  7,     cpu_add(cpu, IMM8))                      \
+    OP (0xC7, 11,     cpu_rst(cpu, 0))                         \
+    OPC(0xC8,  5, 11, cpu_Rccc(cpu, CC_Z))                     \
+    OP (0xC9, 10,     cpu_ret(cpu))                            \
+    OP (0xCA, 10,     cpu_jccc(cpu, CC_Z, IMM16))              \
+    OP (0xCB, 10,     cpu_jmp(cpu, IMM16))                     \
+    OPC(0xCC, 11, 17, cpu_Cccc(cpu, CC_Z, IMM16))              \
+    OP (0xCD, 17,     cpu_call(cpu, IMM16))                    \
+    OP (0xCE,  7,     cpu_adc(cpu, IMM8))                      \
+    OP (0xCF, 11,     cpu_rst(cpu, 1))                         \
+    OPC(0xD0,  5, 11, cpu_Rccc(cpu, CC_NC))                    \
+    OP (0xD1, 10,     cpu_pop(cpu, RP_DE))                     \
+    OP (0xD2, 10,     cpu_jccc(cpu, CC_NC, IMM16))             \
+    OP (0xD3, 10,     cpu_out(cpu, IMM8, NOW))                 \
+    OPC(0xD4, 11, 17, cpu_Cccc(cpu, CC_NC, IMM16))             \
+    OP (0xD5, 11,     cpu_push(cpu, RP_DE))                    \
+    OP (0xD6,  7,     cpu_sub(cpu, IMM8))                      \
+    OP (0xD7, 11,     cpu_rst(cpu, 2))                         \
+    OPC(0xD8,  5, 11, cpu_Rccc(cpu, CC_C))                     \
+    OP (0xD9, 10,     cpu_ret(cpu))                            \
+    OP (0xDA, 10,     cpu_jccc(cpu, CC_C, IMM16))              \
+    OP (0xDB, 10,     cpu_in(cpu, IMM8, NOW))                  \
+    OPC(0xDC, 11, 17, cpu_Cccc(cpu, CC_C, IMM16))              \
+    OP (0xDD, 17,     cpu_call(cpu, IMM16))                    \
+    OP (0xDE,  7,     cpu_sbb(cpu, IMM8))                      \
+    OP (0xDF, 11,     cpu_rst(cpu, 3))                         \
+    OPC(0xE0,  5, 11, cpu_Rccc(cpu, CC_PO))                    \
+    OP (0xE1, 10,     cpu_pop(cpu, RP_HL))                     \
+    OP (0xE2, 10,     cpu_jccc(cpu, CC_PO, IMM16))             \
+    OP (0xE3, 18,     cpu_xthl(cpu))                           \
+    OPC(0xE4, 11, 17, cpu_Cccc(cpu, CC_PO, IMM16))             \
+    OP (0xE5, 11,     cpu_push(cpu, RP_HL))                    \
+    OP (0xE6,  7,     cpu_ana(cpu, IMM8))                      \
+    OP (0xE7, 11,     cpu_rst(cpu, 4))                         \
+    OPC(0xE8,  5, 11, cpu_Rccc(cpu, CC_PE))                    \
+    OP (0xE9,  5,     cpu_pchl(cpu))                           \
+    OP (0xEA, 10,     cpu_jccc(cpu, CC_PE, IMM16))             \
+    OP (0xEB,  5,     cpu_xchg(cpu))                           \
+    OPC(0xEC, 11, 17, cpu_Cccc(cpu, CC_PE, IMM16))             \
+    OP (0xED, 17,     cpu_call(cpu, IMM16))                    \
+    OP (0xEE,  7,     cpu_xra(cpu, IMM8))                      \
+    OP (0xEF, 11,     cpu_rst(cpu, 5))                         \
+    OPC(0xF0,  5, 11, cpu_Rccc(cpu, CC_P))                     \
+    OP (0xF1, 10,     cpu_pop_psw(cpu))                        \
+    OP (0xF2, 10,     cpu_jccc(cpu, CC_P, IMM16))              \
+    OP (0xF3,  4,     cpu_di(cpu))                             \
+    OPC(0xF4, 11, 17, cpu_Cccc(cpu, CC_P, IMM16))              \
+    OP (0xF5, 11,     cpu_push_psw(cpu))                       \
+    OP (0xF6,  7,     cpu_ora(cpu, IMM8))                      \
+    OP (0xF7, 11,     cpu_rst(cpu, 6))                         \
+    OPC(0xF8,  5, 11, cpu_Rccc(cpu, CC_M))                     \
+    OP (0xF9,  5,     cpu_sphl(cpu))                           \
+    OP (0xFA, 10,     cpu_jccc(cpu, CC_M, IMM16))              \
+    OP (0xFB,  4,     cpu_ei(cpu))                             \
+    OPC(0xFC, 11, 17, cpu_Cccc(cpu, CC_M, IMM16))              \
+    OP (0xFD, 17,     cpu_call(cpu, IMM16))                    \
+    OP (0xFE,  7,     cpu_cmp(cpu, IMM8))                      \
+    OP (0xFF, 11,     cpu_rst(cpu, 7))
+
+#define CYCLES_ENTRY(opcode, cycles, handler) [opcode] = cycles,
+#define CYCLES_ENTRY_C(opcode, cycles, taken_cycles, handler) [opcode] = cycles,
+#define TAKEN_CYCLES_ENTRY(opcode, cycles, handler) [opcode] = cycles,
+#define TAKEN_CYCLES_ENTRY_C(opcode, cycles, taken_cycles, handler) [opcode] = taken_cycles,
+
+// cycles per opcode, conditional CALL/RET not taken
+static const uint8_t op_cycles[256] = {
+    CPU_OPCODE_TABLE(CYCLES_ENTRY, CYCLES_ENTRY_C)
+};
+
+// cycles per opcode, conditional CALL/RET taken
+static const uint8_t op_taken_cycles[256] = {
+    CPU_OPCODE_TABLE(TAKEN_CYCLES_ENTRY, TAKEN_CYCLES_ENTRY_C)
+};
+
+// instruction length in bytes, opcode included
+static inline uint8_t opcode_length(uint8_t opcode) {
+    switch (opcode) {
+        case 0x01: case 0x11: case 0x21: case 0x31:     // LXI
+        case 0x22: case 0x2A: case 0x32: case 0x3A:     // SHLD LHLD STA LDA
+        case 0xC2: case 0xD2: case 0xE2: case 0xF2:     // Jccc
+        case 0xCA: case 0xDA: case 0xEA: case 0xFA:
+        case 0xC3: case 0xCB:                           // JMP
+        case 0xC4: case 0xD4: case 0xE4: case 0xF4:     // Cccc
+        case 0xCC: case 0xDC: case 0xEC: case 0xFC:
+        case 0xCD: case 0xDD: case 0xED: case 0xFD:     // CALL
+            return 3;
+        case 0x06: case 0x16: case 0x26: case 0x36:     // MVI
+        case 0x0E: case 0x1E: case 0x2E: case 0x3E:
+        case 0xC6: case 0xCE: case 0xD6: case 0xDE:     // ALU immediate
+        case 0xE6: case 0xEE: case 0xF6: case 0xFE:
+        case 0xD3: case 0xDB:                           // OUT IN
+            return 2;
+    }
+    return 1;
+}
+
+// jumps, calls, returns, RST, PCHL and HLT: the instructions after which
+// the next pc is not simply the following one
+static inline bool opcode_ends_block(uint8_t opcode) {
+    switch (opcode) {
+        case 0xC3: case 0xCB: case 0xE9: case 0x76:     // JMP PCHL HLT
+        case 0xCD: case 0xDD: case 0xED: case 0xFD:     // CALL
+        case 0xC9: case 0xD9:                           // RET
+            return true;
+    }
+    switch (opcode & 0xC7) {
+        case 0xC0:  // Rccc
+        case 0xC2:  // Jccc
+        case 0xC4:  // Cccc
+        case 0xC7:  // RST
+            return true;
+    }
+    return false;
+}
+
+// memory the instruction at cpu->pc is about to store to, returns the
+// number of bytes from *addr on, 0 when it stores nothing. Conditional
+// calls count as taken. Operands are peeked, devices are left alone.
+static inline int cpu_store_span(CpuState *cpu, uint8_t opcode, uint16_t *addr) {
+    if (((opcode & 0xF8) == 0x70 && opcode != 0x76) || opcode == 0x34 || opcode == 0x35 || opcode == 0x36) {
+        // MOV M,r  INR M  DCR M  MVI M
+        *addr = lb_hb_to_uint16(cpu->l, cpu->h);
+        return 1;
+    }
+    if (opcode == 0x32 || opcode == 0x22) {
+        // STA  SHLD
+        *addr = lb_hb_to_uint16(bus_peek(cpu->bus, cpu->pc + 1), bus_peek(cpu->bus, cpu->pc + 2));
+        return opcode == 0x22 ? 2 : 1;
+    }
+    if (opcode == 0x02 || opcode == 0x12) {
+        // STAX
+        *addr = opcode == 0x02 ? lb_hb_to_uint16(cpu->c, cpu->b) : lb_hb_to_uint16(cpu->e, cpu->d);
+        return 1;
+    }
+    if ((opcode & 0xCF) == 0xC5 || (opcode & 0xC7) == 0xC4 || (opcode & 0xC7) == 0xC7 || (opcode & 0xCF) == 0xCD) {
+        // PUSH  Cccc  RST  CALL
+        *addr = cpu->sp - 2;
+        return 2;
+    }
+    if (opcode == 0xE3) {
+        // XTHL
+        *addr = cpu->sp;
+        return 2;
+    }
+    return 0;
+}
+
+// memory the instruction at cpu->pc is about to load from, same contract
+// as cpu_store_span. Conditional returns count as taken, opcode and
+// operand fetches are not included.
+static inline int cpu_load_span(CpuState *cpu, uint8_t opcode, uint16_t *addr) {
+    if (((opcode & 0xC7) == 0x46 && opcode != 0x76) || (opcode & 0xC7) == 0x86
+            || opcode == 0x34 || opcode == 0x35) {
+        // MOV r,M  ALU M  INR M  DCR M
+        *addr = lb_hb_to_uint16(cpu->l, cpu->h);
+        return 1;
+    }
+    if (opcode == 0x3A || opcode == 0x2A) {
+        // LDA  LHLD
+        *addr = lb_hb_to_uint16(bus_peek(cpu->bus, cpu->pc + 1), bus_peek(cpu->bus, cpu->pc + 2));
+        return opcode == 0x2A ? 2 : 1;
+    }
+    if (opcode == 0x0A || opcode == 0x1A) {
+        // LDAX
+        *addr = opcode == 0x0A ? lb_hb_to_uint16(cpu->c, cpu->b) : lb_hb_to_uint16(cpu->e, cpu->d);
+        return 1;
+    }
+    if ((opcode & 0xCF) == 0xC1 || (opcode & 0xC7) == 0xC0 || (opcode & 0xEF) == 0xC9 || opcode == 0xE3) {
+        // POP  Rccc  RET  XTHL
+        *addr = cpu->sp;
+        return 2;
+    }
+    return 0;
+}
@@ -0,0 +1,240 @@
+#include "invaders.h"
+#include <string.h>
+
+#define ROM_SIZE 0x2000
+#define RAM_START 0x2000
+#define RAM_SIZE 0x2000
+#define VRAM_END (RAM_START + RAM_SIZE)
+
+// scanlines per frame, the interrupts come at line 96 and 224
+#define LINES 262
+#define MID_LINE 96
+#define VBLANK_LINE 224
+
+// IN 1 bit 3 and IN 0 bits 1-3 read as 1
+#define PORT0_IDLE 0x0E
+#define PORT1_IDLE 0x08
+
+// texture rows in one bus page of video RAM
+#define ROWS_PER_PAGE (BUS_PAGE_SIZE / (INVADERS_TEXTURE_WIDTH / 8))
+
+typedef struct {
+    uint8_t *port;
+    uint8_t bit;
+} InputBit;
+
+static InputBit input_bit(Invaders *machine, InvadersInput input) {
+    switch (input) {
+        case INVADERS_COIN:      return (InputBit){&machine->port1, 0x01};
+        case INVADERS_P2_START:  return (InputBit){&machine->port1, 0x02};
+        case INVADERS_P1_START:  return (InputBit){&machine->port1, 0x04};
+        case INVADERS_P1_FIRE:   return (InputBit){&machine->port1, 0x10};
+        case INVADERS_P1_LEFT:   return (InputBit){&machine->port1, 0x20};
+        case INVADERS_P1_RIGHT:  return (InputBit){&machine->port1, 0x40};
+        case INVADERS_TILT:      return (InputBit){&machine->port2, 0x04};
+        case INVADERS_P2_FIRE:   return (InputBit){&machine->port2, 0x10};
+        case INVADERS_P2_LEFT:   return (InputBit){&machine->port2, 0x20};
+        case INVADERS_P2_RIGHT:  return (InputBit){&machine->port2, 0x40};
+        default:                 return (InputBit){NULL, 0};
+    }
+}
+
+static uint8_t read_port(void *ctx, uint8_t port) {
+    Invaders *machine = ctx;
+    switch (port) {
+        case 0: return PORT0_IDLE;
+        case 1: return machine->port1;
+        case 2: return machine->port2;
+        default: return machine->shift >> (8 - machine->shift_amount);
+    }
+}
+
+// sample of each latch bit, OUT 3 then OUT 5
+static const uint8_t latch_sounds[2][5] = {
+    {INVADERS_SOUND_UFO, INVADERS_SOUND_SHOT, INVADERS_SOUND_PLAYER_DIE,
+     INVADERS_SOUND_INVADER_DIE, INVADERS_SOUND_EXTRA_LIFE},
+    {INVADERS_SOUND_FLEET, INVADERS_SOUND_FLEET + 1, INVADERS_SOUND_FLEET + 2,
+     INVADERS_SOUND_FLEET + 3, INVADERS_SOUND_UFO_HIT},
+};
+
+static void write_sound(Invaders *machine, int latch, uint8_t val) {
+    uint8_t changed = machine->sound[latch] ^ val;
+    machine->sound[latch] = val;
+    if (!machine->audio) return;
+
+    for (int bit = 0; bit < 5; bit++) {
+        if (!(changed >> bit & 1)) continue;
+
+        uint8_t sample = latch_sounds[latch][bit];
+        bool on = val >> bit & 1;
+        // the rest play to their end once started
+        if (on || sample == INVADERS_SOUND_UFO) {
+            audio_push(machine->audio, (AudioEvent){.cycle = machine->bus.port_cycle, .sample = sample, .start = on});
+        }
+    }
+}
+
+static void write_port(void *ctx, uint8_t port, uint8_t val) {
+    Invaders *machine = ctx;
+    switch (port) {
+        case 2: machine->shift_amount = val & 7; break;
+        case 3: write_sound(machine, 0, val); break;
+        case 4: machine->shift = val << 8 | machine->shift >> 8; break;
+        case 5: write_sound(machine, 1, val); break;
+        default: break;     // 6, the watchdog, is never allowed to bite
+    }
+}
+
+#define WHITE 0xFFFFFFFF
+#define RED   0xFFFF2020
+#define GREEN 0xFF20FF20
+
+// Colour of every texture column, the overlay is strips across the
+// upright screen. Rows 16-133 pass the bottom strip, the one with the
+// remaining ships, through green as well, everything else is white.
+static void overlay_row(uint32_t *colors, bool bottom_green) {
+    for (int col = 0; col < INVADERS_TEXTURE_WIDTH; col++) {
+        int y = INVADERS_TEXTURE_WIDTH - 1 - col;     // from the top, upright
+        uint32_t color = WHITE;
+        if (y >= 32 && y < 64) color = RED;
+        if (y >= 184 && y < 240) color = GREEN;
+        if (y >= 240 && bottom_green) color = GREEN;
+        colors[col] = color;
+    }
+}
+
+bool invaders_init(Invaders *machine, const Image *rom) {
+    for (size_t i = 0; i < rom->segment_count; i++) {
+        const ImageSegment *seg = &rom->segments[i];
+        if (seg->origin + seg->len > ROM_SIZE) {
+            fprintf(stderr, "ERROR: ROM image does not fit in 8K at 0x0000\n");
+            return false;
+        }
+    }
+
+    memset(machine, 0, sizeof(*machine));
+    bus_map_rom(&machine->bus, 0, ROM_SIZE, machine->mem);
+    for (uint32_t addr = RAM_START; addr < MEM_SIZE; addr += RAM_SIZE) {
+        bus_map_ram(&machine->bus, addr, RAM_SIZE, machine->mem + RAM_START);
+    }
+    image_map(rom, &machine->bus, machine->mem);
+    bus_watch(&machine->bus, INVADERS_VRAM, VRAM_END - INVADERS_VRAM, true);
+
+    for (int port = 0; port <= 3; port++) {
+        bus_map_in(&machine->bus, port, read_port, machine);
+    }
+    for (int port = 2; port <= 6; port++) {
+        bus_map_out(&machine->bus, port, write_port, machine);
+    }
+
+    machine->port1 = PORT1_IDLE;
+    machine->cpu.bus = &machine->bus;
+    overlay_row(machine->overlay[0], false);
+    overlay_row(machine->overlay[1], true);
+    scheduler_init(&machine->sched);
+    machine->sched.skip_busy_waits = true;
+    return true;
+}
+
+void invaders_free(Invaders *machine) {
+    scheduler_free(&machine->sched);
+}
+
+void invaders_set_input(Invaders *machine, InvadersInput input, bool pressed) {
+    InputBit in = input_bit(machine, input);
+    if (!in.port) return;
+    if (pressed) {
+        *in.port |= in.bit;
+    } else {
+        *in.port &= ~in.bit;
+    }
+}
+
+static void mid_screen(void *ctx, uint64_t cycle) {
+    (void)cycle;
+    Invaders *machine = ctx;
+    cpu_interrupt(&machine->cpu, 1);
+}
+
+static void vblank(void *ctx, uint64_t cycle) {
+    (void)cycle;
+    Invaders *machine = ctx;
+    cpu_interrupt(&machine->cpu, 2);
+}
+
+// first cycle of a frame, whole cycles with the remainder carried into
+// the following frames so 60 frames take exactly INVADERS_CLOCK
+static uint64_t frame_start(uint64_t frame) {
+    return frame * INVADERS_CLOCK / INVADERS_FPS;
+}
+
+bool invaders_run_frame(Invaders *machine) {
+    uint64_t start = frame_start(machine->frame);
+    uint64_t len = frame_start(machine->frame + 1) - start;
+
+    if (!scheduler_add(&machine->sched, start + len * MID_LINE / LINES, mid_screen, machine)
+            || !scheduler_add(&machine->sched, start + len * VBLANK_LINE / LINES, vblank, machine)) {
+        scheduler_cancel(&machine->sched, mid_screen, machine);
+        return false;
+    }
+
+    uint64_t end = start + len;
+    if (machine->cpu.cycle < end) {
+        scheduler_run(&machine->sched, &machine->cpu, end - machine->cpu.cycle);
+    }
+    machine->frame++;
+    return true;
+}
+
+// 8 pixels, one per bit of a video RAM byte
+typedef uint32_t Pixels __attribute__((vector_size(32)));
+typedef int32_t SignedPixels __attribute__((vector_size(32)));
+
+// texture rows first to first + count - 1
+static void convert_rows(const Invaders *machine, uint32_t *pixels, int first, int count) {
+    // lane i moves bit i to the sign bit, the arithmetic shift back
+    // spreads it over the whole pixel
+    const Pixels to_sign = {31, 30, 29, 28, 27, 26, 25, 24};
+    const uint8_t *vram = machine->mem + INVADERS_VRAM;
+
+    for (int row = first; row < first + count; row++) {
+        const uint32_t *row_colors = machine->overlay[row >= 16 && row < 134];
+        const uint8_t *line = vram + row * (INVADERS_TEXTURE_WIDTH / 8);
+        uint32_t *out = pixels + row * INVADERS_TEXTURE_WIDTH;
+
+        for (int i = 0; i < INVADERS_TEXTURE_WIDTH / 8; i++) {
+            Pixels bits = (Pixels){0} + line[i];
+            Pixels mask = (Pixels)((SignedPixels)(bits << to_sign) >> 31);
+            Pixels colors;
+            memcpy(&colors, row_colors + i * 8, sizeof(colors));
+            Pixels px = (mask & colors) | (~mask & 0xFF000000);
+            memcpy(out + i * 8, &px, sizeof(px));
+        }
+    }
+}
+
+void invaders_render(Invaders *machine, uint32_t *pixels) {
+    convert_rows(machine, pixels, 0, INVADERS_TEXTURE_HEIGHT);
+    for (int page = INVADERS_VRAM >> 8; page < VRAM_END >> 8; page++) {
+        bus_watch_clean(&machine->bus, page);
+    }
+}
+
+int invaders_render_dirty(Invaders *machine, uint32_t *pixels, int *first, int *last) {
+    int count = 0;
+    *first = INVADERS_TEXTURE_HEIGHT;
+    *last = -1;
+
+    for (int page = INVADERS_VRAM >> 8; page < VRAM_END >> 8; page++) {
+        if (!machine->bus.watch_dirty[page]) continue;
+
+        int row = (page - (INVADERS_VRAM >> 8)) * ROWS_PER_PAGE;
+        convert_rows(machine, pixels, row, ROWS_PER_PAGE);
+        bus_watch_clean(&machine->bus, page);
+
+        if (row < *first) *first = row;
+        *last = row + ROWS_PER_PAGE - 1;
+        count += ROWS_PER_PAGE;
+    }
+    return count;
+}
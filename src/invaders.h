@@ -0,0 +1,121 @@
+#pragma once
+
+#include "cpu.h"
+#include "scheduler.h"
+#include "loader.h"
+#include "audio.h"
+
+// Space Invaders arcade board (Taito / Midway 8080).
+//
+// Memory: 8K ROM at 0x0000, 1K work RAM at 0x2000, 7K video RAM at
+// 0x2400, the 8K of RAM mirrored up to 0xFFFF.
+// Ports:
+//   IN 1, IN 2   player controls and DIP switches, see InvadersInput
+//   IN 3         shift register result
+//   OUT 2        shift amount
+//   OUT 3, OUT 5 sound latches
+//   OUT 4        shift register data
+//   OUT 6        watchdog
+// Sound is prerecorded effects started by rising edges on the OUT 3 and
+// OUT 5 latch bits, INVADERS_SOUND_* number them as the usual sample
+// sets do. The UFO plays for as long as its bit stays set.
+// The cpu runs at 2 MHz. A frame is 1/60 s, RST 1 is raised when the
+// beam reaches the middle of the screen and RST 2 at vertical blank.
+//
+// The video RAM holds the screen as it is mounted, rotated: 224 lines of
+// 32 bytes, each line one column of the upright picture with bit 0 of
+// the first byte at the bottom. invaders_render converts it as stored,
+// unrotated, the front end turns the texture upright when drawing.
+
+#define INVADERS_CLOCK 2000000
+#define INVADERS_FPS 60
+
+#define INVADERS_VRAM 0x2400
+
+// rendered texture, before rotating it upright
+#define INVADERS_TEXTURE_WIDTH 256
+#define INVADERS_TEXTURE_HEIGHT 224
+
+#define INVADERS_SOUND_UFO 0
+#define INVADERS_SOUND_SHOT 1
+#define INVADERS_SOUND_PLAYER_DIE 2
+#define INVADERS_SOUND_INVADER_DIE 3
+#define INVADERS_SOUND_FLEET 4      // 4 to 7, the four steps of the march
+#define INVADERS_SOUND_UFO_HIT 8
+#define INVADERS_SOUND_EXTRA_LIFE 9
+#define INVADERS_SOUNDS 10
+
+typedef enum {
+    INVADERS_COIN,
+    INVADERS_P1_START,
+    INVADERS_P1_FIRE,
+    INVADERS_P1_LEFT,
+    INVADERS_P1_RIGHT,
+    INVADERS_P2_START,
+    INVADERS_P2_FIRE,
+    INVADERS_P2_LEFT,
+    INVADERS_P2_RIGHT,
+    INVADERS_TILT,
+    INVADERS_INPUT_COUNT
+} InvadersInput;
+
+typedef struct {
+    CpuState cpu;
+    Bus bus;
+    Scheduler sched;
+    uint8_t mem[MEM_SIZE];
+
+    // upper byte is the last value written to OUT 4, IN 3 reads 8 bits
+    // from shift_amount bits below the top
+    uint16_t shift;
+    uint8_t shift_amount;
+
+    uint8_t port1, port2;
+    uint8_t sound[2];       // last values written to OUT 3 and OUT 5
+
+    // gets the sound events when set, stamped with the cycle the OUT
+    // started at
+    Audio *audio;
+
+    uint64_t frame;
+
+    // colour of every texture column from the overlay on the screen, [1]
+    // for the rows where the bottom strip is green as well
+    uint32_t overlay[2][INVADERS_TEXTURE_WIDTH];
+} Invaders;
+
+// Maps the ROM image and resets the board, false and why on stderr when
+// the image does not fit in the ROM area. The image has to stay loaded
+// while the machine runs.
+bool invaders_init(Invaders *machine, const Image *rom);
+void invaders_free(Invaders *machine);
+
+void invaders_set_input(Invaders *machine, InvadersInput input, bool pressed);
+
+// runs one frame worth of cycles with both interrupts, exactly
+// INVADERS_CLOCK cycles every INVADERS_FPS frames. False when the
+// interrupts could not be scheduled, the frame did not run then.
+bool invaders_run_frame(Invaders *machine);
+
+// Converts the video RAM into INVADERS_TEXTURE_WIDTH x
+// INVADERS_TEXTURE_HEIGHT pixels, 0xAARRGGBB, with the colour overlay
+// the cabinet puts over the screen.
+void invaders_render(Invaders *machine, uint32_t *pixels);
+
+// Converts only the rows written since the last render. Video RAM pages
+// are watched on the bus, the first store to a page after it was
+// converted marks its 8 rows, later stores in the frame run at full
+// speed. Returns the number of rows converted, first and last row are
+// set to the range they span. Memory changed behind the bus, restoring a
+// snapshot for one, needs a full invaders_render.
+int invaders_render_dirty(Invaders *machine, uint32_t *pixels, int *first, int *last);
+
+#ifdef HAVE_SDL
+// Plays in a window at exactly INVADERS_FPS frames a second until it is
+// closed, returns the exit status for main. Keys: C coin, 1 and 2 start,
+// arrows and space player 1, A D W player 2, T tilt, Tab turbo on / off,
+// F fast forward 1x 2x 4x, Escape quits.
+// samples_dir holds 0.wav to 9.wav, numbered INVADERS_SOUND_*, NULL
+// plays without sound.
+int invaders_play(Invaders *machine, const char *samples_dir);
+#endif
@@ -0,0 +1,225 @@
+#ifdef HAVE_SDL
+
+#include "invaders.h"
+#include "pacer.h"
+#include <SDL.h>
+#include <string.h>
+
+#define SCALE 3
+#define WINDOW_WIDTH (INVADERS_TEXTURE_HEIGHT * SCALE)
+#define WINDOW_HEIGHT (INVADERS_TEXTURE_WIDTH * SCALE)
+
+static bool map_key(SDL_Keycode key, InvadersInput *input) {
+    switch (key) {
+        case SDLK_c:      *input = INVADERS_COIN; return true;
+        case SDLK_1:      *input = INVADERS_P1_START; return true;
+        case SDLK_2:      *input = INVADERS_P2_START; return true;
+        case SDLK_SPACE:  *input = INVADERS_P1_FIRE; return true;
+        case SDLK_LEFT:   *input = INVADERS_P1_LEFT; return true;
+        case SDLK_RIGHT:  *input = INVADERS_P1_RIGHT; return true;
+        case SDLK_w:      *input = INVADERS_P2_FIRE; return true;
+        case SDLK_a:      *input = INVADERS_P2_LEFT; return true;
+        case SDLK_d:      *input = INVADERS_P2_RIGHT; return true;
+        case SDLK_t:      *input = INVADERS_TILT; return true;
+        default:          return false;
+    }
+}
+
+// output format, mono 16 bit
+#define AUDIO_RATE 48000
+#define AUDIO_BUFFER 512
+
+// samples start this long after the emulation raised them, a bit over
+// the frame the emulation runs ahead in
+#define AUDIO_LATENCY (INVADERS_CLOCK / INVADERS_FPS * 3 / 2)
+
+typedef struct {
+    SDL_AudioDeviceID device;
+    Audio audio;
+    int16_t *pcm[INVADERS_SOUNDS];
+} Sound;
+
+static void audio_callback(void *userdata, Uint8 *stream, int len) {
+    Audio *audio = userdata;
+    audio_mix(audio, (int16_t *)stream, len / sizeof(int16_t));
+}
+
+// dir/n.wav converted to the output format, NULL when missing
+static int16_t *load_sample(const char *dir, int n, size_t *len) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%d.wav", dir, n);
+
+    SDL_AudioSpec spec;
+    Uint8 *wav;
+    Uint32 wav_len;
+    if (!SDL_LoadWAV(path, &spec, &wav, &wav_len)) {
+        fprintf(stderr, "WARNING: no sample %s: %s\n", path, SDL_GetError());
+        return NULL;
+    }
+
+    SDL_AudioCVT cvt;
+    if (SDL_BuildAudioCVT(&cvt, spec.format, spec.channels, spec.freq, AUDIO_S16SYS, 1, AUDIO_RATE) < 0) {
+        SDL_FreeWAV(wav);
+        return NULL;
+    }
+    cvt.len = wav_len;
+    cvt.buf = malloc((size_t)wav_len * cvt.len_mult);
+    if (cvt.buf) {
+        memcpy(cvt.buf, wav, wav_len);
+    }
+    SDL_FreeWAV(wav);
+    if (!cvt.buf || SDL_ConvertAudio(&cvt) < 0) {
+        free(cvt.buf);
+        return NULL;
+    }
+
+    *len = cvt.len_cvt / sizeof(int16_t);
+    return (int16_t *)cvt.buf;
+}
+
+// plays the samples in dir through an audio device of its own, the
+// callback only ever talks to the emulation through the Audio ring
+static bool open_sound(Sound *sound, Invaders *machine, const char *dir) {
+    if (SDL_InitSubSystem(SDL_INIT_AUDIO) != 0) {
+        fprintf(stderr, "WARNING: no audio: %s\n", SDL_GetError());
+        return false;
+    }
+
+    audio_init(&sound->audio, INVADERS_CLOCK, AUDIO_RATE, AUDIO_LATENCY);
+    for (int n = 0; n < INVADERS_SOUNDS; n++) {
+        size_t len = 0;
+        sound->pcm[n] = load_sample(dir, n, &len);
+        audio_set_sample(&sound->audio, n, sound->pcm[n], len, n == INVADERS_SOUND_UFO);
+    }
+
+    SDL_AudioSpec want = {
+        .freq = AUDIO_RATE, .format = AUDIO_S16SYS, .channels = 1, .samples = AUDIO_BUFFER,
+        .callback = audio_callback, .userdata = &sound->audio,
+    };
+    sound->device = SDL_OpenAudioDevice(NULL, 0, &want, NULL, 0);
+    if (!sound->device) {
+        fprintf(stderr, "WARNING: no audio device: %s\n", SDL_GetError());
+        for (int n = 0; n < INVADERS_SOUNDS; n++) {
+            free(sound->pcm[n]);
+        }
+        return false;
+    }
+
+    machine->audio = &sound->audio;
+    SDL_PauseAudioDevice(sound->device, 0);
+    return true;
+}
+
+static void close_sound(Sound *sound, Invaders *machine) {
+    SDL_CloseAudioDevice(sound->device);
+    machine->audio = NULL;
+    for (int n = 0; n < INVADERS_SOUNDS; n++) {
+        free(sound->pcm[n]);
+    }
+}
+
+// fast forward steps F goes through
+static const double speeds[] = {1.0, 2.0, 4.0};
+
+// false once the window was closed or Escape pressed
+static bool handle_events(Invaders *machine, Pacer *pacer) {
+    SDL_Event event;
+    while (SDL_PollEvent(&event)) {
+        if (event.type == SDL_QUIT) return false;
+        if (event.type != SDL_KEYDOWN && event.type != SDL_KEYUP) continue;
+        if (event.key.repeat) continue;
+
+        SDL_Keycode key = event.key.keysym.sym;
+        if (key == SDLK_ESCAPE) return false;
+
+        if (key == SDLK_TAB && event.type == SDL_KEYDOWN) {
+            pacer->turbo = !pacer->turbo;
+            continue;
+        }
+        if (key == SDLK_f && event.type == SDL_KEYDOWN) {
+            size_t next = 0;
+            while (next < sizeof(speeds) / sizeof(speeds[0]) && speeds[next] <= pacer->speed) next++;
+            pacer_set_speed(pacer, next < sizeof(speeds) / sizeof(speeds[0]) ? speeds[next] : speeds[0],
+                            machine->cpu.cycle);
+            continue;
+        }
+
+        InvadersInput input;
+        if (map_key(key, &input)) {
+            invaders_set_input(machine, input, event.type == SDL_KEYDOWN);
+        }
+    }
+    return true;
+}
+
+int invaders_play(Invaders *machine, const char *samples_dir) {
+    if (SDL_Init(SDL_INIT_VIDEO) != 0) {
+        fprintf(stderr, "ERROR: could not initialize SDL: %s\n", SDL_GetError());
+        return 1;
+    }
+
+    SDL_Window *window = SDL_CreateWindow("Space Invaders", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
+                                          WINDOW_WIDTH, WINDOW_HEIGHT, 0);
+    SDL_Renderer *renderer = window ? SDL_CreateRenderer(window, -1, 0) : NULL;
+    SDL_Texture *texture = renderer ? SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888,
+                                                        SDL_TEXTUREACCESS_STREAMING,
+                                                        INVADERS_TEXTURE_WIDTH, INVADERS_TEXTURE_HEIGHT) : NULL;
+    if (!texture) {
+        fprintf(stderr, "ERROR: could not open a window: %s\n", SDL_GetError());
+        if (renderer) SDL_DestroyRenderer(renderer);
+        if (window) SDL_DestroyWindow(window);
+        SDL_Quit();
+        return 1;
+    }
+
+    static uint32_t pixels[INVADERS_TEXTURE_WIDTH * INVADERS_TEXTURE_HEIGHT];
+
+    // the texture is drawn centred and turned a quarter counter clockwise,
+    // which makes it fill the upright window
+    SDL_Rect dst = {
+        (WINDOW_WIDTH - INVADERS_TEXTURE_WIDTH * SCALE) / 2,
+        (WINDOW_HEIGHT - INVADERS_TEXTURE_HEIGHT * SCALE) / 2,
+        INVADERS_TEXTURE_WIDTH * SCALE,
+        INVADERS_TEXTURE_HEIGHT * SCALE,
+    };
+
+    invaders_render(machine, pixels);
+    SDL_UpdateTexture(texture, NULL, pixels, INVADERS_TEXTURE_WIDTH * sizeof(uint32_t));
+
+    static Sound sound;
+    bool sound_open = samples_dir && open_sound(&sound, machine, samples_dir);
+
+    Pacer pacer;
+    pacer_init(&pacer, INVADERS_CLOCK, machine->cpu.cycle);
+
+    int status = 0;
+    while (handle_events(machine, &pacer)) {
+        if (!invaders_run_frame(machine)) {
+            fprintf(stderr, "ERROR: out of memory scheduling the frame interrupts\n");
+            status = 1;
+            break;
+        }
+
+        // only the rows that changed go to the texture
+        int first, last;
+        if (invaders_render_dirty(machine, pixels, &first, &last)) {
+            SDL_Rect rows = {0, first, INVADERS_TEXTURE_WIDTH, last - first + 1};
+            SDL_UpdateTexture(texture, &rows, pixels + first * INVADERS_TEXTURE_WIDTH,
+                              INVADERS_TEXTURE_WIDTH * sizeof(uint32_t));
+        }
+        SDL_RenderClear(renderer);
+        SDL_RenderCopyEx(renderer, texture, NULL, &dst, -90.0, NULL, SDL_FLIP_NONE);
+        SDL_RenderPresent(renderer);
+
+        pacer_wait(&pacer, machine->cpu.cycle);
+    }
+
+    if (sound_open) close_sound(&sound, machine);
+    SDL_DestroyTexture(texture);
+    SDL_DestroyRenderer(renderer);
+    SDL_DestroyWindow(window);
+    SDL_Quit();
+    return status;
+}
+
+#endif
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "cpu.h"
+
+// Native code backend for the block cache. Hot blocks are compiled to
+// x86-64 with the 8080 registers pinned to host registers and run out of
+// an mmap'd buffer that is writable or executable, never both. Only built
+// on x86-64 unix, elsewhere jit_create returns NULL and the block cache
+// keeps interpreting.
+
+typedef struct Jit Jit;
+
+// set in a block's return value when it stopped in front of an
+// instruction it leaves to the interpreter, pc points at that instruction
+#define JIT_BAIL 0x80000000u
+
+// largest cycle_limit a block accepts
+#define JIT_MAX_CYCLE_LIMIT 0x40000000u
+
+// Runs the block, then runs it again for as long as it jumps back to its
+// own start and the cycles used so far stay below cycle_limit. Returns
+// the cycles used, or'ed with JIT_BAIL when it bailed.
+typedef uint32_t (*JitBlockFn)(CpuState *cpu, uint32_t cycle_limit);
+
+// returns NULL when the platform has no backend or mapping code_size
+// bytes of executable memory failed
+Jit *jit_create(size_t code_size);
+
+void jit_destroy(Jit *jit);
+
+// drops every compiled block
+void jit_reset(Jit *jit);
+
+// whether native code can start with this opcode, I/O, interrupt enable,
+// DAA and XTHL are left to the interpreter
+bool jit_supports(uint8_t opcode);
+
+// compiles op_count instructions at start, the same ones the block cache
+// translated there, stopping in front of code outside host memory.
+// Returns NULL when the code buffer is full or start is outside host
+// memory.
+JitBlockFn jit_compile(Jit *jit, Bus *bus, uint16_t start, int op_count);
@@ -0,0 +1,1019 @@
+#include "jit.h"
+
+#if defined(__x86_64__) && (defined(__unix__) || defined(__APPLE__))
+
+#include "cpu_ops.h"
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// instructions compiled per block at most, longer blocks end early
+#define JIT_MAX_OPS 64
+
+// code bytes reserved for each compiled block, far above what
+// JIT_MAX_OPS instructions with their exit stubs take
+#define JIT_MAX_BLOCK_CODE 16384
+
+struct Jit {
+    uint8_t *code;
+    size_t size;
+    size_t used;
+    uint8_t *epilogue;  // shared by all blocks, at the start of code
+};
+
+enum {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+// SIB index field value meaning no index
+#define NO_INDEX RSP
+
+// Register assignment inside compiled blocks. The 8080 registers live
+// zero extended in the low byte of their host register, sp in esi. rax,
+// rcx and rdx are scratch, rbp is map_addr's own scratch, edi counts the
+// cycles of earlier loop iterations and the cycle limit sits at [rsp].
+#define HOST_CPU    RBX
+#define HOST_BUS    R12
+#define HOST_TMP    RBP
+#define HOST_SP     RSI
+#define HOST_CYCLES RDI
+
+static const int host_reg[8] = {
+    [REG_B] = R9,  [REG_C] = R10, [REG_D] = R11, [REG_E] = R13,
+    [REG_H] = R14, [REG_L] = R15, [REG_M] = -1,  [REG_A] = R8,
+};
+
+static const size_t reg_offset[8] = {
+    [REG_B] = offsetof(CpuState, b), [REG_C] = offsetof(CpuState, c),
+    [REG_D] = offsetof(CpuState, d), [REG_E] = offsetof(CpuState, e),
+    [REG_H] = offsetof(CpuState, h), [REG_L] = offsetof(CpuState, l),
+    [REG_M] = 0,                     [REG_A] = offsetof(CpuState, a),
+};
+
+#define OFF_FLAGS  ((int32_t)offsetof(CpuState, flags))
+#define OFF_PC     ((int32_t)offsetof(CpuState, pc))
+#define OFF_SP     ((int32_t)offsetof(CpuState, sp))
+#define OFF_HALTED ((int32_t)offsetof(CpuState, halted))
+#define OFF_READ   ((int32_t)offsetof(Bus, read_page))
+#define OFF_WRITE  ((int32_t)offsetof(Bus, write_page))
+
+// operand sizes, BYTE always gets a REX prefix so registers 4-7 mean
+// spl/bpl/sil/dil, ah is only ever used through emit_raw
+enum { BYTE, WORD, DWORD, QWORD };
+
+// x86 group 1 opcode extensions
+enum { ALU_ADD, ALU_OR, ALU_ADC, ALU_SBB, ALU_AND, ALU_SUB, ALU_XOR, ALU_CMP };
+
+// x86 group 2 opcode extensions
+enum { SH_ROL, SH_ROR, SH_RCL, SH_RCR, SH_SHL, SH_SHR };
+
+// x86 condition codes for jcc
+enum { CC_X86_B = 0x2, CC_X86_E = 0x4, CC_X86_NE = 0x5 };
+
+// 8080 ALU operation order (ADD ADC SUB SBB ANA XRA ORA CMP) to x86
+static const int alu_ext[8] = {
+    ALU_ADD, ALU_ADC, ALU_SUB, ALU_SBB, ALU_AND, ALU_XOR, ALU_OR, ALU_CMP
+};
+
+// flag tested by each condition code, odd codes are taken when it is set
+static const uint8_t cc_flag[8] = {
+    FLAG_Z, FLAG_Z, FLAG_CY, FLAG_CY, FLAG_P, FLAG_P, FLAG_S, FLAG_S
+};
+
+typedef struct {
+    uint8_t *at;    // rel32 field to patch
+    int op;         // instruction whose bail stub it jumps to
+} Fixup;
+
+typedef struct {
+    uint8_t *p;
+    uint8_t *epilogue;
+    uint8_t *body;
+    uint16_t start;
+
+    int op;                         // instruction being compiled
+    uint16_t op_pc[JIT_MAX_OPS];
+    uint32_t op_before[JIT_MAX_OPS];  // cycles of the instructions before it
+    uint8_t live_flags[JIT_MAX_OPS];  // flags read again after it
+
+    Fixup fixups[JIT_MAX_OPS * 2];
+    int fixup_count;
+} Compiler;
+
+static inline void emit8(Compiler *c, uint8_t byte) {
+    *c->p++ = byte;
+}
+
+static inline void emit16(Compiler *c, uint16_t val) {
+    memcpy(c->p, &val, 2);
+    c->p += 2;
+}
+
+static inline void emit32(Compiler *c, uint32_t val) {
+    memcpy(c->p, &val, 4);
+    c->p += 4;
+}
+
+static inline void emit_raw(Compiler *c, const uint8_t *bytes, size_t len) {
+    memcpy(c->p, bytes, len);
+    c->p += len;
+}
+
+static void emit_prefix(Compiler *c, int size, int reg, int index, int base) {
+    if (size == WORD) emit8(c, 0x66);
+    uint8_t rex = 0x40 | (size == QWORD ? 0x08 : 0) | ((reg & 8) >> 1) | ((index & 8) >> 2) | ((base & 8) >> 3);
+    if (rex != 0x40 || size == BYTE) emit8(c, rex);
+}
+
+static void emit_opcode(Compiler *c, int opcode) {
+    if (opcode > 0xFF) emit8(c, opcode >> 8);
+    emit8(c, opcode);
+}
+
+// opcode with a register in ModRM.rm, reg is a register or an opcode
+// extension
+static void emit_reg(Compiler *c, int size, int opcode, int reg, int rm) {
+    emit_prefix(c, size, reg, 0, rm);
+    emit_opcode(c, opcode);
+    emit8(c, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// opcode with a [base + (index << scale) + disp32] memory operand, always
+// encoded with a SIB byte so rsp/r12 and rbp/r13 need no special cases
+static void emit_mem_scaled(Compiler *c, int size, int opcode, int reg, int base, int index, int scale, int32_t disp) {
+    emit_prefix(c, size, reg, index, base);
+    emit_opcode(c, opcode);
+    emit8(c, 0x84 | ((reg & 7) << 3));
+    emit8(c, (scale << 6) | ((index & 7) << 3) | (base & 7));
+    emit32(c, (uint32_t)disp);
+}
+
+static void emit_mem(Compiler *c, int size, int opcode, int reg, int base, int index, int32_t disp) {
+    emit_mem_scaled(c, size, opcode, reg, base, index, 0, disp);
+}
+
+static void mov_rr(Compiler *c, int size, int dst, int src) {
+    emit_reg(c, size, size == BYTE ? 0x88 : 0x89, src, dst);
+}
+
+static void mov_ri8(Compiler *c, int dst, uint8_t imm) {
+    emit8(c, 0x40 | ((dst & 8) >> 3));
+    emit8(c, 0xB0 | (dst & 7));
+    emit8(c, imm);
+}
+
+static void mov_ri32(Compiler *c, int dst, uint32_t imm) {
+    if (dst & 8) emit8(c, 0x41);
+    emit8(c, 0xB8 | (dst & 7));
+    emit32(c, imm);
+}
+
+static void movzx_rr(Compiler *c, int size, int dst, int src) {
+    emit_reg(c, size == BYTE ? BYTE : DWORD, size == BYTE ? 0x0FB6 : 0x0FB7, dst, src);
+}
+
+static void alu_rr(Compiler *c, int size, int ext, int dst, int src) {
+    emit_reg(c, size, (ext << 3) | (size == BYTE ? 0x00 : 0x01), src, dst);
+}
+
+static void alu_ri(Compiler *c, int size, int ext, int dst, uint32_t imm) {
+    if (size == BYTE) {
+        emit_reg(c, BYTE, 0x80, ext, dst);
+        emit8(c, imm);
+    } else if (size == WORD) {
+        emit_reg(c, WORD, 0x81, ext, dst);
+        emit16(c, imm);
+    } else {
+        emit_reg(c, size, 0x81, ext, dst);
+        emit32(c, imm);
+    }
+}
+
+static void alu_mi8(Compiler *c, int ext, int base, int index, int32_t disp, uint8_t imm) {
+    emit_mem(c, BYTE, 0x80, ext, base, index, disp);
+    emit8(c, imm);
+}
+
+static void shift_ri(Compiler *c, int size, int ext, int dst, uint8_t imm) {
+    if (imm == 1) {
+        emit_reg(c, size, size == BYTE ? 0xD0 : 0xD1, ext, dst);
+    } else {
+        emit_reg(c, size, size == BYTE ? 0xC0 : 0xC1, ext, dst);
+        emit8(c, imm);
+    }
+}
+
+static void load8(Compiler *c, int dst, int base, int index, int32_t disp) {
+    emit_mem(c, BYTE, 0x8A, dst, base, index, disp);
+}
+
+static void store8(Compiler *c, int src, int base, int index, int32_t disp) {
+    emit_mem(c, BYTE, 0x88, src, base, index, disp);
+}
+
+static void lea(Compiler *c, int dst, int base, int32_t disp) {
+    emit_mem(c, DWORD, 0x8D, dst, base, NO_INDEX, disp);
+}
+
+static uint8_t *jcc(Compiler *c, int cc) {
+    emit8(c, 0x0F);
+    emit8(c, 0x80 | cc);
+    emit32(c, 0);
+    return c->p - 4;
+}
+
+static uint8_t *jmp(Compiler *c) {
+    emit8(c, 0xE9);
+    emit32(c, 0);
+    return c->p - 4;
+}
+
+static void patch(uint8_t *at, uint8_t *target) {
+    int32_t rel = (int32_t)(target - (at + 4));
+    memcpy(at, &rel, 4);
+}
+
+// dst = (hi << 8) | lo as a 32 bit value
+static void pair_value(Compiler *c, int dst, int hi, int lo) {
+    mov_rr(c, DWORD, dst, hi);
+    shift_ri(c, DWORD, SH_SHL, dst, 8);
+    alu_rr(c, DWORD, ALU_OR, dst, lo);
+}
+
+static void rp_regs(RegisterPair rp, int *hi, int *lo) {
+    switch (rp) {
+        case RP_BC: *hi = R9;  *lo = R10; break;
+        case RP_DE: *hi = R11; *lo = R13; break;
+        default:    *hi = R14; *lo = R15; break;
+    }
+}
+
+static void bail_on(Compiler *c, int cc) {
+    Fixup *fixup = &c->fixups[c->fixup_count++];
+    fixup->at = jcc(c, cc);
+    fixup->op = c->op;
+}
+
+// Memory goes through the bus page tables (OFF_READ / OFF_WRITE) like
+// bus_read and bus_write. A page without a host pointer bails out in front
+// of the instruction and the interpreter does the access: devices, ROM and
+// writes into translated code, which then get invalidated. Instructions
+// map every byte they touch before changing anything.
+
+// dst = host memory of the page whose number is in the register page
+static void map_page(Compiler *c, int32_t table, int dst, int page) {
+    emit_mem_scaled(c, QWORD, 0x8B, dst, HOST_BUS, page, 3, table);
+    emit_reg(c, QWORD, 0x85, dst, dst);     // test
+    bail_on(c, CC_X86_E);
+}
+
+// dst = host pointer of the 16 bit address in addr, dst may be addr
+static void map_addr(Compiler *c, int32_t table, int dst, int addr) {
+    movzx_rr(c, BYTE, HOST_TMP, addr);
+    mov_rr(c, DWORD, dst, addr);
+    shift_ri(c, DWORD, SH_SHR, dst, 8);
+    map_page(c, table, dst, dst);
+    alu_rr(c, QWORD, ALU_ADD, dst, HOST_TMP);
+}
+
+// dst = host memory of the page holding addr, the byte is at addr & 0xFF
+static void map_const(Compiler *c, int32_t table, int dst, uint16_t addr) {
+    emit_mem(c, QWORD, 0x8B, dst, HOST_BUS, NO_INDEX, table + (addr >> 8) * 8);
+    emit_reg(c, QWORD, 0x85, dst, dst);
+    bail_on(c, CC_X86_E);
+}
+
+// copies the x86 flags picked by mask into the 8080 flags, S Z AC P CY
+// sit at the same bit positions in both flags bytes
+static void store_flags(Compiler *c, uint8_t mask) {
+    static const uint8_t lahf_and_ah[] = { 0x9F, 0x80, 0xE4 };
+    static const uint8_t mov_flags_ah[] = { 0x88, 0xA3 };
+
+    emit_raw(c, lahf_and_ah, sizeof(lahf_and_ah));
+    emit8(c, mask);
+    emit_raw(c, mov_flags_ah, sizeof(mov_flags_ah));
+    emit32(c, OFF_FLAGS);
+}
+
+// INR/DCR keep the 8080 carry
+static void store_flags_keep_carry(Compiler *c) {
+    static const uint8_t lahf_and_ah[] = { 0x9F, 0x80, 0xE4, 0xD4 };
+    static const uint8_t or_al_ah[] = { 0x08, 0xE0 };
+
+    emit_raw(c, lahf_and_ah, sizeof(lahf_and_ah));
+    load8(c, RAX, HOST_CPU, NO_INDEX, OFF_FLAGS);
+    alu_ri(c, BYTE, ALU_AND, RAX, FLAG_CY);
+    emit_raw(c, or_al_ah, sizeof(or_al_ah));
+    store8(c, RAX, HOST_CPU, NO_INDEX, OFF_FLAGS);
+}
+
+// replaces only the 8080 carry with the x86 one
+static void store_carry(Compiler *c) {
+    emit_reg(c, BYTE, 0x0F92, 0, RCX);     // setc cl
+    alu_mi8(c, ALU_AND, HOST_CPU, NO_INDEX, OFF_FLAGS, (uint8_t)~FLAG_CY);
+    emit_mem(c, BYTE, 0x08, RCX, HOST_CPU, NO_INDEX, OFF_FLAGS);
+}
+
+// x86 carry = 8080 carry, for ADC SBB RAL RAR
+static void load_carry(Compiler *c) {
+    load8(c, RAX, HOST_CPU, NO_INDEX, OFF_FLAGS);
+    shift_ri(c, BYTE, SH_SHR, RAX, 1);
+}
+
+// jumps when the 8080 condition holds
+static uint8_t *jump_if(Compiler *c, ConditionCode cc) {
+    emit_mem(c, BYTE, 0xF6, 0, HOST_CPU, NO_INDEX, OFF_FLAGS);    // test
+    emit8(c, cc_flag[cc]);
+    return jcc(c, (cc & 1) ? CC_X86_NE : CC_X86_E);
+}
+
+static void exit_to(Compiler *c, uint16_t pc, uint32_t cycles) {
+    emit_mem(c, WORD, 0xC7, 0, HOST_CPU, NO_INDEX, OFF_PC);
+    emit16(c, pc);
+    lea(c, RAX, HOST_CYCLES, cycles);
+    patch(jmp(c), c->epilogue);
+}
+
+// exit with the new pc in ax
+static void exit_dynamic(Compiler *c, uint32_t cycles) {
+    emit_mem(c, WORD, 0x89, RAX, HOST_CPU, NO_INDEX, OFF_PC);
+    lea(c, RAX, HOST_CYCLES, cycles);
+    patch(jmp(c), c->epilogue);
+}
+
+// Taken jump back to the block start: runs the block again while the
+// cycles used stay below the limit the caller passed.
+static void loop_back(Compiler *c, uint32_t block_cycles) {
+    alu_ri(c, DWORD, ALU_ADD, HOST_CYCLES, block_cycles);
+    emit_mem(c, DWORD, 0x3B, HOST_CYCLES, RSP, NO_INDEX, 0);   // cmp edi, [rsp]
+    patch(jcc(c, CC_X86_B), c->body);
+    exit_to(c, c->start, 0);
+}
+
+// Pushes a 16 bit value, as registers or as an immediate when hi < 0.
+// sp - 1 and sp - 2 wrap around separately and may sit in different pages.
+static void push(Compiler *c, int hi, int lo, uint16_t imm) {
+    lea(c, RDX, HOST_SP, -1);
+    movzx_rr(c, WORD, RDX, RDX);
+    map_addr(c, OFF_WRITE, RDX, RDX);
+    lea(c, RAX, HOST_SP, -2);
+    movzx_rr(c, WORD, RAX, RAX);
+    map_addr(c, OFF_WRITE, RAX, RAX);
+
+    if (hi < 0) {
+        emit_mem(c, BYTE, 0xC6, 0, RDX, NO_INDEX, 0);
+        emit8(c, (uint8_t)(imm >> 8));
+        emit_mem(c, BYTE, 0xC6, 0, RAX, NO_INDEX, 0);
+        emit8(c, (uint8_t)imm);
+    } else {
+        store8(c, hi, RDX, NO_INDEX, 0);
+        store8(c, lo, RAX, NO_INDEX, 0);
+    }
+    alu_ri(c, WORD, ALU_SUB, HOST_SP, 2);
+}
+
+// rax = host pointer of [sp], rdx of [sp + 1]
+static void map_stack_top(Compiler *c) {
+    lea(c, RDX, HOST_SP, 1);
+    movzx_rr(c, WORD, RDX, RDX);
+    map_addr(c, OFF_READ, RDX, RDX);
+    map_addr(c, OFF_READ, RAX, HOST_SP);
+}
+
+// pops into hi/lo
+static void pop(Compiler *c, int hi, int lo) {
+    map_stack_top(c);
+    load8(c, lo, RAX, NO_INDEX, 0);
+    load8(c, hi, RDX, NO_INDEX, 0);
+    alu_ri(c, WORD, ALU_ADD, HOST_SP, 2);
+}
+
+// pops the return address into eax
+static void pop_pc(Compiler *c) {
+    map_stack_top(c);
+    emit_mem(c, BYTE, 0x0FB6, RCX, RAX, NO_INDEX, 0);
+    emit_mem(c, BYTE, 0x0FB6, RAX, RDX, NO_INDEX, 0);
+    shift_ri(c, DWORD, SH_SHL, RAX, 8);
+    alu_rr(c, DWORD, ALU_OR, RAX, RCX);
+    alu_ri(c, WORD, ALU_ADD, HOST_SP, 2);
+}
+
+// host register holding the ALU operand, memory and immediate operands
+// are loaded into cl
+static int alu_operand(Compiler *c, Register src, bool immediate, uint8_t imm) {
+    if (immediate) {
+        mov_ri8(c, RCX, imm);
+        return RCX;
+    }
+    if (src == REG_M) {
+        map_page(c, OFF_READ, RAX, R14);
+        load8(c, RCX, RAX, R15, 0);
+        return RCX;
+    }
+    return host_reg[src];
+}
+
+static void compile_alu(Compiler *c, int op, Register src, bool immediate, uint8_t imm) {
+    int ext = alu_ext[op];
+    bool flags_live = c->live_flags[c->op] != 0;
+    if (ext == ALU_CMP && !flags_live) return;
+
+    int a = host_reg[REG_A];
+    int b = alu_operand(c, src, immediate, imm);
+    if (!flags_live) {
+        if (ext == ALU_ADC || ext == ALU_SBB) load_carry(c);
+        alu_rr(c, BYTE, ext, a, b);
+        return;
+    }
+
+    switch (ext) {
+        case ALU_ADC:
+        case ALU_SBB:
+            load_carry(c);
+            // fall through
+        case ALU_ADD:
+        case ALU_SUB:
+        case ALU_CMP:
+            alu_rr(c, BYTE, ext, a, b);
+            store_flags(c, FLAG_S | FLAG_Z | FLAG_AC | FLAG_P | FLAG_CY);
+            break;
+        case ALU_AND: {
+            // the 8080 sets AC to bit 3 of either operand, dl = that AC
+            static const uint8_t lahf_and_ah[] = { 0x9F, 0x80, 0xE4, FLAG_S | FLAG_Z | FLAG_P };
+            static const uint8_t or_ah_dl[] = { 0x08, 0xD4 };
+            static const uint8_t mov_flags_ah[] = { 0x88, 0xA3 };
+
+            mov_rr(c, DWORD, RDX, b);
+            alu_rr(c, BYTE, ALU_OR, RDX, a);
+            alu_ri(c, BYTE, ALU_AND, RDX, 0x08);
+            shift_ri(c, BYTE, SH_SHL, RDX, 1);
+            alu_rr(c, BYTE, ALU_AND, a, b);
+            emit_raw(c, lahf_and_ah, sizeof(lahf_and_ah));
+            emit_raw(c, or_ah_dl, sizeof(or_ah_dl));
+            emit_raw(c, mov_flags_ah, sizeof(mov_flags_ah));
+            emit32(c, OFF_FLAGS);
+            break;
+        }
+        case ALU_OR:
+        case ALU_XOR:
+            alu_rr(c, BYTE, ext, a, b);
+            store_flags(c, FLAG_S | FLAG_Z | FLAG_P);
+            break;
+    }
+}
+
+// Flags each instruction sets and reads. A flag update that a later
+// instruction of the block overwrites before anything reads it is left
+// out of the native code.
+static uint8_t flags_written(uint8_t opcode) {
+    if ((opcode >= 0x80 && opcode < 0xC0) || (opcode & 0xC7) == 0xC6) {
+        return FLAG_MASK;                   // ALU
+    }
+    if (opcode < 0x40) {
+        switch (opcode & 0x07) {
+            case 0x04: case 0x05:           // INR DCR
+                return FLAG_MASK & ~FLAG_CY;
+        }
+        if ((opcode & 0x0F) == 0x09) {      // DAD
+            return FLAG_CY;
+        }
+    }
+    switch (opcode) {
+        case 0x07: case 0x0F: case 0x17: case 0x1F:     // rotates
+        case 0x37: case 0x3F:                           // STC CMC
+            return FLAG_CY;
+        case 0x27: case 0xF1:                           // DAA POP PSW
+            return FLAG_MASK;
+    }
+    return 0;
+}
+
+static uint8_t flags_read(uint8_t opcode) {
+    if ((opcode >= 0x88 && opcode < 0xA0) || opcode == 0xCE || opcode == 0xDE) {
+        return FLAG_CY;                     // ADC SBB
+    }
+    switch (opcode & 0xC7) {
+        case 0xC0: case 0xC2: case 0xC4:    // Rccc Jccc Cccc
+            return cc_flag[(opcode >> 3) & 7];
+    }
+    switch (opcode) {
+        case 0x17: case 0x1F: case 0x3F:    // RAL RAR CMC
+            return FLAG_CY;
+        case 0x27: case 0xF5:               // DAA PUSH PSW
+            return FLAG_MASK;
+    }
+    return 0;
+}
+
+bool jit_supports(uint8_t opcode) {
+    switch (opcode) {
+        case 0x27:  // DAA
+        case 0xD3:  // OUT
+        case 0xDB:  // IN
+        case 0xE3:  // XTHL
+        case 0xF3:  // DI
+        case 0xFB:  // EI
+            return false;
+    }
+    return true;
+}
+
+// instructions that may stop native code in front of them, every memory
+// access can hit a page without a host pointer. The interpreter then needs
+// every flag up to date.
+static bool may_bail(uint8_t opcode) {
+    if (opcode >= 0x70 && opcode < 0x78) {
+        return true;                        // MOV M,r and HLT
+    }
+    if (opcode >= 0x40 && opcode < 0xC0 && (opcode & 7) == REG_M) {
+        return true;                        // MOV r,M and ALU M
+    }
+    switch (opcode) {
+        case 0x34: case 0x35: case 0x36:                // INR M DCR M MVI M
+        case 0x02: case 0x12: case 0x22: case 0x32:     // STAX SHLD STA
+        case 0x0A: case 0x1A: case 0x2A: case 0x3A:     // LDAX LHLD LDA
+        case 0xC5: case 0xD5: case 0xE5: case 0xF5:     // PUSH
+        case 0xC1: case 0xD1: case 0xE1: case 0xF1:     // POP
+        case 0xCD: case 0xDD: case 0xED: case 0xFD:     // CALL
+        case 0xC9: case 0xD9:                           // RET
+            return true;
+    }
+    switch (opcode & 0xC7) {
+        case 0xC0: case 0xC4: case 0xC7:    // Rccc Cccc RST
+            return true;
+    }
+    return !jit_supports(opcode);
+}
+
+// Compiles one instruction, returns false once the block is done: after
+// a block ender, or in front of an instruction left to the interpreter.
+static bool compile_op(Compiler *c, Bus *bus, uint16_t pc) {
+    uint8_t opcode = bus_peek(bus, pc);
+    uint8_t length = opcode_length(opcode);
+    uint16_t next_pc = pc + length;
+    uint8_t imm8 = bus_peek(bus, pc + 1);
+    uint16_t imm16 = lb_hb_to_uint16(imm8, bus_peek(bus, pc + 2));
+    uint32_t before = c->op_before[c->op];
+    uint32_t done = before + op_cycles[opcode];
+    int hi, lo;
+
+    if (!jit_supports(opcode)) {
+        Fixup *fixup = &c->fixups[c->fixup_count++];
+        fixup->at = jmp(c);
+        fixup->op = c->op;
+        return false;
+    }
+
+    // MOV  01DDDSSS
+    if (opcode >= 0x40 && opcode < 0x80 && opcode != 0x76) {
+        Register dst = (opcode >> 3) & 7;
+        Register src = opcode & 7;
+        if (dst == REG_M) {
+            map_page(c, OFF_WRITE, RAX, R14);
+            store8(c, host_reg[src], RAX, R15, 0);
+        } else if (src == REG_M) {
+            map_page(c, OFF_READ, RAX, R14);
+            load8(c, host_reg[dst], RAX, R15, 0);
+        } else if (dst != src) {
+            mov_rr(c, BYTE, host_reg[dst], host_reg[src]);
+        }
+        return true;
+    }
+
+    // ALU  10OOOSSS
+    if (opcode >= 0x80 && opcode < 0xC0) {
+        compile_alu(c, (opcode >> 3) & 7, opcode & 7, false, 0);
+        return true;
+    }
+
+    // ALU immediate  11OOO110 db
+    if ((opcode & 0xC7) == 0xC6) {
+        compile_alu(c, (opcode >> 3) & 7, REG_A, true, imm8);
+        return true;
+    }
+
+    if (opcode < 0x40) {
+        Register reg = (opcode >> 3) & 7;
+        RegisterPair rp = (opcode >> 4) & 3;
+        rp_regs(rp, &hi, &lo);
+
+        switch (opcode & 0x0F) {
+            case 0x01:  // LXI
+                if (rp == RP_SP) {
+                    mov_ri32(c, HOST_SP, imm16);
+                } else {
+                    mov_ri32(c, hi, imm16 >> 8);
+                    mov_ri32(c, lo, imm16 & 0xFF);
+                }
+                return true;
+            case 0x03:  // INX
+            case 0x0B:  // DCX
+                if (rp == RP_SP) {
+                    emit_reg(c, WORD, 0xFF, (opcode & 0x08) ? 1 : 0, HOST_SP);
+                } else {
+                    alu_ri(c, BYTE, (opcode & 0x08) ? ALU_SUB : ALU_ADD, lo, 1);
+                    alu_ri(c, BYTE, (opcode & 0x08) ? ALU_SBB : ALU_ADC, hi, 0);
+                }
+                return true;
+            case 0x09:  // DAD
+                if (rp == RP_SP) {
+                    mov_rr(c, DWORD, RDX, HOST_SP);
+                } else {
+                    pair_value(c, RDX, hi, lo);
+                }
+                pair_value(c, RAX, R14, R15);
+                alu_rr(c, WORD, ALU_ADD, RAX, RDX);
+                if (c->live_flags[c->op] & FLAG_CY) {
+                    store_carry(c);
+                }
+                mov_rr(c, BYTE, R15, RAX);
+                shift_ri(c, DWORD, SH_SHR, RAX, 8);
+                mov_rr(c, BYTE, R14, RAX);
+                return true;
+        }
+
+        switch (opcode & 0x07) {
+            case 0x04:  // INR
+            case 0x05:  // DCR
+                if (reg == REG_M) {
+                    // RAM is the only kind of page mapped for writes,
+                    // it reads back through the same pointer
+                    map_page(c, OFF_WRITE, RAX, R14);
+                    emit_mem(c, BYTE, 0xFE, opcode & 1, RAX, R15, 0);
+                } else {
+                    emit_reg(c, BYTE, 0xFE, opcode & 1, host_reg[reg]);
+                }
+                if (c->live_flags[c->op] & ~FLAG_CY) {
+                    store_flags_keep_carry(c);
+                }
+                return true;
+            case 0x06:  // MVI
+                if (reg == REG_M) {
+                    map_page(c, OFF_WRITE, RAX, R14);
+                    emit_mem(c, BYTE, 0xC6, 0, RAX, R15, 0);
+                    emit8(c, imm8);
+                } else {
+                    mov_ri8(c, host_reg[reg], imm8);
+                }
+                return true;
+        }
+
+        int a = host_reg[REG_A];
+        switch (opcode) {
+            case 0x02: case 0x12:   // STAX
+                map_page(c, OFF_WRITE, RAX, hi);
+                store8(c, a, RAX, lo, 0);
+                return true;
+            case 0x0A: case 0x1A:   // LDAX
+                map_page(c, OFF_READ, RAX, hi);
+                load8(c, a, RAX, lo, 0);
+                return true;
+            case 0x22:              // SHLD
+                map_const(c, OFF_WRITE, RAX, imm16);
+                map_const(c, OFF_WRITE, RDX, imm16 + 1);
+                store8(c, R15, RAX, NO_INDEX, imm16 & 0xFF);
+                store8(c, R14, RDX, NO_INDEX, (imm16 + 1) & 0xFF);
+                return true;
+            case 0x2A:              // LHLD
+                map_const(c, OFF_READ, RAX, imm16);
+                map_const(c, OFF_READ, RDX, imm16 + 1);
+                load8(c, R15, RAX, NO_INDEX, imm16 & 0xFF);
+                load8(c, R14, RDX, NO_INDEX, (imm16 + 1) & 0xFF);
+                return true;
+            case 0x32:              // STA
+                map_const(c, OFF_WRITE, RAX, imm16);
+                store8(c, a, RAX, NO_INDEX, imm16 & 0xFF);
+                return true;
+            case 0x3A:              // LDA
+                map_const(c, OFF_READ, RAX, imm16);
+                load8(c, a, RAX, NO_INDEX, imm16 & 0xFF);
+                return true;
+            case 0x07:              // RLC
+            case 0x0F:              // RRC
+                shift_ri(c, BYTE, opcode == 0x07 ? SH_ROL : SH_ROR, a, 1);
+                if (c->live_flags[c->op] & FLAG_CY) {
+                    store_carry(c);
+                }
+                return true;
+            case 0x17:              // RAL
+            case 0x1F:              // RAR
+                load_carry(c);
+                shift_ri(c, BYTE, opcode == 0x17 ? SH_RCL : SH_RCR, a, 1);
+                if (c->live_flags[c->op] & FLAG_CY) {
+                    store_carry(c);
+                }
+                return true;
+            case 0x2F:              // CMA
+                emit_reg(c, BYTE, 0xF6, 2, a);
+                return true;
+            case 0x37:              // STC
+                alu_mi8(c, ALU_OR, HOST_CPU, NO_INDEX, OFF_FLAGS, FLAG_CY);
+                return true;
+            case 0x3F:              // CMC
+                alu_mi8(c, ALU_XOR, HOST_CPU, NO_INDEX, OFF_FLAGS, FLAG_CY);
+                return true;
+        }
+
+        // NOP and its undocumented aliases
+        return true;
+    }
+
+    if (opcode == 0x76) {   // HLT
+        emit_mem(c, BYTE, 0xC6, 0, HOST_CPU, NO_INDEX, OFF_HALTED);
+        emit8(c, 1);
+        exit_to(c, next_pc, done);
+        return false;
+    }
+
+    ConditionCode cc = (opcode >> 3) & 7;
+    rp_regs((opcode >> 4) & 3, &hi, &lo);
+
+    switch (opcode & 0xC7) {
+        case 0xC0: {    // Rccc
+            uint8_t *taken = jump_if(c, cc);
+            exit_to(c, next_pc, done);
+            patch(taken, c->p);
+            pop_pc(c);
+            exit_dynamic(c, before + op_taken_cycles[opcode]);
+            return false;
+        }
+        case 0xC2: {    // Jccc
+            uint8_t *taken = jump_if(c, cc);
+            exit_to(c, next_pc, done);
+            patch(taken, c->p);
+            if (imm16 == c->start) {
+                loop_back(c, done);
+            } else {
+                exit_to(c, imm16, done);
+            }
+            return false;
+        }
+        case 0xC4: {    // Cccc
+            uint8_t *taken = jump_if(c, cc);
+            exit_to(c, next_pc, done);
+            patch(taken, c->p);
+            push(c, -1, -1, next_pc);
+            exit_to(c, imm16, before + op_taken_cycles[opcode]);
+            return false;
+        }
+        case 0xC7:      // RST
+            push(c, -1, -1, next_pc);
+            exit_to(c, opcode & 0x38, done);
+            return false;
+    }
+
+    switch (opcode) {
+        case 0xC1: case 0xD1: case 0xE1:    // POP
+            pop(c, hi, lo);
+            return true;
+        case 0xF1:                          // POP PSW
+            pop(c, host_reg[REG_A], RCX);
+            alu_ri(c, BYTE, ALU_AND, RCX, FLAG_MASK);
+            store8(c, RCX, HOST_CPU, NO_INDEX, OFF_FLAGS);
+            return true;
+        case 0xC5: case 0xD5: case 0xE5:    // PUSH
+            push(c, hi, lo, 0);
+            return true;
+        case 0xF5:                          // PUSH PSW
+            load8(c, RCX, HOST_CPU, NO_INDEX, OFF_FLAGS);
+            alu_ri(c, BYTE, ALU_OR, RCX, FLAG_ALWAYS_ONE);
+            push(c, host_reg[REG_A], RCX, 0);
+            return true;
+        case 0xC3: case 0xCB:               // JMP
+            if (imm16 == c->start) {
+                loop_back(c, done);
+            } else {
+                exit_to(c, imm16, done);
+            }
+            return false;
+        case 0xC9: case 0xD9:               // RET
+            pop_pc(c);
+            exit_dynamic(c, done);
+            return false;
+        case 0xCD: case 0xDD: case 0xED: case 0xFD: // CALL
+            push(c, -1, -1, next_pc);
+            exit_to(c, imm16, done);
+            return false;
+        case 0xE9:                          // PCHL
+            pair_value(c, RAX, R14, R15);
+            exit_dynamic(c, done);
+            return false;
+        case 0xEB:                          // XCHG
+            emit_reg(c, DWORD, 0x87, R11, R14);
+            emit_reg(c, DWORD, 0x87, R13, R15);
+            return true;
+        case 0xF9:                          // SPHL
+            pair_value(c, HOST_SP, R14, R15);
+            return true;
+    }
+
+    return true;
+}
+
+static void emit_epilogue(Compiler *c) {
+    static const uint8_t pops[] = {
+        0x59,           // pop rcx, drops the cycle limit
+        0x41, 0x5F,     // pop r15
+        0x41, 0x5E,     // pop r14
+        0x41, 0x5D,     // pop r13
+        0x41, 0x5C,     // pop r12
+        0x5D,           // pop rbp
+        0x5B,           // pop rbx
+        0xC3,           // ret
+    };
+
+    for (Register r = REG_B; r <= REG_A; r++) {
+        if (r == REG_M) continue;
+        store8(c, host_reg[r], HOST_CPU, NO_INDEX, reg_offset[r]);
+    }
+    emit_mem(c, WORD, 0x89, HOST_SP, HOST_CPU, NO_INDEX, OFF_SP);
+    emit_raw(c, pops, sizeof(pops));
+}
+
+static void emit_prologue(Compiler *c) {
+    static const uint8_t pushes[] = {
+        0x53,           // push rbx
+        0x55,           // push rbp
+        0x41, 0x54,     // push r12
+        0x41, 0x55,     // push r13
+        0x41, 0x56,     // push r14
+        0x41, 0x57,     // push r15
+        0x56,           // push rsi, the cycle limit
+    };
+
+    emit_raw(c, pushes, sizeof(pushes));
+    mov_rr(c, QWORD, HOST_CPU, RDI);
+    emit_mem(c, QWORD, 0x8B, HOST_BUS, HOST_CPU, NO_INDEX, offsetof(CpuState, bus));
+    for (Register r = REG_B; r <= REG_A; r++) {
+        if (r == REG_M) continue;
+        emit_mem(c, BYTE, 0x0FB6, host_reg[r], HOST_CPU, NO_INDEX, reg_offset[r]);
+    }
+    emit_mem(c, DWORD, 0x0FB7, HOST_SP, HOST_CPU, NO_INDEX, OFF_SP);
+    alu_rr(c, DWORD, ALU_XOR, HOST_CYCLES, HOST_CYCLES);
+}
+
+// Pages of the buffer are writable or executable, never both. The pages
+// from `from` to the end of a block's reserve are RW only while code is
+// emitted and patched there, RX after.
+static bool set_writable(Jit *jit, uint8_t *from, bool writable) {
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uint8_t *first = (uint8_t *)((uintptr_t)from & ~(page - 1));
+    uint8_t *end = from + JIT_MAX_BLOCK_CODE;
+    if (end > jit->code + jit->size) end = jit->code + jit->size;
+    return mprotect(first, end - first, writable ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC) == 0;
+}
+
+Jit *jit_create(size_t code_size) {
+    Jit *jit = calloc(1, sizeof(Jit));
+    if (!jit) return NULL;
+
+    void *code = mmap(NULL, code_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) {
+        free(jit);
+        return NULL;
+    }
+
+    jit->code = code;
+    jit->size = code_size;
+    jit_reset(jit);
+    if (!jit->epilogue) {
+        jit_destroy(jit);
+        return NULL;
+    }
+    return jit;
+}
+
+void jit_destroy(Jit *jit) {
+    if (!jit) return;
+    munmap(jit->code, jit->size);
+    free(jit);
+}
+
+void jit_reset(Jit *jit) {
+    // only the start gets rewritten, the rest turns RW again once blocks
+    // are compiled over it
+    jit->epilogue = NULL;
+    jit->used = jit->size;
+    if (!set_writable(jit, jit->code, true)) return;
+
+    Compiler c = { .p = jit->code };
+    emit_epilogue(&c);
+    if (!set_writable(jit, jit->code, false)) return;
+    jit->epilogue = jit->code;
+    jit->used = c.p - jit->code;
+}
+
+JitBlockFn jit_compile(Jit *jit, Bus *bus, uint16_t start, int op_count) {
+    if (jit->size - jit->used < JIT_MAX_BLOCK_CODE) return NULL;
+    if (op_count > JIT_MAX_OPS) op_count = JIT_MAX_OPS;
+
+    // code is decoded ahead of execution, which only sees what the cpu
+    // would fetch on host memory, devices are left to the interpreter
+    uint16_t pc = start;
+    for (int i = 0; i < op_count; i++) {
+        uint8_t length = opcode_length(bus_peek(bus, pc));
+        if (!bus_in_host_memory(bus, pc, 1) || !bus_in_host_memory(bus, pc, length)) {
+            op_count = i;
+            break;
+        }
+        pc += length;
+    }
+    if (op_count == 0) return NULL;
+    if (!set_writable(jit, jit->code + jit->used, true)) return NULL;
+
+    Compiler c = {
+        .p = jit->code + jit->used,
+        .epilogue = jit->epilogue,
+        .start = start,
+    };
+    uint8_t *entry = c.p;
+
+    // addresses and cycle offsets of every instruction, bail stubs need them
+    pc = start;
+    uint32_t cycles = 0;
+    for (int i = 0; i < op_count; i++) {
+        uint8_t opcode = bus_peek(bus, pc);
+        c.op_pc[i] = pc;
+        c.op_before[i] = cycles;
+        cycles += op_cycles[opcode];
+        pc += opcode_length(opcode);
+    }
+
+    uint8_t live = FLAG_MASK;
+    for (int i = op_count - 1; i >= 0; i--) {
+        uint8_t opcode = bus_peek(bus, c.op_pc[i]);
+        c.live_flags[i] = live;
+        live = (live & ~flags_written(opcode)) | flags_read(opcode);
+        if (may_bail(opcode)) {
+            live = FLAG_MASK;
+        }
+    }
+
+    emit_prologue(&c);
+    c.body = c.p;
+
+    bool open = true;
+    for (c.op = 0; c.op < op_count && open; c.op++) {
+        open = compile_op(&c, bus, c.op_pc[c.op]);
+    }
+    if (open) {
+        // cut short, continue after the last instruction
+        exit_to(&c, pc, cycles);
+    }
+
+    // bail stubs, one per instruction that can bail
+    for (int i = 0; i < c.fixup_count; i++) {
+        int op = c.fixups[i].op;
+        if (!c.fixups[i].at) continue;
+
+        uint8_t *stub = c.p;
+        emit_mem(&c, WORD, 0xC7, 0, HOST_CPU, NO_INDEX, OFF_PC);
+        emit16(&c, c.op_pc[op]);
+        lea(&c, RAX, HOST_CYCLES, c.op_before[op]);
+        alu_ri(&c, DWORD, ALU_OR, RAX, JIT_BAIL);
+        patch(jmp(&c), c.epilogue);
+
+        for (int j = i; j < c.fixup_count; j++) {
+            if (c.fixups[j].at && c.fixups[j].op == op) {
+                patch(c.fixups[j].at, stub);
+                c.fixups[j].at = NULL;
+            }
+        }
+    }
+
+    if (!set_writable(jit, entry, false)) return NULL;
+    jit->used = c.p - jit->code;
+    return (JitBlockFn)(void *)entry;
+}
+
+#else
+
+Jit *jit_create(size_t code_size) {
+    (void)code_size;
+    return NULL;
+}
+
+void jit_destroy(Jit *jit) {
+    (void)jit;
+}
+
+void jit_reset(Jit *jit) {
+    (void)jit;
+}
+
+bool jit_supports(uint8_t opcode) {
+    (void)opcode;
+    return false;
+}
+
+JitBlockFn jit_compile(Jit *jit, Bus *bus, uint16_t start, int op_count) {
+    (void)jit;
+    (void)bus;
+    (void)start;
+    (void)op_count;
+    return NULL;
+}
+
+#endif
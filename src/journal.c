@@ -0,0 +1,159 @@
+#include "journal.h"
+#include "cpu_ops.h"
+#include <string.h>
+
+Journal *journal_create(size_t capacity, uint64_t checkpoint_interval) {
+    Journal *journal = calloc(1, sizeof(Journal));
+    if (!journal) return NULL;
+
+    journal->entries = malloc(capacity * sizeof(JournalEntry));
+    if (!journal->entries && capacity) {
+        free(journal);
+        return NULL;
+    }
+    journal->capacity = capacity;
+    journal->checkpoint_interval = checkpoint_interval;
+    return journal;
+}
+
+void journal_destroy(Journal *journal) {
+    if (!journal) return;
+    for (int i = 0; i < journal->checkpoint_count; i++) {
+        snapshot_free(journal->checkpoints[i]);
+    }
+    free(journal->entries);
+    free(journal);
+}
+
+static void checkpoint(Journal *journal, CpuState *cpu) {
+    Snapshot *snap = cpu_snapshot(cpu);
+    if (!snap) return;
+
+    if (journal->checkpoint_count == JOURNAL_CHECKPOINTS) {
+        snapshot_free(journal->checkpoints[0]);
+        memmove(journal->checkpoints, journal->checkpoints + 1, (JOURNAL_CHECKPOINTS - 1) * sizeof(Snapshot *));
+        journal->checkpoint_count--;
+    }
+    journal->checkpoints[journal->checkpoint_count++] = snap;
+    journal->next_checkpoint = cpu->cycle + journal->checkpoint_interval;
+}
+
+int journal_step(Journal *journal, CpuState *cpu) {
+    if (journal->checkpoint_interval && cpu->cycle >= journal->next_checkpoint) {
+        checkpoint(journal, cpu);
+    }
+
+    JournalEntry entry = {
+        .a = cpu->a, .b = cpu->b, .c = cpu->c, .d = cpu->d,
+        .e = cpu->e, .h = cpu->h, .l = cpu->l, .flags = cpu->flags,
+        .sp = cpu->sp, .pc = cpu->pc,
+        .state = (cpu->halted ? JOURNAL_HALTED : 0) | (cpu->interruptible ? JOURNAL_INTERRUPTIBLE : 0),
+    };
+
+    // only RAM is saved, reading a device could change it
+    uint16_t addr = 0;
+    int count = cpu_store_span(cpu, bus_peek(cpu->bus, cpu->pc), &addr);
+    entry.store_addr = addr;
+    for (int i = 0; i < count; i++) {
+        uint16_t at = addr + i;
+        const uint8_t *ram = bus_page_ram(cpu->bus, at >> 8);
+        if (ram) {
+            entry.old[i] = ram[at & 0xFF];
+            entry.state |= JOURNAL_OLD0 << i;
+        }
+    }
+
+    int cycles = cpu_step(cpu);
+    cpu->cycle += cycles;
+    entry.cycles = cycles;
+
+    if (journal->capacity) {
+        journal->entries[journal->head] = entry;
+        journal->head = (journal->head + 1) % journal->capacity;
+        if (journal->count < journal->capacity) journal->count++;
+    }
+    return cycles;
+}
+
+uint64_t journal_run(Journal *journal, CpuState *cpu, uint64_t cycle_budget) {
+    uint64_t cycles = 0;
+    while (cycles < cycle_budget && !cpu->halted) {
+        cycles += journal_step(journal, cpu);
+    }
+    return cycles;
+}
+
+bool journal_step_back(Journal *journal, CpuState *cpu) {
+    if (!journal->count) return false;
+
+    journal->head = (journal->head + journal->capacity - 1) % journal->capacity;
+    journal->count--;
+    const JournalEntry *entry = &journal->entries[journal->head];
+
+    for (int i = 0; i < 2; i++) {
+        if (entry->state & (JOURNAL_OLD0 << i)) {
+            bus_write(cpu->bus, entry->store_addr + i, entry->old[i]);
+        }
+    }
+
+    cpu->a = entry->a;
+    cpu->b = entry->b;
+    cpu->c = entry->c;
+    cpu->d = entry->d;
+    cpu->e = entry->e;
+    cpu->h = entry->h;
+    cpu->l = entry->l;
+    cpu->flags = entry->flags;
+    cpu->sp = entry->sp;
+    cpu->pc = entry->pc;
+    cpu->halted = entry->state & JOURNAL_HALTED;
+    cpu->interruptible = entry->state & JOURNAL_INTERRUPTIBLE;
+    cpu->cycle -= entry->cycles;
+    return true;
+}
+
+// cycle the oldest record in the ring starts at
+static uint64_t ring_start(const Journal *journal, const CpuState *cpu) {
+    uint64_t cycle = cpu->cycle;
+    for (size_t i = 0; i < journal->count; i++) {
+        cycle -= journal->entries[(journal->head + journal->capacity - 1 - i) % journal->capacity].cycles;
+    }
+    return cycle;
+}
+
+bool journal_rewind(Journal *journal, CpuState *cpu, uint64_t cycles) {
+    if (cycles > cpu->cycle) return false;
+    uint64_t target = cpu->cycle - cycles;
+
+    if (target < ring_start(journal, cpu)) {
+        // the newest checkpoint at or before target, then replay up to it
+        int i = journal->checkpoint_count - 1;
+        while (i >= 0 && journal->checkpoints[i]->cpu.cycle > target) i--;
+        if (i < 0) return false;
+
+        cpu_restore(cpu, journal->checkpoints[i]);
+        for (int j = i + 1; j < journal->checkpoint_count; j++) {
+            snapshot_free(journal->checkpoints[j]);
+        }
+        journal->checkpoint_count = i + 1;
+        journal->next_checkpoint = cpu->cycle + journal->checkpoint_interval;
+        journal->head = journal->count = 0;
+
+        while (cpu->cycle < target && !cpu->halted) {
+            journal_step(journal, cpu);
+        }
+    }
+
+    while (cpu->cycle > target && journal_step_back(journal, cpu)) {
+    }
+
+    // checkpoints past the present would describe a future that may not
+    // happen again
+    while (journal->checkpoint_count && journal->checkpoints[journal->checkpoint_count - 1]->cpu.cycle > cpu->cycle) {
+        snapshot_free(journal->checkpoints[--journal->checkpoint_count]);
+    }
+    journal->next_checkpoint = journal->checkpoint_count
+        ? journal->checkpoints[journal->checkpoint_count - 1]->cpu.cycle + journal->checkpoint_interval
+        : cpu->cycle;
+    return true;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "cpu.h"
+#include "snapshot.h"
+
+// Reverse execution. journal_step runs one instruction through cpu_step
+// and appends an undo record to a bounded ring: the registers before it
+// and the RAM bytes it is about to overwrite. Stepping back pops records,
+// rewinding further than the ring reaches restores the newest checkpoint
+// old enough and replays forward from it, so a rewind replays at most one
+// checkpoint interval.
+//
+// The journal is a separate way of stepping the cpu, cpu_run and the
+// other cores do not know about it and cost nothing extra. Stores to
+// devices, IN / OUT and interrupts raised between steps are not undone,
+// replaying from a checkpoint assumes they do not change the outcome.
+
+typedef struct {
+    uint8_t a, b, c, d, e, h, l, flags;
+    uint16_t sp, pc;
+    uint16_t store_addr;
+    uint8_t old[2];         // RAM bytes at store_addr before the store
+    uint8_t cycles;
+    uint8_t state;          // JOURNAL_* bits
+} JournalEntry;
+
+#define JOURNAL_HALTED          0x01
+#define JOURNAL_INTERRUPTIBLE   0x02
+#define JOURNAL_OLD0            0x04    // old[0] holds a saved byte
+#define JOURNAL_OLD1            0x08
+
+#define JOURNAL_CHECKPOINTS 8
+
+typedef struct {
+    JournalEntry *entries;
+    size_t capacity;
+    size_t head;            // next slot to write
+    size_t count;
+
+    // checkpoints[0] is the oldest, taken every checkpoint_interval cycles
+    Snapshot *checkpoints[JOURNAL_CHECKPOINTS];
+    int checkpoint_count;
+    uint64_t checkpoint_interval;
+    uint64_t next_checkpoint;
+} Journal;
+
+// capacity is the number of instructions the ring holds, a
+// checkpoint_interval of 0 takes no checkpoints. Returns NULL when out
+// of memory.
+Journal *journal_create(size_t capacity, uint64_t checkpoint_interval);
+void journal_destroy(Journal *journal);
+
+// cpu_step with an undo record, also adds the cycles to cpu->cycle
+int journal_step(Journal *journal, CpuState *cpu);
+
+// same contract as cpu_run, one journal_step at a time
+uint64_t journal_run(Journal *journal, CpuState *cpu, uint64_t cycle_budget);
+
+// undoes the last instruction, false when the ring is empty
+bool journal_step_back(Journal *journal, CpuState *cpu);
+
+// goes back to the last instruction boundary at or before cpu->cycle -
+// cycles. False, with nothing changed, when that is older than both the
+// ring and the oldest checkpoint.
+bool journal_rewind(Journal *journal, CpuState *cpu, uint64_t cycles);
@@ -0,0 +1,341 @@
+#include "loader.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const uint8_t i80_magic[4] = {'I', '8', '0', 0x1A};
+
+#define I80_VERSION 1
+#define I80_HEADER_SIZE 12
+#define I80_SEGMENT_SIZE 12
+
+static uint16_t get16(const uint8_t *p) {
+    return p[0] | p[1] << 8;
+}
+
+static uint32_t get32(const uint8_t *p) {
+    return get16(p) | (uint32_t)get16(p + 2) << 16;
+}
+
+static void put16(uint8_t *p, uint16_t val) {
+    p[0] = val;
+    p[1] = val >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t val) {
+    put16(p, val);
+    put16(p + 2, val >> 16);
+}
+
+static bool has_extension(const char *path, const char *ext) {
+    const char *dot = strrchr(path, '.');
+    return dot && strcasecmp(dot + 1, ext) == 0;
+}
+
+static bool add_segment(Image *image, uint16_t origin, uint32_t len, bool rom, const uint8_t *bytes) {
+    ImageSegment *grown = realloc(image->segments, (image->segment_count + 1) * sizeof(ImageSegment));
+    if (!grown) return false;
+    image->segments = grown;
+    image->segments[image->segment_count++] = (ImageSegment){
+        .origin = origin, .len = len, .rom = rom, .bytes = bytes
+    };
+    return true;
+}
+
+static bool load_raw(Image *image, const uint8_t *data, size_t len, uint16_t origin) {
+    if (origin + len > MEM_SIZE) {
+        fprintf(stderr, "ERROR: %zu bytes do not fit at 0x%04X\n", len, origin);
+        return false;
+    }
+    image->entry = origin;
+    return len == 0 || add_segment(image, origin, len, false, data);
+}
+
+static bool load_legacy(Image *image, const uint8_t *data, size_t len) {
+    size_t count;
+    if (len < sizeof(size_t)) {
+        fprintf(stderr, "ERROR: truncated byte count\n");
+        return false;
+    }
+    memcpy(&count, data, sizeof(size_t));
+    if (count > len - sizeof(size_t)) {
+        fprintf(stderr, "ERROR: byte count %zu past the end of the file\n", count);
+        return false;
+    }
+    return load_raw(image, data + sizeof(size_t), count, 0);
+}
+
+static bool load_i80(Image *image, const uint8_t *data, size_t len) {
+    if (len < I80_HEADER_SIZE || get16(data + 4) != I80_VERSION) {
+        fprintf(stderr, "ERROR: unsupported image version\n");
+        return false;
+    }
+    image->entry = get16(data + 6);
+    size_t count = get16(data + 8);
+
+    if (I80_HEADER_SIZE + count * I80_SEGMENT_SIZE > len) {
+        fprintf(stderr, "ERROR: truncated segment table\n");
+        return false;
+    }
+    for (size_t i = 0; i < count; i++) {
+        const uint8_t *entry = data + I80_HEADER_SIZE + i * I80_SEGMENT_SIZE;
+        uint16_t origin = get16(entry);
+        uint16_t flags = get16(entry + 2);
+        uint32_t seg_len = get32(entry + 4);
+        uint32_t offset = get32(entry + 8);
+
+        if (offset > len || seg_len > len - offset || origin + seg_len > MEM_SIZE) {
+            fprintf(stderr, "ERROR: segment %zu out of bounds\n", i);
+            return false;
+        }
+        if (!add_segment(image, origin, seg_len, flags & IMAGE_SEGMENT_ROM, data + offset)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static int hex_digit(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+static bool looks_like_hex(const uint8_t *data, size_t len) {
+    if (len == 0 || data[0] != ':') return false;
+    for (size_t i = 0; i < len; i++) {
+        if (data[i] != ':' && data[i] != '\r' && data[i] != '\n' && hex_digit(data[i]) < 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// one Intel HEX record without the colon, returns its byte count or -1
+static int hex_record(const uint8_t *text, size_t len, uint8_t *record) {
+    int count = 0;
+    uint8_t sum = 0;
+
+    for (size_t i = 0; i + 1 < len; i += 2) {
+        int hi = hex_digit(text[i]);
+        int lo = hex_digit(text[i + 1]);
+        if (hi < 0 || lo < 0) break;
+        record[count] = hi << 4 | lo;
+        sum += record[count++];
+    }
+    if (count < 5 || count != record[0] + 5 || sum != 0) return -1;
+    return count;
+}
+
+static bool load_hex(Image *image, const uint8_t *data, size_t len) {
+    image->decoded = calloc(MEM_SIZE, 1);
+    bool *present = calloc(MEM_SIZE, sizeof(bool));
+    if (!image->decoded || !present) {
+        free(present);
+        return false;
+    }
+
+    bool ok = true;
+    bool done = false;
+    int line = 0;
+    const uint8_t *p = data;
+    const uint8_t *end = data + len;
+
+    while (ok && !done && p < end) {
+        const uint8_t *eol = memchr(p, '\n', end - p);
+        if (!eol) eol = end;
+        line++;
+
+        size_t line_len = eol - p;
+        if (line_len && p[line_len - 1] == '\r') line_len--;
+
+        if (line_len) {
+            uint8_t record[5 + 255];
+            int count = line_len <= 1 + 2 * sizeof(record) && p[0] == ':'
+                ? hex_record(p + 1, line_len - 1, record) : -1;
+
+            if (count < 0) {
+                ok = false;
+            } else {
+                uint8_t n = record[0];
+                uint32_t addr = record[1] << 8 | record[2];
+                const uint8_t *bytes = record + 4;
+
+                switch (record[3]) {
+                    case 0x00:  // data
+                        if (addr > MEM_SIZE - n) {
+                            ok = false;
+                            break;
+                        }
+                        memcpy(image->decoded + addr, bytes, n);
+                        memset(present + addr, true, n);
+                        break;
+                    case 0x01:  // end of file
+                        done = true;
+                        break;
+                    case 0x02:  // extended segment address
+                    case 0x04:  // extended linear address
+                        // only a base of 0 is within the 8080's 64K
+                        ok = n == 2 && bytes[0] == 0 && bytes[1] == 0;
+                        break;
+                    case 0x03:  // start segment address, CS:IP
+                        ok = n == 4;
+                        image->entry = ((bytes[0] << 8 | bytes[1]) << 4) + (bytes[2] << 8 | bytes[3]);
+                        break;
+                    case 0x05:  // start linear address
+                        ok = n == 4;
+                        image->entry = bytes[2] << 8 | bytes[3];
+                        break;
+                    default:
+                        ok = false;
+                }
+            }
+        }
+        p = eol + 1;
+    }
+
+    if (!ok) {
+        fprintf(stderr, "ERROR: invalid Intel HEX record on line %d\n", line);
+    }
+
+    // every run of loaded bytes becomes a segment
+    for (uint32_t addr = 0; ok && addr < MEM_SIZE; addr++) {
+        if (!present[addr]) continue;
+        uint32_t start = addr;
+        while (addr < MEM_SIZE && present[addr]) addr++;
+        ok = add_segment(image, start, addr - start, false, image->decoded + start);
+    }
+
+    free(present);
+    return ok;
+}
+
+bool image_load(const char *path, ImageFormat format, uint16_t origin, Image *out) {
+    *out = (Image){0};
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "ERROR: could not open %s\n", path);
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return false;
+    }
+
+    size_t len = st.st_size;
+    const uint8_t *data = NULL;
+    if (len) {
+        void *map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+            fprintf(stderr, "ERROR: could not map %s\n", path);
+            close(fd);
+            return false;
+        }
+        out->map = map;
+        out->map_len = len;
+        data = map;
+    }
+    close(fd);
+
+    if (format == IMAGE_AUTO) {
+        size_t legacy_len = 0;
+        if (len >= sizeof(size_t)) memcpy(&legacy_len, data, sizeof(size_t));
+
+        if (len >= sizeof(i80_magic) && memcmp(data, i80_magic, sizeof(i80_magic)) == 0) {
+            format = IMAGE_I80;
+        } else if (has_extension(path, "hex") || has_extension(path, "ihx") || looks_like_hex(data, len)) {
+            format = IMAGE_HEX;
+        } else if (has_extension(path, "com")) {
+            format = IMAGE_RAW;
+            if (!origin) origin = 0x100;
+        } else if (!origin && len >= sizeof(size_t) && legacy_len == len - sizeof(size_t)) {
+            format = IMAGE_LEGACY;
+        } else {
+            format = IMAGE_RAW;
+        }
+    }
+
+    bool ok = false;
+    switch (format) {
+        case IMAGE_RAW:    ok = load_raw(out, data, len, origin); break;
+        case IMAGE_HEX:    ok = load_hex(out, data, len); break;
+        case IMAGE_I80:    ok = load_i80(out, data, len); break;
+        case IMAGE_LEGACY: ok = load_legacy(out, data, len); break;
+        case IMAGE_AUTO:   break;
+    }
+
+    if (!ok) {
+        fprintf(stderr, "ERROR: could not load %s\n", path);
+        image_free(out);
+    }
+    return ok;
+}
+
+void image_free(Image *image) {
+    if (image->map) {
+        munmap(image->map, image->map_len);
+    }
+    free(image->decoded);
+    free(image->segments);
+    *image = (Image){0};
+}
+
+void image_map(const Image *image, Bus *bus, uint8_t *ram) {
+    for (size_t i = 0; i < image->segment_count; i++) {
+        const ImageSegment *seg = &image->segments[i];
+        size_t start = seg->origin;
+        size_t end = start + seg->len;
+
+        size_t rom_start = start, rom_end = start;
+        if (seg->rom) {
+            rom_start = (start + BUS_PAGE_SIZE - 1) & ~(size_t)(BUS_PAGE_SIZE - 1);
+            rom_end = end & ~(size_t)(BUS_PAGE_SIZE - 1);
+            if (rom_end < rom_start) rom_end = rom_start;
+        }
+
+        if (rom_end > rom_start) {
+            bus_map_rom(bus, rom_start, rom_end - rom_start, seg->bytes + (rom_start - start));
+        }
+        memcpy(ram + start, seg->bytes, rom_start - start);
+        memcpy(ram + rom_end, seg->bytes + (rom_end - start), end - rom_end);
+    }
+}
+
+bool image_save(const char *path, const Image *image) {
+    FILE *f = fopen(path, "wb");
+    if (!f) return false;
+
+    uint8_t header[I80_HEADER_SIZE] = {0};
+    memcpy(header, i80_magic, sizeof(i80_magic));
+    put16(header + 4, I80_VERSION);
+    put16(header + 6, image->entry);
+    put16(header + 8, image->segment_count);
+    bool ok = fwrite(header, sizeof(header), 1, f) == 1;
+
+    uint32_t offset = I80_HEADER_SIZE + image->segment_count * I80_SEGMENT_SIZE;
+    for (size_t i = 0; ok && i < image->segment_count; i++) {
+        const ImageSegment *seg = &image->segments[i];
+        uint8_t entry[I80_SEGMENT_SIZE];
+        put16(entry, seg->origin);
+        put16(entry + 2, seg->rom ? IMAGE_SEGMENT_ROM : 0);
+        put32(entry + 4, seg->len);
+        put32(entry + 8, offset);
+        ok = fwrite(entry, sizeof(entry), 1, f) == 1;
+        offset += seg->len;
+    }
+    for (size_t i = 0; ok && i < image->segment_count; i++) {
+        const ImageSegment *seg = &image->segments[i];
+        ok = fwrite(seg->bytes, 1, seg->len, f) == seg->len;
+    }
+
+    return fclose(f) == 0 && ok;
+}
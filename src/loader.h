@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "bus.h"
+
+// Program images. The file is mapped read-only with mmap, segments point
+// straight into the mapping, so nothing is copied until image_map and ROM
+// segments are never copied at all. Read-only file mappings share the
+// page cache, every instance running the same ROM uses the same memory.
+//
+// Formats:
+//   IMAGE_HEX     Intel HEX, data records plus start segment / linear
+//                 address records for the entry point. Extended address
+//                 records have to stay at 0, there is nothing past 64K.
+//   IMAGE_RAW     the whole file as one RAM segment at origin, starting
+//                 there. .COM files load at 0x100.
+//   IMAGE_I80     multi-segment image, all fields little endian:
+//                   "I80" 0x1A, u16 version (1), u16 entry,
+//                   u16 segment count, u16 reserved,
+//                   per segment u16 origin, u16 flags, u32 length,
+//                   u32 file offset of the data
+//                 flags bit 0 marks a ROM segment
+//   IMAGE_LEGACY  the old format: a native size_t byte count, then the
+//                 bytes loaded at 0
+
+#define IMAGE_SEGMENT_ROM 0x0001
+
+typedef enum {
+    IMAGE_AUTO,             // by magic, extension and content
+    IMAGE_RAW,
+    IMAGE_HEX,
+    IMAGE_I80,
+    IMAGE_LEGACY
+} ImageFormat;
+
+typedef struct {
+    uint16_t origin;
+    uint32_t len;
+    bool rom;
+    const uint8_t *bytes;
+} ImageSegment;
+
+typedef struct {
+    ImageSegment *segments;
+    size_t segment_count;
+    uint16_t entry;         // raw images start at origin, others at 0 unless they name one
+
+    // backing storage of the segments
+    void *map;
+    size_t map_len;
+    uint8_t *decoded;       // Intel HEX data
+} Image;
+
+// origin only applies to IMAGE_RAW and raw files found by IMAGE_AUTO,
+// which uses 0x100 for .COM files when origin is 0. Returns false and
+// prints why on failure.
+bool image_load(const char *path, ImageFormat format, uint16_t origin, Image *out);
+
+void image_free(Image *image);
+
+// Puts the image on a bus that has ram mapped over the whole space. RAM
+// segments are copied into ram, ROM segments covering whole pages are
+// mapped read-only straight from the file; what is left of a ROM segment
+// that does not fill its pages is copied like RAM. The image has to stay
+// loaded while the bus uses it.
+void image_map(const Image *image, Bus *bus, uint8_t *ram);
+
+// writes the segments as an IMAGE_I80 file
+bool image_save(const char *path, const Image *image);
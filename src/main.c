@@ -1,68 +1,311 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include "cpu.h"
+#include "block_cache.h"
+#include "console.h"
+#include "loader.h"
+#include "batch.h"
+#include "trace.h"
+#include "profiler.h"
+#include "cpm.h"
+#include "invaders.h"
+#include "pacer.h"
+#include <signal.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
-const int MEM_SIZE = 0x10000;
+// 2 MHz / 60 Hz, one frame worth of cycles per cpu_run call
+const uint64_t CYCLES_PER_SLICE = 33333;
 
-typedef struct {
-    uint8_t *bytes;
-    size_t len;
-} ByteCode;
+static int run_batch(const char *manifest, const BatchOptions *options) {
+    size_t count;
+    BatchJob *jobs = batch_load_manifest(manifest, &count);
+    if (!jobs) return 1;
 
-int load_bytecode(const char *filename, ByteCode *out_bc) {
-    FILE *f = fopen(filename, "rb");
-    if (!f) return 0;
+    double seconds;
+    bool ok = batch_run(jobs, count, options, &seconds);
+    if (ok) {
+        batch_report(stdout, jobs, count, seconds);
+    }
+
+    batch_free(jobs, count);
+    return ok ? 0 : 1;
+}
+
+// SIGUSR1 switches turbo on and off while a paced program runs
+static volatile sig_atomic_t turbo_toggles;
+
+static void toggle_turbo(int sig) {
+    (void)sig;
+    turbo_toggles++;
+}
+
+// FNV-1a over the rendered frame, lets CI compare headless runs
+static uint64_t hash_pixels(const uint32_t *pixels, size_t count) {
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (size_t i = 0; i < count; i++) {
+        hash = (hash ^ pixels[i]) * 0x100000001B3ULL;
+    }
+    return hash;
+}
 
-    size_t length;
-    if (fread(&length, sizeof(size_t), 1, f) != 1) {
-        fclose(f);
-        return 0;
+static int run_invaders(const char *path, bool use_block_cache, bool use_jit, bool headless, long frames,
+                        const char *samples_dir) {
+#ifndef HAVE_SDL
+    (void)samples_dir;
+    if (!headless) {
+        fprintf(stderr, "ERROR: built without SDL, only --headless is available\n");
+        return 1;
     }
+#endif
 
-    out_bc->len = length;
+    Image rom;
+    if (!image_load(path, IMAGE_AUTO, 0, &rom)) {
+        return 1;
+    }
 
-    out_bc->bytes = (uint8_t*)malloc(length);
+    Invaders *machine = malloc(sizeof(Invaders));
+    if (!machine || !invaders_init(machine, &rom)) {
+        free(machine);
+        image_free(&rom);
+        return 1;
+    }
 
-    if (!out_bc->bytes) {
-        fclose(f);
-        return 0;
+    BlockCache *block_cache = NULL;
+    if (use_block_cache && !(block_cache = block_cache_create(&machine->bus))) {
+        fprintf(stderr, "ERROR: could not allocate block cache\n");
+        invaders_free(machine);
+        free(machine);
+        image_free(&rom);
+        return 1;
+    }
+    if (use_jit && !block_cache_enable_jit(block_cache)) {
+        fprintf(stderr, "WARNING: no native code backend, interpreting\n");
     }
 
-    fread(out_bc->bytes, 1, length, f);
+    int status = 0;
+    if (headless) {
+        // as fast as the host goes, every frame still rendered
+        static uint32_t pixels[INVADERS_TEXTURE_WIDTH * INVADERS_TEXTURE_HEIGHT];
+        long rows = 0;
+        int first, last;
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        invaders_render(machine, pixels);
+        for (long i = 0; i < frames && !status; i++) {
+            if (!invaders_run_frame(machine)) {
+                fprintf(stderr, "ERROR: out of memory scheduling the frame interrupts\n");
+                status = 1;
+            }
+            rows += invaders_render_dirty(machine, pixels, &first, &last);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
 
-    fclose(f);
-    return 1;
+        double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        printf("frames: %ld cycles: %llu idle: %llu seconds: %.3f speed: %.1fx rows converted: %ld frame hash: %016llx\n",
+               frames, (unsigned long long)machine->cpu.cycle, (unsigned long long)machine->sched.idle_cycles,
+               seconds, seconds > 0 ? frames / (double)INVADERS_FPS / seconds : 0.0, rows,
+               (unsigned long long)hash_pixels(pixels, sizeof(pixels) / sizeof(pixels[0])));
+    }
+#ifdef HAVE_SDL
+    else {
+        status = invaders_play(machine, samples_dir);
+    }
+#endif
+
+    block_cache_destroy(block_cache);
+    invaders_free(machine);
+    free(machine);
+    image_free(&rom);
+    return status;
 }
 
 int main(int argc, char *argv[]) {
 
-    if (argc != 2) {
-        fprintf(stderr, "ERROR: invalid argument count specify path to input file\n");
+    const char *path = NULL;
+    const char *manifest = NULL;
+    const char *trace_path = NULL;
+    const char *profile_path = NULL;
+    const char *samples_dir = NULL;
+    bool use_block_cache = false;
+    bool use_jit = false;
+    bool use_lazy_flags = false;
+    bool use_cpm = false;
+    bool use_invaders = false;
+    bool headless = false;
+    long frames = 600;
+    uint64_t clock_hz = 0;
+    double speed = 1.0;
+    int threads = 0;
+    uint16_t origin = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--block-cache") == 0) {
+            use_block_cache = true;
+        } else if (strcmp(argv[i], "--jit") == 0) {
+            use_block_cache = true;
+            use_jit = true;
+        } else if (strcmp(argv[i], "--lazy-flags") == 0) {
+            use_lazy_flags = true;
+        } else if (strcmp(argv[i], "--cpm") == 0) {
+            use_cpm = true;
+        } else if (strcmp(argv[i], "--invaders") == 0) {
+            use_invaders = true;
+        } else if (strcmp(argv[i], "--headless") == 0) {
+            headless = true;
+        } else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+            frames = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--samples") == 0 && i + 1 < argc) {
+            samples_dir = argv[++i];
+        } else if (strcmp(argv[i], "--clock") == 0 && i + 1 < argc) {
+            clock_hz = strtoull(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--speed") == 0 && i + 1 < argc) {
+            speed = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            manifest = argv[++i];
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--origin") == 0 && i + 1 < argc) {
+            origin = strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            trace_path = argv[++i];
+        } else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+            profile_path = argv[++i];
+        } else if (!path) {
+            path = argv[i];
+        } else {
+            path = NULL;
+            break;
+        }
+    }
+
+    // each of these runs on a core of its own, see cpu.h
+    int cores = (trace_path != NULL) + (profile_path != NULL) + use_lazy_flags + use_block_cache;
+    if (cores > 1) {
+        fprintf(stderr, "ERROR: --trace, --profile, --lazy-flags and --block-cache / --jit do not combine, pick one\n");
+        return 1;
+    }
+    if ((manifest || use_invaders) && cores > use_block_cache) {
+        fprintf(stderr, "ERROR: --trace, --profile and --lazy-flags only run plain programs\n");
+        return 1;
+    }
+
+    if (manifest && !path) {
+        BatchOptions options = {.threads = threads, .block_cache = use_block_cache, .jit = use_jit};
+        return run_batch(manifest, &options);
+    }
+
+    if (!path || manifest) {
+        fprintf(stderr, "ERROR: invalid arguments usage: i8080 [--block-cache | --jit | --lazy-flags] [--cpm] [--origin addr] [--clock hz [--speed x]] [--trace file] [--profile file] <input file>\n"
+                        "                           i8080 [--block-cache | --jit] [--threads n] --batch <manifest>\n"
+                        "                           i8080 [--block-cache | --jit] --invaders [--samples dir | --headless [--frames n]] <rom>\n"
+                        "  --jit compiles hot blocks to native code. It wins on tight loops but runs call and\n"
+                        "  I/O heavy code slower than the interpreter, since every CALL, RET, IN and OUT leaves it.\n");
         return 1;
     }
 
-    ByteCode byte_code;
-    if (!load_bytecode(argv[1], &byte_code)) {
-        fprintf(stderr, "ERROR: error while loading bytecode\n");
+    if (use_invaders) {
+        return run_invaders(path, use_block_cache, use_jit, headless, frames, samples_dir);
+    }
+
+    if (use_cpm && !origin) {
+        origin = CPM_TPA;
+    }
+
+    Image image;
+    if (!image_load(path, IMAGE_AUTO, origin, &image)) {
         return 1;
     }
 
     CpuState cpu = {0};
     Bus bus = {0};
-    bus.rom_size = byte_code.len;
-    bus.mem = calloc(MEM_SIZE, 1);
+    uint8_t *mem = calloc(MEM_SIZE, 1);
+    bus_map_ram(&bus, 0, MEM_SIZE, mem);
     cpu.bus = &bus;
+    cpu.pc = image.entry;
+
+    image_map(&image, &bus, mem);
+
+    Cpm cpm;
+    if (use_cpm) {
+        cpm_install(&cpm, &cpu, mem, stdout);
+    }
+
+    Console console;
+    console_attach(&console, &bus, 1, stdout);
+
+    BlockCache *block_cache = NULL;
+    if (use_block_cache && !(block_cache = block_cache_create(&bus))) {
+        fprintf(stderr, "ERROR: could not allocate block cache\n");
+        return 1;
+    }
+    if (use_jit && !block_cache_enable_jit(block_cache)) {
+        fprintf(stderr, "WARNING: no native code backend, interpreting\n");
+    }
+
+    Tracer *tracer = NULL;
+    if (trace_path && !(tracer = trace_open(trace_path, &cpu))) {
+        fprintf(stderr, "ERROR: could not open trace %s\n", trace_path);
+        return 1;
+    }
 
-    memcpy(bus.mem, byte_code.bytes, byte_code.len);
-    free(byte_code.bytes);
+    Profiler *profiler = NULL;
+    if (profile_path && !(profiler = profiler_create())) {
+        fprintf(stderr, "ERROR: could not allocate profiler\n");
+        return 1;
+    }
+
+    // flat out unless a clock was given
+    Pacer pacer;
+    if (clock_hz) {
+        pacer_init(&pacer, clock_hz, cpu.cycle);
+        pacer_set_speed(&pacer, speed, cpu.cycle);
+        signal(SIGUSR1, toggle_turbo);
+    }
 
     while(!cpu.halted) {
-        cpu.cycle += cpu_step(&cpu);
+        if (tracer) {
+            trace_run(tracer, &cpu, CYCLES_PER_SLICE);
+        } else if (profiler) {
+            cpu_run_profiled(&cpu, profiler, CYCLES_PER_SLICE);
+        } else if (use_lazy_flags) {
+            cpu_run_lazy(&cpu, CYCLES_PER_SLICE);
+        } else {
+            cpu_run(&cpu, CYCLES_PER_SLICE);
+        }
+        console_flush(&console);
+
+        if (use_cpm && cpu.halted) {
+            cpm_trap(&cpm, &cpu);
+        }
+
+        if (clock_hz) {
+            pacer.turbo = turbo_toggles & 1;
+            pacer_wait(&pacer, cpu.cycle);
+        }
+    }
+
+    if (tracer && !trace_close(tracer)) {
+        fprintf(stderr, "ERROR: could not write trace %s\n", trace_path);
+    }
+
+    if (use_cpm && cpm.exited) {
+        printf("\n");
+    } else {
+        printf("halted: %d\n", cpu.halted);
+    }
+
+    if (profiler) {
+        profiler_report(profiler, &bus, stdout, 10);
+        if (!profiler_write_folded(profiler, profile_path)) {
+            fprintf(stderr, "ERROR: could not write profile %s\n", profile_path);
+        }
+        profiler_destroy(profiler);
     }
 
-    printf("halted: %d\n", cpu.halted);
+    block_cache_destroy(block_cache);
 
-    free(bus.mem);
+    image_free(&image);
+    free(mem);
 }
@@ -0,0 +1,64 @@
+#include "pacer.h"
+#include <time.h>
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void anchor(Pacer *pacer, uint64_t cycle, uint64_t ns) {
+    pacer->anchor_cycle = cycle;
+    pacer->anchor_ns = ns;
+}
+
+void pacer_init(Pacer *pacer, uint64_t clock, uint64_t cycle) {
+    *pacer = (Pacer){.clock = clock, .speed = 1.0, .spin_ns = PACER_MAX_SPIN_NS};
+    anchor(pacer, cycle, now_ns());
+}
+
+void pacer_set_speed(Pacer *pacer, double speed, uint64_t cycle) {
+    pacer->speed = speed > 0 ? speed : 1.0;
+    anchor(pacer, cycle, now_ns());
+}
+
+static void relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+uint64_t pacer_wait(Pacer *pacer, uint64_t cycle) {
+    uint64_t now = now_ns();
+    if (pacer->turbo || cycle < pacer->anchor_cycle) {
+        // leaving turbo carries on from wherever it got to
+        anchor(pacer, cycle, now);
+        return 0;
+    }
+
+    double ns_per_cycle = 1e9 / (pacer->clock * pacer->speed);
+    uint64_t due = pacer->anchor_ns + (uint64_t)((cycle - pacer->anchor_cycle) * ns_per_cycle);
+
+    if (now >= due) {
+        if (now - due > PACER_MAX_LAG_NS) anchor(pacer, cycle, now);
+        return now - due;
+    }
+
+    if (due - now > pacer->spin_ns) {
+        uint64_t sleep = due - now - pacer->spin_ns;
+        struct timespec nap = {sleep / 1000000000, sleep % 1000000000};
+        nanosleep(&nap, NULL);
+
+        // spin for twice the recent oversleep from now on
+        uint64_t woke = now_ns();
+        uint64_t late = woke > now + sleep ? woke - now - sleep : 0;
+        uint64_t spin = (pacer->spin_ns * 7 + 2 * late) / 8;
+        pacer->spin_ns = spin < PACER_MIN_SPIN_NS ? PACER_MIN_SPIN_NS
+                       : spin > PACER_MAX_SPIN_NS ? PACER_MAX_SPIN_NS : spin;
+    }
+
+    while (now_ns() < due) {
+        relax();
+    }
+    return 0;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Ties the cpu cycle count to host time. pacer_wait blocks until the
+// host time a cycle is due at: it sleeps while there is more than
+// spin_ns to go, then spins for the rest, since sleeps wake up late by
+// a scheduler tick or so. spin_ns follows how late the sleeps actually
+// woke, between PACER_MIN_SPIN_NS and PACER_MAX_SPIN_NS.
+//
+// Running more than PACER_MAX_LAG_NS behind, a stall of the host or
+// a debugger, drops the debt instead of running flat out to repay it.
+
+#define PACER_MIN_SPIN_NS 50000
+#define PACER_MAX_SPIN_NS 2000000
+#define PACER_MAX_LAG_NS 100000000
+
+typedef struct {
+    uint64_t clock;         // cpu cycles per second at speed 1
+    double speed;           // fast forward multiplier
+    bool turbo;             // uncapped, pacer_wait returns right away
+
+    uint64_t spin_ns;
+
+    // anchor_cycle is due at anchor_ns, host CLOCK_MONOTONIC
+    uint64_t anchor_cycle;
+    uint64_t anchor_ns;
+} Pacer;
+
+// real time from cycle on
+void pacer_init(Pacer *pacer, uint64_t clock, uint64_t cycle);
+
+// runs speed times the clock from cycle on
+void pacer_set_speed(Pacer *pacer, double speed, uint64_t cycle);
+
+// Waits until cycle is due. Returns how late it was in ns, 0 when it
+// had to wait.
+uint64_t pacer_wait(Pacer *pacer, uint64_t cycle);
@@ -0,0 +1,253 @@
+#include "profiler.h"
+#include "cpu_ops.h"
+#include <string.h>
+
+Profiler *profiler_create(void) {
+    Profiler *profiler = malloc(sizeof(Profiler));
+    if (!profiler) return NULL;
+
+    profiler->node_capacity = 1024;
+    profiler->nodes = malloc(profiler->node_capacity * sizeof(ProfilerNode));
+    if (!profiler->nodes) {
+        free(profiler);
+        return NULL;
+    }
+    profiler_reset(profiler);
+    return profiler;
+}
+
+void profiler_destroy(Profiler *profiler) {
+    if (!profiler) return;
+    free(profiler->nodes);
+    free(profiler);
+}
+
+void profiler_reset(Profiler *profiler) {
+    memset(profiler->count, 0, sizeof(profiler->count));
+    memset(profiler->cycles, 0, sizeof(profiler->cycles));
+    profiler->nodes[0] = (ProfilerNode){0};
+    profiler->node_count = 1;
+    profiler->node = 0;
+    profiler->depth = 0;
+    profiler->lost_calls = 0;
+}
+
+static uint32_t child_node(Profiler *profiler, uint32_t parent, uint16_t entry) {
+    for (uint32_t n = profiler->nodes[parent].first_child; n; n = profiler->nodes[n].next_sibling) {
+        if (profiler->nodes[n].entry == entry) return n;
+    }
+
+    if (profiler->node_count == profiler->node_capacity) {
+        if (profiler->node_capacity == PROFILER_MAX_NODES) return 0;
+        ProfilerNode *grown = realloc(profiler->nodes, 2 * profiler->node_capacity * sizeof(ProfilerNode));
+        if (!grown) return 0;
+        profiler->nodes = grown;
+        profiler->node_capacity *= 2;
+    }
+
+    uint32_t n = profiler->node_count++;
+    profiler->nodes[n] = (ProfilerNode){
+        .entry = entry, .parent = parent, .next_sibling = profiler->nodes[parent].first_child
+    };
+    profiler->nodes[parent].first_child = n;
+    return n;
+}
+
+void profiler_call(Profiler *profiler, uint16_t entry, uint16_t sp) {
+    uint32_t n = profiler->depth < PROFILER_MAX_DEPTH ? child_node(profiler, profiler->node, entry) : 0;
+    if (!n) {
+        // charged to the caller from here on
+        profiler->lost_calls++;
+        return;
+    }
+
+    profiler->stack[profiler->depth++] = (ProfilerFrame){.caller = profiler->node, .sp = sp};
+    profiler->nodes[n].calls++;
+    profiler->node = n;
+}
+
+void profiler_return(Profiler *profiler, uint16_t sp) {
+    // normally exactly the frame whose return address was just popped
+    while (profiler->depth && profiler->stack[profiler->depth - 1].sp < sp) {
+        profiler->node = profiler->stack[--profiler->depth].caller;
+    }
+}
+
+typedef struct {
+    uint16_t start, end;    // end is the last instruction
+    uint64_t count;
+    uint64_t cycles;
+} Block;
+
+typedef struct {
+    uint16_t entry;
+    uint64_t calls;
+    uint64_t self;
+    uint64_t total;
+} Subroutine;
+
+static int by_block_cycles(const void *a, const void *b) {
+    uint64_t x = ((const Block *)a)->cycles, y = ((const Block *)b)->cycles;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static int by_total_cycles(const void *a, const void *b) {
+    uint64_t x = ((const Subroutine *)a)->total, y = ((const Subroutine *)b)->total;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static void report_blocks(const Profiler *profiler, Bus *bus, FILE *out, int top, uint64_t all) {
+    Block *blocks = malloc(MEM_SIZE * sizeof(Block));
+    if (!blocks) return;
+    size_t count = 0;
+
+    for (uint32_t pc = 0; pc < MEM_SIZE; ) {
+        if (!profiler->count[pc]) {
+            pc++;
+            continue;
+        }
+
+        // an instruction joins the block while it ran as often as the first
+        Block *block = &blocks[count++];
+        *block = (Block){.start = pc, .count = profiler->count[pc]};
+        for (;;) {
+            uint8_t opcode = bus_peek(bus, pc);
+            block->end = pc;
+            block->cycles += profiler->cycles[pc];
+            pc += opcode_length(opcode);
+            if (opcode_ends_block(opcode) || pc >= MEM_SIZE || profiler->count[pc] != block->count) break;
+        }
+    }
+
+    qsort(blocks, count, sizeof(Block), by_block_cycles);
+    fprintf(out, "hottest blocks:\n");
+    fprintf(out, "  %-11s %14s %14s %7s\n", "block", "executions", "cycles", "share");
+    for (size_t i = 0; i < count && i < (size_t)top; i++) {
+        fprintf(out, "  %04X-%04X   %14llu %14llu %6.2f%%\n", blocks[i].start, blocks[i].end,
+                (unsigned long long)blocks[i].count, (unsigned long long)blocks[i].cycles,
+                all ? 100.0 * blocks[i].cycles / all : 0.0);
+    }
+    free(blocks);
+}
+
+static void report_subroutines(const Profiler *profiler, FILE *out, int top, uint64_t all) {
+    uint32_t n_count = profiler->node_count;
+    uint64_t *total = malloc(n_count * sizeof(uint64_t));
+    Subroutine *subs = calloc(MEM_SIZE, sizeof(Subroutine));
+    if (!total || !subs) {
+        free(total);
+        free(subs);
+        return;
+    }
+
+    // children always come after their parent
+    for (uint32_t n = 0; n < n_count; n++) {
+        total[n] = profiler->nodes[n].cycles;
+    }
+    for (uint32_t n = n_count - 1; n > 0; n--) {
+        total[profiler->nodes[n].parent] += total[n];
+    }
+
+    for (uint32_t n = 1; n < n_count; n++) {
+        const ProfilerNode *node = &profiler->nodes[n];
+        Subroutine *sub = &subs[node->entry];
+        sub->entry = node->entry;
+        sub->calls += node->calls;
+        sub->self += node->cycles;
+
+        // recursion: only the outermost activation counts towards the total
+        bool outermost = true;
+        for (uint32_t up = node->parent; up && outermost; up = profiler->nodes[up].parent) {
+            outermost = profiler->nodes[up].entry != node->entry;
+        }
+        if (outermost) sub->total += total[n];
+    }
+
+    qsort(subs, MEM_SIZE, sizeof(Subroutine), by_total_cycles);
+    fprintf(out, "hottest subroutines:\n");
+    fprintf(out, "  %-11s %14s %14s %14s %7s\n", "entry", "calls", "self", "total", "share");
+    for (int i = 0; i < top && subs[i].calls; i++) {
+        fprintf(out, "  %04X        %14llu %14llu %14llu %6.2f%%\n", subs[i].entry,
+                (unsigned long long)subs[i].calls, (unsigned long long)subs[i].self,
+                (unsigned long long)subs[i].total, all ? 100.0 * subs[i].total / all : 0.0);
+    }
+    free(total);
+    free(subs);
+}
+
+typedef struct {
+    uint16_t opcodes;       // first one in the high byte
+    uint64_t count;
+} Pair;
+
+static int by_pair_count(const void *a, const void *b) {
+    uint64_t x = ((const Pair *)a)->count, y = ((const Pair *)b)->count;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+// instructions executed straight after each other, what superinstructions
+// are picked by. A block ender is never the first of a pair.
+static void report_pairs(const Profiler *profiler, Bus *bus, FILE *out, int top) {
+    Pair *pairs = calloc(0x10000, sizeof(Pair));
+    if (!pairs) return;
+
+    uint64_t all = 0;
+    for (uint32_t pc = 0; pc < MEM_SIZE; pc++) {
+        if (!profiler->count[pc]) continue;
+        uint8_t opcode = bus_peek(bus, pc);
+        all += profiler->count[pc];
+        if (opcode_ends_block(opcode)) continue;
+
+        uint16_t key = opcode << 8 | bus_peek(bus, pc + opcode_length(opcode));
+        pairs[key].opcodes = key;
+        pairs[key].count += profiler->count[pc];
+    }
+
+    qsort(pairs, 0x10000, sizeof(Pair), by_pair_count);
+    fprintf(out, "hottest instruction pairs:\n");
+    fprintf(out, "  %-11s %14s %7s\n", "opcodes", "executions", "share");
+    for (int i = 0; i < top && pairs[i].count; i++) {
+        fprintf(out, "  %02X %02X       %14llu %6.2f%%\n", pairs[i].opcodes >> 8, pairs[i].opcodes & 0xFF,
+                (unsigned long long)pairs[i].count, all ? 100.0 * pairs[i].count / all : 0.0);
+    }
+    free(pairs);
+}
+
+void profiler_report(const Profiler *profiler, Bus *bus, FILE *out, int top) {
+    uint64_t all = 0;
+    for (uint32_t pc = 0; pc < MEM_SIZE; pc++) {
+        all += profiler->cycles[pc];
+    }
+    fprintf(out, "profiled cycles: %llu\n", (unsigned long long)all);
+
+    report_blocks(profiler, bus, out, top, all);
+    report_subroutines(profiler, out, top, all);
+    report_pairs(profiler, bus, out, top);
+    if (profiler->lost_calls) {
+        fprintf(out, "calls charged to their caller: %llu\n", (unsigned long long)profiler->lost_calls);
+    }
+}
+
+bool profiler_write_folded(const Profiler *profiler, const char *path) {
+    FILE *f = fopen(path, "w");
+    if (!f) return false;
+
+    uint16_t path_entries[PROFILER_MAX_DEPTH];
+    for (uint32_t n = 0; n < profiler->node_count; n++) {
+        const ProfilerNode *node = &profiler->nodes[n];
+        if (!node->cycles) continue;
+
+        int depth = 0;
+        for (uint32_t up = n; up; up = profiler->nodes[up].parent) {
+            path_entries[depth++] = profiler->nodes[up].entry;
+        }
+
+        fprintf(f, "root");
+        while (depth) {
+            fprintf(f, ";%04X", path_entries[--depth]);
+        }
+        fprintf(f, " %llu\n", (unsigned long long)node->cycles);
+    }
+
+    return fclose(f) == 0;
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include "cpu.h"
+
+// Guest code profiler. cpu_run_profiled counts executions and cycles per
+// pc and follows a shadow call stack: CALL, taken Cccc and RST enter a
+// subroutine, RET and taken Rccc leave it. Cycles are charged to a call
+// tree node per distinct stack, which is what the folded output and the
+// subroutine report are built from.
+//
+// Returns pop every frame whose stack pointer lies below the one the
+// return leaves behind, so code that drops its return address or returns
+// from an interrupt handler does not leave the shadow stack out of step.
+
+#define PROFILER_MAX_DEPTH 256
+#define PROFILER_MAX_NODES (1 << 20)
+
+typedef struct {
+    uint16_t entry;         // subroutine address, 0 for the root
+    uint32_t parent;
+    uint32_t first_child;
+    uint32_t next_sibling;
+    uint64_t calls;
+    uint64_t cycles;        // spent in this node itself, not its children
+} ProfilerNode;
+
+typedef struct {
+    uint32_t caller;        // node to return to
+    uint16_t sp;            // after the return address was pushed
+} ProfilerFrame;
+
+struct Profiler {
+    uint64_t count[MEM_SIZE];
+    uint64_t cycles[MEM_SIZE];
+
+    ProfilerNode *nodes;
+    uint32_t node_count;
+    uint32_t node_capacity;
+    uint32_t node;          // currently running
+
+    ProfilerFrame stack[PROFILER_MAX_DEPTH];
+    int depth;
+    uint64_t lost_calls;    // deeper than PROFILER_MAX_DEPTH or out of nodes
+};
+
+// returns NULL when out of memory
+Profiler *profiler_create(void);
+void profiler_destroy(Profiler *profiler);
+
+// drops the counters and the call tree
+void profiler_reset(Profiler *profiler);
+
+// slow paths of profiler_record
+void profiler_call(Profiler *profiler, uint16_t entry, uint16_t sp);
+void profiler_return(Profiler *profiler, uint16_t sp);
+
+// Accounts one instruction that ran at pc, cpu is the state after it.
+// taken is false for conditional instructions that fell through.
+static inline void profiler_record(Profiler *profiler, const CpuState *cpu, uint16_t pc,
+                                   uint8_t opcode, int cycles, bool taken) {
+    profiler->count[pc]++;
+    profiler->cycles[pc] += cycles;
+    profiler->nodes[profiler->node].cycles += cycles;
+
+    if (!taken) return;
+    if ((opcode & 0xCF) == 0xCD || (opcode & 0xC7) == 0xC4 || (opcode & 0xC7) == 0xC7) {
+        // CALL  Cccc  RST
+        profiler_call(profiler, cpu->pc, cpu->sp);
+    } else if ((opcode & 0xEF) == 0xC9 || (opcode & 0xC7) == 0xC0) {
+        // RET  Rccc
+        profiler_return(profiler, cpu->sp);
+    }
+}
+
+// Prints the top hottest basic blocks, runs of instructions executed
+// equally often that end at a control transfer, the top subroutines by
+// inclusive cycles and the opcode pairs executed most often back to back.
+// Opcodes are read from RAM and ROM pages of bus.
+void profiler_report(const Profiler *profiler, Bus *bus, FILE *out, int top);
+
+// Writes the call tree in folded stack format, one line per stack:
+// "root;0150;0200 1234" with the cycles spent in the innermost frame.
+bool profiler_write_folded(const Profiler *profiler, const char *path);
@@ -0,0 +1,206 @@
+#include "scheduler.h"
+#include "cpu_ops.h"
+
+static bool event_before(const Event *a, const Event *b) {
+    return a->cycle != b->cycle ? a->cycle < b->cycle : a->order < b->order;
+}
+
+static void sift_up(Event *heap, size_t i) {
+    Event event = heap[i];
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (!event_before(&event, &heap[parent])) break;
+        heap[i] = heap[parent];
+        i = parent;
+    }
+    heap[i] = event;
+}
+
+static void sift_down(Event *heap, size_t count, size_t i) {
+    Event event = heap[i];
+    for (;;) {
+        size_t child = 2 * i + 1;
+        if (child >= count) break;
+        if (child + 1 < count && event_before(&heap[child + 1], &heap[child])) {
+            child++;
+        }
+        if (!event_before(&heap[child], &event)) break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = event;
+}
+
+void scheduler_init(Scheduler *sched) {
+    *sched = (Scheduler){.probe_interval = BUSY_WAIT_PROBE_MIN};
+}
+
+void scheduler_free(Scheduler *sched) {
+    free(sched->heap);
+    *sched = (Scheduler){.probe_interval = BUSY_WAIT_PROBE_MIN};
+}
+
+bool scheduler_add(Scheduler *sched, uint64_t cycle, EventFn fn, void *ctx) {
+    if (sched->count == sched->capacity) {
+        size_t capacity = sched->capacity ? sched->capacity * 2 : 16;
+        Event *grown = realloc(sched->heap, capacity * sizeof(Event));
+        if (!grown) return false;
+        sched->heap = grown;
+        sched->capacity = capacity;
+    }
+
+    sched->heap[sched->count] = (Event){
+        .cycle = cycle, .order = sched->next_order++, .fn = fn, .ctx = ctx
+    };
+    sift_up(sched->heap, sched->count++);
+    return true;
+}
+
+void scheduler_cancel(Scheduler *sched, EventFn fn, void *ctx) {
+    size_t kept = 0;
+    for (size_t i = 0; i < sched->count; i++) {
+        if (sched->heap[i].fn != fn || sched->heap[i].ctx != ctx) {
+            sched->heap[kept++] = sched->heap[i];
+        }
+    }
+    if (kept == sched->count) return;
+
+    sched->count = kept;
+    for (size_t i = kept / 2; i-- > 0;) {
+        sift_down(sched->heap, kept, i);
+    }
+}
+
+uint64_t scheduler_next(const Scheduler *sched) {
+    return sched->count ? sched->heap[0].cycle : UINT64_MAX;
+}
+
+// fires every event due by now, one at a time since callbacks may change
+// the heap
+static void fire_due(Scheduler *sched, uint64_t now) {
+    while (sched->count && sched->heap[0].cycle <= now) {
+        Event event = sched->heap[0];
+        sched->heap[0] = sched->heap[--sched->count];
+        if (sched->count) {
+            sift_down(sched->heap, sched->count, 0);
+        }
+        event.fn(event.ctx, event.cycle);
+    }
+}
+
+// No stores, no stack, no change to the interrupt or halt state: MOV
+// and MVI except to M, INR DCR LXI INX DCX of B D H, DAD, loads, the
+// accumulator and ALU group, XCHG, JMP, Jccc and IN.
+static bool busy_wait_opcode(uint8_t opcode) {
+    if (opcode >= 0x40 && opcode < 0xC0) {
+        return (opcode & 0xF8) != 0x70;
+    }
+    if (opcode < 0x40) {
+        switch (opcode & 0x07) {
+            case 0x00: return opcode == 0x00;                           // NOP
+            case 0x01: return opcode != 0x31;                           // LXI DAD
+            case 0x02: return opcode == 0x0A || opcode == 0x1A
+                           || opcode == 0x2A || opcode == 0x3A;         // LDAX LHLD LDA
+            case 0x03: return (opcode & 0x30) != 0x30;                  // INX DCX
+            case 0x04: case 0x05: case 0x06: return (opcode & 0x38) != 0x30;
+            default: return true;                                       // rotates DAA CMA STC CMC
+        }
+    }
+    return (opcode & 0xC7) == 0xC2 || (opcode & 0xC7) == 0xC6           // Jccc, ALU immediate
+        || opcode == 0xC3 || opcode == 0xEB || opcode == 0xDB;          // JMP XCHG IN
+}
+
+static bool device_page(Bus *bus, uint16_t addr) {
+    return bus->page[addr >> 8].read != NULL;
+}
+
+static bool same_state(const CpuState *a, const CpuState *b) {
+    return a->a == b->a && a->b == b->b && a->c == b->c && a->d == b->d && a->e == b->e
+        && a->h == b->h && a->l == b->l && a->flags == b->flags && a->sp == b->sp && a->pc == b->pc
+        && a->halted == b->halted && a->interruptible == b->interruptible;
+}
+
+// Steps the cpu through the loop it is in, as long as every instruction
+// can be part of a busy wait. Returns the cycles of one iteration when
+// the cpu came back to where it started without any change, 0 otherwise
+// or when the deadline comes first.
+// Everything stepped is harmless to run for real either way.
+static uint64_t busy_wait_cycles(CpuState *cpu, uint64_t deadline) {
+    CpuState start = *cpu;
+    uint64_t cycles = 0;
+
+    for (int i = 0; i < BUSY_WAIT_MAX_INSTRUCTIONS; i++) {
+        // the probe runs for real, so like cpu_run it must not start an
+        // instruction at or past the deadline
+        if (cpu->cycle >= deadline) return 0;
+        uint8_t opcode = bus_peek(cpu->bus, cpu->pc);
+        uint16_t addr;
+        int load = cpu_load_span(cpu, opcode, &addr);
+        if (!busy_wait_opcode(opcode) || device_page(cpu->bus, cpu->pc)
+                || device_page(cpu->bus, cpu->pc + opcode_length(opcode) - 1)
+                || (load && (device_page(cpu->bus, addr) || device_page(cpu->bus, addr + load - 1)))) {
+            return 0;
+        }
+
+        int step = cpu_step(cpu);
+        cpu->cycle += step;
+        cycles += step;
+        if (cpu->pc == start.pc) {
+            return same_state(&start, cpu) ? cycles : 0;
+        }
+    }
+    return 0;
+}
+
+// cpu_run up to deadline, probing for busy waits on the way
+static void run_skipping_busy_waits(Scheduler *sched, CpuState *cpu, uint64_t deadline) {
+    while (cpu->cycle < deadline && !cpu->halted) {
+        uint64_t chunk = deadline - cpu->cycle;
+        if (chunk > sched->probe_interval) chunk = sched->probe_interval;
+        cpu_run(cpu, chunk);
+        if (cpu->cycle >= deadline || cpu->halted) break;
+
+        uint64_t loop = busy_wait_cycles(cpu, deadline);
+        if (cpu->cycle >= deadline || cpu->halted) break;
+        if (!loop) {
+            if (sched->probe_interval < BUSY_WAIT_PROBE_MAX) sched->probe_interval *= 2;
+            continue;
+        }
+
+        // the last partial iteration runs for real, so the cpu is at the
+        // same instruction at the same cycle as without skipping
+        uint64_t skip = cpu->cycle < deadline ? (deadline - cpu->cycle) / loop * loop : 0;
+        cpu->cycle += skip;
+        sched->idle_cycles += skip;
+        sched->probe_interval = BUSY_WAIT_PROBE_MIN;
+    }
+}
+
+uint64_t scheduler_run(Scheduler *sched, CpuState *cpu, uint64_t cycle_budget) {
+    uint64_t start = cpu->cycle;
+    uint64_t end = start + cycle_budget;
+
+    while (cpu->cycle < end) {
+        fire_due(sched, cpu->cycle);
+
+        uint64_t deadline = scheduler_next(sched);
+        if (deadline > end) deadline = end;
+
+        if (!cpu->halted) {
+            if (sched->skip_busy_waits) {
+                run_skipping_busy_waits(sched, cpu, deadline);
+            } else {
+                cpu_run(cpu, deadline - cpu->cycle);
+            }
+        } else if (cpu->interruptible) {
+            // nothing runs until an event raises an interrupt
+            sched->idle_cycles += deadline - cpu->cycle;
+            cpu->cycle = deadline;
+        } else {
+            break;
+        }
+    }
+
+    fire_due(sched, cpu->cycle);
+    return cpu->cycle - start;
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include "cpu.h"
+
+// Device events ordered by the cpu cycle they are due at, kept in a
+// binary min-heap. scheduler_run lets the cpu run straight up to the next
+// deadline, then fires every event that came due. Events due at the same
+// cycle fire in the order they were added.
+
+// cycle is the deadline the event was scheduled for, the cpu may have
+// run a few cycles past it. Callbacks may add and cancel events.
+typedef void (*EventFn)(void *ctx, uint64_t cycle);
+
+typedef struct {
+    uint64_t cycle;
+    uint64_t order;
+    EventFn fn;
+    void *ctx;
+} Event;
+
+// busy wait probes, see skip_busy_waits
+#define BUSY_WAIT_MAX_INSTRUCTIONS 8
+#define BUSY_WAIT_PROBE_MIN 256
+#define BUSY_WAIT_PROBE_MAX 65536
+
+typedef struct {
+    Event *heap;
+    size_t count, capacity;
+    uint64_t next_order;
+
+    // Off by default. While the cpu runs towards a deadline it is probed
+    // every probe_interval cycles: when it sits in a loop of at most
+    // BUSY_WAIT_MAX_INSTRUCTIONS that only reads memory and ports and
+    // leaves every register as it found it, nothing changes until an
+    // event does, so cycle moves on by whole iterations to the deadline.
+    // Memory mapped devices never count as memory here, IN handlers have
+    // to return the same value until an event changes their device.
+    // A probe that finds nothing doubles the interval up to
+    // BUSY_WAIT_PROBE_MAX, one that does resets it.
+    bool skip_busy_waits;
+    uint64_t probe_interval;
+
+    // cycles passed over in HLT and in busy waits
+    uint64_t idle_cycles;
+} Scheduler;
+
+void scheduler_init(Scheduler *sched);
+void scheduler_free(Scheduler *sched);
+
+// returns false when out of memory
+bool scheduler_add(Scheduler *sched, uint64_t cycle, EventFn fn, void *ctx);
+
+// removes every pending event with this callback and context
+void scheduler_cancel(Scheduler *sched, EventFn fn, void *ctx);
+
+// deadline of the earliest event, UINT64_MAX when there is none
+uint64_t scheduler_next(const Scheduler *sched);
+
+// Runs the cpu for at least cycle_budget cycles, firing events on the
+// way. A halted cpu idles up to the next event, which may wake it with
+// cpu_interrupt. Stops early only when the cpu halted with interrupts
+// disabled, nothing can wake it then. Same return value as cpu_run.
+uint64_t scheduler_run(Scheduler *sched, CpuState *cpu, uint64_t cycle_budget);
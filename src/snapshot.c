@@ -0,0 +1,184 @@
+#include "snapshot.h"
+#include "block_cache.h"
+#include <stdatomic.h>
+#include <string.h>
+
+static const uint8_t snapshot_magic[4] = {'I', '8', '0', 'S'};
+
+// snapshots are told apart by generation, an address may be reused once
+// freed
+static atomic_uint_fast64_t last_generation;
+
+static void track(Snapshot *snap, Bus *bus) {
+    snap->tracked_on = bus;
+    bus_track_dirty(bus, snap->generation);
+}
+
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_HEADER_SIZE 62
+
+Snapshot *cpu_snapshot(CpuState *cpu) {
+    Snapshot *snap = malloc(sizeof(Snapshot));
+    if (!snap) return NULL;
+
+    Bus *bus = cpu->bus;
+    snap->generation = atomic_fetch_add(&last_generation, 1) + 1;
+    snap->cpu = *cpu;
+    for (int page = 0; page < BUS_PAGES; page++) {
+        const uint8_t *ram = bus_page_ram(bus, page);
+        snap->saved[page] = ram != NULL;
+        if (ram) {
+            memcpy(snap->mem + page * BUS_PAGE_SIZE, ram, BUS_PAGE_SIZE);
+        }
+    }
+
+    track(snap, bus);
+    return snap;
+}
+
+void cpu_restore(CpuState *cpu, Snapshot *snap) {
+    Bus *bus = cpu->bus;
+
+    // pages untouched since this snapshot was taken or restored still
+    // hold its contents
+    bool incremental = bus->dirty_generation == snap->generation;
+
+    for (int page = 0; page < BUS_PAGES; page++) {
+        if (!snap->saved[page] || (incremental && !bus->dirty[page])) continue;
+
+        uint8_t *ram = bus_page_ram(bus, page);
+        if (!ram) continue;
+        memcpy(ram, snap->mem + page * BUS_PAGE_SIZE, BUS_PAGE_SIZE);
+
+        if (!bus->block_cache) continue;
+        uint8_t p = page;
+        do {
+            if (bus->code_page[p]) {
+                block_cache_invalidate_page(bus->block_cache, p);
+            }
+            p += bus->mirror_step[p];
+        } while (p != page);
+    }
+
+    *cpu = snap->cpu;
+    cpu->bus = bus;
+    track(snap, bus);
+}
+
+void snapshot_free(Snapshot *snap) {
+    if (snap && snap->tracked_on && snap->tracked_on->dirty_generation == snap->generation) {
+        bus_track_dirty(snap->tracked_on, 0);
+    }
+    free(snap);
+}
+
+static void put16(uint8_t *p, uint16_t val) {
+    p[0] = val;
+    p[1] = val >> 8;
+}
+
+static uint16_t get16(const uint8_t *p) {
+    return p[0] | p[1] << 8;
+}
+
+// memory as image_map leaves it on freshly cleared RAM
+static void baseline(const Image *image, uint8_t *mem) {
+    memset(mem, 0, MEM_SIZE);
+    for (size_t i = 0; image && i < image->segment_count; i++) {
+        const ImageSegment *seg = &image->segments[i];
+        memcpy(mem + seg->origin, seg->bytes, seg->len);
+    }
+}
+
+bool snapshot_save(const Snapshot *snap, const Image *image, const char *path) {
+    uint8_t *base = malloc(MEM_SIZE);
+    if (!base) return false;
+    baseline(image, base);
+
+    const CpuState *cpu = &snap->cpu;
+    uint8_t header[SNAPSHOT_HEADER_SIZE] = {0};
+    memcpy(header, snapshot_magic, sizeof(snapshot_magic));
+    put16(header + 4, SNAPSHOT_VERSION);
+    uint8_t regs[] = {cpu->a, cpu->b, cpu->c, cpu->d, cpu->e, cpu->h, cpu->l, cpu->flags};
+    memcpy(header + 6, regs, sizeof(regs));
+    put16(header + 14, cpu->sp);
+    put16(header + 16, cpu->pc);
+    header[18] = cpu->halted;
+    header[19] = cpu->interruptible;
+    for (int i = 0; i < 8; i++) {
+        header[20 + i] = cpu->cycle >> (8 * i);
+    }
+
+    uint16_t count = 0;
+    for (int page = 0; page < BUS_PAGES; page++) {
+        const uint8_t *mem = snap->mem + page * BUS_PAGE_SIZE;
+        if (!snap->saved[page]) continue;
+        header[28 + page / 8] |= 1 << (page % 8);
+        count += memcmp(mem, base + page * BUS_PAGE_SIZE, BUS_PAGE_SIZE) != 0;
+    }
+    put16(header + 60, count);
+
+    FILE *f = fopen(path, "wb");
+    bool ok = f && fwrite(header, sizeof(header), 1, f) == 1;
+
+    for (int page = 0; ok && page < BUS_PAGES; page++) {
+        const uint8_t *mem = snap->mem + page * BUS_PAGE_SIZE;
+        if (!snap->saved[page] || memcmp(mem, base + page * BUS_PAGE_SIZE, BUS_PAGE_SIZE) == 0) continue;
+
+        uint8_t number = page;
+        ok = fwrite(&number, 1, 1, f) == 1 && fwrite(mem, BUS_PAGE_SIZE, 1, f) == 1;
+    }
+
+    free(base);
+    if (f && fclose(f) != 0) ok = false;
+    return ok;
+}
+
+Snapshot *snapshot_load(const char *path, const Image *image) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        fprintf(stderr, "ERROR: could not open snapshot %s\n", path);
+        return NULL;
+    }
+
+    uint8_t header[SNAPSHOT_HEADER_SIZE];
+    Snapshot *snap = malloc(sizeof(Snapshot));
+    bool ok = snap && fread(header, sizeof(header), 1, f) == 1
+        && memcmp(header, snapshot_magic, sizeof(snapshot_magic)) == 0
+        && get16(header + 4) == SNAPSHOT_VERSION;
+
+    if (ok) {
+        snap->generation = atomic_fetch_add(&last_generation, 1) + 1;
+        snap->tracked_on = NULL;
+        baseline(image, snap->mem);
+
+        CpuState *cpu = &snap->cpu;
+        *cpu = (CpuState){
+            .a = header[6], .b = header[7], .c = header[8], .d = header[9],
+            .e = header[10], .h = header[11], .l = header[12],
+            .flags = header[13] & FLAG_MASK,
+            .sp = get16(header + 14), .pc = get16(header + 16),
+            .halted = header[18], .interruptible = header[19],
+        };
+        for (int i = 0; i < 8; i++) {
+            cpu->cycle |= (uint64_t)header[20 + i] << (8 * i);
+        }
+        for (int page = 0; page < BUS_PAGES; page++) {
+            snap->saved[page] = header[28 + page / 8] >> (page % 8) & 1;
+        }
+
+        for (int count = get16(header + 60); ok && count > 0; count--) {
+            uint8_t number;
+            ok = fread(&number, 1, 1, f) == 1
+                && fread(snap->mem + number * BUS_PAGE_SIZE, BUS_PAGE_SIZE, 1, f) == 1;
+        }
+    }
+
+    fclose(f);
+    if (!ok) {
+        fprintf(stderr, "ERROR: invalid snapshot %s\n", path);
+        free(snap);
+        return NULL;
+    }
+    return snap;
+}
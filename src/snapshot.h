@@ -0,0 +1,40 @@
+#pragma once
+
+#include "cpu.h"
+#include "loader.h"
+
+// Save states of a cpu and the RAM of its bus. Taking or restoring a
+// snapshot arms dirty page tracking on the bus, so restoring the same
+// snapshot again only copies back the pages written since. Memory changed
+// without going through the bus (a device writing its own buffer that is
+// also mapped as RAM, image_map) is not seen by the tracking.
+
+struct Snapshot {
+    uint64_t generation;        // unique for the run, never 0
+    Bus *tracked_on;            // bus it last armed the tracking on
+    CpuState cpu;
+    bool saved[BUS_PAGES];      // pages that had RAM behind them
+    uint8_t mem[MEM_SIZE];
+};
+
+// returns NULL when out of memory
+Snapshot *cpu_snapshot(CpuState *cpu);
+
+// puts the registers and RAM back, cpu->bus stays. Pages that are no
+// longer RAM are skipped. Translated code on restored pages is dropped.
+void cpu_restore(CpuState *cpu, Snapshot *snap);
+
+// stops the tracking against snap if its bus still does it, so free
+// snapshots before the bus they were last taken or restored on
+void snapshot_free(Snapshot *snap);
+
+// On disk only pages that differ from what image_map put there are
+// stored, all fields little endian:
+//   "I80S", u16 version (1), a b c d e h l flags, u16 sp, u16 pc,
+//   u8 halted, u8 interruptible, u64 cycle, 32 byte bitmap of saved
+//   pages, u16 page count, per page u8 page number and the 256 bytes
+// image may be NULL when the program started from empty memory.
+bool snapshot_save(const Snapshot *snap, const Image *image, const char *path);
+
+// returns NULL and prints why on failure
+Snapshot *snapshot_load(const char *path, const Image *image);
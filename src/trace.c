@@ -0,0 +1,235 @@
+#include "trace.h"
+#include "cpu_ops.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+
+struct Tracer {
+    FILE *file;
+    pthread_t writer;
+
+    // head is only written by the writer thread, tail only by the
+    // emulation thread. Each side caches the other's index and reloads it
+    // only when the cached one says there is no room.
+    _Alignas(64) atomic_size_t head;
+    _Alignas(64) atomic_size_t tail;
+    size_t cached_head;
+
+    atomic_bool closing;
+    atomic_bool failed;
+
+    // state after the last record, for the deltas
+    uint8_t regs[8];
+    uint16_t sp;
+    uint16_t next_pc;
+
+    uint8_t ring[TRACE_RING_SIZE];
+};
+
+static void put16(uint8_t *p, uint16_t val) {
+    p[0] = val;
+    p[1] = val >> 8;
+}
+
+static void *writer_main(void *arg) {
+    Tracer *tracer = arg;
+    size_t head = atomic_load_explicit(&tracer->head, memory_order_relaxed);
+
+    for (;;) {
+        size_t tail = atomic_load_explicit(&tracer->tail, memory_order_acquire);
+        if (head == tail) {
+            if (atomic_load_explicit(&tracer->closing, memory_order_acquire)
+                    && head == atomic_load_explicit(&tracer->tail, memory_order_acquire)) {
+                break;
+            }
+            struct timespec nap = {0, 200000};
+            nanosleep(&nap, NULL);
+            continue;
+        }
+
+        // up to the end of the buffer, the wrapped part goes next round
+        size_t start = head & (TRACE_RING_SIZE - 1);
+        size_t len = tail - head;
+        if (len > TRACE_RING_SIZE - start) len = TRACE_RING_SIZE - start;
+
+        if (fwrite(tracer->ring + start, 1, len, tracer->file) != len) {
+            atomic_store(&tracer->failed, true);
+        }
+        head += len;
+        atomic_store_explicit(&tracer->head, head, memory_order_release);
+    }
+    return NULL;
+}
+
+static void regs_of(const CpuState *cpu, uint8_t *regs) {
+    regs[0] = cpu->a;
+    regs[1] = cpu->b;
+    regs[2] = cpu->c;
+    regs[3] = cpu->d;
+    regs[4] = cpu->e;
+    regs[5] = cpu->h;
+    regs[6] = cpu->l;
+    regs[7] = cpu->flags;
+}
+
+Tracer *trace_open(const char *path, const CpuState *cpu) {
+    Tracer *tracer = calloc(1, sizeof(Tracer));
+    if (!tracer) return NULL;
+
+    tracer->file = fopen(path, "wb");
+    if (!tracer->file) {
+        free(tracer);
+        return NULL;
+    }
+
+    regs_of(cpu, tracer->regs);
+    tracer->sp = cpu->sp;
+    tracer->next_pc = cpu->pc;
+
+    uint8_t header[TRACE_HEADER_SIZE];
+    memcpy(header, "I80T", 4);
+    put16(header + 4, TRACE_VERSION);
+    memcpy(header + 6, tracer->regs, 8);
+    put16(header + 14, cpu->sp);
+    put16(header + 16, cpu->pc);
+    for (int i = 0; i < 8; i++) {
+        header[18 + i] = cpu->cycle >> (8 * i);
+    }
+    bool ok = fwrite(header, sizeof(header), 1, tracer->file) == 1;
+
+    if (!ok || pthread_create(&tracer->writer, NULL, writer_main, tracer) != 0) {
+        fclose(tracer->file);
+        free(tracer);
+        return NULL;
+    }
+    return tracer;
+}
+
+// copies a record into the ring, waiting for the writer when it is full
+static void push(Tracer *tracer, const uint8_t *record, size_t len) {
+    size_t tail = atomic_load_explicit(&tracer->tail, memory_order_relaxed);
+
+    while (tail + len - tracer->cached_head > TRACE_RING_SIZE) {
+        tracer->cached_head = atomic_load_explicit(&tracer->head, memory_order_acquire);
+        if (tail + len - tracer->cached_head > TRACE_RING_SIZE) {
+            sched_yield();
+        }
+    }
+
+    size_t start = tail & (TRACE_RING_SIZE - 1);
+    size_t first = len < TRACE_RING_SIZE - start ? len : TRACE_RING_SIZE - start;
+    memcpy(tracer->ring + start, record, first);
+    memcpy(tracer->ring, record + first, len - first);
+
+    atomic_store_explicit(&tracer->tail, tail + len, memory_order_release);
+}
+
+static uint8_t *put_access(uint8_t *p, Bus *bus, int count, uint16_t addr) {
+    *p++ = count;
+    put16(p, addr);
+    p += 2;
+    for (int i = 0; i < count; i++) {
+        *p++ = bus_peek(bus, addr + i);
+    }
+    return p;
+}
+
+int trace_step(Tracer *tracer, CpuState *cpu) {
+    uint8_t record[TRACE_RECORD_MAX];
+    uint8_t *p = record + 1;
+    uint16_t pc = cpu->pc;
+    uint8_t opcode = bus_peek(cpu->bus, pc);
+    int len = opcode_length(opcode);
+    uint8_t tags = len << TRACE_LEN_SHIFT;
+
+    if (pc != tracer->next_pc) {
+        tags |= TRACE_PC;
+        put16(p, pc);
+        p += 2;
+    }
+    for (int i = 0; i < len; i++) {
+        *p++ = bus_peek(cpu->bus, pc + i);
+    }
+
+    // loads are captured before the instruction, INR M and XTHL store
+    // over what they read
+    uint8_t load[1 + 2 + 2];
+    uint8_t *load_end = load;
+    uint16_t load_addr = 0, store_addr = 0;
+    int loads = cpu_load_span(cpu, opcode, &load_addr);
+    int stores = cpu_store_span(cpu, opcode, &store_addr);
+    if (loads) {
+        load_end = put_access(load, cpu->bus, loads, load_addr);
+    }
+
+    int cycles = cpu_step(cpu);
+    cpu->cycle += cycles;
+    *p++ = cycles;
+
+    uint8_t regs[8];
+    regs_of(cpu, regs);
+    uint8_t *mask = p++;
+    *mask = 0;
+    for (int i = 0; i < 8; i++) {
+        if (regs[i] != tracer->regs[i]) {
+            *mask |= 1 << i;
+            *p++ = regs[i];
+        }
+    }
+    if (*mask) {
+        tags |= TRACE_REGS;
+        memcpy(tracer->regs, regs, sizeof(regs));
+    } else {
+        p--;
+    }
+
+    if (cpu->sp != tracer->sp) {
+        tags |= TRACE_SP;
+        put16(p, cpu->sp);
+        p += 2;
+        tracer->sp = cpu->sp;
+    }
+
+    // conditional returns and calls take longer when taken, 11 against 5
+    // and 17 against 11, whatever address they went to
+    bool taken = cycles > op_cycles[opcode];
+
+    // conditional returns that were not taken read nothing
+    if (loads && !((opcode & 0xC7) == 0xC0 && !taken)) {
+        tags |= TRACE_LOAD;
+        memcpy(p, load, load_end - load);
+        p += load_end - load;
+    }
+
+    // a conditional call that was not taken stored nothing
+    bool stored = stores && !((opcode & 0xC7) == 0xC4 && !taken);
+    if (stored) {
+        tags |= TRACE_STORE;
+        p = put_access(p, cpu->bus, stores, store_addr);
+    }
+
+    record[0] = tags;
+    tracer->next_pc = pc + len;
+    push(tracer, record, p - record);
+    return cycles;
+}
+
+uint64_t trace_run(Tracer *tracer, CpuState *cpu, uint64_t cycle_budget) {
+    uint64_t cycles = 0;
+    while (cycles < cycle_budget && !cpu->halted) {
+        cycles += trace_step(tracer, cpu);
+    }
+    return cycles;
+}
+
+bool trace_close(Tracer *tracer) {
+    atomic_store_explicit(&tracer->closing, true, memory_order_release);
+    pthread_join(tracer->writer, NULL);
+
+    bool ok = !atomic_load(&tracer->failed);
+    if (fclose(tracer->file) != 0) ok = false;
+    free(tracer);
+    return ok;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include "cpu.h"
+
+// Binary execution trace. trace_step runs one instruction through
+// cpu_step and encodes it into a single producer / single consumer ring,
+// a writer thread drains the ring to the file. The emulation thread only
+// blocks when the disk falls a whole ring behind.
+//
+// File format, all fields little endian:
+//   header: "I80T", u16 version (1), a b c d e h l flags, u16 sp,
+//           u16 pc, u64 cycle
+//   one record per instruction:
+//     u8 tags (TRACE_*, bits 4-5 the instruction length)
+//     u16 pc                   only with TRACE_PC, when the instruction
+//                              does not follow the previous one
+//     instruction bytes
+//     u8 cycles
+//     u8 register mask, then   with TRACE_REGS, bit n set for a b c d e
+//     the new values           h l flags in that order
+//     u16 sp                   with TRACE_SP
+//     u8 n, u16 addr, n bytes  with TRACE_LOAD, the bytes read
+//     u8 n, u16 addr, n bytes  with TRACE_STORE, the bytes written
+// Registers are deltas against the state after the previous record.
+
+#define TRACE_VERSION 1
+#define TRACE_HEADER_SIZE 26
+
+#define TRACE_PC        0x01
+#define TRACE_REGS      0x02
+#define TRACE_LOAD      0x04
+#define TRACE_STORE     0x08
+#define TRACE_LEN_SHIFT 4
+#define TRACE_SP        0x40
+
+// longest record: tags, pc, 3 instruction bytes, cycles, mask and 8
+// registers, sp, two memory accesses of 2 bytes
+#define TRACE_RECORD_MAX 32
+
+// ring size in bytes, a power of two
+#define TRACE_RING_SIZE (1 << 20)
+
+typedef struct Tracer Tracer;
+
+// writes the header with the state of cpu and starts the writer thread,
+// NULL when the file or the thread could not be created
+Tracer *trace_open(const char *path, const CpuState *cpu);
+
+// cpu_step with a trace record, also adds the cycles to cpu->cycle
+int trace_step(Tracer *tracer, CpuState *cpu);
+
+// same contract as cpu_run, one trace_step at a time
+uint64_t trace_run(Tracer *tracer, CpuState *cpu, uint64_t cycle_budget);
+
+// drains the ring and closes the file, false when any write failed
+bool trace_close(Tracer *tracer);
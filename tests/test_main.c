@@ -2,11 +2,28 @@
 #include "unittest.h"
 
 #include "../src/cpu.h"
+#include "../src/cpu_ops.h"
+#include "../src/block_cache.h"
+#include "../src/jit.h"
+#include "../src/console.h"
+#include "../src/scheduler.h"
+#include "../src/loader.h"
+#include "../src/snapshot.h"
+#include "../src/journal.h"
+#include "../src/trace.h"
+#include "../src/profiler.h"
+#include "../src/cpm.h"
+#include "../src/invaders.h"
+#include "../src/audio.h"
+#include "../src/pacer.h"
+#include "../src/cpu_lanes.h"
+#include "../src/batch.h"
+#include <time.h>
 
 TEST(mov_instrucion) {
     {
         uint8_t mem[256] = {0};
-        Bus bus = {.mem = mem, .rom_size = 8};
+        Bus bus = {.mem = mem};
         CpuState cpu = {.bus = &bus};
 
         // MOV B A
@@ -23,7 +40,7 @@ TEST(mov_instrucion) {
 
     {
         uint8_t mem[256] = {0};
-        Bus bus = {.mem = mem, .rom_size = 8};
+        Bus bus = {.mem = mem};
         CpuState cpu = {.bus = &bus};
 
         cpu.h = 0x00;
@@ -43,7 +60,7 @@ TEST(mov_instrucion) {
 TEST(mvi_instruction) {
     {
         uint8_t mem[256] = {0};
-        Bus bus = {.mem = mem, .rom_size = 8};
+        Bus bus = {.mem = mem};
         CpuState cpu = {.bus = &bus};
 
         // MVI A 0xF8
@@ -60,6 +77,1583 @@ TEST(mvi_instruction) {
     }
 }
 
+TEST(lxi_instruction) {
+    {
+        uint8_t mem[256] = {0};
+        Bus bus = {.mem = mem};
+        CpuState cpu = {.bus = &bus};
+
+        // LXI D 0x1234
+        mem[0] = 0b00010001;
+        mem[1] = 0x34;
+        mem[2] = 0x12;
+
+        EXPECT_EQ(10, cpu_step(&cpu));
+
+        EXPECT_EQ(0x12, cpu.d);
+        EXPECT_EQ(0x34, cpu.e);
+        EXPECT_EQ(3, cpu.pc);
+    }
+}
+
+TEST(cmp_instruction) {
+    {
+        uint8_t mem[256] = {0};
+        Bus bus = {.mem = mem};
+        CpuState cpu = {.bus = &bus};
+
+        // CMP B
+        mem[0] = 0b10111000;
+
+        cpu.a = 0x10;
+        cpu.b = 0x20;
+
+        EXPECT_EQ(4, cpu_step(&cpu));
+
+        EXPECT_EQ(FLAG_CY, cpu.flags & FLAG_CY);
+        EXPECT_EQ(0, cpu.flags & FLAG_Z);
+        EXPECT_EQ(0x10, cpu.a);
+    }
+}
+
+TEST(psw_flags) {
+    {
+        uint8_t mem[256] = {0};
+        Bus bus = {.mem = mem};
+        CpuState cpu = {.bus = &bus};
+
+        // ADI 0x01 ; PUSH PSW ; POP B
+        uint8_t program[] = {0xC6, 0x01, 0xF5, 0xC1};
+        memcpy(mem, program, sizeof(program));
+
+        cpu.a = 0x0F;
+        cpu.sp = 0x80;
+
+        EXPECT_EQ(7, cpu_step(&cpu));
+        EXPECT_EQ(0x10, cpu.a);
+        EXPECT_EQ(FLAG_AC, cpu.flags);
+
+        EXPECT_EQ(11, cpu_step(&cpu));
+        EXPECT_EQ(10, cpu_step(&cpu));
+        EXPECT_EQ(0x10, cpu.b);
+        EXPECT_EQ(FLAG_AC | FLAG_ALWAYS_ONE, cpu.c);
+    }
+
+    {
+        uint8_t mem[256] = {0};
+        Bus bus = {.mem = mem};
+        CpuState cpu = {.bus = &bus};
+
+        // SUB A
+        mem[0] = 0b10010111;
+
+        cpu.a = 0x42;
+        cpu.flags = FLAG_CY;
+
+        EXPECT_EQ(4, cpu_step(&cpu));
+        EXPECT_EQ(0, cpu.a);
+        EXPECT_EQ(FLAG_Z | FLAG_P, cpu.flags);
+    }
+}
+
+TEST(cpu_run) {
+    {
+        uint8_t mem[256] = {0};
+        Bus bus = {.mem = mem};
+        CpuState cpu = {.bus = &bus};
+
+        // MVI B 3 ; loop: DCR B ; JNZ loop ; HLT
+        uint8_t program[] = {0x06, 0x03, 0x05, 0xC2, 0x02, 0x00, 0x76};
+        memcpy(mem, program, sizeof(program));
+
+        EXPECT_EQ(7 + 3 * (5 + 10) + 7, (int)cpu_run(&cpu, 1000));
+
+        EXPECT_EQ(1, cpu.halted);
+        EXPECT_EQ(0, cpu.b);
+        EXPECT_EQ(7, cpu.pc);
+        EXPECT_EQ(59, (int)cpu.cycle);
+
+        EXPECT_EQ(0, (int)cpu_run(&cpu, 1000));
+    }
+
+    {
+        uint8_t mem[256] = {0};
+        Bus bus = {.mem = mem};
+        CpuState cpu = {.bus = &bus};
+
+        // NOPs, stops at the first instruction boundary past the budget
+        EXPECT_EQ(12, (int)cpu_run(&cpu, 10));
+        EXPECT_EQ(3, cpu.pc);
+        EXPECT_EQ(0, cpu.halted);
+    }
+}
+
+// code served by a device, counting the bytes fetched
+typedef struct {
+    const uint8_t *code;
+    int reads;
+} CodeDevice;
+
+static uint8_t code_device_read(void *ctx, uint16_t addr) {
+    CodeDevice *device = ctx;
+    device->reads++;
+    return device->code[addr & 0xFF];
+}
+
+// MVI B 2 ; loop: JMP 0x100 ; back: DCR B ; JNZ loop ; HLT
+// on the device at 0x100: MVI A 5 ; INR A ; JMP back
+static const uint8_t device_loop_program[] = {
+    0x06, 0x02, 0xC3, 0x00, 0x01, 0x05, 0xC2, 0x02, 0x00, 0x76
+};
+static const uint8_t device_loop_code[] = {0x3E, 0x05, 0x3C, 0xC3, 0x05, 0x00};
+
+TEST(block_cache) {
+    {
+        uint8_t mem[256] = {0};
+        Bus bus = {.mem = mem};
+        CpuState cpu = {.bus = &bus};
+        BlockCache *cache = block_cache_create(&bus);
+
+        // MVI B 2 ; loop: INR C ; MVI A 0x14 ; STA loop ; DCR B ; JNZ loop ; HLT
+        // the first pass overwrites INR C with INR D
+        uint8_t program[] = {
+            0x06, 0x02, 0x0C, 0x3E, 0x14, 0x32, 0x02, 0x00,
+            0x05, 0xC2, 0x02, 0x00, 0x76
+        };
+        memcpy(mem, program, sizeof(program));
+
+        EXPECT_EQ(7 + 2 * (5 + 7 + 13 + 5 + 10) + 7, (int)cpu_run(&cpu, 1000));
+
+        EXPECT_EQ(1, cpu.halted);
+        EXPECT_EQ(1, cpu.c);
+        EXPECT_EQ(1, cpu.d);
+        EXPECT_EQ(13, cpu.pc);
+
+        block_cache_destroy(cache);
+        EXPECT_EQ(1, bus.block_cache == NULL);
+    }
+
+    {
+        uint8_t mem[256] = {0};
+        Bus bus = {.mem = mem};
+        CpuState cpu = {.bus = &bus};
+        BlockCache *cache = block_cache_create(&bus);
+
+        // loop: INR A ; JMP loop, budget ends inside the block
+        uint8_t program[] = {0x3C, 0xC3, 0x00, 0x00};
+        memcpy(mem, program, sizeof(program));
+
+        EXPECT_EQ(20, (int)cpu_run(&cpu, 16));
+        EXPECT_EQ(2, cpu.a);
+        EXPECT_EQ(1, cpu.pc);
+        EXPECT_EQ(10, (int)cpu_run(&cpu, 1));
+        EXPECT_EQ(0, cpu.pc);
+
+        block_cache_destroy(cache);
+    }
+
+    {
+        uint8_t mem[2][256] = {{0}};
+        Bus bus[2] = {{.mem = mem[0]}, {.mem = mem[1]}};
+        CpuState cpu[2] = {{.bus = &bus[0]}, {.bus = &bus[1]}};
+        BlockCache *cache = block_cache_create(&bus[1]);
+
+        // every superinstruction, against the interpreter
+        // LXI H 0x80 ; LXI D 0x105
+        // loop: MOV A,M ; INX H ; CPI 3 ; JNC skip ; INR C
+        // skip: MVI B 3
+        // inner: DCR B ; JNZ inner
+        // MOV A,L ; CPI 0x90 ; JNZ next ; LXI H 0x80
+        // next: DCX D ; MOV A,E ; ORA D ; JNZ loop ; HLT
+        uint8_t program[] = {
+            0x21, 0x80, 0x00, 0x11, 0x05, 0x01,
+            0x7E, 0x23, 0xFE, 0x03, 0xD2, 0x0E, 0x00, 0x0C,
+            0x06, 0x03,
+            0x05, 0xC2, 0x10, 0x00,
+            0x7D, 0xFE, 0x90, 0xC2, 0x1D, 0x00, 0x21, 0x80, 0x00,
+            0x1B, 0x7B, 0xB2, 0xC2, 0x06, 0x00, 0x76
+        };
+        for (int i = 0; i < 2; i++) {
+            memcpy(mem[i], program, sizeof(program));
+            for (int j = 0; j < 16; j++) mem[i][0x80 + j] = j * 5 & 7;
+        }
+
+        bool same = true;
+        while (!cpu[0].halted && same) {
+            uint64_t cycles = block_cache_run(cache, &cpu[1], 37);
+            same = cycles == cpu_run(&cpu[0], 37)
+                && cpu[0].pc == cpu[1].pc && cpu[0].a == cpu[1].a && cpu[0].flags == cpu[1].flags
+                && cpu[0].b == cpu[1].b && cpu[0].c == cpu[1].c && cpu[0].d == cpu[1].d
+                && cpu[0].e == cpu[1].e && cpu[0].h == cpu[1].h && cpu[0].l == cpu[1].l;
+        }
+        EXPECT_EQ(1, same);
+        EXPECT_EQ(1, cpu[1].halted);
+        EXPECT_EQ(1, cpu[0].cycle == cpu[1].cycle);
+        EXPECT_EQ(98, cpu[1].c);
+
+        block_cache_destroy(cache);
+    }
+
+    {
+        static uint8_t mem[2][MEM_SIZE];
+        Bus bus[2] = {0};
+        CpuState cpu[2] = {{.bus = &bus[0]}, {.bus = &bus[1]}};
+
+        // JNZ chain ; fall: INR D ; JNZ fall ; INR C ; HLT
+        // chain: BLOCK_POOL_SIZE - 2 blocks of JMP next, then XRA A ; JMP 0
+        // The pool fills up exactly, the block at 0 falls through to a new
+        // block and the flush hands its own slot to that block.
+        uint8_t program[] = {0xC2, 0x00, 0x01, 0x14, 0xC2, 0x03, 0x00, 0x0C, 0x76};
+        uint16_t addr = 0x100;
+        for (int i = 0; i < 2; i++) {
+            memset(mem[i], 0, MEM_SIZE);
+            memcpy(mem[i], program, sizeof(program));
+            bus_map_ram(&bus[i], 0, MEM_SIZE, mem[i]);
+        }
+        for (int n = 0; n < BLOCK_POOL_SIZE - 2; n++, addr += 3) {
+            uint8_t jmp[] = {0xC3, (uint8_t)(addr + 3), (uint8_t)((addr + 3) >> 8)};
+            memcpy(mem[0] + addr, jmp, sizeof(jmp));
+            memcpy(mem[1] + addr, jmp, sizeof(jmp));
+        }
+        uint8_t back[] = {0xAF, 0xC3, 0x00, 0x00};
+        memcpy(mem[0] + addr, back, sizeof(back));
+        memcpy(mem[1] + addr, back, sizeof(back));
+
+        BlockCache *cache = block_cache_create(&bus[1]);
+        uint64_t cycles = cpu_run(&cpu[1], 1000000);
+        EXPECT_EQ(cpu_run(&cpu[0], 1000000), cycles);
+        EXPECT_EQ(1, cpu[1].halted);
+        EXPECT_EQ(1, cpu[1].c);
+        EXPECT_EQ(0, cpu[1].d);
+        EXPECT_EQ(cpu[0].pc, cpu[1].pc);
+
+        block_cache_destroy(cache);
+    }
+
+    {
+        // code on a device is fetched by cpu_step every time it runs,
+        // like without the cache, not decoded ahead
+        uint8_t mem[MEM_SIZE] = {0};
+        CodeDevice device = {.code = device_loop_code};
+        Bus bus = {.mem = mem};
+        bus_map_device(&bus, 0x0100, BUS_PAGE_SIZE, code_device_read, NULL, &device);
+        CpuState cpu = {.bus = &bus};
+        memcpy(mem, device_loop_program, sizeof(device_loop_program));
+
+        BlockCache *cache = block_cache_create(&bus);
+        EXPECT_EQ(7 + 2 * (10 + 7 + 5 + 10 + 5 + 10) + 7, (int)cpu_run(&cpu, 1000));
+        EXPECT_EQ(1, cpu.halted);
+        EXPECT_EQ(6, cpu.a);
+        EXPECT_EQ(2 * sizeof(device_loop_code), device.reads);
+
+        block_cache_destroy(cache);
+    }
+}
+
+TEST(jit) {
+    {
+        uint8_t mem[2][512] = {{0}};
+        Bus bus[2] = {0};
+        bus_map_ram(&bus[0], 0, sizeof(mem[0]), mem[0]);
+        bus_map_ram(&bus[1], 0, sizeof(mem[1]), mem[1]);
+        CpuState cpu[2] = {{.bus = &bus[0]}, {.bus = &bus[1]}};
+        BlockCache *cache = block_cache_create(&bus[1]);
+        block_cache_enable_jit(cache);
+
+        // LXI H 0x100 ; LXI SP 0x200 ; MVI B 200
+        // loop: MOV A,M ; ADC B ; RAL ; MOV M,A ; PUSH PSW ; POP D ; INX H ;
+        //       CPI 7 ; DCR B ; JNZ loop ; HLT
+        uint8_t program[] = {
+            0x21, 0x00, 0x01, 0x31, 0x00, 0x02, 0x06, 0xC8,
+            0x7E, 0x88, 0x17, 0x77, 0xF5, 0xD1, 0x23, 0xFE,
+            0x07, 0x05, 0xC2, 0x08, 0x00, 0x76
+        };
+        memcpy(mem[0], program, sizeof(program));
+        memcpy(mem[1], program, sizeof(program));
+
+        // the interpreter and native code agree after every slice
+        bool same = true;
+        while (!cpu[0].halted && same) {
+            uint64_t cycles = cpu_run(&cpu[0], 50);
+            same = cycles == block_cache_run(cache, &cpu[1], 50)
+                && cpu[0].pc == cpu[1].pc && cpu[0].sp == cpu[1].sp
+                && cpu[0].a == cpu[1].a && cpu[0].flags == cpu[1].flags
+                && cpu[0].d == cpu[1].d && cpu[0].e == cpu[1].e
+                && cpu[0].h == cpu[1].h && cpu[0].l == cpu[1].l;
+        }
+        EXPECT_EQ(1, same);
+        EXPECT_EQ(1, cpu[1].halted);
+        EXPECT_EQ(cpu[0].cycle, cpu[1].cycle);
+        EXPECT_EQ(0, memcmp(mem[0], mem[1], sizeof(mem[0])));
+
+        block_cache_destroy(cache);
+    }
+
+    {
+        uint8_t mem[256] = {0};
+        Bus bus = {0};
+        bus_map_ram(&bus, 0, sizeof(mem), mem);
+        CpuState cpu = {.bus = &bus};
+        BlockCache *cache = block_cache_create(&bus);
+        block_cache_enable_jit(cache);
+
+        // MVI B 40 ; loop: INR C ; MVI A 0x14 ; STA loop ; DCR B ; JNZ loop ; HLT
+        // every pass writes over the loop, native code leaves those stores
+        // to the interpreter
+        uint8_t program[] = {
+            0x06, 0x28, 0x0C, 0x3E, 0x14, 0x32, 0x02, 0x00,
+            0x05, 0xC2, 0x02, 0x00, 0x76
+        };
+        memcpy(mem, program, sizeof(program));
+
+        EXPECT_EQ(7 + 40 * (5 + 7 + 13 + 5 + 10) + 7, (int)cpu_run(&cpu, 10000));
+
+        EXPECT_EQ(1, cpu.halted);
+        EXPECT_EQ(1, cpu.c);
+        EXPECT_EQ(39, cpu.d);
+
+        block_cache_destroy(cache);
+    }
+
+    {
+        // native code comes from host memory only, compiling stops in
+        // front of a device without reading it
+        uint8_t mem[MEM_SIZE] = {0};
+        CodeDevice device = {.code = device_loop_code};
+        Bus bus = {.mem = mem};
+        bus_map_device(&bus, 0x0100, BUS_PAGE_SIZE, code_device_read, NULL, &device);
+        CpuState cpu = {.bus = &bus, .pc = 0xFE};
+        Jit *jit = jit_create(1 << 20);
+
+        if (jit) {
+            EXPECT_EQ(1, jit_compile(jit, &bus, 0x0100, 3) == NULL);
+
+            // NOP ; NOP, then the device
+            JitBlockFn block = jit_compile(jit, &bus, 0x00FE, 4);
+            EXPECT_EQ(1, block != NULL);
+            EXPECT_EQ(8, (int)block(&cpu, 1000));
+            EXPECT_EQ(0x0100, cpu.pc);
+            EXPECT_EQ(0, device.reads);
+            jit_destroy(jit);
+        }
+    }
+}
+
+static uint8_t device_read(void *ctx, uint16_t addr) {
+    (void)ctx;
+    return addr >> 8;
+}
+
+static void device_write(void *ctx, uint16_t addr, uint8_t val) {
+    uint16_t *last = ctx;
+    last[0] = addr;
+    last[1] = val;
+}
+
+static uint8_t counting_read(void *ctx, uint16_t addr) {
+    (void)addr;
+    int *reads = ctx;
+    (*reads)++;
+    return 0x12;
+}
+
+TEST(bus) {
+    {
+        uint8_t ram[256] = {0};
+        uint8_t rom[256] = {0x11};
+        uint16_t last[2] = {0};
+        Bus bus = {0};
+        bus_map_ram(&bus, 0x0000, sizeof(ram), ram);
+        bus_map_ram(&bus, 0x4000, sizeof(ram), ram);
+        bus_map_rom(&bus, 0x1000, sizeof(rom), rom);
+        bus_map_device(&bus, 0x2000, 0x200, device_read, device_write, last);
+
+        // a mirror sees writes to the original
+        bus_write(&bus, 0x0010, 0x42);
+        EXPECT_EQ(0x42, bus_read(&bus, 0x4010));
+
+        // ROM ignores writes
+        bus_write(&bus, 0x1000, 0x22);
+        EXPECT_EQ(0x11, rom[0]);
+        EXPECT_EQ(0x11, bus_read(&bus, 0x1000));
+
+        // devices see the full address
+        EXPECT_EQ(0x21, bus_read(&bus, 0x2105));
+        bus_write(&bus, 0x2007, 0x33);
+        EXPECT_EQ(0x2007, last[0]);
+        EXPECT_EQ(0x33, last[1]);
+
+        // unmapped without mem reads 0xFF
+        EXPECT_EQ(0xFF, bus_read(&bus, 0x8000));
+        bus_unmap(&bus, 0x1000, sizeof(rom));
+        EXPECT_EQ(0xFF, bus_read(&bus, 0x1000));
+    }
+
+    {
+        uint8_t mem[256] = {0};
+        Bus bus = {0};
+        bus_map_ram(&bus, 0x0000, sizeof(mem), mem);
+        bus_map_ram(&bus, 0x8000, sizeof(mem), mem);
+        CpuState cpu = {.bus = &bus};
+        BlockCache *cache = block_cache_create(&bus);
+
+        // MVI B 2 ; loop: INR C ; MVI A 0x14 ; STA 0x8002 ; DCR B ; JNZ loop ; HLT
+        // the store goes through the mirror and still replaces INR C
+        uint8_t program[] = {
+            0x06, 0x02, 0x0C, 0x3E, 0x14, 0x32, 0x02, 0x80,
+            0x05, 0xC2, 0x02, 0x00, 0x76
+        };
+        memcpy(mem, program, sizeof(program));
+
+        cpu_run(&cpu, 1000);
+        EXPECT_EQ(1, cpu.halted);
+        EXPECT_EQ(1, cpu.c);
+        EXPECT_EQ(1, cpu.d);
+
+        block_cache_destroy(cache);
+    }
+
+    {
+        // looking at operands leaves devices alone, they peek as 0xFF
+        uint8_t mem[256] = {0};
+        int reads = 0;
+        Bus bus = {0};
+        bus_map_ram(&bus, 0x0000, sizeof(mem), mem);
+        bus_map_device(&bus, 0x0100, BUS_PAGE_SIZE, counting_read, NULL, &reads);
+        CpuState cpu = {.bus = &bus, .pc = 0xFE};
+
+        // STA 0x..34 and LDA 0x..34, the high byte on the device
+        uint16_t addr = 0;
+        mem[0xFF] = 0x34;
+        EXPECT_EQ(1, cpu_store_span(&cpu, 0x32, &addr));
+        EXPECT_EQ(0xFF34, addr);
+        EXPECT_EQ(1, cpu_load_span(&cpu, 0x3A, &addr));
+        EXPECT_EQ(0xFF34, addr);
+        EXPECT_EQ(0xFF, bus_peek(&bus, 0x0100));
+        EXPECT_EQ(0, reads);
+        EXPECT_EQ(0x12, bus_read(&bus, 0x0100));
+        EXPECT_EQ(1, reads);
+    }
+}
+
+static uint8_t port_in(void *ctx, uint8_t port) {
+    (void)ctx;
+    return port * 3;
+}
+
+static void port_out(void *ctx, uint8_t port, uint8_t val) {
+    uint8_t *last = ctx;
+    last[0] = port;
+    last[1] = val;
+}
+
+TEST(io_ports) {
+    uint8_t mem[256] = {0};
+    uint8_t last[2] = {0};
+    char *text = NULL;
+    size_t text_len = 0;
+    FILE *out = open_memstream(&text, &text_len);
+
+    Bus bus = {.mem = mem};
+    Console console;
+    bus_map_in(&bus, 5, port_in, NULL);
+    bus_map_out(&bus, 7, port_out, last);
+    console_attach(&console, &bus, 1, out);
+    CpuState cpu = {.bus = &bus};
+
+    // IN 5 ; OUT 7 ; OUT 1 ; IN 9 ; OUT 1 ; MVI A 7 ; OUT 1 ; OUT 2 ; HLT
+    // nothing handles IN 9 or OUT 2
+    uint8_t program[] = {
+        0xDB, 0x05, 0xD3, 0x07, 0xD3, 0x01, 0xDB, 0x09,
+        0xD3, 0x01, 0x3E, 0x07, 0xD3, 0x01, 0xD3, 0x02, 0x76
+    };
+    memcpy(mem, program, sizeof(program));
+    cpu_run(&cpu, 1000);
+
+    EXPECT_EQ(1, cpu.halted);
+    EXPECT_EQ(7, last[0]);
+    EXPECT_EQ(15, last[1]);
+
+    // buffered until flushed
+    fflush(out);
+    EXPECT_EQ(0, (int)text_len);
+    console_flush(&console);
+    fclose(out);
+    EXPECT_EQ(0, strcmp("15\n15\n7\n", text));
+    free(text);
+}
+
+typedef struct {
+    Scheduler *sched;
+    CpuState *cpu;
+    int fired;
+    uint64_t last_cycle;
+} Timer;
+
+// raises RST 1 every 1000 cycles
+static void timer_tick(void *ctx, uint64_t cycle) {
+    Timer *timer = ctx;
+    timer->fired++;
+    timer->last_cycle = cycle;
+    cpu_interrupt(timer->cpu, 1);
+    scheduler_add(timer->sched, cycle + 1000, timer_tick, timer);
+}
+
+static void set_flag(void *ctx, uint64_t cycle) {
+    (void)cycle;
+    *(uint8_t *)ctx = 1;
+}
+
+static uint8_t read_flag(void *ctx, uint16_t addr) {
+    (void)addr;
+    return *(uint8_t *)ctx;
+}
+
+typedef struct {
+    CpuState *cpu;
+    uint64_t fired_at;
+} FireTime;
+
+static void record_fire_time(void *ctx, uint64_t cycle) {
+    (void)cycle;
+    FireTime *fire = ctx;
+    fire->fired_at = fire->cpu->cycle;
+    fire->cpu->bus->mem[0x80] = 1;
+}
+
+static void record_order(void *ctx, uint64_t cycle) {
+    int *order = ctx;
+    order[order[0]++ + 1] = (int)cycle;
+}
+
+TEST(scheduler) {
+    {
+        // events fire by cycle, then in the order they were added
+        Scheduler sched;
+        scheduler_init(&sched);
+        int order[8] = {0};
+        uint64_t cycles[] = {300, 100, 200, 100, 50};
+        for (int i = 0; i < 5; i++) {
+            scheduler_add(&sched, cycles[i], record_order, order);
+        }
+        scheduler_cancel(&sched, record_order, NULL);
+        EXPECT_EQ(50, (int)scheduler_next(&sched));
+
+        uint8_t mem[256] = {0};
+        Bus bus = {.mem = mem};
+        CpuState cpu = {.bus = &bus};
+        EXPECT_EQ(248, (int)scheduler_run(&sched, &cpu, 248));
+        EXPECT_EQ(4, order[0]);
+        EXPECT_EQ(50, order[1]);
+        EXPECT_EQ(100, order[2]);
+        EXPECT_EQ(100, order[3]);
+        EXPECT_EQ(200, order[4]);
+        EXPECT_EQ(300, (int)scheduler_next(&sched));
+        scheduler_free(&sched);
+    }
+
+    {
+        uint8_t mem[256] = {0};
+        Bus bus = {.mem = mem};
+        CpuState cpu = {.bus = &bus};
+        Scheduler sched;
+        scheduler_init(&sched);
+        Timer timer = {.sched = &sched, .cpu = &cpu};
+        scheduler_add(&sched, 1000, timer_tick, &timer);
+
+        // LXI SP 0x100 ; EI ; loop: HLT ; JMP loop
+        // 0x08: INR B ; EI ; RET
+        uint8_t program[] = {0x31, 0x00, 0x01, 0xFB, 0x76, 0xC3, 0x04, 0x00};
+        uint8_t handler[] = {0x04, 0xFB, 0xC9};
+        memcpy(mem, program, sizeof(program));
+        memcpy(mem + 8, handler, sizeof(handler));
+
+        EXPECT_EQ(10500, (int)scheduler_run(&sched, &cpu, 10500));
+        EXPECT_EQ(10, timer.fired);
+        EXPECT_EQ(10000, (int)timer.last_cycle);
+        EXPECT_EQ(10, cpu.b);
+        EXPECT_EQ(1, cpu.halted);
+        EXPECT_EQ(1, sched.idle_cycles > 9000);
+
+        // with interrupts off the ticks are refused and HLT is final
+        cpu.interruptible = false;
+        EXPECT_EQ(0, (int)scheduler_run(&sched, &cpu, 5000));
+        cpu.halted = false;
+        cpu.pc = 4;
+        cpu_run(&cpu, 1);
+        EXPECT_EQ(1, cpu.halted);
+        EXPECT_EQ(0, cpu_interrupt(&cpu, 1));
+        EXPECT_EQ(10, cpu.b);
+
+        scheduler_free(&sched);
+    }
+
+    {
+        // loop: LDA 0x80 ; ANI 1 ; JZ loop ; MVI A 0x55 ; STA 0x81 ; DI ; HLT
+        // polls until the event sets the flag. Skipped or not, it gets
+        // there at the very same cycle.
+        uint8_t program[] = {0x3A, 0x80, 0x00, 0xE6, 0x01, 0xCA, 0x00, 0x00, 0x3E, 0x55, 0x32, 0x81, 0x00, 0xF3, 0x76};
+        uint64_t halted_at[3], idle[3];
+        for (int run = 0; run < 3; run++) {
+            static uint8_t mem[MEM_SIZE];
+            memset(mem, 0, sizeof(mem));
+            memcpy(mem, program, sizeof(program));
+            Bus bus = {0};
+            bus_map_ram(&bus, 0, MEM_SIZE, mem);
+            if (run == 2) {
+                // reading a device may have side effects, never skipped
+                bus_map_device(&bus, 0x8000, BUS_PAGE_SIZE, read_flag, NULL, mem + 0x80);
+                mem[1] = 0x00;
+                mem[2] = 0x80;
+            }
+            CpuState cpu = {.bus = &bus};
+            Scheduler sched;
+            scheduler_init(&sched);
+            sched.skip_busy_waits = run > 0;
+            scheduler_add(&sched, 100003, set_flag, mem + 0x80);
+
+            scheduler_run(&sched, &cpu, 200000);
+            EXPECT_EQ(0x55, mem[0x81]);
+            halted_at[run] = cpu.cycle;
+            idle[run] = sched.idle_cycles;
+            scheduler_free(&sched);
+        }
+        EXPECT_EQ(1, halted_at[0] == halted_at[1]);
+        EXPECT_EQ(0, (int)idle[0]);
+        EXPECT_EQ(1, idle[1] > 99000);
+        EXPECT_EQ(1, halted_at[2] == halted_at[0]);
+        EXPECT_EQ(0, (int)idle[2]);
+    }
+
+    {
+        // events due within the first probe fire at the same instruction
+        // boundary with skipping as without
+        // loop: LDA 0x80 ; ANI 1 ; JZ loop ; HLT
+        uint8_t program[] = {0x3A, 0x80, 0x00, 0xE6, 0x01, 0xCA, 0x00, 0x00, 0x76};
+        bool same = true;
+        for (uint64_t due = 1; due < 4 * BUSY_WAIT_PROBE_MIN; due++) {
+            uint64_t fired_at[2];
+            for (int skip = 0; skip < 2; skip++) {
+                uint8_t mem[256] = {0};
+                memcpy(mem, program, sizeof(program));
+                Bus bus = {.mem = mem};
+                CpuState cpu = {.bus = &bus};
+                FireTime fire = {.cpu = &cpu};
+                Scheduler sched;
+                scheduler_init(&sched);
+                sched.skip_busy_waits = skip;
+                scheduler_add(&sched, due, record_fire_time, &fire);
+                scheduler_run(&sched, &cpu, 2000);
+                fired_at[skip] = fire.fired_at;
+                scheduler_free(&sched);
+            }
+            same = same && fired_at[0] == fired_at[1];
+        }
+        EXPECT_EQ(1, same);
+    }
+}
+
+static void write_file(const char *path, const void *data, size_t len) {
+    FILE *f = fopen(path, "wb");
+    fwrite(data, 1, len, f);
+    fclose(f);
+}
+
+TEST(loader) {
+    {
+        // RAM at 0x100, a ROM page at 0x200 and 4 more ROM bytes past it
+        uint8_t code[] = {0x3E, 0x05, 0x32, 0x00, 0x02, 0x76};
+        uint8_t rom[BUS_PAGE_SIZE + 4];
+        for (size_t i = 0; i < sizeof(rom); i++) rom[i] = i * 7;
+        ImageSegment segments[] = {
+            {.origin = 0x100, .len = sizeof(code), .bytes = code},
+            {.origin = 0x200, .len = sizeof(rom), .rom = true, .bytes = rom},
+        };
+        Image saved = {.segments = segments, .segment_count = 2, .entry = 0x100};
+        EXPECT_EQ(1, image_save("/tmp/i8080_test.i80", &saved));
+
+        Image image;
+        EXPECT_EQ(1, image_load("/tmp/i8080_test.i80", IMAGE_AUTO, 0, &image));
+        EXPECT_EQ(2, (int)image.segment_count);
+        EXPECT_EQ(0x100, image.entry);
+
+        static uint8_t mem[MEM_SIZE];
+        Bus bus = {0};
+        bus_map_ram(&bus, 0, MEM_SIZE, mem);
+        image_map(&image, &bus, mem);
+        CpuState cpu = {.bus = &bus, .pc = image.entry};
+
+        // the page is read straight from the file and ignores the store
+        EXPECT_EQ(1, bus.read_page[2] == image.segments[1].bytes);
+        cpu_run(&cpu, 100);
+        EXPECT_EQ(1, cpu.halted);
+        EXPECT_EQ(0, bus_read(&bus, 0x200));
+        EXPECT_EQ(rom[0x101], bus_read(&bus, 0x301));
+        EXPECT_EQ(rom[0x101], mem[0x301]);
+
+        image_free(&image);
+    }
+
+    {
+        // 3 bytes at 0x1234, start linear address 0x1234
+        const char *hex =
+            ":031234003E0776FC\r\n"
+            ":0400000500001234B1\r\n"
+            ":00000001FF\r\n";
+        write_file("/tmp/i8080_test.hex", hex, strlen(hex));
+
+        Image image;
+        EXPECT_EQ(1, image_load("/tmp/i8080_test.hex", IMAGE_AUTO, 0, &image));
+        EXPECT_EQ(1, (int)image.segment_count);
+        EXPECT_EQ(0x1234, image.segments[0].origin);
+        EXPECT_EQ(3, (int)image.segments[0].len);
+        EXPECT_EQ(0x1234, image.entry);
+        EXPECT_EQ(0x3E, image.segments[0].bytes[0]);
+        image_free(&image);
+
+        const char *bad = ":031234003E0776FD\n";
+        write_file("/tmp/i8080_test.hex", bad, strlen(bad));
+        EXPECT_EQ(0, image_load("/tmp/i8080_test.hex", IMAGE_AUTO, 0, &image));
+
+        // a base of 0 is fine, any other one is past 64K, as is data
+        // running over the top
+        const char *zero_base = ":020000040000FA\n:031234003E0776FC\n:00000001FF\n";
+        write_file("/tmp/i8080_test.hex", zero_base, strlen(zero_base));
+        EXPECT_EQ(1, image_load("/tmp/i8080_test.hex", IMAGE_AUTO, 0, &image));
+        image_free(&image);
+        const char *linear = ":02000004FFFFFC\n:01FFFF000001\n:00000001FF\n";
+        write_file("/tmp/i8080_test.hex", linear, strlen(linear));
+        EXPECT_EQ(0, image_load("/tmp/i8080_test.hex", IMAGE_AUTO, 0, &image));
+        const char *segment = ":020000021000EC\n:031234003E0776FC\n";
+        write_file("/tmp/i8080_test.hex", segment, strlen(segment));
+        EXPECT_EQ(0, image_load("/tmp/i8080_test.hex", IMAGE_AUTO, 0, &image));
+        const char *over_top = ":02FFFF00AABB9D\n";
+        write_file("/tmp/i8080_test.hex", over_top, strlen(over_top));
+        EXPECT_EQ(0, image_load("/tmp/i8080_test.hex", IMAGE_AUTO, 0, &image));
+    }
+
+    {
+        uint8_t com[] = {0x3E, 0x01, 0x76};
+        write_file("/tmp/i8080_test.com", com, sizeof(com));
+
+        Image image;
+        EXPECT_EQ(1, image_load("/tmp/i8080_test.com", IMAGE_AUTO, 0, &image));
+        EXPECT_EQ(0x100, image.segments[0].origin);
+        EXPECT_EQ(0x100, image.entry);
+        image_free(&image);
+
+        EXPECT_EQ(1, image_load("/tmp/i8080_test.com", IMAGE_RAW, 0x8000, &image));
+        EXPECT_EQ(0x8000, image.segments[0].origin);
+        EXPECT_EQ(0x8000, image.entry);
+        image_free(&image);
+
+        // raw images other than .COM start at their origin as well
+        write_file("/tmp/i8080_test.bin", com, sizeof(com));
+        EXPECT_EQ(1, image_load("/tmp/i8080_test.bin", IMAGE_AUTO, 0x8000, &image));
+        EXPECT_EQ(0x8000, image.segments[0].origin);
+        EXPECT_EQ(0x8000, image.entry);
+        image_free(&image);
+    }
+
+    {
+        // legacy byte counts have to stay within the file
+        size_t count = 3;
+        uint8_t legacy[sizeof(size_t) + 3] = {0};
+        memcpy(legacy, &count, sizeof(count));
+        write_file("/tmp/i8080_test.bin", legacy, sizeof(legacy));
+        Image image;
+        EXPECT_EQ(1, image_load("/tmp/i8080_test.bin", IMAGE_LEGACY, 0, &image));
+        EXPECT_EQ(3, (int)image.segments[0].len);
+        image_free(&image);
+
+        count = 100;
+        memcpy(legacy, &count, sizeof(count));
+        write_file("/tmp/i8080_test.bin", legacy, sizeof(legacy));
+        EXPECT_EQ(0, image_load("/tmp/i8080_test.bin", IMAGE_LEGACY, 0, &image));
+        write_file("/tmp/i8080_test.bin", legacy, 4);
+        EXPECT_EQ(0, image_load("/tmp/i8080_test.bin", IMAGE_LEGACY, 0, &image));
+        write_file("/tmp/i8080_test.bin", legacy, 0);
+        EXPECT_EQ(0, image_load("/tmp/i8080_test.bin", IMAGE_LEGACY, 0, &image));
+    }
+
+    remove("/tmp/i8080_test.i80");
+    remove("/tmp/i8080_test.hex");
+    remove("/tmp/i8080_test.com");
+    remove("/tmp/i8080_test.bin");
+}
+
+TEST(snapshot) {
+    for (int jit = 0; jit < 2; jit++) {
+        static uint8_t mem[MEM_SIZE];
+        memset(mem, 0, sizeof(mem));
+        Bus bus = {0};
+        bus_map_ram(&bus, 0, MEM_SIZE, mem);
+        CpuState cpu = {.bus = &bus};
+        BlockCache *cache = block_cache_create(&bus);
+        if (jit) block_cache_enable_jit(cache);
+
+        // LXI H 0x2000 ; loop: MOV M,L ; INR L ; JNZ loop ; MVI A 0x3C ; STA 3 ; HLT
+        // the STA turns INR L into INR A for the next run
+        uint8_t program[] = {
+            0x21, 0x00, 0x20, 0x75, 0x2C, 0xC2, 0x03, 0x00,
+            0x3E, 0x3C, 0x32, 0x04, 0x00, 0x76
+        };
+        memcpy(mem, program, sizeof(program));
+        mem[0x5000] = 0x11;
+
+        Snapshot *snap = cpu_snapshot(&cpu);
+        EXPECT_EQ(1, snap != NULL);
+
+        for (int run = 0; run < 3; run++) {
+            cpu_run(&cpu, 100000);
+            EXPECT_EQ(1, cpu.halted);
+            EXPECT_EQ(0xFF, mem[0x20FF]);
+            EXPECT_EQ(0x3C, mem[4]);
+
+            // changed behind the bus, an incremental restore leaves it
+            mem[0x5000] = 0x22;
+            cpu_restore(&cpu, snap);
+            EXPECT_EQ(0, cpu.halted);
+            EXPECT_EQ(0, cpu.pc);
+            EXPECT_EQ(0, (int)cpu.cycle);
+            EXPECT_EQ(0x2C, mem[4]);
+            EXPECT_EQ(0, mem[0x20FF]);
+            EXPECT_EQ(0x22, mem[0x5000]);
+        }
+
+        // a different snapshot restores every page
+        Snapshot *other = cpu_snapshot(&cpu);
+        cpu_restore(&cpu, snap);
+        EXPECT_EQ(0x11, mem[0x5000]);
+        snapshot_free(other);
+
+        // freeing stops the tracking, so a snapshot that gets the address
+        // of a freed one is not taken for it
+        EXPECT_EQ(1, snapshot_save(snap, NULL, "/tmp/i8080_test.sav"));
+        Snapshot *gone = cpu_snapshot(&cpu);
+        cpu_run(&cpu, 100000);
+        mem[0x5000] = 0x33;
+        snapshot_free(gone);
+        EXPECT_EQ(0, (int)bus.dirty_generation);
+        EXPECT_EQ(1, bus.write_page[0x50] != NULL);
+        Snapshot *loaded = snapshot_load("/tmp/i8080_test.sav", NULL);
+        cpu_restore(&cpu, loaded);
+        EXPECT_EQ(0x11, mem[0x5000]);
+        EXPECT_EQ(0, memcmp(loaded->mem, mem, sizeof(mem)));
+        snapshot_free(loaded);
+        remove("/tmp/i8080_test.sav");
+
+        snapshot_free(snap);
+        block_cache_destroy(cache);
+    }
+
+    {
+        static uint8_t mem[MEM_SIZE];
+        uint8_t code[] = {0x3E, 0x01, 0x76};
+        ImageSegment segment = {.origin = 0, .len = sizeof(code), .bytes = code};
+        Image image = {.segments = &segment, .segment_count = 1};
+
+        memset(mem, 0, sizeof(mem));
+        Bus bus = {0};
+        bus_map_ram(&bus, 0, 0x8000, mem);
+        image_map(&image, &bus, mem);
+        CpuState cpu = {.bus = &bus, .sp = 0x1234, .cycle = 99};
+        mem[0x7FFF] = 0xAB;
+
+        Snapshot *snap = cpu_snapshot(&cpu);
+        EXPECT_EQ(1, snapshot_save(snap, &image, "/tmp/i8080_test.sav"));
+
+        FILE *f = fopen("/tmp/i8080_test.sav", "rb");
+        fseek(f, 0, SEEK_END);
+        EXPECT_EQ(62 + 1 + BUS_PAGE_SIZE, (int)ftell(f));
+        fclose(f);
+
+        Snapshot *loaded = snapshot_load("/tmp/i8080_test.sav", &image);
+        EXPECT_EQ(1, loaded != NULL);
+        EXPECT_EQ(0, memcmp(snap->mem, loaded->mem, sizeof(snap->mem)));
+        EXPECT_EQ(0, memcmp(snap->saved, loaded->saved, sizeof(snap->saved)));
+        EXPECT_EQ(0x1234, loaded->cpu.sp);
+        EXPECT_EQ(99, (int)loaded->cpu.cycle);
+
+        snapshot_free(loaded);
+        snapshot_free(snap);
+        remove("/tmp/i8080_test.sav");
+    }
+}
+
+TEST(journal) {
+    static uint8_t mem[MEM_SIZE];
+    static uint8_t saved_mem[3][MEM_SIZE];
+    CpuState saved[3];
+    int save_at[3] = {1500, 700, 100};
+
+    memset(mem, 0, sizeof(mem));
+    Bus bus = {0};
+    bus_map_ram(&bus, 0, MEM_SIZE, mem);
+    CpuState cpu = {.bus = &bus};
+
+    // LXI SP 0x1000 ; LXI H 0x2000
+    // loop: MOV M,L ; PUSH H ; CALL sub ; INR L ; JNZ loop ; HLT
+    // sub: SHLD 0x3000 ; RET
+    uint8_t program[] = {
+        0x31, 0x00, 0x10, 0x21, 0x00, 0x20, 0x75, 0xE5,
+        0xCD, 0x10, 0x00, 0x2C, 0xC2, 0x06, 0x00, 0x76,
+        0x22, 0x00, 0x30, 0xC9
+    };
+    memcpy(mem, program, sizeof(program));
+
+    // the ring holds 64 instructions, older ones come from checkpoints
+    Journal *journal = journal_create(64, 3000);
+    for (int step = 0; !cpu.halted; step++) {
+        for (int i = 0; i < 3; i++) {
+            if (step == save_at[i]) {
+                saved[i] = cpu;
+                memcpy(saved_mem[i], mem, sizeof(mem));
+            }
+        }
+        journal_step(journal, &cpu);
+    }
+    EXPECT_EQ(0xFF, mem[0x20FF]);
+
+    for (int i = 0; i < 3; i++) {
+        EXPECT_EQ(1, journal_rewind(journal, &cpu, cpu.cycle - saved[i].cycle));
+        EXPECT_EQ((int)saved[i].cycle, (int)cpu.cycle);
+        EXPECT_EQ(saved[i].pc, cpu.pc);
+        EXPECT_EQ(saved[i].sp, cpu.sp);
+        EXPECT_EQ(saved[i].l, cpu.l);
+        EXPECT_EQ(saved[i].flags, cpu.flags);
+        EXPECT_EQ(0, cpu.halted);
+        EXPECT_EQ(0, memcmp(saved_mem[i], mem, sizeof(mem)));
+    }
+
+    // stepping back one instruction and running it again lands in the same place
+    CpuState before = cpu;
+    journal_step(journal, &cpu);
+    EXPECT_EQ(1, journal_step_back(journal, &cpu));
+    EXPECT_EQ(before.pc, cpu.pc);
+    EXPECT_EQ((int)before.cycle, (int)cpu.cycle);
+
+    EXPECT_EQ(0, journal_rewind(journal, &cpu, cpu.cycle + 1));
+    journal_destroy(journal);
+}
+
+TEST(trace) {
+    static uint8_t mem[MEM_SIZE];
+    memset(mem, 0, sizeof(mem));
+    Bus bus = {0};
+    bus_map_ram(&bus, 0, MEM_SIZE, mem);
+    CpuState cpu = {.bus = &bus, .sp = 0x1000};
+
+    // LXI H 0x2000 ; loop: MOV M,L ; INR L ; JNZ loop ; PUSH H ; POP B ;
+    // LXI B next ; PUSH B ; XRA A ; RZ ; next: CZ after ; after: POP D ; HLT
+    // RZ and CZ are taken to the instruction after them
+    uint8_t program[] = {
+        0x21, 0x00, 0x20, 0x75, 0x2C, 0xC2, 0x03, 0x00, 0xE5, 0xC1,
+        0x01, 0x10, 0x00, 0xC5, 0xAF, 0xC8, 0xCC, 0x13, 0x00, 0xD1, 0x76
+    };
+    memcpy(mem, program, sizeof(program));
+
+    const char *path = "/tmp/i8080_test.trace";
+    Tracer *tracer = trace_open(path, &cpu);
+    EXPECT_EQ(1, tracer != NULL);
+    trace_run(tracer, &cpu, 100000);
+    EXPECT_EQ(1, trace_close(tracer));
+    EXPECT_EQ(1, cpu.halted);
+
+    FILE *f = fopen(path, "rb");
+    uint8_t data[8192];
+    size_t len = fread(data, 1, sizeof(data), f);
+    fclose(f);
+    EXPECT_EQ(0, memcmp(data, "I80T", 4));
+
+    // walk the records, counting instructions, cycles, jumps and stores
+    int records = 0, jumps = 0, stores = 0, loads = 0;
+    uint64_t cycles = 0;
+    uint16_t pc = 0;
+    size_t i = TRACE_HEADER_SIZE;
+    while (i < len) {
+        uint8_t tags = data[i++];
+        if (tags & TRACE_PC) {
+            pc = data[i] | data[i + 1] << 8;
+            jumps++;
+            i += 2;
+        }
+        int ilen = (tags >> TRACE_LEN_SHIFT) & 3;
+        i += ilen;
+        cycles += data[i++];
+        if (tags & TRACE_REGS) {
+            uint8_t mask = data[i++];
+            i += __builtin_popcount(mask);
+        }
+        if (tags & TRACE_SP) i += 2;
+        if (tags & TRACE_LOAD) {
+            EXPECT_EQ(0x0FFE, data[i + 1] | data[i + 2] << 8);
+            loads++;
+            i += 3 + data[i];
+        }
+        if (tags & TRACE_STORE) {
+            stores++;
+            i += 3 + data[i];
+        }
+        pc += ilen;
+        records++;
+    }
+    EXPECT_EQ((int)len, (int)i);
+    EXPECT_EQ(1 + 256 * 3 + 9, records);
+    EXPECT_EQ(255, jumps);
+    EXPECT_EQ(259, stores);
+    EXPECT_EQ(3, loads);
+    EXPECT_EQ((int)cpu.cycle, (int)cycles);
+    EXPECT_EQ(cpu.pc, pc);
+    remove(path);
+}
+
+TEST(profiler) {
+    static uint8_t mem[MEM_SIZE];
+    memset(mem, 0, sizeof(mem));
+    Bus bus = {0};
+    bus_map_ram(&bus, 0, MEM_SIZE, mem);
+    CpuState cpu = {.bus = &bus};
+
+    // LXI SP 0x1000 ; MVI B 3 ; loop: CALL outer ; DCR B ; JNZ loop ; HLT
+    // outer: CALL inner ; CALL inner ; RET
+    // inner: NOP ; RET
+    uint8_t program[] = {
+        0x31, 0x00, 0x10, 0x06, 0x03, 0xCD, 0x10, 0x00, 0x05, 0xC2, 0x05, 0x00, 0x76
+    };
+    uint8_t outer[] = {0xCD, 0x20, 0x00, 0xCD, 0x20, 0x00, 0xC9};
+    uint8_t inner[] = {0x00, 0xC9};
+    memcpy(mem, program, sizeof(program));
+    memcpy(mem + 0x10, outer, sizeof(outer));
+    memcpy(mem + 0x20, inner, sizeof(inner));
+
+    Profiler *profiler = profiler_create();
+    cpu_run_profiled(&cpu, profiler, 100000);
+    EXPECT_EQ(1, cpu.halted);
+    EXPECT_EQ(3, (int)profiler->count[0x05]);
+    EXPECT_EQ(6, (int)profiler->count[0x20]);
+    EXPECT_EQ(6 * 4, (int)profiler->cycles[0x20]);
+    EXPECT_EQ(0, profiler->depth);
+
+    const char *path = "/tmp/i8080_test.folded";
+    EXPECT_EQ(1, profiler_write_folded(profiler, path));
+    char folded[256] = {0};
+    FILE *f = fopen(path, "r");
+    fread(folded, 1, sizeof(folded) - 1, f);
+    fclose(f);
+    remove(path);
+
+    // nodes are written in the order they were first entered
+    EXPECT_EQ(0, strcmp("root 120\nroot;0010 132\nroot;0010;0020 84\n", folded));
+    EXPECT_EQ(120 + 132 + 84, (int)cpu.cycle);
+    profiler_destroy(profiler);
+}
+
+TEST(cpm) {
+    static uint8_t mem[MEM_SIZE];
+    memset(mem, 0, sizeof(mem));
+    Bus bus = {0};
+    bus_map_ram(&bus, 0, MEM_SIZE, mem);
+    CpuState cpu = {.bus = &bus};
+
+    // LHLD 6 ; SPHL ; MVI C 9 ; LXI D msg ; CALL 5 ;
+    // MVI C 2 ; MVI E '!' ; CALL 5 ; JMP 0 ; msg: "hi$"
+    uint8_t program[] = {
+        0x2A, 0x06, 0x00, 0xF9, 0x0E, 0x09, 0x11, 0x16, 0x01, 0xCD, 0x05, 0x00,
+        0x0E, 0x02, 0x1E, '!', 0xCD, 0x05, 0x00, 0xC3, 0x00, 0x00, 'h', 'i', '$'
+    };
+    memcpy(mem + CPM_TPA, program, sizeof(program));
+
+    FILE *out = tmpfile();
+    Cpm cpm;
+    cpm_install(&cpm, &cpu, mem, out);
+    cpm_run(&cpm, &cpu, 100000);
+    EXPECT_EQ(1, cpm.exited);
+    EXPECT_EQ(2, (int)cpm.bdos_calls);
+    EXPECT_EQ(CPM_BDOS, cpu.sp);
+
+    char text[16] = {0};
+    rewind(out);
+    EXPECT_EQ(3, (int)fread(text, 1, sizeof(text), out));
+    EXPECT_EQ(0, strcmp("hi!", text));
+    fclose(out);
+
+    // returning to the CCP exits too, a HLT in the program is no trap
+    uint8_t ret[] = {0xC9};
+    memcpy(mem + CPM_TPA, ret, sizeof(ret));
+    cpm_install(&cpm, &cpu, mem, stdout);
+    cpm_run(&cpm, &cpu, 100000);
+    EXPECT_EQ(1, cpm.exited);
+
+    mem[CPM_TPA] = 0x76;
+    cpm_install(&cpm, &cpu, mem, stdout);
+    cpm_run(&cpm, &cpu, 100000);
+    EXPECT_EQ(0, cpm.exited);
+    EXPECT_EQ(1, cpu.halted);
+    EXPECT_EQ(CPM_TPA + 1, cpu.pc);
+}
+
+TEST(invaders) {
+    // 0x00: JMP 0x60 ; RST 1: JMP 0x20 ; RST 2: JMP 0x30
+    // 0x60: LXI SP 0x2400 ; MVI A 0x81 ; STA 0x2400 ; EI ; loop: JMP loop
+    // 0x20: PUSH PSW ; LDA 0x2000 ; INR A ; STA 0x2000 ; POP PSW ; EI ; RET
+    // 0x30: PUSH PSW ; LDA 0x2001 ; INR A ; STA 0x2001 ;
+    //       MVI A 0xAB ; OUT 4 ; MVI A 0xCD ; OUT 4 ; MVI A 4 ; OUT 2 ;
+    //       IN 3 ; STA 0x2002 ; IN 1 ; STA 0x2003 ; POP PSW ; EI ; RET
+    static uint8_t rom[0x100];
+    uint8_t vectors[] = {
+        0xC3, 0x60, 0x00, 0, 0, 0, 0, 0, 0xC3, 0x20, 0x00, 0, 0, 0, 0, 0, 0xC3, 0x30, 0x00
+    };
+    uint8_t start[] = {0x31, 0x00, 0x24, 0x3E, 0x81, 0x32, 0x00, 0x24, 0xFB, 0xC3, 0x69, 0x00};
+    uint8_t rst1[] = {0xF5, 0x3A, 0x00, 0x20, 0x3C, 0x32, 0x00, 0x20, 0xF1, 0xFB, 0xC9};
+    uint8_t rst2[] = {
+        0xF5, 0x3A, 0x01, 0x20, 0x3C, 0x32, 0x01, 0x20,
+        0x3E, 0xAB, 0xD3, 0x04, 0x3E, 0xCD, 0xD3, 0x04, 0x3E, 0x04, 0xD3, 0x02,
+        0xDB, 0x03, 0x32, 0x02, 0x20, 0xDB, 0x01, 0x32, 0x03, 0x20, 0xF1, 0xFB, 0xC9
+    };
+    memset(rom, 0, sizeof(rom));
+    memcpy(rom, vectors, sizeof(vectors));
+    memcpy(rom + 0x60, start, sizeof(start));
+    memcpy(rom + 0x20, rst1, sizeof(rst1));
+    memcpy(rom + 0x30, rst2, sizeof(rst2));
+
+    ImageSegment seg = {.origin = 0, .len = sizeof(rom), .bytes = rom};
+    Image image = {.segments = &seg, .segment_count = 1};
+    static Invaders machine;
+    EXPECT_EQ(1, invaders_init(&machine, &image));
+    invaders_set_input(&machine, INVADERS_COIN, true);
+
+    bool ran = true;
+    for (int i = 0; i < INVADERS_FPS; i++) {
+        ran = invaders_run_frame(&machine) && ran;
+    }
+    EXPECT_EQ(1, ran);
+    EXPECT_EQ(INVADERS_FPS, machine.mem[0x2000]);
+    EXPECT_EQ(INVADERS_FPS, machine.mem[0x2001]);
+    EXPECT_EQ(1, machine.cpu.cycle >= INVADERS_CLOCK && machine.cpu.cycle < INVADERS_CLOCK + 20);
+    EXPECT_EQ(0xDA, machine.mem[0x2002]);
+    EXPECT_EQ(0x09, machine.mem[0x2003]);
+
+    // RAM is mirrored above 0x4000, ROM ignores stores
+    EXPECT_EQ(0x81, bus_read(&machine.bus, 0x6400));
+    bus_write(&machine.bus, 0x0000, 0xFF);
+    EXPECT_EQ(0xC3, bus_read(&machine.bus, 0x0000));
+
+    static uint32_t pixels[INVADERS_TEXTURE_WIDTH * INVADERS_TEXTURE_HEIGHT];
+    invaders_render(&machine, pixels);
+    EXPECT_EQ(1, pixels[0] == 0xFFFFFFFF);
+    EXPECT_EQ(1, pixels[1] == 0xFF000000);
+    EXPECT_EQ(1, pixels[7] == 0xFFFFFFFF);
+    EXPECT_EQ(1, pixels[8] == 0xFF000000);
+
+    // only the page written since the last render converts, through a
+    // mirror as well, and once
+    int first, last;
+    EXPECT_EQ(0, invaders_render_dirty(&machine, pixels, &first, &last));
+    bus_write(&machine.bus, 0x6400 + 3 * BUS_PAGE_SIZE + 0x40, 0x01);
+    bus_write(&machine.bus, 0x2400 + 3 * BUS_PAGE_SIZE + 0x41, 0x01);
+    EXPECT_EQ(8, invaders_render_dirty(&machine, pixels, &first, &last));
+    EXPECT_EQ(24, first);
+    EXPECT_EQ(31, last);
+    EXPECT_EQ(1, pixels[26 * INVADERS_TEXTURE_WIDTH] != 0xFF000000);
+    EXPECT_EQ(1, pixels[26 * INVADERS_TEXTURE_WIDTH + 8] != 0xFF000000);
+    EXPECT_EQ(0, invaders_render_dirty(&machine, pixels, &first, &last));
+
+    // rising latch bits start their sample, only the UFO stops again
+    static Audio audio;
+    audio_init(&audio, INVADERS_CLOCK, INVADERS_CLOCK, 0);
+    machine.audio = &audio;
+    const BusOutPort *sound = &machine.bus.out_port[3];
+    sound->out(sound->ctx, 3, 0x03);
+    sound->out(sound->ctx, 3, 0x02);
+    sound->out(sound->ctx, 3, 0x00);
+    sound = &machine.bus.out_port[5];
+    sound->out(sound->ctx, 5, 0x14);
+    EXPECT_EQ(5, (int)atomic_load(&audio.tail));
+    EXPECT_EQ(INVADERS_SOUND_UFO, audio.events[0].sample);
+    EXPECT_EQ(INVADERS_SOUND_SHOT, audio.events[1].sample);
+    EXPECT_EQ(INVADERS_SOUND_UFO, audio.events[2].sample);
+    EXPECT_EQ(0, audio.events[2].start);
+    EXPECT_EQ(INVADERS_SOUND_FLEET + 2, audio.events[3].sample);
+    EXPECT_EQ(INVADERS_SOUND_UFO_HIT, audio.events[4].sample);
+    EXPECT_EQ(1, audio.events[4].cycle == machine.bus.port_cycle);
+
+    // events carry the cycle of their OUT, not the one the run started at
+    // MVI A 2 ; NOP ; OUT 3 ; HLT
+    uint8_t shot[] = {0x3E, 0x02, 0x00, 0xD3, 0x03, 0x76};
+    for (int core = 0; core < 4; core++) {
+        BlockCache *cache = NULL;
+        if (core >= 2) {
+            cache = block_cache_create(&machine.bus);
+            if (core == 3) block_cache_enable_jit(cache);
+        }
+        for (size_t i = 0; i < sizeof(shot); i++) {
+            bus_write(&machine.bus, 0x2000 + i, shot[i]);
+        }
+        machine.sound[0] = 0;
+        machine.cpu = (CpuState){.bus = &machine.bus, .pc = 0x2000, .cycle = 1000};
+        size_t tail = atomic_load(&audio.tail);
+        if (core == 1) {
+            cpu_run_lazy(&machine.cpu, 100);
+        } else {
+            cpu_run(&machine.cpu, 100);
+        }
+        EXPECT_EQ(1, machine.cpu.halted);
+        EXPECT_EQ(tail + 1, atomic_load(&audio.tail));
+        EXPECT_EQ(INVADERS_SOUND_SHOT, audio.events[tail].sample);
+        EXPECT_EQ(1011, audio.events[tail].cycle);
+        block_cache_destroy(cache);
+    }
+    invaders_free(&machine);
+}
+
+TEST(audio) {
+    static Audio audio;
+    int16_t shot[] = {100, 200, 300};
+    int16_t ufo[] = {-7, 7};
+    int16_t out[12];
+    audio_init(&audio, 2000, 1000, 4);
+    audio_set_sample(&audio, 0, shot, 3, false);
+    audio_set_sample(&audio, 1, ufo, 2, true);
+
+    // silent until the first event, which it then trails by the latency
+    audio_mix(&audio, out, 2);
+    EXPECT_EQ(0, out[0]);
+    EXPECT_EQ(1, audio_push(&audio, (AudioEvent){.cycle = 1000, .sample = 0, .start = true}));
+    EXPECT_EQ(1, audio_push(&audio, (AudioEvent){.cycle = 1002, .sample = 1, .start = true}));
+    EXPECT_EQ(1, audio_push(&audio, (AudioEvent){.cycle = 1008, .sample = 1, .start = false}));
+    audio_mix(&audio, out, 8);
+    EXPECT_EQ(0, out[1]);
+    EXPECT_EQ(100, out[2]);
+    EXPECT_EQ(193, out[3]);
+    EXPECT_EQ(307, out[4]);
+    EXPECT_EQ(-7, out[5]);
+    EXPECT_EQ(0, out[6]);
+    EXPECT_EQ(0, out[7]);
+    EXPECT_EQ(1, atomic_load(&audio.head) == atomic_load(&audio.tail));
+
+    // a full ring drops instead of waiting
+    for (int i = 0; i < AUDIO_RING_SIZE; i++) {
+        audio_push(&audio, (AudioEvent){.cycle = 2000, .sample = 0, .start = true});
+    }
+    EXPECT_EQ(0, audio_push(&audio, (AudioEvent){.cycle = 2000, .sample = 0, .start = true}));
+    EXPECT_EQ(1, (int)atomic_load(&audio.dropped));
+
+    // far ahead of the playhead: put back on the events
+    audio_mix(&audio, out, 12);
+    EXPECT_EQ(0, out[1]);
+    EXPECT_EQ(100, out[2]);
+}
+
+static double elapsed_ms(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+TEST(pacer) {
+    // 1 kHz, a cycle per ms
+    Pacer pacer;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pacer_init(&pacer, 1000, 100);
+    EXPECT_EQ(0, (int)pacer_wait(&pacer, 120));
+    EXPECT_EQ(1, elapsed_ms(&start) >= 20 && elapsed_ms(&start) < 60);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pacer_set_speed(&pacer, 2.0, 120);
+    pacer_wait(&pacer, 140);
+    EXPECT_EQ(1, elapsed_ms(&start) >= 10 && elapsed_ms(&start) < 19);
+
+    // turbo does not wait, and does not owe the time afterwards either
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pacer.turbo = true;
+    pacer_wait(&pacer, 1000000);
+    pacer.turbo = false;
+    pacer_wait(&pacer, 1000010);
+    EXPECT_EQ(1, elapsed_ms(&start) >= 5 && elapsed_ms(&start) < 14);
+
+    // behind schedule it says by how much
+    struct timespec nap = {0, 5000000};
+    nanosleep(&nap, NULL);
+    EXPECT_EQ(1, pacer_wait(&pacer, 1000010) >= 5000000);
+}
+
+TEST(cpu_lazy) {
+    uint8_t mem[2][256] = {{0}};
+    Bus bus[2] = {{.mem = mem[0]}, {.mem = mem[1]}};
+    CpuState cpu[2] = {{.bus = &bus[0]}, {.bus = &bus[1]}};
+
+    // every flag reader after every kind of flag writer, against cpu_run
+    // LXI SP 0x100 ; MVI B 0x10
+    // loop: MOV A,B ; ADI 0x39 ; DAA ; ACI 0x80 ; PUSH PSW ; POP D
+    // SUI 0x47 ; SBI 1 ; CZ sub ; ANI 0x5A ; RAL ; XRI 0x3C ; JPE skip ; INR H
+    // skip: ORA B ; INR L ; JM next ; PUSH PSW ; POP PSW
+    // next: DCR B ; JNZ loop ; CMP C ; HLT
+    // sub: INR C ; RC ; DCR L ; RNC
+    uint8_t program[] = {
+        0x31, 0x00, 0x01, 0x06, 0x10,
+        0x78, 0xC6, 0x39, 0x27, 0xCE, 0x80, 0xF5, 0xD1,
+        0xD6, 0x47, 0xDE, 0x01, 0xCC, 0x30, 0x00, 0xE6, 0x5A, 0x17, 0xEE, 0x3C, 0xEA, 0x1D, 0x00, 0x24,
+        0xB0, 0x2C, 0xFA, 0x24, 0x00, 0xF5, 0xF1,
+        0x05, 0xC2, 0x05, 0x00, 0xB9, 0x76,
+    };
+    uint8_t sub[] = {0x0C, 0xD8, 0x2D, 0xD0};
+    for (int i = 0; i < 2; i++) {
+        memcpy(mem[i], program, sizeof(program));
+        memcpy(mem[i] + 0x30, sub, sizeof(sub));
+    }
+
+    // short budgets materialize the flags between most instructions
+    bool same = true;
+    for (int budget = 5; !cpu[0].halted && same; budget = budget % 23 + 5) {
+        uint64_t cycles = cpu_run_lazy(&cpu[1], budget);
+        same = cycles == cpu_run(&cpu[0], budget)
+            && cpu[0].pc == cpu[1].pc && cpu[0].a == cpu[1].a && cpu[0].flags == cpu[1].flags
+            && cpu[0].b == cpu[1].b && cpu[0].c == cpu[1].c && cpu[0].d == cpu[1].d
+            && cpu[0].e == cpu[1].e && cpu[0].h == cpu[1].h && cpu[0].l == cpu[1].l
+            && cpu[0].sp == cpu[1].sp;
+    }
+    EXPECT_EQ(1, same);
+    EXPECT_EQ(1, cpu[1].halted);
+    EXPECT_EQ(1, cpu[0].cycle == cpu[1].cycle);
+    EXPECT_EQ(0, memcmp(mem[0], mem[1], sizeof(mem[0])));
+
+    // and in one go
+    CpuState eager = cpu[0];
+    memcpy(mem[1], program, sizeof(program));
+    cpu[1] = (CpuState){.bus = &bus[1]};
+    cpu_run_lazy(&cpu[1], 100000);
+    EXPECT_EQ(1, cpu[1].halted);
+    EXPECT_EQ(eager.flags, cpu[1].flags);
+    EXPECT_EQ(eager.a, cpu[1].a);
+    EXPECT_EQ(eager.c, cpu[1].c);
+    EXPECT_EQ(1, eager.cycle == cpu[1].cycle);
+
+    // POP PSW of a byte no result produces: S with Z, Z without P, bit 3
+    // LXI SP 0x80 ; POP PSW ; JZ l1 ; HLT
+    // l1: JM l2 ; HLT
+    // l2: JPE l3 ; INR A
+    // l3: ACI 1 ; PUSH PSW ; HLT
+    uint8_t pop_program[] = {
+        0x31, 0x80, 0x00, 0xF1, 0xCA, 0x08, 0x00, 0x76,
+        0xFA, 0x0C, 0x00, 0x76,
+        0xEA, 0x10, 0x00, 0x3C,
+        0xCE, 0x01, 0xF5, 0x76,
+    };
+    uint8_t pop_flags[] = {0xC2, 0x42, 0xC7, 0x4B, 0xDB};
+    for (size_t i = 0; i < sizeof(pop_flags); i++) {
+        for (int j = 0; j < 2; j++) {
+            memset(mem[j], 0, sizeof(mem[j]));
+            memcpy(mem[j], pop_program, sizeof(pop_program));
+            mem[j][0x80] = pop_flags[i];
+            mem[j][0x81] = 0xFF;
+            cpu[j] = (CpuState){.bus = &bus[j]};
+        }
+        cpu_run(&cpu[0], 1000);
+        cpu_run_lazy(&cpu[1], 1000);
+        EXPECT_EQ(1, cpu[1].halted);
+        EXPECT_EQ(cpu[0].pc, cpu[1].pc);
+        EXPECT_EQ(cpu[0].a, cpu[1].a);
+        EXPECT_EQ(cpu[0].flags, cpu[1].flags);
+        EXPECT_EQ(1, cpu[0].cycle == cpu[1].cycle);
+        EXPECT_EQ(0, memcmp(mem[0], mem[1], sizeof(mem[0])));
+    }
+}
+
+TEST(cpu_lanes) {
+    // MVI C 0 ; loop: INR C ; DCR B ; JNZ loop ; MOV A C ; CPI 5 ; JC done ;
+    // ADD A ; CMA ; done: STA 0x80 ; PUSH B ; HLT
+    uint8_t program[] = {
+        0x0E, 0x00, 0x0C, 0x05, 0xC2, 0x02, 0x00, 0x79, 0xFE, 0x05,
+        0xDA, 0x0F, 0x00, 0x87, 0x2F, 0x32, 0x80, 0x00, 0xC5, 0x76,
+    };
+    static uint8_t lane_mem[CPU_LANES][256];
+    static uint8_t scalar_mem[CPU_LANES][256];
+    Bus lane_bus[CPU_LANES], scalar_bus[CPU_LANES];
+    static CpuLanes lanes;
+
+    // same program, the loop count differs per lane
+    for (int i = 0; i < CPU_LANES; i++) {
+        memcpy(lane_mem[i], program, sizeof(program));
+        memcpy(scalar_mem[i], program, sizeof(program));
+        lane_bus[i] = (Bus){.mem = lane_mem[i]};
+        scalar_bus[i] = (Bus){.mem = scalar_mem[i]};
+
+        CpuState cpu = {.bus = &lane_bus[i], .b = i + 1, .sp = 0xF0};
+        cpu_lanes_set(&lanes, i, &cpu);
+    }
+
+    EXPECT_EQ(0, cpu_lanes_run(&lanes, 100000));
+
+    for (int i = 0; i < CPU_LANES; i++) {
+        CpuState expected = {.bus = &scalar_bus[i], .b = i + 1, .sp = 0xF0};
+        cpu_run(&expected, 100000);
+
+        CpuState cpu;
+        cpu_lanes_get(&lanes, i, &cpu);
+        EXPECT_EQ(1, cpu.halted);
+        EXPECT_EQ(expected.a, cpu.a);
+        EXPECT_EQ(expected.c, cpu.c);
+        EXPECT_EQ(expected.flags, cpu.flags);
+        EXPECT_EQ(expected.sp, cpu.sp);
+        EXPECT_EQ(expected.pc, cpu.pc);
+        EXPECT_EQ((int)expected.cycle, (int)cpu.cycle);
+        EXPECT_EQ(0, memcmp(scalar_mem[i], lane_mem[i], sizeof(lane_mem[i])));
+    }
+
+    {
+        // code on a device goes lane by lane through cpu_step, which
+        // fetches it as often as the scalar core
+        static uint8_t mem[CPU_LANES][256];
+        static CpuLanes device_lanes;
+        CodeDevice device = {.code = device_loop_code};
+        Bus bus[CPU_LANES];
+        for (int i = 0; i < CPU_LANES; i++) {
+            memcpy(mem[i], device_loop_program, sizeof(device_loop_program));
+            bus[i] = (Bus){.mem = mem[i]};
+            bus_map_device(&bus[i], 0x0100, BUS_PAGE_SIZE, code_device_read, NULL, &device);
+            CpuState cpu = {.bus = &bus[i]};
+            cpu_lanes_set(&device_lanes, i, &cpu);
+        }
+
+        EXPECT_EQ(0, cpu_lanes_run(&device_lanes, 100000));
+        EXPECT_EQ(CPU_LANES * 2 * (int)sizeof(device_loop_code), device.reads);
+        for (int i = 0; i < CPU_LANES; i++) {
+            CpuState cpu;
+            cpu_lanes_get(&device_lanes, i, &cpu);
+            EXPECT_EQ(6, cpu.a);
+            EXPECT_EQ(10, cpu.pc);
+            EXPECT_EQ(7 + 2 * (10 + 7 + 5 + 10 + 5 + 10) + 7, (int)cpu.cycle);
+        }
+    }
+}
+
+static char *batch_report_text(BatchJob *jobs, size_t count) {
+    char *text = NULL;
+    size_t text_len = 0;
+    FILE *out = open_memstream(&text, &text_len);
+    batch_report(out, jobs, count, 0);
+    fclose(out);
+    return text;
+}
+
+TEST(batch) {
+    // count: INR C ; MOV A,C ; OUT 1 ; DCR B ; JNZ count ; HLT
+    uint8_t count_program[] = {0x0C, 0x79, 0xD3, 0x01, 0x05, 0xC2, 0x00, 0x00, 0x76};
+    // spin: JMP spin
+    uint8_t spin_program[] = {0xC3, 0x00, 0x00};
+    write_file("/tmp/i8080_test_count.bin", count_program, sizeof(count_program));
+    write_file("/tmp/i8080_test_spin.bin", spin_program, sizeof(spin_program));
+    const char *manifest = "/tmp/i8080_test.manifest";
+
+    {
+        const char *text =
+            "# comment only\n"
+            "\n"
+            "/tmp/i8080_test_count.bin b=3 sp=0x80  # after a job\n"
+            "  /tmp/i8080_test_spin.bin\tcycles=1000\n"
+            "/tmp/i8080_test_missing.bin\n"
+            "/tmp/i8080_test_count.bin origin=0x10 pc=0x10 b=0x5 flags=0xFF\n";
+        write_file(manifest, text, strlen(text));
+
+        size_t count = 0;
+        BatchJob *jobs = batch_load_manifest(manifest, &count);
+        EXPECT_EQ(1, jobs != NULL);
+        EXPECT_EQ(4, (int)count);
+        EXPECT_EQ(3, jobs[0].initial.b);
+        EXPECT_EQ(0x80, jobs[0].initial.sp);
+        EXPECT_EQ(0, jobs[0].pc_given);
+        EXPECT_EQ(BATCH_DEFAULT_CYCLE_LIMIT, jobs[0].cycle_limit);
+        EXPECT_EQ(0, strcmp("/tmp/i8080_test_spin.bin", jobs[1].path));
+        EXPECT_EQ(1000, jobs[1].cycle_limit);
+        EXPECT_EQ(0x10, jobs[3].origin);
+        EXPECT_EQ(1, jobs[3].pc_given);
+        EXPECT_EQ(0x10, jobs[3].initial.pc);
+        EXPECT_EQ(FLAG_MASK, jobs[3].initial.flags);
+
+        BatchOptions options = {.threads = 2};
+        double seconds = -1;
+        EXPECT_EQ(1, batch_run(jobs, count, &options, &seconds));
+        EXPECT_EQ(1, seconds >= 0);
+
+        // halted with the registers it ended on and everything it printed
+        EXPECT_EQ(JOB_HALTED, jobs[0].status);
+        EXPECT_EQ(3, jobs[0].final.c);
+        EXPECT_EQ(0, jobs[0].final.b);
+        EXPECT_EQ(0x09, jobs[0].final.pc);
+        EXPECT_EQ(0x80, jobs[0].final.sp);
+        EXPECT_EQ(6, jobs[0].output_len);
+        EXPECT_EQ(0, memcmp("1\n2\n3\n", jobs[0].output, 6));
+
+        // stopped at the first instruction boundary past the limit
+        EXPECT_EQ(JOB_CYCLE_LIMIT, jobs[1].status);
+        EXPECT_EQ(1, jobs[1].final.cycle >= 1000 && jobs[1].final.cycle < 1010);
+        EXPECT_EQ(0, jobs[1].final.halted);
+
+        EXPECT_EQ(JOB_LOAD_ERROR, jobs[2].status);
+
+        // loaded at origin, JNZ 0 then runs through the zeros as NOPs
+        EXPECT_EQ(JOB_HALTED, jobs[3].status);
+        EXPECT_EQ(5, jobs[3].final.c);
+        EXPECT_EQ(10, jobs[3].output_len);
+        EXPECT_EQ(0, memcmp("1\n2\n3\n4\n5\n", jobs[3].output, 10));
+        batch_free(jobs, count);
+    }
+    {
+        // every bad line rejects the whole manifest
+        const char *bad[] = {
+            "/tmp/i8080_test_count.bin b=0x100\n",
+            "/tmp/i8080_test_count.bin sp=0x10000\n",
+            "/tmp/i8080_test_count.bin x=1\n",
+            "/tmp/i8080_test_count.bin bc=1\n",
+            "/tmp/i8080_test_count.bin cycles\n",
+            "/tmp/i8080_test_count.bin a=12z\n",
+            "/tmp/i8080_test_count.bin a=\n",
+            "/tmp/i8080_test_count.bin\n/tmp/i8080_test_count.bin pc=-1\n",
+            "# nothing but comments\n\n",
+        };
+        for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+            write_file(manifest, bad[i], strlen(bad[i]));
+            size_t count = 0;
+            EXPECT_EQ(1, batch_load_manifest(manifest, &count) == NULL);
+        }
+        size_t count = 0;
+        EXPECT_EQ(1, batch_load_manifest("/tmp/i8080_test_no_such.manifest", &count) == NULL);
+    }
+    {
+        // results are the same on one thread, several threads and the block cache
+        char text[4096] = "";
+        for (int i = 0; i < 40; i++) {
+            const char *line = i % 3 == 2 ? "/tmp/i8080_test_spin.bin cycles=%d\n"
+                                          : "/tmp/i8080_test_count.bin b=%d\n";
+            snprintf(text + strlen(text), sizeof(text) - strlen(text), line, i % 3 == 2 ? 100 * i : i + 1);
+        }
+        write_file(manifest, text, strlen(text));
+
+        BatchOptions options[] = {{.threads = 1}, {.threads = 4}, {.threads = 7, .block_cache = true}};
+        char *reports[3];
+        for (int i = 0; i < 3; i++) {
+            size_t count = 0;
+            BatchJob *jobs = batch_load_manifest(manifest, &count);
+            EXPECT_EQ(40, (int)count);
+            double seconds;
+            EXPECT_EQ(1, batch_run(jobs, count, &options[i], &seconds));
+            reports[i] = batch_report_text(jobs, count);
+            batch_free(jobs, count);
+        }
+        EXPECT_EQ(0, strcmp(reports[0], reports[1]));
+        EXPECT_EQ(0, strcmp(reports[0], reports[2]));
+        for (int i = 0; i < 3; i++) {
+            free(reports[i]);
+        }
+    }
+
+    remove(manifest);
+    remove("/tmp/i8080_test_count.bin");
+    remove("/tmp/i8080_test_spin.bin");
+}
+
 int main() {
     return run_all_tests();
 }
@@ -30,6 +30,10 @@ extern int unittest_passed_tests;
 #define UT_FORMAT(val) _Generic((val), \
     int: "%d", \
     long: "%ld", \
+    long long: "%lld", \
+    unsigned int: "%u", \
+    unsigned long: "%lu", \
+    unsigned long long: "%llu", \
     float: "%.6f", \
     double: "%.6f", \
     char*: "\"%s\"", \
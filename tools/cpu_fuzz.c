@@ -0,0 +1,397 @@
+// Differential fuzzer: random programs and cpu states run on a fast core
+// and on cpu_step_reference side by side.
+//
+// usage: cpu_fuzz [--engine step|run|block|jit|lazy|all] [--cases n]
+//                 [--seed n] [--threads n] [--chunks n]
+//
+// A case is 64K of random memory, often with a planted loop of straight
+// line code so the block cache and the jit get hot blocks, and a random
+// register file. The engine under test runs it in chunks: one
+// instruction for step, random cycle budgets for the others. After every
+// chunk the reference is stepped to the same cycle count and registers,
+// flags, cycles and the memory the reference stored to must match, the
+// whole memory is compared when the case ends.
+//
+// Cases are spread over one thread per cpu. The first divergence stops
+// the run, its case is minimized by zeroing memory and registers while it
+// still diverges, and printed.
+
+#include "../src/cpu_ops.h"
+#include "../src/block_cache.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FUZZ_MAX_STORES 1024
+
+typedef enum {
+    ENGINE_STEP,
+    ENGINE_RUN,
+    ENGINE_BLOCK,
+    ENGINE_JIT,
+    ENGINE_LAZY,
+    ENGINE_COUNT
+} Engine;
+
+static const char *const engine_names[ENGINE_COUNT] = {"step", "run", "block", "jit", "lazy"};
+
+typedef struct {
+    uint64_t seed;
+    CpuState start;
+    uint8_t mem[MEM_SIZE];
+} Case;
+
+typedef struct {
+    int chunk;
+    uint16_t pc;            // where the chunk started
+    char what[160];
+} Divergence;
+
+typedef struct {
+    uint8_t ref_mem[MEM_SIZE];
+    uint8_t got_mem[MEM_SIZE];
+    Bus ref_bus, got_bus;
+    uint16_t stores[FUZZ_MAX_STORES];
+    int store_count;
+    bool stores_overflowed;
+    uint64_t instructions;
+} Machine;
+
+static uint64_t next_random(uint64_t *state) {
+    // xorshift64*
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+static void make_case(Case *c, uint64_t seed) {
+    uint64_t rng = seed * 0x9E3779B97F4A7C15ULL + 1;
+    c->seed = seed;
+
+    for (int i = 0; i < MEM_SIZE; i += 8) {
+        uint64_t r = next_random(&rng);
+        memcpy(c->mem + i, &r, 8);
+    }
+    // most HLTs go, otherwise few cases get far
+    for (int i = 0; i < MEM_SIZE; i++) {
+        if (c->mem[i] == 0x76 && next_random(&rng) % 8) c->mem[i] = 0x00;
+    }
+
+    uint64_t r = next_random(&rng);
+    c->start = (CpuState){
+        .a = r, .b = r >> 8, .c = r >> 16, .d = r >> 24,
+        .e = r >> 32, .h = r >> 40, .l = r >> 48,
+        .flags = ((r >> 56) & FLAG_MASK) | FLAG_ALWAYS_ONE,
+    };
+    r = next_random(&rng);
+    c->start.sp = r;
+    c->start.pc = r >> 16;
+    c->start.interruptible = r >> 32 & 1;
+
+    // every other case loops over straight line code ending in
+    // DCR B ; JNZ start, stores may still land in the loop itself
+    if (seed & 1) {
+        uint16_t addr = c->start.pc;
+        int count = 1 + next_random(&rng) % 24;
+        for (int i = 0; i < count; i++) {
+            uint8_t opcode;
+            do {
+                opcode = next_random(&rng);
+            } while (opcode_ends_block(opcode) || opcode == 0x05);
+            c->mem[addr++] = opcode;
+            for (int k = 1; k < opcode_length(opcode); k++) {
+                c->mem[addr++] = next_random(&rng);
+            }
+        }
+        c->mem[addr++] = 0x05;
+        c->mem[addr++] = 0xC2;
+        c->mem[addr++] = c->start.pc & 0xFF;
+        c->mem[addr++] = c->start.pc >> 8;
+    }
+}
+
+static void note_stores(Machine *m, const CpuState *cpu) {
+    uint16_t addr;
+    int count = cpu_store_span((CpuState *)cpu, m->ref_mem[cpu->pc], &addr);
+    for (int i = 0; i < count; i++) {
+        if (m->store_count == FUZZ_MAX_STORES) {
+            m->stores_overflowed = true;
+            return;
+        }
+        m->stores[m->store_count++] = addr + i;
+    }
+}
+
+static bool compare(const CpuState *ref, const CpuState *got, char *what, size_t len) {
+#define FUZZ_FIELD(field) \
+    if (ref->field != got->field) { \
+        snprintf(what, len, #field " is %llX, reference %llX", \
+                 (unsigned long long)got->field, (unsigned long long)ref->field); \
+        return false; \
+    }
+    FUZZ_FIELD(a) FUZZ_FIELD(b) FUZZ_FIELD(c) FUZZ_FIELD(d) FUZZ_FIELD(e)
+    FUZZ_FIELD(h) FUZZ_FIELD(l) FUZZ_FIELD(flags) FUZZ_FIELD(sp) FUZZ_FIELD(pc)
+    FUZZ_FIELD(halted) FUZZ_FIELD(interruptible) FUZZ_FIELD(cycle)
+#undef FUZZ_FIELD
+    return true;
+}
+
+static bool compare_mem(Machine *m, int from, int to, char *what, size_t len) {
+    for (int addr = from; addr < to; addr++) {
+        if (m->ref_mem[addr] != m->got_mem[addr]) {
+            snprintf(what, len, "memory at %04X is %02X, reference %02X",
+                     addr, m->got_mem[addr], m->ref_mem[addr]);
+            return false;
+        }
+    }
+    return true;
+}
+
+// runs one case for at most chunks chunks, false with div filled in when
+// the engine diverged from the reference
+static bool run_case(Machine *m, const Case *c, Engine engine, int chunks, Divergence *div) {
+    memcpy(m->ref_mem, c->mem, MEM_SIZE);
+    memcpy(m->got_mem, c->mem, MEM_SIZE);
+    m->ref_bus = (Bus){0};
+    m->got_bus = (Bus){0};
+    bus_map_ram(&m->ref_bus, 0, MEM_SIZE, m->ref_mem);
+    bus_map_ram(&m->got_bus, 0, MEM_SIZE, m->got_mem);
+
+    CpuState ref = c->start, got = c->start;
+    ref.bus = &m->ref_bus;
+    got.bus = &m->got_bus;
+
+    BlockCache *cache = NULL;
+    if (engine == ENGINE_BLOCK || engine == ENGINE_JIT) {
+        cache = block_cache_create(&m->got_bus);
+        if (!cache || (engine == ENGINE_JIT && !block_cache_enable_jit(cache))) {
+            fprintf(stderr, "ERROR: %s engine unavailable\n", engine_names[engine]);
+            exit(1);
+        }
+    }
+
+    uint64_t rng = c->seed ^ 0xD1B54A32D192ED03ULL;
+    bool ok = true;
+
+    for (int chunk = 0; ok && chunk < chunks && !ref.halted; chunk++) {
+        uint16_t pc = got.pc;
+        if (engine == ENGINE_STEP) {
+            got.cycle += cpu_step(&got);
+        } else {
+            // mostly short runs, every few a long one
+            uint64_t r = next_random(&rng);
+            uint64_t budget = 1 + (r >> 8) % (r & 3 ? 64 : 4000);
+            if (engine == ENGINE_LAZY) {
+                cpu_run_lazy(&got, budget);
+            } else {
+                cpu_run(&got, budget);
+            }
+        }
+
+        // the reference runs until it caught up, cpu_run stops at the
+        // first instruction boundary at or past its budget as well
+        m->store_count = 0;
+        m->stores_overflowed = false;
+        while (ref.cycle < got.cycle && !ref.halted) {
+            note_stores(m, &ref);
+            ref.cycle += cpu_step_reference(&ref);
+            m->instructions++;
+        }
+
+        ok = compare(&ref, &got, div->what, sizeof(div->what));
+        if (ok && m->stores_overflowed) {
+            ok = compare_mem(m, 0, MEM_SIZE, div->what, sizeof(div->what));
+        }
+        for (int i = 0; ok && i < m->store_count; i++) {
+            ok = compare_mem(m, m->stores[i], m->stores[i] + 1, div->what, sizeof(div->what));
+        }
+        div->chunk = chunk;
+        div->pc = pc;
+    }
+    if (ok) {
+        ok = compare_mem(m, 0, MEM_SIZE, div->what, sizeof(div->what));
+    }
+
+    block_cache_destroy(cache);
+    return ok;
+}
+
+static void minimize(Machine *m, Case *c, Engine engine, int chunks, Divergence *div) {
+    uint8_t saved[MEM_SIZE / 2];
+
+    for (int size = MEM_SIZE / 2; size >= 1; size /= 2) {
+        for (int start = 0; start < MEM_SIZE; start += size) {
+            bool zero = true;
+            for (int i = start; i < start + size && zero; i++) {
+                zero = c->mem[i] == 0;
+            }
+            if (zero) continue;
+
+            memcpy(saved, c->mem + start, size);
+            memset(c->mem + start, 0, size);
+            Divergence attempt;
+            if (run_case(m, c, engine, chunks, &attempt)) {
+                memcpy(c->mem + start, saved, size);
+            } else {
+                *div = attempt;
+            }
+        }
+    }
+
+    uint8_t *regs[] = {&c->start.a, &c->start.b, &c->start.c, &c->start.d,
+                       &c->start.e, &c->start.h, &c->start.l};
+    for (size_t i = 0; i < sizeof(regs) / sizeof(regs[0]); i++) {
+        uint8_t old = *regs[i];
+        *regs[i] = 0;
+        Divergence attempt;
+        if (run_case(m, c, engine, chunks, &attempt)) {
+            *regs[i] = old;
+        } else {
+            *div = attempt;
+        }
+    }
+}
+
+static void print_case(const Case *c, Engine engine, const Divergence *div) {
+    const CpuState *s = &c->start;
+    printf("DIVERGENCE on %s, case seed %llu, chunk %d starting at pc %04X:\n  %s\n",
+           engine_names[engine], (unsigned long long)c->seed, div->chunk, div->pc, div->what);
+    printf("minimized start: a=%02X b=%02X c=%02X d=%02X e=%02X h=%02X l=%02X f=%02X sp=%04X pc=%04X ei=%d\n",
+           s->a, s->b, s->c, s->d, s->e, s->h, s->l, s->flags, s->sp, s->pc, s->interruptible);
+    printf("non-zero memory:\n");
+    for (int addr = 0; addr < MEM_SIZE; ) {
+        if (!c->mem[addr]) {
+            addr++;
+            continue;
+        }
+        printf("  %04X:", addr);
+        for (int n = 0; n < 16 && addr < MEM_SIZE && c->mem[addr]; n++) {
+            printf(" %02X", c->mem[addr++]);
+        }
+        printf("\n");
+    }
+}
+
+typedef struct {
+    bool engines[ENGINE_COUNT];
+    uint64_t cases;
+    uint64_t seed;
+    int chunks;
+
+    atomic_uint_fast64_t next_case;
+    atomic_uint_fast64_t instructions;
+    atomic_bool stop;
+    pthread_mutex_t report_lock;
+    int diverged;
+} Fuzz;
+
+static void *worker_main(void *arg) {
+    Fuzz *fuzz = arg;
+    Machine *m = calloc(1, sizeof(Machine));
+    Case *c = malloc(sizeof(Case));
+    if (!m || !c) {
+        free(m);
+        free(c);
+        return NULL;
+    }
+
+    while (!atomic_load(&fuzz->stop)) {
+        uint64_t index = atomic_fetch_add(&fuzz->next_case, 1);
+        if (index >= fuzz->cases) break;
+
+        make_case(c, fuzz->seed + index);
+        for (Engine engine = 0; engine < ENGINE_COUNT; engine++) {
+            if (!fuzz->engines[engine]) continue;
+
+            Divergence div;
+            m->instructions = 0;
+            bool ok = run_case(m, c, engine, fuzz->chunks, &div);
+            atomic_fetch_add(&fuzz->instructions, m->instructions);
+            if (ok) continue;
+
+            // only the first divergence is minimized and reported
+            if (atomic_exchange(&fuzz->stop, true)) break;
+            minimize(m, c, engine, fuzz->chunks, &div);
+            pthread_mutex_lock(&fuzz->report_lock);
+            print_case(c, engine, &div);
+            fuzz->diverged = 1;
+            pthread_mutex_unlock(&fuzz->report_lock);
+            break;
+        }
+    }
+
+    free(m);
+    free(c);
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    static Fuzz fuzz = {.cases = 2000, .seed = 1, .chunks = 64};
+    const char *engine = "all";
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 >= argc) {
+            fprintf(stderr, "ERROR: %s needs a value\n", argv[i]);
+            return 1;
+        } else if (strcmp(argv[i], "--engine") == 0) {
+            engine = argv[++i];
+        } else if (strcmp(argv[i], "--cases") == 0) {
+            fuzz.cases = strtoull(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--seed") == 0) {
+            fuzz.seed = strtoull(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--threads") == 0) {
+            threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--chunks") == 0) {
+            fuzz.chunks = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "ERROR: unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    bool known = strcmp(engine, "all") == 0;
+    for (Engine e = 0; e < ENGINE_COUNT; e++) {
+        fuzz.engines[e] = known || strcmp(engine, engine_names[e]) == 0;
+        known = known || fuzz.engines[e];
+    }
+    if (!known) {
+        fprintf(stderr, "ERROR: unknown engine %s\n", engine);
+        return 1;
+    }
+    if (threads < 1) threads = 1;
+
+    pthread_mutex_init(&fuzz.report_lock, NULL);
+    pthread_t *ids = malloc(threads * sizeof(pthread_t));
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    int started = 0;
+    for (int t = 0; t < threads; t++) {
+        if (pthread_create(&ids[t], NULL, worker_main, &fuzz) != 0) break;
+        started++;
+    }
+    if (started == 0) {
+        worker_main(&fuzz);
+    }
+    for (int t = 0; t < started; t++) {
+        pthread_join(ids[t], NULL);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    uint64_t cases = atomic_load(&fuzz.next_case);
+    if (cases > fuzz.cases) cases = fuzz.cases;
+    uint64_t instructions = atomic_load(&fuzz.instructions);
+
+    printf("%llu cases, %llu instructions checked in %.2f s, %.0f per second on %d threads\n",
+           (unsigned long long)cases, (unsigned long long)instructions, seconds,
+           seconds > 0 ? instructions / seconds : 0.0, started ? started : 1);
+
+    free(ids);
+    pthread_mutex_destroy(&fuzz.report_lock);
+    return fuzz.diverged;
+}
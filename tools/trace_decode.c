@@ -0,0 +1,187 @@
+// Prints a binary trace written by trace.c, one line per instruction.
+//
+// usage: trace_decode [--pc lo:hi] [--cycles from:to] [--addr lo:hi] <trace>
+//   --pc      only instructions at pc within lo..hi
+//   --cycles  only instructions starting within from..to
+//   --addr    only instructions loading or storing within lo..hi
+// Numbers are decimal or 0x prefixed hex, either end may be left out.
+// Registers are shown as they are after the instruction.
+
+#include "../src/trace.h"
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+    uint64_t lo, hi;
+} Range;
+
+typedef struct {
+    uint16_t addr;
+    uint8_t count;
+    uint8_t bytes[2];
+} Access;
+
+static bool parse_range(const char *text, Range *range) {
+    char *end;
+    range->lo = 0;
+    range->hi = UINT64_MAX;
+
+    if (*text != ':') {
+        range->lo = strtoull(text, &end, 0);
+        if (end == text) return false;
+        text = end;
+    }
+    if (*text++ != ':') return false;
+    if (*text) {
+        range->hi = strtoull(text, &end, 0);
+        if (*end) return false;
+    }
+    return true;
+}
+
+static bool in_range(const Range *range, uint64_t val) {
+    return val >= range->lo && val <= range->hi;
+}
+
+static bool access_in_range(const Range *range, const Access *access) {
+    for (int i = 0; i < access->count; i++) {
+        if (in_range(range, (uint16_t)(access->addr + i))) return true;
+    }
+    return false;
+}
+
+static int get8(FILE *f) {
+    return fgetc(f);
+}
+
+static int get16(FILE *f) {
+    int lo = fgetc(f);
+    int hi = fgetc(f);
+    return lo < 0 || hi < 0 ? -1 : lo | hi << 8;
+}
+
+static bool read_access(FILE *f, Access *access) {
+    int count = get8(f);
+    int addr = get16(f);
+    if (count < 0 || count > 2 || addr < 0) return false;
+    access->count = count;
+    access->addr = addr;
+    return fread(access->bytes, 1, count, f) == (size_t)count;
+}
+
+static void print_access(const char *what, const Access *access) {
+    printf("  %s %04X:", what, access->addr);
+    for (int i = 0; i < access->count; i++) {
+        printf(" %02X", access->bytes[i]);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    Range pc_range = {0, UINT64_MAX};
+    Range cycle_range = {0, UINT64_MAX};
+    Range addr_range = {0, UINT64_MAX};
+    bool addr_filter = false;
+    const char *path = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        bool ok = true;
+        if (strcmp(argv[i], "--pc") == 0 && i + 1 < argc) {
+            ok = parse_range(argv[++i], &pc_range);
+        } else if (strcmp(argv[i], "--cycles") == 0 && i + 1 < argc) {
+            ok = parse_range(argv[++i], &cycle_range);
+        } else if (strcmp(argv[i], "--addr") == 0 && i + 1 < argc) {
+            ok = parse_range(argv[++i], &addr_range);
+            addr_filter = true;
+        } else if (!path) {
+            path = argv[i];
+        } else {
+            ok = false;
+        }
+        if (!ok) path = NULL;
+        if (!ok) break;
+    }
+    if (!path) {
+        fprintf(stderr, "usage: trace_decode [--pc lo:hi] [--cycles from:to] [--addr lo:hi] <trace>\n");
+        return 1;
+    }
+
+    FILE *f = fopen(path, "rb");
+    uint8_t header[TRACE_HEADER_SIZE];
+    if (!f || fread(header, sizeof(header), 1, f) != 1 || memcmp(header, "I80T", 4) != 0
+            || (header[4] | header[5] << 8) != TRACE_VERSION) {
+        fprintf(stderr, "ERROR: %s is not a trace\n", path);
+        return 1;
+    }
+
+    uint8_t regs[8];
+    memcpy(regs, header + 6, 8);
+    uint16_t sp = header[14] | header[15] << 8;
+    uint16_t pc = header[16] | header[17] << 8;
+    uint64_t cycle = 0;
+    for (int i = 0; i < 8; i++) {
+        cycle |= (uint64_t)header[18 + i] << (8 * i);
+    }
+
+    int tags;
+    while ((tags = get8(f)) >= 0) {
+        bool ok = true;
+        if (tags & TRACE_PC) {
+            int val = get16(f);
+            ok = val >= 0;
+            pc = val;
+        }
+
+        uint8_t code[3];
+        int len = (tags >> TRACE_LEN_SHIFT) & 3;
+        ok = ok && len >= 1 && fread(code, 1, len, f) == (size_t)len;
+        int cycles = get8(f);
+        ok = ok && cycles >= 0;
+
+        if (ok && (tags & TRACE_REGS)) {
+            int mask = get8(f);
+            for (int i = 0; ok && i < 8; i++) {
+                if (mask >> i & 1) {
+                    int val = get8(f);
+                    ok = val >= 0;
+                    regs[i] = val;
+                }
+            }
+        }
+        if (ok && (tags & TRACE_SP)) {
+            int val = get16(f);
+            ok = val >= 0;
+            sp = val;
+        }
+
+        Access load = {0}, store = {0};
+        if (ok && (tags & TRACE_LOAD)) ok = read_access(f, &load);
+        if (ok && (tags & TRACE_STORE)) ok = read_access(f, &store);
+        if (!ok) {
+            fprintf(stderr, "ERROR: truncated record at cycle %" PRIu64 "\n", cycle);
+            return 1;
+        }
+
+        bool show = in_range(&pc_range, pc) && in_range(&cycle_range, cycle)
+            && (!addr_filter || access_in_range(&addr_range, &load) || access_in_range(&addr_range, &store));
+        if (show) {
+            printf("%12" PRIu64 " %04X ", cycle, pc);
+            for (int i = 0; i < 3; i++) {
+                if (i < len) printf(" %02X", code[i]);
+                else printf("   ");
+            }
+            printf("  a=%02X b=%02X c=%02X d=%02X e=%02X h=%02X l=%02X f=%02X sp=%04X",
+                regs[0], regs[1], regs[2], regs[3], regs[4], regs[5], regs[6], regs[7], sp);
+            if (load.count) print_access("load", &load);
+            if (store.count) print_access("store", &store);
+            printf("\n");
+        }
+
+        // the next record says when it does not follow this one
+        pc += len;
+        cycle += cycles;
+    }
+
+    fclose(f);
+    return 0;
+}